@@ -49,6 +49,7 @@
 #include "EnsoniqFS.h"
 #include "error.h"
 #include "cache.h"
+#include "backend.h"
 #include "optionsdlg.h"
 #include "choosediskdlg.h"
 #include "resource.h"
@@ -86,6 +87,18 @@ char g_cOptionInstallPath[261];
 int g_iOptionBankAdaption = 0;
 int g_iOptionBankSourceDevice = -1;
 int g_iOptionBankTargetDevice = 0;
+int g_iOptionReadAheadFloppy = 160;
+int g_iOptionReadAheadCDROM = 1024;
+int g_iOptionReadAheadDisk = 2048;
+int g_iOptionReadAheadImage = 4096;
+int g_iOptionMemoryMapLimit = 512;
+int g_iOptionRamImageLimit = 0;
+int g_iOptionDirectIODisk = 0;
+int g_iOptionDirectIOImage = 0;
+int g_iOptionDirectIOMinSize = 512;
+int g_iOptionCachePolicy = 1;
+int g_iOptionCacheBudget = 32;
+int g_iOptionIdleTimeout = 60;
 
 // flag for operations on multiple files to flush the cache only once after
 // the last file
@@ -218,9 +231,11 @@ int ReadDirectory(DISK *pDisk, ENSONIQDIR *pDir, unsigned char ucShowWarning)
 	memset(pDir, 0, sizeof(ENSONIQDIR));
 	pDir->dwDirectoryBlock = dwBlock;
 
-	// read directory blocks from disk
+	// read directory blocks from disk and keep them in the metadata cache
+	// tier (the disk has its cache only after the first access)
 	iResult = ReadBlocks(pDisk, dwBlock, 2, pDir->ucDirectory);
 	if(ERR_OK!=iResult) return iResult;
+	CacheSetMetadata(pDisk, dwBlock, 2);
 
 	// loop through all entries
 //	LOG("\n");
@@ -399,9 +414,10 @@ int ReadDirectory(DISK *pDisk, ENSONIQDIR *pDir, unsigned char ucShowWarning)
 int ReadWaveFile(DISK *pDisk, VIRTUALWAVEFILE *pVirtualWaveFile, char *cDestFN,
 				 char *cSourceFN)
 {
-	unsigned char ucBuf1[512], ucBuf2[512], ucStereoBuf[1024], ucTemp;
+	unsigned char ucBuf1[512], *ucData1, *ucData2, *ucStereoBuf, ucTemp;
 	int i, j, iResult, iProgress, iLastProgress = -1;
-	DWORD dwByteRate, dwBlock1, dwBlock2, dwChunkSize, dwSampleRate, dwSize;
+	DWORD dwByteRate, dwChunkSize, dwSampleRate, dwSize, dwBlocks, dwChunk;
+	EXTENT_MAP ExtentMap1, ExtentMap2;
 	FILE *f;
 
 	// TODO: Handle multi disk audio tracks (priority: very low, multi disk 
@@ -488,91 +504,123 @@ int ReadWaveFile(DISK *pDisk, VIRTUALWAVEFILE *pVirtualWaveFile, char *cDestFN,
 	
 	LOG("Extracting file... ");
 	
-	// set starting block
-	dwBlock1 = pVirtualWaveFile->dwStart1;
-	dwBlock2 = pVirtualWaveFile->dwStart2;
+	// resolve the FAT chains of both channels to extents
+	iResult = GetExtentMap(pDisk, pVirtualWaveFile->dwStart1, 
+		pVirtualWaveFile->dwLen1, &ExtentMap1);
+	if(ERR_OK!=iResult)
+	{
+		LOG("Error reading FAT, code=%d.\n", iResult);
+		fclose(f);
+		return iResult;
+	}
+	dwBlocks = ExtentMap1.dwBlocks;
 	
-	// loop through all blocks
-	for(i=0; i<(int)pVirtualWaveFile->dwLen1; i++)
+	memset(&ExtentMap2, 0, sizeof(EXTENT_MAP));
+	if(pVirtualWaveFile->ucIsStereo)
 	{
-		// read next block from disk image
-		iResult = ReadBlock(pDisk, dwBlock1, ucBuf1);
+		iResult = GetExtentMap(pDisk, pVirtualWaveFile->dwStart2, 
+			pVirtualWaveFile->dwLen1, &ExtentMap2);
 		if(ERR_OK!=iResult)
 		{
-			LOG("Error reading block, code=%d.\n", iResult);
+			LOG("Error reading FAT, code=%d.\n", iResult);
+			FreeExtentMap(&ExtentMap1);
 			fclose(f);
 			return iResult;
 		}
+		if(ExtentMap2.dwBlocks<dwBlocks) dwBlocks = ExtentMap2.dwBlocks;
+	}
+	
+	// either end of file reached or error getting FAT entry occured
+	if(dwBlocks<pVirtualWaveFile->dwLen1)
+	{
+		LOG("Warning: EOF in FAT occured before file length was reached.\n");
+	}
+	
+	// allocate buffers for both channels and the multiplexed stereo data
+	ucData1 = malloc(EXTENT_READ_COUNT*512*4);
+	if(NULL==ucData1)
+	{
+		LOG("Error allocating read buffer.\n");
+		FreeExtentMap(&ExtentMap1);
+		FreeExtentMap(&ExtentMap2);
+		fclose(f);
+		return ERR_MEM;
+	}
+	ucData2 = ucData1 + EXTENT_READ_COUNT*512;
+	ucStereoBuf = ucData2 + EXTENT_READ_COUNT*512;
+	
+	// loop through all blocks
+	for(i=0; i<(int)dwBlocks; i+=dwChunk)
+	{
+		dwChunk = dwBlocks - i;
+		if(dwChunk>EXTENT_READ_COUNT) dwChunk = EXTENT_READ_COUNT;
+		
+		// read next blocks from disk image
+		iResult = ReadExtentMap(pDisk, &ExtentMap1, dwChunk, ucData1);
+		if((ERR_OK==iResult)&&(pVirtualWaveFile->ucIsStereo))
+		{
+			iResult = ReadExtentMap(pDisk, &ExtentMap2, dwChunk, ucData2);
+		}
+		if(ERR_OK!=iResult)
+		{
+			LOG("Error reading block, code=%d.\n", iResult);
+			break;
+		}
 
 		if(pVirtualWaveFile->ucIsStereo)
 		{
-			iResult = ReadBlock(pDisk, dwBlock2, ucBuf2);
-			if(ERR_OK!=iResult)
-			{
-				LOG("Error reading block, code=%d.\n", iResult);
-				fclose(f);
-				return iResult;
-			}
 			// swap bytes and multiplex two channels
-			for(j=0; j<256; j++)
+			for(j=0; j<(int)dwChunk*256; j++)
 			{
-				ucStereoBuf[j*4+0] = ucBuf1[j*2+1];
-				ucStereoBuf[j*4+1] = ucBuf1[j*2+0];
-				ucStereoBuf[j*4+2] = ucBuf2[j*2+1];
-				ucStereoBuf[j*4+3] = ucBuf2[j*2+0];
+				ucStereoBuf[j*4+0] = ucData1[j*2+1];
+				ucStereoBuf[j*4+1] = ucData1[j*2+0];
+				ucStereoBuf[j*4+2] = ucData2[j*2+1];
+				ucStereoBuf[j*4+3] = ucData2[j*2+0];
 			}
-			// write next block to file
-			if(1024!=fwrite(ucStereoBuf, 1, 1024, f))
+			// write next blocks to file
+			if(dwChunk*1024!=fwrite(ucStereoBuf, 1, dwChunk*1024, f))
 			{
 				LOG("Error writing to destination file.\n");
-				fclose(f);
-				return ERR_LOCAL_WRITE;
+				iResult = ERR_LOCAL_WRITE;
+				break;
 			}
-			// get next FAT entry
-			dwBlock2 = GetFATEntry(pDisk, dwBlock2);
 		}
 		else
 		{
 			// swap bytes, only one channel
-			for(j=0; j<256; j++)
+			for(j=0; j<(int)dwChunk*256; j++)
 			{
-				ucTemp = ucBuf1[j*2];
-				ucBuf1[j*2] = ucBuf1[j*2+1];
-				ucBuf1[j*2+1] = ucTemp;
+				ucTemp = ucData1[j*2];
+				ucData1[j*2] = ucData1[j*2+1];
+				ucData1[j*2+1] = ucTemp;
 			}
-			// write next block to file
-			if(512!=fwrite(ucBuf1, 1, 512, f))
+			// write next blocks to file
+			if(dwChunk*512!=fwrite(ucData1, 1, dwChunk*512, f))
 			{
 				LOG("Error writing to destination file.\n");
-				fclose(f);
-				return ERR_LOCAL_WRITE;
+				iResult = ERR_LOCAL_WRITE;
+				break;
 			}
 		}
-				
-		// get next FAT entry
-		dwBlock1 = GetFATEntry(pDisk, dwBlock1);
-
-		// either end of file reached or error getting FAT entry occured
-		if((dwBlock1<3)||((pVirtualWaveFile->ucIsStereo)&&(dwBlock2<3)))
-		{
-			LOG("Warning: EOF in FAT occured before file length was reached.\n");
-			break;
-		}
 		
 		// notify TotalCmd of progress
-		iProgress = i*100/pVirtualWaveFile->dwLen1;
+		iProgress = (i+dwChunk)*100/pVirtualWaveFile->dwLen1;
 		if((iProgress-iLastProgress)>5)
 		{
 			if(1==g_pProgressProc(g_iPluginNr, cSourceFN, cDestFN, iProgress))
 			{
-				fclose(f);
-				return ERR_ABORTED;
+				iResult = ERR_ABORTED;
+				break;
 			}
 			iLastProgress = iProgress;
 		}
 	}
-	LOG("OK.\n");
+	free(ucData1);
+	FreeExtentMap(&ExtentMap1);
+	FreeExtentMap(&ExtentMap2);
 	fclose(f);
+	if(ERR_OK!=iResult) return iResult;
+	LOG("OK.\n");
 	
 	// notify TotalCmd of progress
 	if(1==g_pProgressProc(g_iPluginNr, cSourceFN, cDestFN, 100))
@@ -846,10 +894,11 @@ int RenameEnsoniqItem( DISK *pDisk, ENSONIQDIRENTRY *pDirEntry, const char* cOld
 int ReadEnsoniqFile(DISK *pDisk, ENSONIQDIRENTRY *pDirEntry, char *cDestFN,
 					char *cSourceFN)
 {
-	unsigned char ucBuf[512], ucCopyMultidisk = 0;
+	unsigned char ucBuf[512], ucCopyMultidisk = 0, *ucData;
 	char cFiletype[13];
 	int i, iResult, iProgress, iLastProgress = -1;
-	DWORD dwBlock, dwSize, dwBlockCounter = 0;
+	DWORD dwBlock, dwSize, dwBlockCounter = 0, dwBlocks, dwChunk;
+	EXTENT_MAP ExtentMap;
 	FILE *f;
 	
 	LOG("Reading Ensoniq file (Start=%d, size=%d blocks, type=%d, "
@@ -966,77 +1015,99 @@ int ReadEnsoniqFile(DISK *pDisk, ENSONIQDIRENTRY *pDirEntry, char *cDestFN,
 
 	LOG("Extracting file... ");
 	
-	// loop through all blocks
-	i = 0;
+	// allocate read buffer
+	ucData = malloc(EXTENT_READ_COUNT*512);
+	if(NULL==ucData)
+	{
+		LOG("Error allocating read buffer.\n");
+		fclose(f);
+		return ERR_MEM;
+	}
+	
+	// loop through all parts (only one if this is not a multi disk copy)
 	while(dwBlockCounter<dwSize)
 	{
-		// read next block from disk image
-		iResult = ReadBlock(pDisk, dwBlock, ucBuf);
+		// resolve the FAT chain of the current part to extents
+		dwBlocks = pDirEntry->dwLen;
+		if(dwBlocks>(dwSize-dwBlockCounter)) dwBlocks = dwSize - dwBlockCounter;
+		iResult = GetExtentMap(pDisk, dwBlock, dwBlocks, &ExtentMap);
 		if(ERR_OK!=iResult)
 		{
-			LOG("Error reading block, code=%d.\n", iResult);
+			LOG("Error reading FAT, code=%d.\n", iResult);
+			free(ucData);
 			fclose(f);
 			return iResult;
 		}
 		
-		// write next block to file
-		if(512!=fwrite(ucBuf, 1, 512, f))
+		// stop here even if file is too short
+		if(ExtentMap.dwBlocks<dwBlocks)
 		{
-			LOG("Error writing to destination file.\n");
-			fclose(f);
-			return ERR_LOCAL_WRITE;
+			LOG("FAT chain ends after %d blocks, Len=%d - stopping.\n",
+				ExtentMap.dwBlocks, pDirEntry->dwLen);
 		}
 		
-		// get next FAT entry
-		dwBlock = GetFATEntry(pDisk, dwBlock);
-
-		// either end of file reached or error getting FAT entry occured
-		if(dwBlock<3)
-		{
-			LOG("FAT entry=%d, i=%d, Len=%d - stopping.\n", dwBlock, i, 
-				pDirEntry->dwLen);
-			i = pDirEntry->dwLen; // stop here even if file is too short
-		}
-		
-		// notify TotalCmd of progress
-		iProgress = i*100/dwSize;
-		if((iProgress-iLastProgress)>5)
+		// read all extents in large chunks
+		for(i=0; i<(int)ExtentMap.dwBlocks; i+=dwChunk)
 		{
-			if(1==g_pProgressProc(g_iPluginNr, cSourceFN, cDestFN, iProgress))
+			dwChunk = ExtentMap.dwBlocks - i;
+			if(dwChunk>EXTENT_READ_COUNT) dwChunk = EXTENT_READ_COUNT;
+			
+			iResult = ReadExtentMap(pDisk, &ExtentMap, dwChunk, ucData);
+			if(ERR_OK!=iResult)
 			{
+				LOG("Error reading blocks, code=%d.\n", iResult);
+				FreeExtentMap(&ExtentMap);
+				free(ucData);
 				fclose(f);
-				return ERR_ABORTED;
+				return iResult;
 			}
-			iLastProgress = iProgress;
-		}
-		
-		i++;
-		dwBlockCounter++;
-		
-		// check counter in case of a multi-disk file
-		if(ucCopyMultidisk && (dwBlockCounter<dwSize))
-		{
-			// next disk?
-			if(i>=(int)pDirEntry->dwLen)
+			
+			// write blocks to file
+			if(dwChunk*512!=fwrite(ucData, 1, dwChunk*512, f))
 			{
-				// ask user for next disk
-				iResult = SelectNextDisk(&pDisk, &dwBlock, pDirEntry);
-				if(ERR_OK!=iResult)
+				LOG("Error writing to destination file.\n");
+				FreeExtentMap(&ExtentMap);
+				free(ucData);
+				fclose(f);
+				return ERR_LOCAL_WRITE;
+			}
+			dwBlockCounter += dwChunk;
+			
+			// notify TotalCmd of progress
+			iProgress = dwBlockCounter*100/dwSize;
+			if((iProgress-iLastProgress)>5)
+			{
+				if(1==g_pProgressProc(g_iPluginNr, cSourceFN, cDestFN, 
+					iProgress))
 				{
+					FreeExtentMap(&ExtentMap);
+					free(ucData);
 					fclose(f);
-					return iResult;
+					return ERR_ABORTED;
 				}
-				
-				LOG("Multi-disk file: Continuing with next disk (%d)\n", 
-					pDirEntry->ucMultiFileIndex);
-				
-				// reset counter for current part
-				i = 0;
+				iLastProgress = iProgress;
 			}
 		}
+		FreeExtentMap(&ExtentMap);
+		
+		// not a multi-disk copy or all parts read?
+		if((!ucCopyMultidisk)||(dwBlockCounter>=dwSize)) break;
+		
+		// ask user for next disk
+		iResult = SelectNextDisk(&pDisk, &dwBlock, pDirEntry);
+		if(ERR_OK!=iResult)
+		{
+			free(ucData);
+			fclose(f);
+			return iResult;
+		}
+		
+		LOG("Multi-disk file: Continuing with next disk (%d)\n", 
+			pDirEntry->ucMultiFileIndex);
 	}
 	
 	LOG("OK.\n");
+	free(ucData);
 	fclose(f);
 	
 	// notify TotalCmd of progress
@@ -1394,6 +1465,9 @@ DLLEXPORT HANDLE __stdcall FsFindFirst(char* cPath, WIN32_FIND_DATA *FindData)
 	FIND_HANDLE *pHandle, *pTemp;
 
 	LOG("FsFindFirst(\""); LOG(cPath); LOG("\") called.\n");
+
+	// close disks which have not been used for a while
+	if(0==g_ucMultiple) SuspendIdleDisks();
 	
 	// allocate new search structure
 	pHandle = malloc(sizeof(FIND_HANDLE));
@@ -2041,8 +2115,10 @@ DLLEXPORT void __stdcall FsGetDefRootName(char* cDefRootName, int iMaxLen)
 //    pSourceDisk   = pointer to source disk structure if copying from Ensoniq
 //    dwSourceStart = first block of file, the FAT chain will be followed for
 //                    reading the source file
-//    dwLen         = number of blocks to copy (if EOF is reached before
-//                    reaching dwLen, the function returns with no error)
+//    pdwLen        = pointer to the number of blocks to copy, receives the
+//                    number of blocks copied (if EOF is reached before
+//                    reaching dwLen, only the blocks read are written and
+//                    linked, the function returns with no error)
 //    dwDestStart   = pointer to a DWORD to receive the start of the newly
 //	 			  	  created destination file
 //    dwContiguous  = pointer to a DWORD to receive the number of contiguous
@@ -2062,17 +2138,28 @@ DLLEXPORT void __stdcall FsGetDefRootName(char* cDefRootName, int iMaxLen)
 //    ERR_ABORTED
 //----------------------------------------------------------------------------
 int CopyEnsoniqFile(DISK *pDestDisk, int iMode, FILE *f, DISK *pSourceDisk, 
-	DWORD dwSourceStart, DWORD dwLen, DWORD *dwDestStart, DWORD *dwContiguous,
-	char *cLocalName, char *cRemoteName)
+	DWORD dwSourceStart, DWORD *pdwLen, DWORD *dwDestStart,
+	DWORD *dwContiguous, char *cLocalName, char *cRemoteName)
 {
 #define READ_COUNT 64
 
 	unsigned char ucBuf[512*READ_COUNT], ucContiguous = 0;
-	DWORD dwStart, dwReadBlock, dwWriteBlock = 0, dwBytesRead, dwBlocks, 
-		dwNextBlock;
-	int i, j, iEOF, iResult, iContiguousFlag = 1;
+	DWORD dwStart, dwReadBlocks, dwBytesRead, dwBlocks, dwNextBlock, 
+		*dwChain = NULL, dwLen = *pdwLen;
+	int i, j, k, iEOF, iResult;
+	EXTENT_MAP SourceMap;
 	
-	dwReadBlock = dwSourceStart;
+	// resolve the FAT chain of the source file to extents
+	memset(&SourceMap, 0, sizeof(EXTENT_MAP));
+	if(COPY_ENSONIQ==iMode)
+	{
+		iResult = GetExtentMap(pSourceDisk, dwSourceStart, dwLen, &SourceMap);
+		if(ERR_OK!=iResult)
+		{
+			LOG("Error reading FAT of source file, code=%d.\n", iResult);
+			return ERR_READ;
+		}
+	}
 	
 	// try to find a contiguous block of free space for the file
 	dwStart = GetContiguousBlocks(pDestDisk, dwLen);
@@ -2088,15 +2175,37 @@ int CopyEnsoniqFile(DISK *pDestDisk, int iMode, FILE *f, DISK *pSourceDisk,
 	}
 	else // non-contiguous file
 	{
-		// get first single free block
-		*dwContiguous = 1; iContiguousFlag = 1;
-		dwStart = GetContiguousBlocks(pDestDisk, 1);
-		dwWriteBlock = dwStart;
-		if(0==dwStart)
+		// collect <dwLen> free blocks, they are linked to one FAT chain
+		// after all blocks have been written
+		dwChain = malloc(dwLen*sizeof(DWORD));
+		if(NULL==dwChain)
 		{
-			MessageBoxA(TC_HWND, "The disk is full.", 
-				"EnsoniqFS  Warning", MB_ICONWARNING);
-			return FS_FILE_WRITEERROR;
+			FreeExtentMap(&SourceMap);
+			return ERR_MEM;
+		}
+		
+		dwNextBlock = 0;
+		for(i=0; i<(int)dwLen; i++)
+		{
+			dwNextBlock = GetNextFreeBlock(pDestDisk, dwNextBlock);
+			if(0==dwNextBlock)
+			{
+				free(dwChain);
+				FreeExtentMap(&SourceMap);
+				MessageBoxA(TC_HWND, "The disk is full.", 
+					"EnsoniqFS  Warning", MB_ICONWARNING);
+				return FS_FILE_WRITEERROR;
+			}
+			dwChain[i] = dwNextBlock++;
+		}
+		dwStart = dwChain[0];
+		
+		// count contiguous blocks at the start of the file
+		*dwContiguous = 1;
+		while((*dwContiguous<dwLen)&&
+			  (dwChain[*dwContiguous]==dwStart+*dwContiguous))
+		{
+			(*dwContiguous)++;
 		}
 		
 		// loop through file
@@ -2118,6 +2227,8 @@ int CopyEnsoniqFile(DISK *pDestDisk, int iMode, FILE *f, DISK *pSourceDisk,
 			{
 				LOG("Error reading local file (block %d-%d, tried to read %d, "
 					"got %d).\n", i, i+dwBlocks, dwBlocks, dwBytesRead/512);
+				if(dwChain) free(dwChain);
+				FreeExtentMap(&SourceMap);
 				return ERR_LOCAL_READ;
 			}
 		}
@@ -2125,38 +2236,35 @@ int CopyEnsoniqFile(DISK *pDestDisk, int iMode, FILE *f, DISK *pSourceDisk,
 
 		// read blocks from Ensoniq disk
 		{
-			for(j=0; j<(int)dwBlocks; j++)
+			// read as far as the FAT chain of the source file goes
+			dwReadBlocks = SourceMap.dwBlocks - i;
+			if(dwReadBlocks>dwBlocks) dwReadBlocks = dwBlocks;
+			
+			iResult = ReadExtentMap(pSourceDisk, &SourceMap, dwReadBlocks, 
+				ucBuf);
+			if(ERR_OK!=iResult)
 			{
-				// read block from Ensoniq device
-				iResult = ReadBlock(pSourceDisk, dwReadBlock, ucBuf+j*512);
-				if(ERR_OK!=iResult)
-				{
-					LOG("Error reading block from Ensoniq device.\n");
-					return iResult;
-				}
-				
-				// get next block from FAT
-				dwReadBlock = GetFATEntry(pSourceDisk, dwReadBlock);
-				if(-1==(int)dwReadBlock)
-				{
-					LOG("Error reading FAT entry.\n");
-					return ERR_READ;
-				}
-				
-				// empty block, EOF or bad block?
-				if(dwReadBlock<3)
-				{
-					if((DWORD)(i+j)<(dwLen-1))
-					{
-						LOG("Error: EOF before dwLen was reached.\n");
-					}
-					iEOF = 1; break;
-				}
+				LOG("Error reading blocks from Ensoniq device.\n");
+				if(dwChain) free(dwChain);
+				FreeExtentMap(&SourceMap);
+				return iResult;
+			}
+			
+			// empty block, EOF or bad block? only the blocks read are
+			// written and become part of the file
+			if(dwReadBlocks<dwBlocks)
+			{
+				LOG("Error: EOF before dwLen was reached.\n");
+				dwBlocks = dwReadBlocks;
+				iEOF = 1;
+				if(0==dwBlocks) break;
 			}
 		}
 		else
 		{
 			LOG("Error: Unsupported copy mode.\n");
+			if(dwChain) free(dwChain);
+			FreeExtentMap(&SourceMap);
 			return ERR_NOT_SUPPORTED;
 		}
 
@@ -2167,87 +2275,41 @@ int CopyEnsoniqFile(DISK *pDestDisk, int iMode, FILE *f, DISK *pSourceDisk,
 			if(ERR_OK!=iResult)
 			{
 				LOG("Error writing Ensoniq file, code=%d.\n", iResult);
+				FreeExtentMap(&SourceMap);
 				return ERR_WRITE;
 			}
 		}
 		else
 		{
-			// write non-contiguous blocks
-			for(j=0; j<(int)dwBlocks; j++)
+			// write non-contiguous blocks, adjacent blocks at once
+			for(j=0; j<(int)dwBlocks; j+=k)
 			{
-				LOG("Writing 1 block at %d: ", dwWriteBlock);
-				iResult = WriteBlocks(pDestDisk, dwWriteBlock, 1, ucBuf+j*512);
+				for(k=1; (j+k<(int)dwBlocks)&&
+						 (dwChain[i+j+k]==dwChain[i+j]+k); k++);
+				
+				LOG("Writing %d block(s) at %d: ", k, dwChain[i+j]);
+				iResult = WriteBlocks(pDestDisk, dwChain[i+j], k, 
+					ucBuf+j*512);
 				if(ERR_OK!=iResult)
 				{
 					LOG("Error writing Ensoniq file, code=%d.\n", iResult);
+					free(dwChain);
+					FreeExtentMap(&SourceMap);
 					return ERR_WRITE;
 				}
-				
-				// mark this block used so next call to GetContiguousBlocks()
-				// won't deliver the same block, as a side effect this block
-				// gets set to EOF but will be written with the real value if
-				// EOF is not yet reached
-				SetFATEntry(pDestDisk, dwWriteBlock, 1);
-				
-				// if not EOF, allocate a new block
-				if((i+j)<(int)(dwLen-1))
-				{
-					// get next free FAT entry
-					dwNextBlock = GetContiguousBlocks(pDestDisk, 1);
-					if(0==dwNextBlock)
-					{
-						// undo changes to FAT
-						dwNextBlock = dwStart;
-						while(dwNextBlock!=dwWriteBlock)
-						{
-							// mark block as free
-							dwNextBlock = SetFATEntry(pDestDisk, 
-								dwNextBlock, 0);
-							if((-1==(int)dwNextBlock)||(dwNextBlock<3)) break;
-						}
-						CacheFlush(pDestDisk);
-	
-						MessageBoxA(TC_HWND, "The disk is full or not writable.", 
-							"EnsoniqFS  Warning", MB_ICONWARNING);
-						return FS_FILE_WRITEERROR;
-					}
-					
-					// set current FAT entry to point to next entry
-					SetFATEntry(pDestDisk, dwWriteBlock, dwNextBlock);
-					
-					// count contiguous blocks
-					if((dwNextBlock==(dwWriteBlock+1))&&(0!=iContiguousFlag))
-					{
-						*dwContiguous++;
-					}
-					else iContiguousFlag = 0;
-					
-					dwWriteBlock = dwNextBlock;
-				}
+				LOG("OK.\n");
 			}
-			LOG("OK.\n");
 		}
 		
 		// notify TotalCmd of progress, check for user abort
 		if(1==g_pProgressProc(g_iPluginNr, cLocalName, cRemoteName, 
 							  100*i/dwLen))
 		{
-			// if user wants to abort, undo FAT changes before returning
-			LOG("Aborting, undo FAT changes: ");
-			if(!ucContiguous)
-			{
-				// undo non-contiguous FAT changes only, contiguous FAT changes
-				// would be done below, so no need to undo them here
-				dwNextBlock = dwStart;
-				while(dwNextBlock!=dwWriteBlock)
-				{
-					// mark block as free
-					dwNextBlock = SetFATEntry(pDestDisk, dwNextBlock, 0);
-					if((-1==(int)dwNextBlock)||(dwNextBlock<3)) break;
-				}
-			}
-			
-			LOG("OK.\n");
+			// the FAT is written after the last block, so there are no
+			// FAT changes to undo here
+			LOG("Aborting.\n");
+			if(dwChain) free(dwChain);
+			FreeExtentMap(&SourceMap);
 			CacheFlush(pDestDisk);
 			return ERR_ABORTED;
 		}
@@ -2256,29 +2318,36 @@ int CopyEnsoniqFile(DISK *pDestDisk, int iMode, FILE *f, DISK *pSourceDisk,
 		i += dwBlocks;
 	}
 	LOG("OK.\n");
+	FreeExtentMap(&SourceMap);
+	
+	// the file ends after the last block written
+	dwLen = i;
+	if(0==dwLen)
+	{
+		LOG("Error: Source file is empty.\n");
+		if(dwChain) free(dwChain);
+		return ERR_EOF;
+	}
+	if(*dwContiguous>dwLen) *dwContiguous = dwLen;
 
-	if(ucContiguous) // write all FAT entries in at once for contiguous files
+	// write all FAT entries at once
+	LOG("Writing FAT entries: ");
+	if(ucContiguous) iResult = LinkFATRange(pDestDisk, dwStart, dwLen);
+	else
 	{
-		// set all FAT entries
-		LOG("Writing FAT entries: ");
-		for(i=0; i<(int)(dwLen-1); i++)
-		{
-			if(-1==SetFATEntry(pDestDisk, dwStart+i, dwStart+i+1))
-			{
-				LOG("Error writing FAT entry %d.\n", dwStart+i);
-				return ERR_WRITE;
-			}
-		}
-		if(-1==SetFATEntry(pDestDisk, dwStart+dwLen-1, 1)) // EOF
-		{
-			LOG("Error writing FAT entry %d.\n", dwStart+dwLen-1);
-			return ERR_WRITE;
-		}
-		LOG("OK.\n");
+		iResult = LinkFATChain(pDestDisk, dwChain, dwLen);
+		free(dwChain);
 	}
+	if(ERR_OK!=iResult)
+	{
+		LOG("Error writing FAT entries, code=%d.\n", iResult);
+		return ERR_WRITE;
+	}
+	LOG("OK.\n");
 
 	// set external pointer to starting block
 	*dwDestStart = dwStart;
+	*pdwLen = dwLen;
 	return ERR_OK;
 }
 
@@ -2325,7 +2394,8 @@ void AddToImageList(char *cName)
 			"     ISO format (plain disk image)\n"
 			"     BIN format (CDROM Mode1)\n"
 			"     GKH format (Epsread/Epswrite)\n"
-			"     Giebler disk image (EDE, EDA, EDT, EDV)\n\n"
+			"     Giebler disk image (EDE, EDA, EDT, EDV)\n"
+			"     EnsoniqFS chunk-compressed image\n\n"
 			"Additionally, the image file must contain a valid Ensoniq "
 			"file\nsystem for EnsoniqFS to be able to mount it.",
 			"EnsoniqFS  Error", MB_ICONSTOP);
@@ -2628,7 +2698,7 @@ DLLEXPORT int __stdcall FsPutFile(char* LocalName, char* RemoteName,
 	LOG("Writing file: ");
 	
 	// do the copying with another function
-	iResult = CopyEnsoniqFile(Handle.pDisk, COPY_DOS, f, 0, 0, dwFilesize, 
+	iResult = CopyEnsoniqFile(Handle.pDisk, COPY_DOS, f, 0, 0, &dwFilesize, 
 		&dwStart, &dwContiguous, LocalName, RemoteName);
 	fclose(f);
 		
@@ -2847,9 +2917,9 @@ DLLEXPORT int __stdcall FsGetFile(char* RemoteName, char* LocalName,
 DLLEXPORT BOOL __stdcall FsDeleteFile(char* RemoteName)
 {
 	FIND_HANDLE Handle;
-	int i, iEntry, iSize;
+	int i, iEntry, iSize, iResult;
 	char cName[17], cLegalName[17];
-	DWORD dwBlock;
+	DWORD dwFreed;
 	
 	upcase(RemoteName);
 	LOG("\nFsDeleteFile('%s')\n", RemoteName);
@@ -2901,22 +2971,13 @@ DLLEXPORT BOOL __stdcall FsDeleteFile(char* RemoteName)
 		Handle.EnsoniqDir.Entry[iEntry].dwLen);
 
 	// mark FAT entries as empty for this file
-	dwBlock = Handle.EnsoniqDir.Entry[iEntry].dwStart;
-	iSize = 0;
-	while(1)
+	iResult = FreeFATChain(Handle.pDisk, Handle.EnsoniqDir.Entry[iEntry].dwStart,
+		&dwFreed);
+	if(ERR_OK!=iResult)
 	{
-		dwBlock = SetFATEntry(Handle.pDisk, dwBlock, 0);
-		iSize++;
-		
-		// check error
-		if(-1==(int)dwBlock) break;
-		
-		// hit an empty block -> something is wrong here
-		if(0==dwBlock) break;
-		
-		// regular end of file
-		if(1==dwBlock) break;
+		LOG("Error freeing FAT chain, code=%d.\n", iResult);
 	}
+	iSize = dwFreed;
 
 	// delete file from current directory
 	Handle.EnsoniqDir.ucDirectory[iEntry*26+1] = 0;
@@ -2932,7 +2993,6 @@ DLLEXPORT BOOL __stdcall FsDeleteFile(char* RemoteName)
 	
 	// adjust free blocks counter
 	AdjustFreeBlocks(Handle.pDisk, -iSize);
-	Handle.pDisk->dwLastFreeFATEntry=Handle.EnsoniqDir.Entry[iEntry].dwStart;
 	
 	// only flush cache if this was a single file to delete
 	if(0==g_ucMultiple) CacheFlush(Handle.pDisk);
@@ -3050,8 +3110,6 @@ DLLEXPORT BOOL __stdcall FsRemoveDir(char* RemoteName)
 
 	// only flush cache if this was a single dir to delete
 	if(0==g_ucMultiple) CacheFlush(Handle.pDisk);
-	
-	Handle.pDisk->dwLastFreeFATEntry = dwDeleteDirBlock;
 
 	return TRUE;
 }
@@ -3171,12 +3229,17 @@ DLLEXPORT BOOL __stdcall FsMkDir(char* Path)
 
 	// write to FAT
 	LOG("Writing FAT entries: ");
-	SetFATEntry(Handle.pDisk, iNextFreeBlocks, iNextFreeBlocks+1);
-	SetFATEntry(Handle.pDisk, iNextFreeBlocks+1, 1);
+	if(ERR_OK!=LinkFATRange(Handle.pDisk, iNextFreeBlocks, 2))
+	{
+		LOG("failed.\n");
+		CacheFlush(Handle.pDisk);
+		return FALSE;
+	}
 	LOG("OK.\n");
 
-	// write new directory to disk
+	// write new directory to disk (kept in the metadata cache tier)
 	LOG("Writing new directory: ");
+	CacheSetMetadata(Handle.pDisk, iNextFreeBlocks, 2);
 	if(ERR_OK!=WriteBlocks(Handle.pDisk, iNextFreeBlocks, 2, ucNewDir))
 	{
 		LOG("failed.\n");
@@ -3307,7 +3370,7 @@ DLLEXPORT void __stdcall FsStatusInfo(char* RemoteDir, int InfoStartEnd,
 //----------------------------------------------------------------------------
 DLLEXPORT void __stdcall FsSetDefaultParams(FsDefaultParamStruct* dps)
 {
-	char *cName, cValue[3];
+	char *cName, cValue[3], cNumber[9];
 	
 	LOG("FsSetDefaultParams(): DefaultIniName='%s', "
 		"PluginInterfaceVersionHi=%d, PluginInterfaceVersionLow=%d, size=%d\n",
@@ -3347,6 +3410,44 @@ DLLEXPORT void __stdcall FsSetDefaultParams(FsDefaultParamStruct* dps)
 	g_iOptionBankTargetDevice = atoi(cValue);
 	if (g_iOptionBankTargetDevice < 0) g_iOptionBankTargetDevice = 0;
 	if (g_iOptionBankTargetDevice > 8) g_iOptionBankTargetDevice = 8;
+	
+	// maximum read ahead per media type (blocks)
+	GetIniValue(cName, "[EnsoniqFS]", "ReadAheadFloppy", cNumber, 8, "160");
+	g_iOptionReadAheadFloppy = atoi(cNumber);
+	GetIniValue(cName, "[EnsoniqFS]", "ReadAheadCDROM", cNumber, 8, "1024");
+	g_iOptionReadAheadCDROM = atoi(cNumber);
+	GetIniValue(cName, "[EnsoniqFS]", "ReadAheadDisk", cNumber, 8, "2048");
+	g_iOptionReadAheadDisk = atoi(cNumber);
+	GetIniValue(cName, "[EnsoniqFS]", "ReadAheadImage", cNumber, 8, "4096");
+	g_iOptionReadAheadImage = atoi(cNumber);
+	
+	// maximum size of image files mapped into memory (MB, 0 = off)
+	GetIniValue(cName, "[EnsoniqFS]", "MemoryMapLimit", cNumber, 8, "512");
+	g_iOptionMemoryMapLimit = atoi(cNumber);
+	
+	// maximum size of image files loaded into memory (MB, 0 = off)
+	GetIniValue(cName, "[EnsoniqFS]", "RamImageLimit", cNumber, 8, "0");
+	g_iOptionRamImageLimit = atoi(cNumber);
+	
+	// unbuffered I/O for harddisks and large image files
+	GetIniValue(cName, "[EnsoniqFS]", "DirectIODisk", cValue, 2, "0");
+	g_iOptionDirectIODisk = (cValue[0]=='0')?0:1;
+	GetIniValue(cName, "[EnsoniqFS]", "DirectIOImage", cValue, 2, "0");
+	g_iOptionDirectIOImage = (cValue[0]=='0')?0:1;
+	GetIniValue(cName, "[EnsoniqFS]", "DirectIOMinSize", cNumber, 8, "512");
+	g_iOptionDirectIOMinSize = atoi(cNumber);
+	
+	// cache replacement policy (0 = LRU, 1 = scan resistant 2Q)
+	GetIniValue(cName, "[EnsoniqFS]", "CachePolicy", cValue, 2, "1");
+	g_iOptionCachePolicy = (cValue[0]=='0')?0:1;
+	
+	// memory shared by the caches of all disks (MB)
+	GetIniValue(cName, "[EnsoniqFS]", "CacheBudget", cNumber, 8, "32");
+	g_iOptionCacheBudget = atoi(cNumber);
+	
+	// close unused disks and free their cache after this time (s, 0 = off)
+	GetIniValue(cName, "[EnsoniqFS]", "IdleTimeout", cNumber, 8, "60");
+	g_iOptionIdleTimeout = atoi(cNumber);
 }
 
 //----------------------------------------------------------------------------
@@ -3665,8 +3766,7 @@ DLLEXPORT int __stdcall FsRenMovFile(char* OldName, char* NewName, BOOL Move,
 	{
 		iResult = CopyEnsoniqFile(NewHandle.pDisk, COPY_ENSONIQ, 0, 
 			OldHandle.pDisk, OldHandle.EnsoniqDir.Entry[iOldEntry].dwStart,
-			OldHandle.EnsoniqDir.Entry[iOldEntry].dwLen, &dwNewStart, 
-			&dwContiguous, cOldName, cNewName);
+			&dwFilesize, &dwNewStart, &dwContiguous, cOldName, cNewName);
 
 		if(ERR_OK!=iResult)
 		{
@@ -3692,7 +3792,7 @@ DLLEXPORT int __stdcall FsRenMovFile(char* OldName, char* NewName, BOOL Move,
 
 			iOldAdjust = -OldHandle.EnsoniqDir.Entry[iOldEntry].dwLen;
 		}
-		iNewAdjust = OldHandle.EnsoniqDir.Entry[iOldEntry].dwLen;
+		iNewAdjust = dwFilesize;
 		
 		// prepare directory entry
 		ucNewDir[iNewEntry*26+1] = ucType;
@@ -3814,6 +3914,8 @@ BOOL APIENTRY DllMain (HINSTANCE hInst /*Library instance handle.*/,
 		case DLL_PROCESS_ATTACH:
 			LOG("DllMain() DLL_PROCESS_ATTACH called.\n");
 			g_hInst = hInst;
+			CacheStartup();
+			BackendStartup();
 
 			// create memory mapped file
 			// this is to detect several running instances (also used within
@@ -3883,6 +3985,8 @@ BOOL APIENTRY DllMain (HINSTANCE hInst /*Library instance handle.*/,
 			LOG("Unmapping file.\n");
 			UnmapViewOfFile(g_ucSharedMemory);
 			CloseHandle(g_hMemoryMappedFile);
+			BackendShutdown();
+			CacheShutdown();
 						
 	        break;
 
@@ -0,0 +1,1685 @@
+//----------------------------------------------------------------------------
+// EnsoniqFS plugin for TotalCommander
+//
+// BLOCK DEVICE BACKENDS
+//----------------------------------------------------------------------------
+//
+// (c) 2006 Thoralt Franz
+//
+// This source code was written using Dev-Cpp 4.9.9.2
+// If you want to compile it, get Dev-Cpp. Normally the code should compile
+// with other IDEs/compilers too (with small modifications), but I did not
+// test it.
+//
+//----------------------------------------------------------------------------
+// License
+//----------------------------------------------------------------------------
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, 
+// MA  02110-1301, USA.
+// 
+// Alternatively, download a copy of the license here:
+// http://www.gnu.org/licenses/gpl.txt
+//----------------------------------------------------------------------------
+#include "backend.h"
+#include "chunkimg.h"
+
+//----------------------------------------------------------------------------
+// externals
+//----------------------------------------------------------------------------
+extern int g_iOptionMemoryMapLimit;
+extern int g_iOptionRamImageLimit;
+extern int g_iOptionDirectIODisk;
+extern int g_iOptionDirectIOImage;
+extern int g_iOptionDirectIOMinSize;
+
+//----------------------------------------------------------------------------
+// raw positional I/O (used by the unbuffered I/O functions)
+//----------------------------------------------------------------------------
+typedef int (*RAWIO)(DISK *pDisk, __int64 iiOffset, unsigned char *ucBuf,
+	DWORD dwBytes);
+
+//----------------------------------------------------------------------------
+// pool of aligned bounce buffers for unbuffered I/O
+//----------------------------------------------------------------------------
+static unsigned char *g_ucDirectPool[DIRECT_IO_POOL];
+static int g_iDirectPoolUsed[DIRECT_IO_POOL];
+static CRITICAL_SECTION g_csDirectPool;	// guards the two above
+
+//----------------------------------------------------------------------------
+// ReadAt
+//
+// Read from a device or file at the given offset. The offset is passed
+// with the call, the file pointer of the handle is not used.
+//
+// -> hHandle = handle of device or file
+//    iiOffset = byte offset to read from
+//    pBuf = pointer to destination buffer
+//    dwBytes = number of bytes to read
+// <- ERR_OK
+//    ERR_READ
+//----------------------------------------------------------------------------
+int ReadAt(HANDLE hHandle, __int64 iiOffset, void *pBuf, DWORD dwBytes)
+{
+	OVERLAPPED Overlapped;
+	DWORD dwBytesRead = 0, dwError;
+
+	memset(&Overlapped, 0, sizeof(OVERLAPPED));
+	Overlapped.Offset = iiOffset & 0xFFFFFFFF;
+	Overlapped.OffsetHigh = (iiOffset >> 32) & 0xFFFFFFFF;
+
+	if(0==ReadFile(hHandle, pBuf, dwBytes, &dwBytesRead, &Overlapped))
+	{
+		dwError = GetLastError();
+		LOG("ReadAt() failed: "); LOG_ERR(dwError);
+		return ERR_READ;
+	}
+	if(dwBytes!=dwBytesRead) return ERR_READ;
+
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// WriteAt
+//
+// Write to a device or file at the given offset. The offset is passed
+// with the call, the file pointer of the handle is not used.
+//
+// -> hHandle = handle of device or file
+//    iiOffset = byte offset to write to
+//    pBuf = pointer to source buffer
+//    dwBytes = number of bytes to write
+// <- ERR_OK
+//    ERR_WRITE
+//----------------------------------------------------------------------------
+int WriteAt(HANDLE hHandle, __int64 iiOffset, void *pBuf, DWORD dwBytes)
+{
+	OVERLAPPED Overlapped;
+	DWORD dwBytesWritten = 0, dwError;
+
+	memset(&Overlapped, 0, sizeof(OVERLAPPED));
+	Overlapped.Offset = iiOffset & 0xFFFFFFFF;
+	Overlapped.OffsetHigh = (iiOffset >> 32) & 0xFFFFFFFF;
+
+	if(0==WriteFile(hHandle, pBuf, dwBytes, &dwBytesWritten, &Overlapped))
+	{
+		dwError = GetLastError();
+		LOG("WriteAt() failed: "); LOG_ERR(dwError);
+		return ERR_WRITE;
+	}
+	if(dwBytes!=dwBytesWritten) return ERR_WRITE;
+
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// unbuffered I/O
+//
+// Devices and image files opened with FILE_FLAG_NO_BUFFERING bypass the OS
+// file cache, the block cache is the only cache then. Offset, length and
+// buffer address of every transfer have to be multiples of the sector size
+// (dwDirectIOAlign), transfers which are not aligned go through a bounce
+// buffer from the pool.
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+// BackendStartup
+//
+// Create the lock of the bounce buffer pool, which is shared by all disks
+// (called once when the DLL is loaded)
+//
+// -> --
+// <- --
+//----------------------------------------------------------------------------
+void BackendStartup(void)
+{
+	InitializeCriticalSection(&g_csDirectPool);
+}
+
+//----------------------------------------------------------------------------
+// BackendShutdown
+//
+// Free the bounce buffer pool and delete its lock (called once when the DLL
+// is unloaded)
+//
+// -> --
+// <- --
+//----------------------------------------------------------------------------
+void BackendShutdown(void)
+{
+	FreeDirectIOPool();
+	DeleteCriticalSection(&g_csDirectPool);
+}
+
+//----------------------------------------------------------------------------
+// DirectBufferGet
+//
+// Take an aligned bounce buffer (DIRECT_IO_BUFFER bytes) from the pool. If
+// all pool buffers are in use, a buffer is allocated.
+//
+// <- pointer to buffer or NULL if out of memory
+//----------------------------------------------------------------------------
+static unsigned char *DirectBufferGet(void)
+{
+	unsigned char *ucBuf;
+	int i;
+
+	EnterCriticalSection(&g_csDirectPool);
+	for(i=0; i<DIRECT_IO_POOL; i++)
+	{
+		if(g_iDirectPoolUsed[i]) continue;
+		if(NULL==g_ucDirectPool[i])
+		{
+			g_ucDirectPool[i] = VirtualAlloc(NULL, DIRECT_IO_BUFFER,
+				MEM_COMMIT, PAGE_READWRITE);
+			if(NULL==g_ucDirectPool[i]) break;
+		}
+		g_iDirectPoolUsed[i] = 1;
+		ucBuf = g_ucDirectPool[i];
+		LeaveCriticalSection(&g_csDirectPool);
+		return ucBuf;
+	}
+	LeaveCriticalSection(&g_csDirectPool);
+
+	return VirtualAlloc(NULL, DIRECT_IO_BUFFER, MEM_COMMIT, PAGE_READWRITE);
+}
+
+//----------------------------------------------------------------------------
+// DirectBufferRelease
+//
+// Return a bounce buffer to the pool (buffers not from the pool are freed)
+//
+// -> ucBuf = buffer from DirectBufferGet()
+// <- --
+//----------------------------------------------------------------------------
+static void DirectBufferRelease(unsigned char *ucBuf)
+{
+	int i;
+
+	EnterCriticalSection(&g_csDirectPool);
+	for(i=0; i<DIRECT_IO_POOL; i++)
+	{
+		if(ucBuf!=g_ucDirectPool[i]) continue;
+		g_iDirectPoolUsed[i] = 0;
+		LeaveCriticalSection(&g_csDirectPool);
+		return;
+	}
+	LeaveCriticalSection(&g_csDirectPool);
+
+	VirtualFree(ucBuf, 0, MEM_RELEASE);
+}
+
+//----------------------------------------------------------------------------
+// FreeDirectIOPool
+//
+// Free all bounce buffers of the pool (none of them may be in use)
+//
+// <- --
+//----------------------------------------------------------------------------
+void FreeDirectIOPool(void)
+{
+	int i;
+
+	EnterCriticalSection(&g_csDirectPool);
+	for(i=0; i<DIRECT_IO_POOL; i++)
+	{
+		if(g_ucDirectPool[i]) VirtualFree(g_ucDirectPool[i], 0, MEM_RELEASE);
+		g_ucDirectPool[i] = NULL;
+		g_iDirectPoolUsed[i] = 0;
+	}
+	LeaveCriticalSection(&g_csDirectPool);
+}
+
+//----------------------------------------------------------------------------
+// DirectTransfer
+//
+// Read or write any range through unbuffered I/O. Aligned transfers go
+// directly to the caller's buffer, all others are split into aligned
+// windows of the bounce buffer. Windows which are only partly written are
+// read first.
+//
+// -> pDisk = pointer to initialized disk structure (dwDirectIOAlign set)
+//    pRead = raw read function
+//    pWrite = raw write function or NULL to read
+//    iiOffset = byte offset
+//    ucBuf = pointer to source or destination buffer
+//    dwBytes = number of bytes to transfer
+// <- ERR_OK
+//    ERR_READ
+//    ERR_WRITE
+//    ERR_MEM
+//----------------------------------------------------------------------------
+static int DirectTransfer(DISK *pDisk, RAWIO pRead, RAWIO pWrite,
+	__int64 iiOffset, unsigned char *ucBuf, DWORD dwBytes)
+{
+	DWORD dwAlign = pDisk->dwDirectIOAlign, dwSkip, dwWindow, dwBytesNow;
+	unsigned char *ucBounce;
+	__int64 iiStart;
+	int iResult = ERR_OK;
+
+	// aligned transfers need no bounce buffer
+	if((0==(iiOffset & (dwAlign-1)))&&(0==(dwBytes & (dwAlign-1)))&&
+	   (0==((DWORD)ucBuf & (dwAlign-1))))
+	{
+		return pWrite ? pWrite(pDisk, iiOffset, ucBuf, dwBytes) :
+			pRead(pDisk, iiOffset, ucBuf, dwBytes);
+	}
+
+	ucBounce = DirectBufferGet();
+	if(NULL==ucBounce)
+	{
+		LOG("DirectTransfer(): ERR_MEM\n");
+		return ERR_MEM;
+	}
+
+	while(dwBytes)
+	{
+		// aligned window around the next part of the transfer
+		dwSkip = (DWORD)(iiOffset & (dwAlign-1));
+		iiStart = iiOffset - dwSkip;
+		dwWindow = (dwSkip + dwBytes + dwAlign - 1) & ~(dwAlign-1);
+		if(dwWindow>DIRECT_IO_BUFFER) dwWindow = DIRECT_IO_BUFFER;
+		dwBytesNow = dwWindow - dwSkip;
+		if(dwBytesNow>dwBytes) dwBytesNow = dwBytes;
+
+		if(NULL==pWrite)
+		{
+			iResult = pRead(pDisk, iiStart, ucBounce, dwWindow);
+			if(ERR_OK!=iResult) break;
+			memcpy(ucBuf, ucBounce+dwSkip, dwBytesNow);
+		}
+		else
+		{
+			// keep the rest of partly written sectors
+			if((dwSkip>0)||(dwBytesNow<dwWindow))
+			{
+				iResult = pRead(pDisk, iiStart, ucBounce, dwWindow);
+				if(ERR_OK!=iResult)
+				{
+					iResult = ERR_WRITE;
+					break;
+				}
+			}
+			memcpy(ucBounce+dwSkip, ucBuf, dwBytesNow);
+			iResult = pWrite(pDisk, iiStart, ucBounce, dwWindow);
+			if(ERR_OK!=iResult) break;
+		}
+
+		iiOffset += dwBytesNow;
+		ucBuf += dwBytesNow;
+		dwBytes -= dwBytesNow;
+	}
+
+	DirectBufferRelease(ucBounce);
+	return iResult;
+}
+
+//----------------------------------------------------------------------------
+// HandleReadAt, HandleWriteAt
+//
+// Raw I/O on the Win32 handle of a disk
+//----------------------------------------------------------------------------
+static int HandleReadAt(DISK *pDisk, __int64 iiOffset, unsigned char *ucBuf,
+	DWORD dwBytes)
+{
+	return ReadAt(pDisk->hHandle, iiOffset, ucBuf, dwBytes);
+}
+
+static int HandleWriteAt(DISK *pDisk, __int64 iiOffset, unsigned char *ucBuf,
+	DWORD dwBytes)
+{
+	return WriteAt(pDisk->hHandle, iiOffset, ucBuf, dwBytes);
+}
+
+//----------------------------------------------------------------------------
+// DiskReadAt
+//
+// Read from the handle of a disk, unbuffered if the handle was opened that
+// way
+//
+// -> pDisk = pointer to initialized disk structure
+//    iiOffset = byte offset to read from
+//    ucBuf = pointer to destination buffer
+//    dwBytes = number of bytes to read
+// <- ERR_OK
+//    ERR_READ
+//    ERR_MEM
+//----------------------------------------------------------------------------
+static int DiskReadAt(DISK *pDisk, __int64 iiOffset, unsigned char *ucBuf,
+	DWORD dwBytes)
+{
+	if(0==pDisk->dwDirectIOAlign)
+	{
+		return ReadAt(pDisk->hHandle, iiOffset, ucBuf, dwBytes);
+	}
+	return DirectTransfer(pDisk, HandleReadAt, NULL, iiOffset, ucBuf, dwBytes);
+}
+
+//----------------------------------------------------------------------------
+// DiskWriteAt
+//
+// Write to the handle of a disk, unbuffered if the handle was opened that
+// way
+//
+// -> pDisk = pointer to initialized disk structure
+//    iiOffset = byte offset to write to
+//    ucBuf = pointer to source buffer
+//    dwBytes = number of bytes to write
+// <- ERR_OK
+//    ERR_WRITE
+//    ERR_MEM
+//----------------------------------------------------------------------------
+static int DiskWriteAt(DISK *pDisk, __int64 iiOffset, unsigned char *ucBuf,
+	DWORD dwBytes)
+{
+	if(0==pDisk->dwDirectIOAlign)
+	{
+		return WriteAt(pDisk->hHandle, iiOffset, ucBuf, dwBytes);
+	}
+	return DirectTransfer(pDisk, HandleReadAt, HandleWriteAt, iiOffset, ucBuf,
+		dwBytes);
+}
+
+//----------------------------------------------------------------------------
+// physical devices (harddisk, CDROM, floppy)
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+// DeviceReadBlocks
+//
+// -> pDisk = pointer to initialized disk structure
+//    dwBlock = first block to read
+//    dwNumBlocks = number of blocks to read
+//    ucBuf = pointer to destination buffer (dwNumBlocks*512 bytes)
+// <- ERR_OK
+//    ERR_READ
+//----------------------------------------------------------------------------
+static int DeviceReadBlocks(DISK *pDisk, DWORD dwBlock, DWORD dwNumBlocks,
+	unsigned char *ucBuf)
+{
+	__int64 iiOffset;
+
+	iiOffset = dwBlock; iiOffset *= 512;
+	if(ERR_OK!=DiskReadAt(pDisk, iiOffset, ucBuf, dwNumBlocks*512))
+	{
+		LOG("DeviceReadBlocks(): ERR_READ\n");
+		return ERR_READ;
+	}
+
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// DeviceWriteBlocks
+//
+// -> pDisk = pointer to initialized disk structure
+//    dwBlock = first block to write
+//    dwNumBlocks = number of blocks to write
+//    ucBuf = pointer to source buffer (dwNumBlocks*512 bytes)
+// <- ERR_OK
+//    ERR_WRITE
+//----------------------------------------------------------------------------
+static int DeviceWriteBlocks(DISK *pDisk, DWORD dwBlock, DWORD dwNumBlocks,
+	unsigned char *ucBuf)
+{
+	__int64 iiOffset;
+
+	iiOffset = dwBlock; iiOffset *= 512;
+	if(ERR_OK!=DiskWriteAt(pDisk, iiOffset, ucBuf, dwNumBlocks*512))
+	{
+		LOG("DeviceWriteBlocks(): ERR_WRITE\n");
+		return ERR_WRITE;
+	}
+
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// DeviceGetGeometry
+//
+// Ask the driver for the geometry of a harddisk or CDROM
+//
+// -> pDisk = pointer to initialized disk structure
+// <- ERR_OK
+//    ERR_READ
+//----------------------------------------------------------------------------
+static int DeviceGetGeometry(DISK *pDisk)
+{
+	DWORD dwBytesReturned;
+
+	LOG("Reading disk geometry: ");
+	if(0==DeviceIoControl(pDisk->hHandle, IOCTL_DISK_GET_DRIVE_GEOMETRY_EX,
+						  NULL, 0, &(pDisk->DiskGeometry),
+						  sizeof(DISK_GEOMETRY_EX),
+						  &dwBytesReturned, NULL))
+	{
+		LOG("DeviceIoControl(IOCTL_DISK_GET_DRIVE_GEOMETRY_EX) "
+			"failed.\n");
+		return ERR_READ;
+	}
+
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// DeviceClose
+//
+// -> pDisk = pointer to initialized disk structure
+// <- --
+//----------------------------------------------------------------------------
+static void DeviceClose(DISK *pDisk)
+{
+	if(INVALID_HANDLE_VALUE!=pDisk->hHandle) CloseHandle(pDisk->hHandle);
+	pDisk->hHandle = INVALID_HANDLE_VALUE;
+}
+
+//----------------------------------------------------------------------------
+// FloppyGetGeometry
+//
+// Floppy disks are as large as the DeviceID block says (dwBlocks must be
+// set before)
+//
+// -> pDisk = pointer to initialized disk structure
+// <- ERR_OK
+//----------------------------------------------------------------------------
+static int FloppyGetGeometry(DISK *pDisk)
+{
+	pDisk->DiskGeometry.DiskSize.QuadPart = pDisk->dwBlocks;
+	pDisk->DiskGeometry.DiskSize.QuadPart *= 512;
+
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// FloppyClose
+//
+// Unlock the floppy drive, close it and disable the extended formats
+//
+// -> pDisk = pointer to initialized disk structure
+// <- --
+//----------------------------------------------------------------------------
+static void FloppyClose(DISK *pDisk)
+{
+	DWORD dwBytesReturned;
+
+	if(INVALID_HANDLE_VALUE==pDisk->hHandle) return;
+
+	DeviceIoControl(pDisk->hHandle, FSCTL_UNLOCK_VOLUME, NULL, 0,
+					NULL, 0, &dwBytesReturned, NULL);
+	CloseHandle(pDisk->hHandle);
+	EnableExtendedFormats(pDisk->cMsDosName, FALSE);
+	pDisk->hHandle = INVALID_HANDLE_VALUE;
+}
+
+//----------------------------------------------------------------------------
+// image files
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+// ImageReadBlocks
+//
+// Read from ISO or GKH image files (plain blocks behind dwDataOffset). Large
+// ranges are read in chunks of DIRECT_READ_CHUNK blocks.
+//
+// -> pDisk = pointer to initialized disk structure
+//    dwBlock = first block to read
+//    dwNumBlocks = number of blocks to read
+//    ucBuf = pointer to destination buffer (dwNumBlocks*512 bytes)
+// <- ERR_OK
+//    ERR_READ
+//----------------------------------------------------------------------------
+static int ImageReadBlocks(DISK *pDisk, DWORD dwBlock, DWORD dwNumBlocks,
+	unsigned char *ucBuf)
+{
+	DWORD dwBlocks;
+	__int64 iiOffset;
+
+	while(dwNumBlocks)
+	{
+		// read up to the next chunk boundary
+		dwBlocks = DIRECT_READ_CHUNK - (dwBlock % DIRECT_READ_CHUNK);
+		if(dwBlocks>dwNumBlocks) dwBlocks = dwNumBlocks;
+
+		iiOffset = dwBlock; iiOffset *= 512; iiOffset += pDisk->dwDataOffset;
+		if(ERR_OK!=DiskReadAt(pDisk, iiOffset, ucBuf, dwBlocks*512))
+		{
+			LOG("ImageReadBlocks(): ERR_READ\n");
+			return ERR_READ;
+		}
+
+		dwBlock += dwBlocks;
+		dwNumBlocks -= dwBlocks;
+		ucBuf += dwBlocks*512;
+	}
+
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// IsZeroBlock
+//
+// -> ucBuf = pointer to one block
+// <- 1 = all bytes are zero, 0 = block contains data
+//----------------------------------------------------------------------------
+static int IsZeroBlock(unsigned char *ucBuf)
+{
+	int i;
+
+	for(i=0; (i<512)&&(0==ucBuf[i]); i++);
+	return (512==i);
+}
+
+//----------------------------------------------------------------------------
+// PunchHole
+//
+// Zero a range of an image file by deallocating it on the host file system.
+// The file is made sparse on first use. Host file systems without sparse
+// files are remembered and not asked again.
+//
+// -> pDisk = pointer to initialized disk structure
+//    iiOffset = byte offset of the range
+//    iiLength = length of the range in bytes
+// <- ERR_OK
+//    ERR_NOT_SUPPORTED (range has to be written instead)
+//----------------------------------------------------------------------------
+static int PunchHole(DISK *pDisk, __int64 iiOffset, __int64 iiLength)
+{
+	LARGE_INTEGER liZeroData[2];	// FILE_ZERO_DATA_INFORMATION
+	DWORD dwBytesReturned;
+
+	// holes must not change the size of the image file
+	if(iiOffset+iiLength>pDisk->DiskGeometry.DiskSize.QuadPart)
+	{
+		return ERR_NOT_SUPPORTED;
+	}
+
+	if(0==pDisk->iSparseFile)
+	{
+		pDisk->iSparseFile = DeviceIoControl(pDisk->hHandle, FSCTL_SET_SPARSE,
+			NULL, 0, NULL, 0, &dwBytesReturned, NULL) ? 1 : -1;
+		LOG("Image file %s sparse.\n",
+			(1==pDisk->iSparseFile)?"made":"can not be made");
+	}
+	if(1!=pDisk->iSparseFile) return ERR_NOT_SUPPORTED;
+
+	liZeroData[0].QuadPart = iiOffset;
+	liZeroData[1].QuadPart = iiOffset + iiLength;
+	if(0==DeviceIoControl(pDisk->hHandle, FSCTL_SET_ZERO_DATA, liZeroData,
+		sizeof(liZeroData), NULL, 0, &dwBytesReturned, NULL))
+	{
+		return ERR_NOT_SUPPORTED;
+	}
+
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// ImageWriteBlocks
+//
+// Write to ISO or GKH image files. CacheFlush() passes whole runs of
+// contiguous dirty blocks, each run is written with a single call. Runs of
+// at least SPARSE_MIN_BLOCKS zero blocks are not written but punched out of
+// the file, so images stay sparse on the host file system.
+//
+// -> pDisk = pointer to initialized disk structure
+//    dwBlock = first block to write
+//    dwNumBlocks = number of blocks to write
+//    ucBuf = pointer to source buffer (dwNumBlocks*512 bytes)
+// <- ERR_OK
+//    ERR_WRITE
+//----------------------------------------------------------------------------
+static int ImageWriteBlocks(DISK *pDisk, DWORD dwBlock, DWORD dwNumBlocks,
+	unsigned char *ucBuf)
+{
+	__int64 iiOffset;
+	DWORD i, j, dwZero;
+
+	iiOffset = dwBlock; iiOffset *= 512; iiOffset += pDisk->dwDataOffset;
+	for(i=0; i<dwNumBlocks; i=j+dwZero)
+	{
+		// find the next run of zero blocks long enough for a hole
+		dwZero = 0;
+		for(j=i; j<dwNumBlocks; j+=dwZero)
+		{
+			for(dwZero=0; (j+dwZero<dwNumBlocks)&&
+				IsZeroBlock(ucBuf+(j+dwZero)*512); dwZero++);
+			if(dwZero>=SPARSE_MIN_BLOCKS) break;
+			if(0==dwZero) dwZero = 1;
+		}
+		if(j>=dwNumBlocks)
+		{
+			j = dwNumBlocks;
+			dwZero = 0;
+		}
+
+		// write the data in front of it
+		if((j>i)&&(ERR_OK!=DiskWriteAt(pDisk, iiOffset+i*512,
+									   ucBuf+i*512, (j-i)*512)))
+		{
+			LOG("ImageWriteBlocks(): ERR_WRITE\n");
+			return ERR_WRITE;
+		}
+
+		// punch the hole, write the zeroes if this is not possible
+		if((dwZero>0)&&
+		   (ERR_OK!=PunchHole(pDisk, iiOffset+j*512, (__int64)dwZero*512))&&
+		   (ERR_OK!=DiskWriteAt(pDisk, iiOffset+j*512, ucBuf+j*512,
+								dwZero*512)))
+		{
+			LOG("ImageWriteBlocks(): ERR_WRITE\n");
+			return ERR_WRITE;
+		}
+	}
+
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// ImageGetGeometry
+//
+// -> pDisk = pointer to initialized disk structure
+// <- ERR_OK
+//    ERR_READ
+//----------------------------------------------------------------------------
+static int ImageGetGeometry(DISK *pDisk)
+{
+	DWORD fsl, fsh, dwError;
+
+	// get image file size
+	fsl = GetFileSize(pDisk->hHandle, &fsh); dwError = GetLastError();
+	if((0xFFFFFFFF==fsl)&&(NO_ERROR!=dwError))
+	{
+		LOG("Error reading file size.\n");
+		LOG_ERR(dwError);
+		return ERR_READ;
+	}
+	pDisk->DiskGeometry.DiskSize.LowPart = fsl;
+	pDisk->DiskGeometry.DiskSize.HighPart = fsh;
+
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// Mode1ReadBlocks
+//
+// Read from Mode1 CD images. Up to MODE1_READ_SECTORS raw 2352 byte sectors
+// are read at once, their 16 byte header and 288 byte EDC/ECC tail are
+// stripped in memory.
+//
+// -> pDisk = pointer to initialized disk structure
+//    dwBlock = first block to read
+//    dwNumBlocks = number of blocks to read
+//    ucBuf = pointer to destination buffer (dwNumBlocks*512 bytes)
+// <- ERR_OK
+//    ERR_READ
+//    ERR_MEM
+//----------------------------------------------------------------------------
+static int Mode1ReadBlocks(DISK *pDisk, DWORD dwBlock, DWORD dwNumBlocks,
+	unsigned char *ucBuf)
+{
+	DWORD dwFirst, dwLast, dwBlocks, dwBytes, i, j;
+	__int64 iiOffset;
+
+	// raw sectors are read into a separate buffer
+	if(NULL==pDisk->ucSectorBuf)
+	{
+		pDisk->ucSectorBuf = malloc(MODE1_READ_SECTORS*2352);
+		if(NULL==pDisk->ucSectorBuf)
+		{
+			LOG("Mode1ReadBlocks(): ERR_MEM "
+				"(error allocating raw sector buffer.\n");
+			return ERR_MEM;
+		}
+	}
+
+	while(dwNumBlocks)
+	{
+		// position of the first and last block in the sectors to read
+		dwFirst = dwBlock&0x03;
+		dwBlocks = MODE1_READ_SECTORS*4 - dwFirst;
+		if(dwBlocks>dwNumBlocks) dwBlocks = dwNumBlocks;
+		dwLast = dwFirst + dwBlocks - 1;
+
+		// read from the first wanted block up to the end of the last one
+		iiOffset = dwBlock>>2; iiOffset *= 2352; iiOffset += 16 + dwFirst*512;
+		dwBytes = (dwLast>>2)*2352 + (dwLast&0x03)*512 + 512 - dwFirst*512;
+		if(ERR_OK!=ReadAt(pDisk->hHandle, iiOffset, pDisk->ucSectorBuf,
+						  dwBytes))
+		{
+			LOG("Mode1ReadBlocks(): ERR_READ\n");
+			return ERR_READ;
+		}
+
+		// strip headers and tails of all sectors
+		for(i=dwFirst; i<=dwLast; i+=j)
+		{
+			j = 4 - (i&0x03);
+			if(i+j>dwLast+1) j = dwLast + 1 - i;
+			memcpy(ucBuf, pDisk->ucSectorBuf + (i>>2)*2352 + (i&0x03)*512
+				- dwFirst*512, j*512);
+			ucBuf += j*512;
+		}
+
+		dwBlock += dwBlocks;
+		dwNumBlocks -= dwBlocks;
+	}
+
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// Mode1GetGeometry
+//
+// The disk size of a Mode1 image is the data part of its raw sectors (2048
+// of 2352 bytes), incomplete sectors at the end of the file are ignored
+//
+// -> pDisk = pointer to initialized disk structure
+// <- ERR_OK
+//    ERR_READ
+//----------------------------------------------------------------------------
+static int Mode1GetGeometry(DISK *pDisk)
+{
+	int iResult;
+
+	iResult = ImageGetGeometry(pDisk);
+	if(ERR_OK!=iResult) return iResult;
+
+	pDisk->DiskGeometry.DiskSize.QuadPart /= 2352;
+	pDisk->DiskGeometry.DiskSize.QuadPart *= 2048;
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// GieblerReadBlocks
+//
+// Read from Giebler images. Blocks not stored in the image are returned as
+// zeroes, runs of blocks stored back to back are read at once. New blocks
+// not yet inserted into the image are taken from the pending buffer.
+//
+// -> pDisk = pointer to initialized disk structure
+//    dwBlock = first block to read
+//    dwNumBlocks = number of blocks to read
+//    ucBuf = pointer to destination buffer (dwNumBlocks*512 bytes)
+// <- ERR_OK
+//    ERR_READ
+//    ERR_NOT_SUPPORTED
+//----------------------------------------------------------------------------
+static int GieblerReadBlocks(DISK *pDisk, DWORD dwBlock, DWORD dwNumBlocks,
+	unsigned char *ucBuf)
+{
+	DWORD i, dwCount, dwOffset;
+
+	if(NULL==pDisk->dwGieblerOffset) return ERR_NOT_SUPPORTED;
+
+	for(i=0; i<dwNumBlocks; i+=dwCount)
+	{
+		// new block waiting for insertion?
+		if((dwBlock+i<pDisk->dwGieblerBlocks)&&
+		   (GIEBLER_PENDING_BLOCK==pDisk->dwGieblerOffset[dwBlock+i]))
+		{
+			memcpy(ucBuf+i*512, pDisk->ucGieblerPending+(dwBlock+i)*512,
+				512);
+			dwCount = 1;
+			continue;
+		}
+		
+		// block not stored in the image?
+		if((dwBlock+i>=pDisk->dwGieblerBlocks)||
+		   (GIEBLER_ZERO_BLOCK==pDisk->dwGieblerOffset[dwBlock+i]))
+		{
+			memset(ucBuf+i*512, 0, 512);
+			dwCount = 1;
+			continue;
+		}
+
+		// collect the following blocks stored right behind this one
+		dwOffset = pDisk->dwGieblerOffset[dwBlock+i];
+		for(dwCount=1; i+dwCount<dwNumBlocks; dwCount++)
+		{
+			if((dwBlock+i+dwCount>=pDisk->dwGieblerBlocks)||
+			   (pDisk->dwGieblerOffset[dwBlock+i+dwCount]!=
+			    dwOffset+dwCount*512))
+			{
+				break;
+			}
+		}
+
+		// read the whole run at once
+		if(ERR_OK!=ReadAt(pDisk->hHandle, dwOffset, ucBuf+i*512,
+						  dwCount*512))
+		{
+			LOG("GieblerReadBlocks(): ERR_READ\n");
+			return ERR_READ;
+		}
+	}
+
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// GieblerWriteBlocks
+//
+// Write to Giebler images. Blocks already stored in the image are updated in
+// place (runs of blocks stored back to back at once). Blocks not stored in
+// the image stay missing if they are all zero, otherwise they are kept in
+// the pending buffer until GieblerFlush() inserts them into the image.
+//
+// -> pDisk = pointer to initialized disk structure
+//    dwBlock = first block to write
+//    dwNumBlocks = number of blocks to write
+//    ucBuf = pointer to source buffer (dwNumBlocks*512 bytes)
+// <- ERR_OK
+//    ERR_WRITE
+//    ERR_MEM
+//    ERR_OUT_OF_BOUNDS
+//    ERR_NOT_SUPPORTED
+//----------------------------------------------------------------------------
+static int GieblerWriteBlocks(DISK *pDisk, DWORD dwBlock, DWORD dwNumBlocks,
+	unsigned char *ucBuf)
+{
+	DWORD i, j, dwCount, dwOffset;
+
+	if(NULL==pDisk->dwGieblerOffset) return ERR_NOT_SUPPORTED;
+	if(dwBlock+dwNumBlocks>pDisk->dwGieblerBlocks) return ERR_OUT_OF_BOUNDS;
+
+	for(i=0; i<dwNumBlocks; i+=dwCount)
+	{
+		dwOffset = pDisk->dwGieblerOffset[dwBlock+i];
+		dwCount = 1;
+
+		// block not stored in the image?
+		if((GIEBLER_ZERO_BLOCK==dwOffset)||(GIEBLER_PENDING_BLOCK==dwOffset))
+		{
+			// missing blocks read as zeroes anyway
+			for(j=0; (j<512)&&(0==ucBuf[i*512+j]); j++);
+			if((512==j)&&(GIEBLER_ZERO_BLOCK==dwOffset)) continue;
+
+			if(NULL==pDisk->ucGieblerPending)
+			{
+				pDisk->ucGieblerPending = malloc(pDisk->dwGieblerBlocks*512);
+				if(NULL==pDisk->ucGieblerPending)
+				{
+					LOG("GieblerWriteBlocks(): ERR_MEM\n");
+					return ERR_MEM;
+				}
+			}
+			memcpy(pDisk->ucGieblerPending+(dwBlock+i)*512, ucBuf+i*512,
+				512);
+			if(GIEBLER_ZERO_BLOCK==dwOffset)
+			{
+				pDisk->dwGieblerOffset[dwBlock+i] = GIEBLER_PENDING_BLOCK;
+				pDisk->dwGieblerPending++;
+			}
+			continue;
+		}
+
+		// collect the following blocks stored right behind this one
+		for(dwCount=1; i+dwCount<dwNumBlocks; dwCount++)
+		{
+			if(pDisk->dwGieblerOffset[dwBlock+i+dwCount]!=
+			   dwOffset+dwCount*512)
+			{
+				break;
+			}
+		}
+
+		// update the whole run in place
+		if(ERR_OK!=WriteAt(pDisk->hHandle, dwOffset, ucBuf+i*512,
+						   dwCount*512))
+		{
+			LOG("GieblerWriteBlocks(): ERR_WRITE\n");
+			return ERR_WRITE;
+		}
+	}
+
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// GieblerFlush
+//
+// Insert all pending blocks into a Giebler image. Blocks are stored in the
+// order of their bitmap bits, so the stored blocks behind the first new one
+// are moved towards the end of the file in a single pass (starting at the
+// end, each block is moved only once). New blocks behind the last stored
+// block are simply appended. Afterwards the new blocks are written, their
+// bits are cleared in the bitmap and the offset table is updated (only from
+// the first new block on).
+// The target offset of every block follows from its position, a run is
+// never moved onto itself and its offsets are updated only after it has
+// been written. If a transfer fails, the offset table still describes the
+// file and the next call continues where this one stopped.
+//
+// -> pDisk = pointer to initialized disk structure
+// <- ERR_OK
+//    ERR_READ
+//    ERR_WRITE
+//    ERR_MEM
+//----------------------------------------------------------------------------
+static int GieblerFlush(DISK *pDisk)
+{
+	DWORD i, dwFirst, dwLast, dwShift, dwCount, dwOffset, dwTarget;
+	unsigned char *ucMoveBuf;
+
+	// the bitmap may still have to be written after a failed call
+	if((0==pDisk->dwGieblerPending)&&(NULL==pDisk->ucGieblerPending))
+	{
+		return ERR_OK;
+	}
+
+	ucMoveBuf = malloc(GIEBLER_MOVE_BLOCKS*512);
+	if(NULL==ucMoveBuf) return ERR_MEM;
+
+	// find the first new block and the end of the image after insertion
+	dwFirst = pDisk->dwGieblerBlocks;
+	dwTarget = 512;
+	for(i=0; i<pDisk->dwGieblerBlocks; i++)
+	{
+		if(GIEBLER_ZERO_BLOCK==pDisk->dwGieblerOffset[i]) continue;
+		if((GIEBLER_PENDING_BLOCK==pDisk->dwGieblerOffset[i])&&(i<dwFirst))
+		{
+			dwFirst = i;
+		}
+		dwTarget += 512;
+	}
+
+	// move stored blocks behind it by the number of new blocks in front
+	// of them, starting at the end of the image
+	i = pDisk->dwGieblerBlocks;
+	while(i>dwFirst)
+	{
+		i--;
+		dwOffset = pDisk->dwGieblerOffset[i];
+		if(GIEBLER_ZERO_BLOCK==dwOffset) continue;
+		dwTarget -= 512;
+		if(GIEBLER_PENDING_BLOCK==dwOffset) continue;
+
+		// already moved by an earlier call
+		if(dwOffset==dwTarget) continue;
+		dwShift = (dwTarget-dwOffset)/512;
+
+		// collect the preceding stored blocks, they are stored right in
+		// front of this one as long as no new block is in between
+		dwLast = i;
+		dwCount = 1;
+		while((dwCount<GIEBLER_MOVE_BLOCKS)&&(dwCount<dwShift)&&
+			  (i>dwFirst)&&
+			  (GIEBLER_PENDING_BLOCK!=pDisk->dwGieblerOffset[i-1]))
+		{
+			i--;
+			if(GIEBLER_ZERO_BLOCK==pDisk->dwGieblerOffset[i]) continue;
+			dwCount++;
+			dwOffset -= 512;
+			dwTarget -= 512;
+		}
+
+		// the run does not overlap its new position, so it stays intact
+		// at its old one if the write fails
+		if(ERR_OK!=ReadAt(pDisk->hHandle, dwOffset, ucMoveBuf, dwCount*512))
+		{
+			LOG("GieblerFlush(): ERR_READ\n");
+			free(ucMoveBuf);
+			return ERR_READ;
+		}
+		if(ERR_OK!=WriteAt(pDisk->hHandle, dwTarget, ucMoveBuf, dwCount*512))
+		{
+			LOG("GieblerFlush(): ERR_WRITE\n");
+			free(ucMoveBuf);
+			return ERR_WRITE;
+		}
+		for(dwCount=i; dwCount<=dwLast; dwCount++)
+		{
+			if(GIEBLER_ZERO_BLOCK==pDisk->dwGieblerOffset[dwCount]) continue;
+			pDisk->dwGieblerOffset[dwCount] += dwShift*512;
+		}
+	}
+	free(ucMoveBuf);
+
+	// new blocks go right behind the preceding stored block
+	dwOffset = 512;
+	for(i=dwFirst; i>0; i--)
+	{
+		if(GIEBLER_ZERO_BLOCK!=pDisk->dwGieblerOffset[i-1])
+		{
+			dwOffset = pDisk->dwGieblerOffset[i-1] + 512;
+			break;
+		}
+	}
+
+	// write the new blocks, runs of adjacent ones at once
+	for(i=dwFirst; (i<pDisk->dwGieblerBlocks)&&(pDisk->dwGieblerPending>0);
+		i+=dwCount)
+	{
+		dwCount = 1;
+		if(GIEBLER_ZERO_BLOCK==pDisk->dwGieblerOffset[i]) continue;
+		if(GIEBLER_PENDING_BLOCK!=pDisk->dwGieblerOffset[i])
+		{
+			dwOffset = pDisk->dwGieblerOffset[i] + 512;
+			continue;
+		}
+
+		while((i+dwCount<pDisk->dwGieblerBlocks)&&
+			  (GIEBLER_PENDING_BLOCK==pDisk->dwGieblerOffset[i+dwCount]))
+		{
+			dwCount++;
+		}
+		if(ERR_OK!=WriteAt(pDisk->hHandle, dwOffset,
+						   pDisk->ucGieblerPending+i*512, dwCount*512))
+		{
+			LOG("GieblerFlush(): ERR_WRITE\n");
+			return ERR_WRITE;
+		}
+
+		// the blocks are stored in the image now
+		for(dwShift=0; dwShift<dwCount; dwShift++)
+		{
+			pDisk->dwGieblerOffset[i+dwShift] = dwOffset;
+			pDisk->ucGieblerMap[(i+dwShift)>>3] &=
+				~(1<<(7-((i+dwShift)&0x07)));
+			pDisk->dwGieblerPending--;
+			dwOffset += 512;
+		}
+	}
+
+	// write back the bitmap
+	if(ERR_OK!=WriteAt(pDisk->hHandle, pDisk->dwGieblerMapOffset,
+					   pDisk->ucGieblerMap, pDisk->dwGieblerBlocks/8))
+	{
+		LOG("GieblerFlush(): ERR_WRITE\n");
+		return ERR_WRITE;
+	}
+
+	free(pDisk->ucGieblerPending);
+	pDisk->ucGieblerPending = NULL;
+
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// image files mapped into memory
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+// MappedReadBlocks
+//
+// Copy blocks out of a mapped image file.
+//
+// -> pDisk = pointer to initialized disk structure of a mapped image file
+//    dwBlock = first block to read
+//    dwNumBlocks = number of blocks to read
+//    ucBuf = pointer to destination buffer (dwNumBlocks*512 bytes)
+// <- ERR_OK
+//    ERR_READ (blocks beyond the end of the image file)
+//----------------------------------------------------------------------------
+static int MappedReadBlocks(DISK *pDisk, DWORD dwBlock, DWORD dwNumBlocks,
+	unsigned char *ucBuf)
+{
+	__int64 iiOffset;
+
+	iiOffset = dwBlock; iiOffset *= 512; iiOffset += pDisk->dwDataOffset;
+	if(iiOffset+dwNumBlocks*512>pDisk->DiskGeometry.DiskSize.QuadPart)
+	{
+		LOG("MappedReadBlocks(): ERR_READ\n");
+		return ERR_READ;
+	}
+
+	memcpy(ucBuf, pDisk->ucMapView + (DWORD)iiOffset, dwNumBlocks*512);
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// MappedWriteBlocks
+//
+// Copy blocks into a mapped image file. The modified pages are written
+// back to the file by MappedFlush().
+//
+// -> pDisk = pointer to initialized disk structure of a mapped image file
+//    dwBlock = first block to write
+//    dwNumBlocks = number of blocks to write
+//    ucBuf = pointer to source buffer (dwNumBlocks*512 bytes)
+// <- ERR_OK
+//    ERR_WRITE (blocks beyond the end of the image file)
+//----------------------------------------------------------------------------
+static int MappedWriteBlocks(DISK *pDisk, DWORD dwBlock, DWORD dwNumBlocks,
+	unsigned char *ucBuf)
+{
+	__int64 iiOffset;
+
+	iiOffset = dwBlock; iiOffset *= 512; iiOffset += pDisk->dwDataOffset;
+	if(iiOffset+dwNumBlocks*512>pDisk->DiskGeometry.DiskSize.QuadPart)
+	{
+		LOG("MappedWriteBlocks(): ERR_WRITE\n");
+		return ERR_WRITE;
+	}
+
+	memcpy(pDisk->ucMapView + (DWORD)iiOffset, ucBuf, dwNumBlocks*512);
+	pDisk->iMapDirty = 1;
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// MappedFlush
+//
+// Write back the modified pages of a mapped image file
+//
+// -> pDisk = pointer to initialized disk structure of a mapped image file
+// <- ERR_OK
+//    ERR_WRITE
+//----------------------------------------------------------------------------
+static int MappedFlush(DISK *pDisk)
+{
+	DWORD dwError;
+
+	if(0==pDisk->iMapDirty) return ERR_OK;
+
+	if(0==FlushViewOfFile(pDisk->ucMapView, 0))
+	{
+		dwError = GetLastError();
+		LOG("MappedFlush(): FlushViewOfFile() failed: "); LOG_ERR(dwError);
+		return ERR_WRITE;
+	}
+	pDisk->iMapDirty = 0;
+
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// MappedClose
+//
+// Write back all modified pages, remove the mapping and close the file
+//
+// -> pDisk = pointer to initialized disk structure of a mapped image file
+// <- --
+//----------------------------------------------------------------------------
+static void MappedClose(DISK *pDisk)
+{
+	MappedFlush(pDisk);
+	UnmapViewOfFile(pDisk->ucMapView);
+	CloseHandle(pDisk->hMapping);
+
+	pDisk->ucMapView = NULL;
+	pDisk->hMapping = NULL;
+
+	DeviceClose(pDisk);
+}
+
+//----------------------------------------------------------------------------
+// image files held in memory completely (RAM mode)
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+// RamReadBlocks
+//
+// Copy blocks out of an image file held in memory.
+//
+// -> pDisk = pointer to initialized disk structure of an image in memory
+//    dwBlock = first block to read
+//    dwNumBlocks = number of blocks to read
+//    ucBuf = pointer to destination buffer (dwNumBlocks*512 bytes)
+// <- ERR_OK
+//    ERR_READ (blocks beyond the end of the image)
+//----------------------------------------------------------------------------
+static int RamReadBlocks(DISK *pDisk, DWORD dwBlock, DWORD dwNumBlocks,
+	unsigned char *ucBuf)
+{
+	if(dwBlock+dwNumBlocks>pDisk->dwPhysicalBlocks)
+	{
+		LOG("RamReadBlocks(): ERR_READ\n");
+		return ERR_READ;
+	}
+
+	memcpy(ucBuf, pDisk->ucRamImage + dwBlock*512, dwNumBlocks*512);
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// RamWriteBlocks
+//
+// Copy blocks into an image file held in memory. The range of modified
+// blocks is written back by RamFlush().
+//
+// -> pDisk = pointer to initialized disk structure of an image in memory
+//    dwBlock = first block to write
+//    dwNumBlocks = number of blocks to write
+//    ucBuf = pointer to source buffer (dwNumBlocks*512 bytes)
+// <- ERR_OK
+//    ERR_WRITE (blocks beyond the end of the image)
+//----------------------------------------------------------------------------
+static int RamWriteBlocks(DISK *pDisk, DWORD dwBlock, DWORD dwNumBlocks,
+	unsigned char *ucBuf)
+{
+	if(dwBlock+dwNumBlocks>pDisk->dwPhysicalBlocks)
+	{
+		LOG("RamWriteBlocks(): ERR_WRITE\n");
+		return ERR_WRITE;
+	}
+
+	memcpy(pDisk->ucRamImage + dwBlock*512, ucBuf, dwNumBlocks*512);
+	if(dwBlock<pDisk->dwRamDirtyFirst) pDisk->dwRamDirtyFirst = dwBlock;
+	if(dwBlock+dwNumBlocks>pDisk->dwRamDirtyLast)
+	{
+		pDisk->dwRamDirtyLast = dwBlock+dwNumBlocks;
+	}
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// RamFlush
+//
+// Write the modified range of an image held in memory back to the image
+// file with a single call to the backend of the image format
+//
+// -> pDisk = pointer to initialized disk structure of an image in memory
+// <- ERR_OK
+//    errors from the backend of the image format
+//----------------------------------------------------------------------------
+static int RamFlush(DISK *pDisk)
+{
+	int iResult;
+
+	if(pDisk->dwRamDirtyFirst>=pDisk->dwRamDirtyLast) return ERR_OK;
+
+	iResult = pDisk->pImageBackend->WriteBlocks(pDisk, pDisk->dwRamDirtyFirst,
+		pDisk->dwRamDirtyLast-pDisk->dwRamDirtyFirst,
+		pDisk->ucRamImage + pDisk->dwRamDirtyFirst*512);
+	if((ERR_OK==iResult)&&(pDisk->pImageBackend->Flush))
+	{
+		iResult = pDisk->pImageBackend->Flush(pDisk);
+	}
+	if(ERR_OK!=iResult)
+	{
+		LOG("RamFlush(): write back failed.\n");
+		return iResult;
+	}
+	pDisk->dwDeviceWrites++;
+	pDisk->iiDeviceBytesWritten += 
+		(__int64)(pDisk->dwRamDirtyLast-pDisk->dwRamDirtyFirst)*512;
+
+	pDisk->dwRamDirtyFirst = pDisk->dwPhysicalBlocks;
+	pDisk->dwRamDirtyLast = 0;
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// RamGetGeometry
+//
+// -> pDisk = pointer to initialized disk structure of an image in memory
+// <- result of the backend of the image format
+//----------------------------------------------------------------------------
+static int RamGetGeometry(DISK *pDisk)
+{
+	return pDisk->pImageBackend->GetGeometry(pDisk);
+}
+
+//----------------------------------------------------------------------------
+// RamClose
+//
+// Write back and free an image held in memory, close the image file with
+// the backend of the image format
+//
+// -> pDisk = pointer to initialized disk structure of an image in memory
+// <- --
+//----------------------------------------------------------------------------
+static void RamClose(DISK *pDisk)
+{
+	RamFlush(pDisk);
+	free(pDisk->ucRamImage);
+	pDisk->ucRamImage = NULL;
+
+	pDisk->pBackend = pDisk->pImageBackend;
+	pDisk->pImageBackend = NULL;
+	pDisk->pBackend->Close(pDisk);
+}
+
+//----------------------------------------------------------------------------
+// backend tables
+//----------------------------------------------------------------------------
+static BACKEND g_BackendDisk =
+	{ "disk", DeviceReadBlocks, DeviceWriteBlocks, NULL,
+	  DeviceGetGeometry, DeviceClose };
+static BACKEND g_BackendCDROM =
+	{ "CDROM", DeviceReadBlocks, NULL, NULL,
+	  DeviceGetGeometry, DeviceClose };
+static BACKEND g_BackendFloppy =
+	{ "floppy", DeviceReadBlocks, DeviceWriteBlocks, NULL,
+	  FloppyGetGeometry, FloppyClose };
+static BACKEND g_BackendISO =
+	{ "ISO image", ImageReadBlocks, ImageWriteBlocks, NULL,
+	  ImageGetGeometry, DeviceClose };
+static BACKEND g_BackendGKH =
+	{ "GKH image", ImageReadBlocks, ImageWriteBlocks, NULL,
+	  ImageGetGeometry, DeviceClose };
+static BACKEND g_BackendMode1 =
+	{ "Mode1 image", Mode1ReadBlocks, NULL, NULL,
+	  Mode1GetGeometry, DeviceClose };
+static BACKEND g_BackendGiebler =
+	{ "Giebler image", GieblerReadBlocks, GieblerWriteBlocks, GieblerFlush,
+	  ImageGetGeometry, DeviceClose };
+static BACKEND g_BackendChunked =
+	{ "chunk-compressed image", ChunkReadBlocks, ChunkWriteBlocks, ChunkFlush,
+	  ChunkGetGeometry, ChunkClose };
+static BACKEND g_BackendMapped =
+	{ "mapped image", MappedReadBlocks, MappedWriteBlocks, MappedFlush,
+	  ImageGetGeometry, MappedClose };
+static BACKEND g_BackendRam =
+	{ "image in memory", RamReadBlocks, RamWriteBlocks, RamFlush,
+	  RamGetGeometry, RamClose };
+static BACKEND g_BackendRamReadOnly =
+	{ "image in memory (read only)", RamReadBlocks, NULL, NULL,
+	  RamGetGeometry, RamClose };
+
+//----------------------------------------------------------------------------
+// SelectBackend
+//
+// Set the backend of a disk according to its device and image type
+//
+// -> pDisk = pointer to disk structure with iType and iImageType set
+// <- ERR_OK
+//    ERR_NOT_SUPPORTED
+//----------------------------------------------------------------------------
+int SelectBackend(DISK *pDisk)
+{
+	pDisk->pBackend = NULL;
+
+	switch(pDisk->iType)
+	{
+		case TYPE_DISK:
+			pDisk->pBackend = &g_BackendDisk;
+			break;
+		case TYPE_CDROM:
+			pDisk->pBackend = &g_BackendCDROM;
+			break;
+		case TYPE_FLOPPY:
+			pDisk->pBackend = &g_BackendFloppy;
+			break;
+		case TYPE_FILE:
+			switch(pDisk->iImageType)
+			{
+				case IMAGE_FILE_ISO:
+					pDisk->pBackend = &g_BackendISO;
+					break;
+				case IMAGE_FILE_GKH:
+					pDisk->pBackend = &g_BackendGKH;
+					break;
+				case IMAGE_FILE_MODE1:
+					pDisk->pBackend = &g_BackendMode1;
+					break;
+				case IMAGE_FILE_GIEBLER:
+					pDisk->pBackend = &g_BackendGiebler;
+					break;
+				case IMAGE_FILE_CHUNKED:
+					pDisk->pBackend = &g_BackendChunked;
+					break;
+			}
+			break;
+	}
+
+	if(NULL==pDisk->pBackend) return ERR_NOT_SUPPORTED;
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// BackendRead
+//
+// Read blocks with the backend of a disk and count the device I/O (disks
+// held in memory are not counted)
+//
+// -> pDisk = pointer to initialized disk structure
+//    dwBlock = first block to read
+//    dwNumBlocks = number of blocks to read
+//    ucBuf = pointer to destination buffer (dwNumBlocks*512 bytes)
+// <- ERR_OK
+//    errors from the backend
+//----------------------------------------------------------------------------
+int BackendRead(DISK *pDisk, DWORD dwBlock, DWORD dwNumBlocks,
+	unsigned char *ucBuf)
+{
+	int iResult;
+
+	iResult = pDisk->pBackend->ReadBlocks(pDisk, dwBlock, dwNumBlocks, ucBuf);
+	if((ERR_OK==iResult)&&(NULL==pDisk->ucRamImage)&&
+	   (NULL==pDisk->ucMapView))
+	{
+		pDisk->dwDeviceReads++;
+		pDisk->iiDeviceBytesRead += (__int64)dwNumBlocks*512;
+	}
+	return iResult;
+}
+
+//----------------------------------------------------------------------------
+// BackendWrite
+//
+// Write blocks with the backend of a disk and count the device I/O (disks
+// held in memory are not counted)
+//
+// -> pDisk = pointer to initialized disk structure
+//    dwBlock = first block to write
+//    dwNumBlocks = number of blocks to write
+//    ucBuf = pointer to source buffer (dwNumBlocks*512 bytes)
+// <- ERR_OK
+//    errors from the backend
+//----------------------------------------------------------------------------
+int BackendWrite(DISK *pDisk, DWORD dwBlock, DWORD dwNumBlocks,
+	unsigned char *ucBuf)
+{
+	int iResult;
+
+	iResult = pDisk->pBackend->WriteBlocks(pDisk, dwBlock, dwNumBlocks, 
+		ucBuf);
+	if((ERR_OK==iResult)&&(NULL==pDisk->ucRamImage)&&
+	   (NULL==pDisk->ucMapView))
+	{
+		pDisk->dwDeviceWrites++;
+		pDisk->iiDeviceBytesWritten += (__int64)dwNumBlocks*512;
+	}
+	return iResult;
+}
+
+//----------------------------------------------------------------------------
+// MapImageFile
+//
+// Map an ISO or GKH image file into memory and switch the disk to the
+// mapped backend. Reads and writes of a mapped image are served from the
+// mapping without using the cache. Files larger than the MemoryMapLimit
+// option (MB, 0 = never map) are not mapped.
+//
+// -> pDisk = pointer to initialized disk structure of an image file
+// <- ERR_OK
+//    ERR_NOT_SUPPORTED (image type or size not suitable for mapping)
+//    ERR_MEM
+//----------------------------------------------------------------------------
+int MapImageFile(DISK *pDisk)
+{
+	__int64 iiLimit;
+	DWORD dwError;
+
+	if((&g_BackendISO!=pDisk->pBackend)&&(&g_BackendGKH!=pDisk->pBackend))
+	{
+		return ERR_NOT_SUPPORTED;
+	}
+
+	// check size limit
+	iiLimit = g_iOptionMemoryMapLimit; iiLimit *= 1024*1024;
+	if((iiLimit<=0)||(pDisk->DiskGeometry.DiskSize.QuadPart>iiLimit)||
+	   (0==pDisk->DiskGeometry.DiskSize.QuadPart))
+	{
+		return ERR_NOT_SUPPORTED;
+	}
+
+	pDisk->hMapping = CreateFileMapping(pDisk->hHandle, NULL,
+		PAGE_READWRITE, 0, 0, NULL);
+	if(NULL==pDisk->hMapping)
+	{
+		dwError = GetLastError();
+		LOG("MapImageFile(): CreateFileMapping() failed: "); LOG_ERR(dwError);
+		return ERR_MEM;
+	}
+
+	pDisk->ucMapView = MapViewOfFile(pDisk->hMapping, FILE_MAP_WRITE, 
+		0, 0, 0);
+	if(NULL==pDisk->ucMapView)
+	{
+		dwError = GetLastError();
+		LOG("MapImageFile(): MapViewOfFile() failed: "); LOG_ERR(dwError);
+		CloseHandle(pDisk->hMapping);
+		pDisk->hMapping = NULL;
+		return ERR_MEM;
+	}
+	pDisk->iMapDirty = 0;
+	pDisk->pBackend = &g_BackendMapped;
+
+	LOG("Image file mapped into memory.\n");
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// LoadRamImage
+//
+// Load a small image file into memory completely and switch the disk to
+// the RAM backend. Reads and writes are served from memory without using
+// the cache, modified blocks are written back in one go by the backend of
+// the image format on flush. Images larger than the RamImageLimit option
+// (MB, 0 = never load) are not loaded. dwPhysicalBlocks must be set.
+//
+// -> pDisk = pointer to initialized disk structure of an image file
+// <- ERR_OK
+//    ERR_NOT_SUPPORTED (image type or size not suitable)
+//    ERR_MEM
+//    ERR_READ
+//----------------------------------------------------------------------------
+int LoadRamImage(DISK *pDisk)
+{
+	__int64 iiLimit;
+
+	if((TYPE_FILE!=pDisk->iType)||(NULL==pDisk->pBackend)) 
+	{
+		return ERR_NOT_SUPPORTED;
+	}
+
+	// check size limit
+	iiLimit = g_iOptionRamImageLimit; iiLimit *= 1024*1024;
+	if((iiLimit<=0)||(0==pDisk->dwPhysicalBlocks)||
+	   ((__int64)pDisk->dwPhysicalBlocks*512>iiLimit))
+	{
+		return ERR_NOT_SUPPORTED;
+	}
+
+	pDisk->ucRamImage = malloc(pDisk->dwPhysicalBlocks*512);
+	if(NULL==pDisk->ucRamImage)
+	{
+		LOG("LoadRamImage(): ERR_MEM\n");
+		return ERR_MEM;
+	}
+
+	// read the whole image through the backend of its format
+	if(ERR_OK!=BackendRead(pDisk, 0, pDisk->dwPhysicalBlocks, 
+						   pDisk->ucRamImage))
+	{
+		LOG("LoadRamImage(): ERR_READ\n");
+		free(pDisk->ucRamImage);
+		pDisk->ucRamImage = NULL;
+		return ERR_READ;
+	}
+
+	pDisk->dwRamDirtyFirst = pDisk->dwPhysicalBlocks;
+	pDisk->dwRamDirtyLast = 0;
+	pDisk->pImageBackend = pDisk->pBackend;
+	pDisk->pBackend = pDisk->pImageBackend->WriteBlocks ? &g_BackendRam : 
+		&g_BackendRamReadOnly;
+
+	LOG("Image file loaded into memory.\n");
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// OpenDirectIO
+//
+// Reopen a harddisk (option DirectIODisk) or a large ISO or GKH image file
+// (option DirectIOImage) without the OS file cache. Image files smaller
+// than the DirectIOMinSize option (MB) stay buffered, the OS file cache
+// holds them well. The device or file has to be a multiple of the sector
+// size long, otherwise the last sectors could not be transferred.
+//
+// -> pDisk = pointer to initialized disk structure (not in memory)
+// <- ERR_OK
+//    ERR_NOT_SUPPORTED (disk stays buffered)
+//    ERR_NOT_OPEN
+//----------------------------------------------------------------------------
+int OpenDirectIO(DISK *pDisk)
+{
+	DWORD dwAlign, dwSectorsPerCluster, dwBytesPerSector, dwFree, dwTotal;
+	DWORD dwError;
+	char cRoot[4], *cName;
+	HANDLE h;
+
+	if(TYPE_DISK==pDisk->iType)
+	{
+		if(!g_iOptionDirectIODisk) return ERR_NOT_SUPPORTED;
+		dwAlign = pDisk->DiskGeometry.Geometry.BytesPerSector;
+		cName = pDisk->cMsDosName;
+	}
+	else if(TYPE_FILE==pDisk->iType)
+	{
+		if(!g_iOptionDirectIOImage) return ERR_NOT_SUPPORTED;
+		if((&g_BackendISO!=pDisk->pBackend)&&(&g_BackendGKH!=pDisk->pBackend))
+		{
+			return ERR_NOT_SUPPORTED;
+		}
+		if(pDisk->DiskGeometry.DiskSize.QuadPart<
+		   (__int64)g_iOptionDirectIOMinSize*1024*1024)
+		{
+			return ERR_NOT_SUPPORTED;
+		}
+		cName = pDisk->cMsDosName+10;
+
+		// sector size of the volume holding the image file
+		dwAlign = DIRECT_IO_ALIGN;
+		if(':'==cName[1])
+		{
+			cRoot[0] = cName[0]; cRoot[1] = ':'; cRoot[2] = '\\';
+			cRoot[3] = 0;
+			if(GetDiskFreeSpace(cRoot, &dwSectorsPerCluster, 
+				&dwBytesPerSector, &dwFree, &dwTotal))
+			{
+				dwAlign = dwBytesPerSector;
+			}
+		}
+	}
+	else return ERR_NOT_SUPPORTED;
+
+	// the alignment has to be a power of 2 and fit into a bounce buffer
+	if((dwAlign<512)||(dwAlign>DIRECT_IO_BUFFER)||(dwAlign & (dwAlign-1))||
+	   (pDisk->DiskGeometry.DiskSize.QuadPart & (dwAlign-1)))
+	{
+		LOG("OpenDirectIO(): sector size %d does not fit, staying "
+			"buffered.\n", dwAlign);
+		return ERR_NOT_SUPPORTED;
+	}
+
+	h = CreateFile(cName, FILE_ALL_ACCESS, FILE_SHARE_READ | FILE_SHARE_WRITE,
+		NULL, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, NULL);
+	if(INVALID_HANDLE_VALUE==h)
+	{
+		dwError = GetLastError();
+		LOG("OpenDirectIO(): CreateFile() failed: "); LOG_ERR(dwError);
+		return ERR_NOT_OPEN;
+	}
+
+	CloseHandle(pDisk->hHandle);
+	pDisk->hHandle = h;
+	pDisk->dwDirectIOAlign = dwAlign;
+
+	LOG("Unbuffered I/O, sector size %d.\n", dwAlign);
+	return ERR_OK;
+}
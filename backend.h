@@ -0,0 +1,80 @@
+//----------------------------------------------------------------------------
+// EnsoniqFS plugin for TotalCommander
+//
+// BLOCK DEVICE BACKENDS header file
+//----------------------------------------------------------------------------
+//
+// (c) 2006 Thoralt Franz
+//
+// This source code was written using Dev-Cpp 4.9.9.2
+// If you want to compile it, get Dev-Cpp. Normally the code should compile
+// with other IDEs/compilers too (with small modifications), but I did not
+// test it.
+//
+//----------------------------------------------------------------------------
+// License
+//----------------------------------------------------------------------------
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, 
+// MA  02110-1301, USA.
+// 
+// Alternatively, download a copy of the license here:
+// http://www.gnu.org/licenses/gpl.txt
+//----------------------------------------------------------------------------
+#ifndef _BACKEND_H_
+#define _BACKEND_H_
+
+#include "error.h"
+#include "log.h"
+#include "disk.h"
+
+//----------------------------------------------------------------------------
+// block device backend
+//
+// Every DISK has a backend which does the physical I/O for its device or
+// image format. All functions work on whole 512 byte blocks, block numbers
+// are Ensoniq block numbers (offsets and sector layouts of the image format
+// are handled by the backend). A NULL WriteBlocks means the backend is read
+// only, a NULL Flush means there is nothing to write back.
+//----------------------------------------------------------------------------
+typedef struct _BACKEND
+{
+	char *cName;		// backend name for log output
+	int (*ReadBlocks)(DISK *pDisk, DWORD dwBlock, DWORD dwNumBlocks,
+		unsigned char *ucBuf);
+	int (*WriteBlocks)(DISK *pDisk, DWORD dwBlock, DWORD dwNumBlocks,
+		unsigned char *ucBuf);
+	int (*Flush)(DISK *pDisk);
+	int (*GetGeometry)(DISK *pDisk);	// sets DiskGeometry.DiskSize
+	void (*Close)(DISK *pDisk);
+} BACKEND;
+
+//----------------------------------------------------------------------------
+// Prototypes
+//----------------------------------------------------------------------------
+int ReadAt(HANDLE hHandle, __int64 iiOffset, void *pBuf, DWORD dwBytes);
+int WriteAt(HANDLE hHandle, __int64 iiOffset, void *pBuf, DWORD dwBytes);
+int SelectBackend(DISK *pDisk);
+int BackendRead(DISK *pDisk, DWORD dwBlock, DWORD dwNumBlocks,
+	unsigned char *ucBuf);
+int BackendWrite(DISK *pDisk, DWORD dwBlock, DWORD dwNumBlocks,
+	unsigned char *ucBuf);
+int MapImageFile(DISK *pDisk);
+int LoadRamImage(DISK *pDisk);
+int OpenDirectIO(DISK *pDisk);
+void FreeDirectIOPool(void);
+void BackendStartup(void);
+void BackendShutdown(void);
+
+#endif
@@ -420,7 +420,8 @@ int setIndexList( unsigned char* pData, unsigned char trackId, ITEM_INDEX_LIST *
 int ReadEnsoniqBankFile(DISK *pDisk, ENSONIQDIRENTRY *pDirEntry, unsigned char **handleBankData)
 {
 	int iResult;
-	DWORD dwBlock, dwSize, dwBlockCounter = 0;
+	DWORD dwBlock, dwSize;
+	EXTENT_MAP ExtentMap;
 
 	// check pointers
 	if(NULL==pDisk) return ERR_NOT_OPEN;
@@ -447,34 +448,36 @@ int ReadEnsoniqBankFile(DISK *pDisk, ENSONIQDIRENTRY *pDirEntry, unsigned char *
 		
 	// allocate memory for bank file
 	unsigned char *pBankData = malloc( dwSize * 512 );
+	if(NULL==pBankData) return ERR_MEM;
 	
 
 	LOG("ReadEnsoniqBankFile: Extracting file... ");
 	
-	// loop through all blocks
-	while(dwBlockCounter<dwSize)
+	// resolve the FAT chain to extents and read them straight into memory
+	iResult = GetExtentMap(pDisk, dwBlock, dwSize, &ExtentMap);
+	if(ERR_OK!=iResult)
 	{
-		// read next block from disk image
-		iResult = ReadBlock(pDisk, dwBlock, pBankData + dwBlockCounter*512);
-		if(ERR_OK!=iResult)
-		{
-			LOG("ReadEnsoniqBankFile: Error reading block, code=%d.\n", iResult);
-			return iResult;
-		}
-		
-		// get next FAT entry
-		dwBlock = GetFATEntry(pDisk, dwBlock);
-
-		// either end of file reached or error getting FAT entry occured
-		if(dwBlock<3)
-		{
-			LOG("ReadEnsoniqBankFile: FAT entry=%d, Len=%d - stopping.\n", dwBlock, 
-				pDirEntry->dwLen);
-			break; // stop here even if file is too short
-		}
-		
-		dwBlockCounter++;
-		
+		LOG("ReadEnsoniqBankFile: Error reading FAT, code=%d.\n", iResult);
+		free(pBankData);
+		return iResult;
+	}
+	
+	if(ExtentMap.dwBlocks<dwSize)
+	{
+		// stop here even if file is too short
+		LOG("ReadEnsoniqBankFile: FAT chain ends after %d blocks, Len=%d.\n",
+			ExtentMap.dwBlocks, pDirEntry->dwLen);
+		memset(pBankData + ExtentMap.dwBlocks*512, 0, 
+			(dwSize - ExtentMap.dwBlocks)*512);
+	}
+	
+	iResult = ReadExtentMap(pDisk, &ExtentMap, ExtentMap.dwBlocks, pBankData);
+	FreeExtentMap(&ExtentMap);
+	if(ERR_OK!=iResult)
+	{
+		LOG("ReadEnsoniqBankFile: Error reading block, code=%d.\n", iResult);
+		free(pBankData);
+		return iResult;
 	}
 	
 	LOG("OK.\n");
@@ -34,6 +34,810 @@
 //----------------------------------------------------------------------------
 #include "cache.h"
 #include "disk.h"
+#include "backend.h"
+
+//----------------------------------------------------------------------------
+// externals
+//----------------------------------------------------------------------------
+extern int g_iOptionCacheBudget;
+
+//----------------------------------------------------------------------------
+// global variables
+//----------------------------------------------------------------------------
+static DISK *g_pCacheDisks = NULL;		// all disks with a cache
+static DWORD g_dwCacheSlotsUsed = 0;	// cache slots of all disks
+static CRITICAL_SECTION g_csCacheBudget;	// guards the two above
+
+//----------------------------------------------------------------------------
+// CacheStartup
+// 
+// Create the lock of the cache budget shared by all disks (called once when
+// the DLL is loaded)
+//
+// -> --
+// <- --
+//----------------------------------------------------------------------------
+void CacheStartup(void)
+{
+	InitializeCriticalSection(&g_csCacheBudget);
+}
+
+//----------------------------------------------------------------------------
+// CacheShutdown
+// 
+// Delete the lock of the cache budget (called once when the DLL is unloaded)
+//
+// -> --
+// <- --
+//----------------------------------------------------------------------------
+void CacheShutdown(void)
+{
+	DeleteCriticalSection(&g_csCacheBudget);
+}
+
+//----------------------------------------------------------------------------
+// CacheHash
+// 
+// Calculate the hash bucket for a given block number
+//
+// -> dwBlock = block number
+// <- index into dwCacheHashHead[]
+//----------------------------------------------------------------------------
+static DWORD CacheHash(DWORD dwBlock)
+{
+	return (dwBlock * 2654435761UL) & (CACHE_HASH_SIZE-1);
+}
+
+//----------------------------------------------------------------------------
+// CacheLookup
+// 
+// Find the cache slot holding a given block
+//
+// -> pDisk = pointer to valid disk structure
+//    dwBlock = block to find
+// <- cache slot or CACHE_NONE if the block is not in cache
+//----------------------------------------------------------------------------
+static DWORD CacheLookup(DISK *pDisk, DWORD dwBlock)
+{
+	DWORD dwSlot;
+	
+	dwSlot = pDisk->dwCacheHashHead[CacheHash(dwBlock)];
+	while(CACHE_NONE!=dwSlot)
+	{
+		if(dwBlock==pDisk->dwCacheTable[dwSlot]) return dwSlot;
+		dwSlot = pDisk->dwCacheHashNext[dwSlot];
+	}
+	
+	return CACHE_NONE;
+}
+
+//----------------------------------------------------------------------------
+// CacheHashInsert
+// 
+// Add a cache slot to the hash bucket of its block
+//
+// -> pDisk = pointer to valid disk structure
+//    dwSlot = cache slot (dwCacheTable[dwSlot] must already be set)
+// <- --
+//----------------------------------------------------------------------------
+static void CacheHashInsert(DISK *pDisk, DWORD dwSlot)
+{
+	DWORD dwHash = CacheHash(pDisk->dwCacheTable[dwSlot]);
+	
+	pDisk->dwCacheHashNext[dwSlot] = pDisk->dwCacheHashHead[dwHash];
+	pDisk->dwCacheHashHead[dwHash] = dwSlot;
+}
+
+//----------------------------------------------------------------------------
+// CacheHashRemove
+// 
+// Remove a cache slot from the hash bucket of its block
+//
+// -> pDisk = pointer to valid disk structure
+//    dwSlot = cache slot (dwCacheTable[dwSlot] must still be set)
+// <- --
+//----------------------------------------------------------------------------
+static void CacheHashRemove(DISK *pDisk, DWORD dwSlot)
+{
+	DWORD *pLink;
+	
+	pLink = &(pDisk->dwCacheHashHead[CacheHash(pDisk->dwCacheTable[dwSlot])]);
+	while(CACHE_NONE!=*pLink)
+	{
+		if(dwSlot==*pLink)
+		{
+			*pLink = pDisk->dwCacheHashNext[dwSlot];
+			break;
+		}
+		pLink = &(pDisk->dwCacheHashNext[*pLink]);
+	}
+	pDisk->dwCacheHashNext[dwSlot] = CACHE_NONE;
+}
+
+//----------------------------------------------------------------------------
+// CacheIsMetadata
+// 
+// Check if a block holds file system metadata: the system blocks (device ID,
+// OS block, root directory), the FAT and all directories announced with
+// CacheSetMetadata()
+//
+// -> pDisk = pointer to valid disk structure
+//    dwBlock = block number
+// <- 1 = metadata, 0 = file data
+//----------------------------------------------------------------------------
+static int CacheIsMetadata(DISK *pDisk, DWORD dwBlock)
+{
+	if(dwBlock<(5 + pDisk->dwBlocks/170 + 1)) return 1;
+	if((NULL==pDisk->ucMetadataMap)||(dwBlock>=pDisk->dwBlocks)) return 0;
+	return (pDisk->ucMetadataMap[dwBlock>>3]>>(dwBlock&7))&1;
+}
+
+//----------------------------------------------------------------------------
+// CacheLRUUnlink
+// 
+// Remove a cache slot from its LRU list (the metadata list if the slot is
+// flagged CACHE_FLAG_METADATA, the protected list if it is flagged
+// CACHE_FLAG_PROTECTED, the probation list otherwise)
+//
+// -> pDisk = pointer to valid disk structure
+//    dwSlot = cache slot (must be linked)
+// <- --
+//----------------------------------------------------------------------------
+static void CacheLRUUnlink(DISK *pDisk, DWORD dwSlot)
+{
+	DWORD dwPrev = pDisk->dwCacheLRUPrev[dwSlot];
+	DWORD dwNext = pDisk->dwCacheLRUNext[dwSlot];
+	DWORD *pdwHead = &(pDisk->dwCacheLRUHead);
+	DWORD *pdwTail = &(pDisk->dwCacheLRUTail);
+	
+	if(pDisk->ucCacheFlags[dwSlot]&CACHE_FLAG_METADATA)
+	{
+		pdwHead = &(pDisk->dwCacheMetaHead);
+		pdwTail = &(pDisk->dwCacheMetaTail);
+		pDisk->dwCacheMetaCount--;
+	}
+	else if(pDisk->ucCacheFlags[dwSlot]&CACHE_FLAG_PROTECTED)
+	{
+		pdwHead = &(pDisk->dwCacheProtHead);
+		pdwTail = &(pDisk->dwCacheProtTail);
+		pDisk->dwCacheProtCount--;
+	}
+	
+	if(CACHE_NONE!=dwPrev) pDisk->dwCacheLRUNext[dwPrev] = dwNext;
+	else *pdwHead = dwNext;
+	
+	if(CACHE_NONE!=dwNext) pDisk->dwCacheLRUPrev[dwNext] = dwPrev;
+	else *pdwTail = dwPrev;
+	
+	pDisk->dwCacheLRUPrev[dwSlot] = CACHE_NONE;
+	pDisk->dwCacheLRUNext[dwSlot] = CACHE_NONE;
+}
+
+//----------------------------------------------------------------------------
+// CacheLRUPushFront
+// 
+// Insert a cache slot as most recently used entry into its LRU list (the
+// metadata list if the slot is flagged CACHE_FLAG_METADATA, the protected
+// list if it is flagged CACHE_FLAG_PROTECTED, the probation list otherwise).
+// If the metadata list grows above CACHE_METADATA_MAX, its least recently
+// used slots go to the front of the probation list.
+//
+// -> pDisk = pointer to valid disk structure
+//    dwSlot = cache slot (must not be linked)
+// <- --
+//----------------------------------------------------------------------------
+static void CacheLRUPushFront(DISK *pDisk, DWORD dwSlot)
+{
+	DWORD *pdwHead = &(pDisk->dwCacheLRUHead);
+	DWORD *pdwTail = &(pDisk->dwCacheLRUTail);
+	DWORD dwDemote;
+	
+	if(pDisk->ucCacheFlags[dwSlot]&CACHE_FLAG_METADATA)
+	{
+		pdwHead = &(pDisk->dwCacheMetaHead);
+		pdwTail = &(pDisk->dwCacheMetaTail);
+		pDisk->dwCacheMetaCount++;
+	}
+	else if(pDisk->ucCacheFlags[dwSlot]&CACHE_FLAG_PROTECTED)
+	{
+		pdwHead = &(pDisk->dwCacheProtHead);
+		pdwTail = &(pDisk->dwCacheProtTail);
+		pDisk->dwCacheProtCount++;
+	}
+	
+	pDisk->dwCacheLRUPrev[dwSlot] = CACHE_NONE;
+	pDisk->dwCacheLRUNext[dwSlot] = *pdwHead;
+	
+	if(CACHE_NONE!=*pdwHead) pDisk->dwCacheLRUPrev[*pdwHead] = dwSlot;
+	else *pdwTail = dwSlot;
+
+	*pdwHead = dwSlot;
+	
+	// keep the metadata tier within its budget
+	while(pDisk->dwCacheMetaCount>CACHE_METADATA_MAX(pDisk))
+	{
+		dwDemote = pDisk->dwCacheMetaTail;
+		CacheLRUUnlink(pDisk, dwDemote);
+		pDisk->ucCacheFlags[dwDemote] &= ~(CACHE_FLAG_METADATA | 
+			CACHE_FLAG_PROTECTED);
+		CacheLRUPushFront(pDisk, dwDemote);
+	}
+}
+
+//----------------------------------------------------------------------------
+// CacheRealloc
+// 
+// Resize one cache array, the old array stays valid if this fails
+//
+// -> ppBuf = pointer to the array pointer
+//    dwBytes = new size in bytes
+// <- ERR_OK
+//    ERR_MEM
+//----------------------------------------------------------------------------
+static int CacheRealloc(void **ppBuf, DWORD dwBytes)
+{
+	void *pNew = realloc(*ppBuf, dwBytes);
+	
+	if(NULL==pNew) return ERR_MEM;
+	*ppBuf = pNew;
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// CacheResize
+// 
+// Resize all per slot arrays of a disk's cache (slots are neither
+// initialized nor released here)
+//
+// -> pDisk = pointer to valid disk structure
+//    dwSlots = new number of slots
+// <- ERR_OK
+//    ERR_MEM
+//----------------------------------------------------------------------------
+static int CacheResize(DISK *pDisk, DWORD dwSlots)
+{
+	if((ERR_OK!=CacheRealloc((void**)&pDisk->ucCache, dwSlots*512))||
+	   (ERR_OK!=CacheRealloc((void**)&pDisk->dwCacheTable, 
+	   		dwSlots*sizeof(DWORD)))||
+	   (ERR_OK!=CacheRealloc((void**)&pDisk->dwCacheAge, 
+	   		dwSlots*sizeof(DWORD)))||
+	   (ERR_OK!=CacheRealloc((void**)&pDisk->ucCacheFlags, dwSlots))||
+	   (ERR_OK!=CacheRealloc((void**)&pDisk->dwCacheHashNext, 
+	   		dwSlots*sizeof(DWORD)))||
+	   (ERR_OK!=CacheRealloc((void**)&pDisk->dwCacheLRUPrev, 
+	   		dwSlots*sizeof(DWORD)))||
+	   (ERR_OK!=CacheRealloc((void**)&pDisk->dwCacheLRUNext, 
+	   		dwSlots*sizeof(DWORD)))||
+	   (ERR_OK!=CacheRealloc((void**)&pDisk->dwCacheDirty, 
+	   		dwSlots*sizeof(DWORD))))
+	{
+		return ERR_MEM;
+	}
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// CacheAddSlots
+// 
+// Initialize new (empty) cache slots and append them to the tail of the
+// probation list, so they are taken first
+//
+// -> pDisk = pointer to valid disk structure
+//    dwSlots = new number of slots (the arrays must already be that large)
+// <- --
+//----------------------------------------------------------------------------
+static void CacheAddSlots(DISK *pDisk, DWORD dwSlots)
+{
+	DWORD i;
+	
+	for(i=pDisk->dwCacheSlots; i<dwSlots; i++)
+	{
+		pDisk->dwCacheTable[i] = CACHE_NONE;
+		pDisk->dwCacheAge[i] = 0;
+		pDisk->ucCacheFlags[i] = CACHE_FLAG_NONE;
+		pDisk->dwCacheHashNext[i] = CACHE_NONE;
+		
+		pDisk->dwCacheLRUPrev[i] = pDisk->dwCacheLRUTail;
+		pDisk->dwCacheLRUNext[i] = CACHE_NONE;
+		if(CACHE_NONE!=pDisk->dwCacheLRUTail)
+		{
+			pDisk->dwCacheLRUNext[pDisk->dwCacheLRUTail] = i;
+		}
+		else pDisk->dwCacheLRUHead = i;
+		pDisk->dwCacheLRUTail = i;
+	}
+	
+	EnterCriticalSection(&g_csCacheBudget);
+	g_dwCacheSlotsUsed += dwSlots - pDisk->dwCacheSlots;
+	LeaveCriticalSection(&g_csCacheBudget);
+	pDisk->dwCacheSlots = dwSlots;
+	if(dwSlots>pDisk->dwCacheSlotsPeak) pDisk->dwCacheSlotsPeak = dwSlots;
+}
+
+//----------------------------------------------------------------------------
+// CacheShrink
+// 
+// Give cache memory of a disk back to the budget. The cache is flushed, 
+// the blocks in the slots above the new size are dropped.
+//
+// -> pDisk = pointer to valid disk structure
+//    dwSlots = new number of slots
+// <- ERR_OK
+//    errors from CacheFlush()
+//----------------------------------------------------------------------------
+static int CacheShrink(DISK *pDisk, DWORD dwSlots)
+{
+	DWORD i;
+	int iResult;
+	
+	if(pDisk->dwCacheSlots<=dwSlots) return ERR_OK;
+	
+	// all slots have to be clean (linked) to be released
+	iResult = CacheFlush(pDisk);
+	if(ERR_OK!=iResult) return iResult;
+	
+	for(i=dwSlots; i<pDisk->dwCacheSlots; i++)
+	{
+		if(CACHE_NONE!=pDisk->dwCacheTable[i]) CacheHashRemove(pDisk, i);
+		CacheLRUUnlink(pDisk, i);
+	}
+	
+	// shrinking a memory block can't really fail, the larger arrays stay
+	// valid anyway
+	CacheResize(pDisk, dwSlots);
+	
+	LOG("CacheShrink(): '%s' %d KB -> %d KB\n", pDisk->cMsDosName, 
+		pDisk->dwCacheSlots/2, dwSlots/2);
+	EnterCriticalSection(&g_csCacheBudget);
+	g_dwCacheSlotsUsed -= pDisk->dwCacheSlots - dwSlots;
+	LeaveCriticalSection(&g_csCacheBudget);
+	pDisk->dwCacheSlots = dwSlots;
+	
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// CacheGrow
+// 
+// Enlarge the cache of a disk by CACHE_GROW_SLOTS. If the CacheBudget option
+// does not allow this, the caches of idle disks are shrunk to their minimum
+// size first. Disks locked by another thread are not idle and are skipped.
+//
+// -> pDisk = pointer to valid disk structure
+// <- ERR_OK
+//    ERR_MEM (maximum size or budget reached, no memory)
+//----------------------------------------------------------------------------
+static int CacheGrow(DISK *pDisk)
+{
+	DWORD dwSlots, dwBudget, dwNow;
+	DISK *pOther;
+	
+	// never grow above the size of the disk
+	dwSlots = pDisk->dwCacheSlots + CACHE_GROW_SLOTS;
+	if(dwSlots>CACHE_MAX_SLOTS) dwSlots = CACHE_MAX_SLOTS;
+	if((pDisk->dwPhysicalBlocks>0)&&(dwSlots>pDisk->dwPhysicalBlocks))
+	{
+		dwSlots = pDisk->dwPhysicalBlocks;
+	}
+	if(dwSlots<=pDisk->dwCacheSlots) return ERR_MEM;
+	
+	dwBudget = (g_iOptionCacheBudget>0) ? g_iOptionCacheBudget*2048 : 0;
+	EnterCriticalSection(&g_csCacheBudget);
+	if((g_dwCacheSlotsUsed+dwSlots-pDisk->dwCacheSlots)>dwBudget)
+	{
+		// take memory back from disks which are not in use
+		dwNow = GetTickCount();
+		for(pOther=g_pCacheDisks; pOther; pOther=pOther->pCacheNext)
+		{
+			if(pOther==pDisk) continue;
+			if(!TryEnterCriticalSection(&pOther->csLock)) continue;
+			if((pOther->dwCacheSlots>CACHE_MIN_SLOTS)&&
+			   ((dwNow-pOther->dwCacheLastUse)>=CACHE_IDLE_TIME))
+			{
+				CacheShrink(pOther, CACHE_MIN_SLOTS);
+			}
+			LeaveCriticalSection(&pOther->csLock);
+		}
+		
+		if((g_dwCacheSlotsUsed+dwSlots-pDisk->dwCacheSlots)>dwBudget)
+		{
+			LeaveCriticalSection(&g_csCacheBudget);
+			return ERR_MEM;
+		}
+	}
+	
+	if(ERR_OK!=CacheResize(pDisk, dwSlots))
+	{
+		LeaveCriticalSection(&g_csCacheBudget);
+		LOG("CacheGrow(): Unable to allocate cache memory.\n");
+		return ERR_MEM;
+	}
+	
+	LOG("CacheGrow(): '%s' %d KB -> %d KB\n", pDisk->cMsDosName, 
+		pDisk->dwCacheSlots/2, dwSlots/2);
+	CacheAddSlots(pDisk, dwSlots);
+	LeaveCriticalSection(&g_csCacheBudget);
+	
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// CacheMetaPin
+// 
+// Move a clean cache slot of a metadata block into the metadata list. A
+// full metadata list lets the cache grow first (its limit grows with it).
+//
+// -> pDisk = pointer to valid disk structure
+//    dwSlot = clean cache slot (must be linked)
+// <- --
+//----------------------------------------------------------------------------
+static void CacheMetaPin(DISK *pDisk, DWORD dwSlot)
+{
+	if(pDisk->ucCacheFlags[dwSlot]&CACHE_FLAG_METADATA) return;
+	
+	if(pDisk->dwCacheMetaCount>=CACHE_METADATA_MAX(pDisk)) CacheGrow(pDisk);
+	
+	CacheLRUUnlink(pDisk, dwSlot);
+	pDisk->ucCacheFlags[dwSlot] |= CACHE_FLAG_METADATA;
+	CacheLRUPushFront(pDisk, dwSlot);
+}
+
+//----------------------------------------------------------------------------
+// CacheProtect
+// 
+// Move a clean cache slot to the front of the protected list. If the
+// protected list grows above CACHE_PROTECTED_MAX, its least recently used
+// slots go back to the front of the probation list.
+//
+// -> pDisk = pointer to valid disk structure
+//    dwSlot = clean cache slot (must be linked)
+// <- --
+//----------------------------------------------------------------------------
+static void CacheProtect(DISK *pDisk, DWORD dwSlot)
+{
+	DWORD dwDemote;
+	
+	CacheLRUUnlink(pDisk, dwSlot);
+	pDisk->ucCacheFlags[dwSlot] |= CACHE_FLAG_PROTECTED;
+	CacheLRUPushFront(pDisk, dwSlot);
+	
+	while(pDisk->dwCacheProtCount>CACHE_PROTECTED_MAX(pDisk))
+	{
+		dwDemote = pDisk->dwCacheProtTail;
+		CacheLRUUnlink(pDisk, dwDemote);
+		pDisk->ucCacheFlags[dwDemote] &= ~CACHE_FLAG_PROTECTED;
+		CacheLRUPushFront(pDisk, dwDemote);
+	}
+}
+
+//----------------------------------------------------------------------------
+// CacheTouch
+// 
+// Refresh a cache slot so it will stay in cache longer. Dirty slots are not
+// part of the LRU lists (they can't be evicted before the next CacheFlush()),
+// so only their age is updated.
+//
+// Metadata slots are refreshed in the metadata list. With CACHE_POLICY_2Q
+// the first reference of other blocks only refreshes them in the probation
+// list, the second reference moves them to the protected list. Blocks used
+// once (e.g. streamed wave data) therefore never displace blocks used over
+// and over again.
+//
+// -> pDisk = pointer to valid disk structure
+//    dwSlot = cache slot
+// <- --
+//----------------------------------------------------------------------------
+static void CacheTouch(DISK *pDisk, DWORD dwSlot)
+{
+	pDisk->dwCacheAge[dwSlot] = pDisk->dwReadCounter;
+	if(pDisk->ucCacheFlags[dwSlot]&CACHE_FLAG_DIRTY) return;
+	
+	if(pDisk->ucCacheFlags[dwSlot]&CACHE_FLAG_METADATA)
+	{
+		if(pDisk->dwCacheMetaHead==dwSlot) return;
+		CacheLRUUnlink(pDisk, dwSlot);
+		CacheLRUPushFront(pDisk, dwSlot);
+		return;
+	}
+	
+	if((CACHE_POLICY_2Q==pDisk->iCachePolicy)&&
+	   (pDisk->ucCacheFlags[dwSlot]&CACHE_FLAG_REFERENCED))
+	{
+		if((pDisk->ucCacheFlags[dwSlot]&CACHE_FLAG_PROTECTED)&&
+		   (pDisk->dwCacheProtHead==dwSlot)) return;
+		CacheProtect(pDisk, dwSlot);
+		return;
+	}
+	pDisk->ucCacheFlags[dwSlot] |= CACHE_FLAG_REFERENCED;
+	
+	if(pDisk->dwCacheLRUHead==dwSlot) return;
+	CacheLRUUnlink(pDisk, dwSlot);
+	CacheLRUPushFront(pDisk, dwSlot);
+}
+
+//----------------------------------------------------------------------------
+// CacheEvict
+// 
+// Take the least recently used clean cache slot and assign it to a new
+// block. Empty slots are taken first, the cache grows before a cached block
+// has to be dropped. Slots of the probation list are taken first, then the
+// protected list, metadata slots only if there is nothing else. The slot is
+// moved to the front of the probation list, its flags are cleared.
+//
+// -> pDisk = pointer to valid disk structure
+//    dwBlock = new block for this slot
+// <- cache slot or CACHE_NONE if no clean slot is available
+//----------------------------------------------------------------------------
+static DWORD CacheEvict(DISK *pDisk, DWORD dwBlock)
+{
+	DWORD dwSlot = pDisk->dwCacheLRUTail;
+	
+	if(((CACHE_NONE==dwSlot)||(CACHE_NONE!=pDisk->dwCacheTable[dwSlot]))&&
+	   (ERR_OK==CacheGrow(pDisk)))
+	{
+		dwSlot = pDisk->dwCacheLRUTail;
+	}
+	
+	if(CACHE_NONE==dwSlot) dwSlot = pDisk->dwCacheProtTail;
+	if(CACHE_NONE==dwSlot) dwSlot = pDisk->dwCacheMetaTail;
+	if(CACHE_NONE==dwSlot) return CACHE_NONE;
+	
+	// drop old block from hash index
+	if(CACHE_NONE!=pDisk->dwCacheTable[dwSlot]) 
+	{
+		CacheHashRemove(pDisk, dwSlot);
+		pDisk->dwCacheEvictions++;
+	}
+	
+	pDisk->dwCacheTable[dwSlot] = dwBlock;
+	CacheHashInsert(pDisk, dwSlot);
+	
+	CacheLRUUnlink(pDisk, dwSlot);
+	pDisk->ucCacheFlags[dwSlot] = CACHE_FLAG_NONE;
+	CacheLRUPushFront(pDisk, dwSlot);
+	pDisk->dwCacheAge[dwSlot] = pDisk->dwReadCounter;
+	
+	return dwSlot;
+}
+
+//----------------------------------------------------------------------------
+// CacheInit
+// 
+// Allocate and initialize the cache of a disk. The disk starts with
+// CACHE_MIN_SLOTS slots (this reservation is granted even if the CacheBudget
+// option is exceeded), the cache grows while it is used.
+//
+// -> pDisk = pointer to valid disk structure
+// <- ERR_OK
+//    ERR_MEM
+//----------------------------------------------------------------------------
+int CacheInit(DISK *pDisk)
+{
+	pDisk->dwCacheSlots = 0;
+	pDisk->dwCacheSlotsPeak = 0;
+	pDisk->dwCacheHashHead = malloc(CACHE_HASH_SIZE*sizeof(DWORD));
+	pDisk->ucCacheFlushBuf = malloc(CACHE_FLUSH_RUN*512);
+
+	if((NULL==pDisk->dwCacheHashHead)||(NULL==pDisk->ucCacheFlushBuf)||
+	   (ERR_OK!=CacheResize(pDisk, CACHE_MIN_SLOTS)))
+	{
+		LOG("CacheInit(): Unable to allocate cache memory.\n");
+		CacheFree(pDisk);
+		return ERR_MEM;
+	}
+	
+	memset(pDisk->dwCacheHashHead, 0xFF, CACHE_HASH_SIZE*sizeof(DWORD));
+	
+	// all slots are empty and available for eviction
+	pDisk->dwCacheLRUHead = CACHE_NONE;
+	pDisk->dwCacheLRUTail = CACHE_NONE;
+	pDisk->dwCacheProtHead = CACHE_NONE;
+	pDisk->dwCacheProtTail = CACHE_NONE;
+	pDisk->dwCacheProtCount = 0;
+	pDisk->dwCacheMetaHead = CACHE_NONE;
+	pDisk->dwCacheMetaTail = CACHE_NONE;
+	pDisk->dwCacheMetaCount = 0;
+	CacheAddSlots(pDisk, CACHE_MIN_SLOTS);
+	pDisk->dwCacheLastUse = GetTickCount();
+	
+	pDisk->dwCacheDirtyCount = 0;
+	pDisk->iCacheDirtySorted = 1;
+	
+	// share the budget with the other disks
+	EnterCriticalSection(&g_csCacheBudget);
+	pDisk->pCacheNext = g_pCacheDisks;
+	g_pCacheDisks = pDisk;
+	LeaveCriticalSection(&g_csCacheBudget);
+	
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// CacheFree
+// 
+// Free the cache memory of a disk (the cache is not flushed). The map of
+// metadata blocks stays, it describes the disk and not the cache.
+//
+// -> pDisk = pointer to valid disk structure
+// <- --
+//----------------------------------------------------------------------------
+void CacheFree(DISK *pDisk)
+{
+	DISK **ppLink;
+	
+	// give the memory back to the budget
+	EnterCriticalSection(&g_csCacheBudget);
+	for(ppLink=&g_pCacheDisks; *ppLink; ppLink=&((*ppLink)->pCacheNext))
+	{
+		if(pDisk==*ppLink)
+		{
+			*ppLink = pDisk->pCacheNext;
+			break;
+		}
+	}
+	g_dwCacheSlotsUsed -= pDisk->dwCacheSlots;
+	LeaveCriticalSection(&g_csCacheBudget);
+	pDisk->dwCacheSlots = 0;
+	pDisk->pCacheNext = NULL;
+	
+	if(pDisk->ucCache) free(pDisk->ucCache);
+	if(pDisk->dwCacheTable) free(pDisk->dwCacheTable);
+	if(pDisk->dwCacheAge) free(pDisk->dwCacheAge);
+	if(pDisk->ucCacheFlags) free(pDisk->ucCacheFlags);
+	if(pDisk->dwCacheHashHead) free(pDisk->dwCacheHashHead);
+	if(pDisk->dwCacheHashNext) free(pDisk->dwCacheHashNext);
+	if(pDisk->dwCacheLRUPrev) free(pDisk->dwCacheLRUPrev);
+	if(pDisk->dwCacheLRUNext) free(pDisk->dwCacheLRUNext);
+	if(pDisk->dwCacheDirty) free(pDisk->dwCacheDirty);
+	if(pDisk->ucCacheFlushBuf) free(pDisk->ucCacheFlushBuf);
+	if(pDisk->ucReadAheadBuf) free(pDisk->ucReadAheadBuf);
+	if(pDisk->ucSectorBuf) free(pDisk->ucSectorBuf);
+	
+	pDisk->ucCache = NULL;
+	pDisk->dwCacheTable = NULL;
+	pDisk->dwCacheAge = NULL;
+	pDisk->ucCacheFlags = NULL;
+	pDisk->dwCacheHashHead = NULL;
+	pDisk->dwCacheHashNext = NULL;
+	pDisk->dwCacheLRUPrev = NULL;
+	pDisk->dwCacheLRUNext = NULL;
+	pDisk->dwCacheDirty = NULL;
+	pDisk->ucCacheFlushBuf = NULL;
+	pDisk->ucReadAheadBuf = NULL;
+	pDisk->ucSectorBuf = NULL;
+	pDisk->dwReadAheadBufSize = 0;
+	pDisk->dwCacheDirtyCount = 0;
+	
+	// the lists referred to the freed slots
+	pDisk->dwCacheLRUHead = CACHE_NONE;
+	pDisk->dwCacheLRUTail = CACHE_NONE;
+	pDisk->dwCacheProtHead = CACHE_NONE;
+	pDisk->dwCacheProtTail = CACHE_NONE;
+	pDisk->dwCacheProtCount = 0;
+	pDisk->dwCacheMetaHead = CACHE_NONE;
+	pDisk->dwCacheMetaTail = CACHE_NONE;
+	pDisk->dwCacheMetaCount = 0;
+}
+
+//----------------------------------------------------------------------------
+// CacheSetPolicyLocked
+// 
+// Select the replacement policy of a disk's cache. Switching to plain LRU
+// moves all protected slots back into the single LRU list. A disk without
+// cache (suspended or not yet used) only remembers the policy.
+//
+// -> pDisk = pointer to valid disk structure
+//    iPolicy = CACHE_POLICY_LRU or CACHE_POLICY_2Q
+// <- ERR_OK
+//    ERR_NOT_OPEN
+//    ERR_NOT_SUPPORTED
+//----------------------------------------------------------------------------
+static int CacheSetPolicyLocked(DISK *pDisk, int iPolicy)
+{
+	DWORD dwSlot;
+	
+	if(NULL==pDisk) return ERR_NOT_OPEN;
+	if((CACHE_POLICY_LRU!=iPolicy)&&(CACHE_POLICY_2Q!=iPolicy))
+	{
+		return ERR_NOT_SUPPORTED;
+	}
+	
+	if((CACHE_POLICY_LRU==iPolicy)&&(NULL!=pDisk->ucCache))
+	{
+		while(CACHE_NONE!=(dwSlot = pDisk->dwCacheProtTail))
+		{
+			CacheLRUUnlink(pDisk, dwSlot);
+			pDisk->ucCacheFlags[dwSlot] &= ~CACHE_FLAG_PROTECTED;
+			CacheLRUPushFront(pDisk, dwSlot);
+		}
+	}
+	pDisk->iCachePolicy = iPolicy;
+	
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// CacheSetPolicy
+//
+// Call CacheSetPolicyLocked() with the lock of the disk held
+//
+// -> and <- see CacheSetPolicyLocked()
+//----------------------------------------------------------------------------
+DLLEXPORT int __stdcall CacheSetPolicy(DISK *pDisk, int iPolicy)
+{
+	int iResult;
+	
+	if(NULL==pDisk) return ERR_NOT_OPEN;
+	EnterCriticalSection(&pDisk->csLock);
+	iResult = CacheSetPolicyLocked(pDisk, iPolicy);
+	LeaveCriticalSection(&pDisk->csLock);
+	return iResult;
+}
+
+//----------------------------------------------------------------------------
+// CacheSetMetadataLocked
+// 
+// Announce blocks holding metadata which can not be found by block number
+// (directories). They are kept in the metadata tier from now on, blocks
+// already in cache are moved there.
+//
+// -> pDisk = pointer to valid disk structure
+//    dwBlock = first block
+//    dwNumBlocks = number of blocks
+// <- ERR_OK
+//    ERR_MEM
+//----------------------------------------------------------------------------
+static int CacheSetMetadataLocked(DISK *pDisk, DWORD dwBlock,
+	DWORD dwNumBlocks)
+{
+	DWORD dwSlot;
+	
+	// disks without cache (held in memory) need no metadata tier
+	if(NULL==pDisk->ucCache) return ERR_OK;
+	
+	if(NULL==pDisk->ucMetadataMap)
+	{
+		pDisk->ucMetadataMap = calloc(pDisk->dwBlocks/8 + 1, 1);
+		if(NULL==pDisk->ucMetadataMap)
+		{
+			LOG("CacheSetMetadata(): ERR_MEM\n");
+			return ERR_MEM;
+		}
+	}
+	
+	for(; dwNumBlocks>0; dwNumBlocks--, dwBlock++)
+	{
+		if(dwBlock>=pDisk->dwBlocks) break;
+		pDisk->ucMetadataMap[dwBlock>>3] |= 1<<(dwBlock&7);
+		
+		dwSlot = CacheLookup(pDisk, dwBlock);
+		if((CACHE_NONE!=dwSlot)&&
+		   (0==(pDisk->ucCacheFlags[dwSlot]&CACHE_FLAG_DIRTY)))
+		{
+			CacheMetaPin(pDisk, dwSlot);
+		}
+	}
+	
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// CacheSetMetadata
+//
+// Call CacheSetMetadataLocked() with the lock of the disk held
+//
+// -> and <- see CacheSetMetadataLocked()
+//----------------------------------------------------------------------------
+int CacheSetMetadata(DISK *pDisk, DWORD dwBlock, DWORD dwNumBlocks)
+{
+	int iResult;
+	
+	if(NULL==pDisk) return ERR_NOT_OPEN;
+	EnterCriticalSection(&pDisk->csLock);
+	iResult = CacheSetMetadataLocked(pDisk, dwBlock, dwNumBlocks);
+	LeaveCriticalSection(&pDisk->csLock);
+	return iResult;
+}
 
 //----------------------------------------------------------------------------
 // CacheReadBlock
@@ -49,78 +853,104 @@
 //----------------------------------------------------------------------------
 int CacheReadBlock(DISK *pDisk, DWORD dwBlock, unsigned char *ucBuf)
 {
-	int i;
+	DWORD dwSlot;
 
 	pDisk->dwReadCounter++;
+	pDisk->dwCacheLastUse = GetTickCount();
 
 	// check if block is in cache
-	for(i=0; i<CACHE_SIZE; i++)
+	dwSlot = CacheLookup(pDisk, dwBlock);
+	if(CACHE_NONE!=dwSlot)
 	{
-		if(dwBlock==pDisk->dwCacheTable[i])
+		memcpy(ucBuf, pDisk->ucCache + dwSlot*512, 512);
+		
+		// first use of a block which was read ahead? (metadata read ahead
+		// enters the metadata tier only now)
+		if(pDisk->ucCacheFlags[dwSlot]&CACHE_FLAG_READAHEAD)
 		{
-			memcpy(ucBuf, pDisk->ucCache + i*512, 512);
-			
-			// refresh this block
-			pDisk->dwCacheAge[i] = pDisk->dwReadCounter;
-			pDisk->dwCacheHits++;
-			return ERR_OK;
+			pDisk->ucCacheFlags[dwSlot] &= ~CACHE_FLAG_READAHEAD;
+			pDisk->dwReadAheadHits++;
+			if(CacheIsMetadata(pDisk, dwBlock)) CacheMetaPin(pDisk, dwSlot);
 		}
+		
+		// refresh this block
+		CacheTouch(pDisk, dwSlot);
+		pDisk->dwCacheHits++;
+		return ERR_OK;
 	}
 	
 	pDisk->dwCacheMisses++;
 	return ERR_NOT_IN_CACHE;
 }
 
+//----------------------------------------------------------------------------
+// CacheContainsBlock
+// 
+// Check if a block is in the cache (without refreshing it)
+//
+// -> pDisk = pointer to valid disk structure
+//    dwBlock = block to look up
+// <- 1 if the block is in the cache, 0 otherwise
+//----------------------------------------------------------------------------
+int CacheContainsBlock(DISK *pDisk, DWORD dwBlock)
+{
+	return (CACHE_NONE!=CacheLookup(pDisk, dwBlock));
+}
+
 //----------------------------------------------------------------------------
 // CacheInsertReadBlock
 // 
 // Insert a freshly read block into Cache (read cache entry). The oldest
-// block in the cache is overwritten.
+// non-dirty block in the cache is overwritten.
 //
 // -> pDisk = pointer to valid disk structure
 //    dwBlock = block to insert
 //    ucBuf = pointer to buffer to be inserted
+//    iReadAhead = 1 if the block was not requested but read ahead
 // <- ERR_OK
 //----------------------------------------------------------------------------
-int CacheInsertReadBlock(DISK *pDisk, DWORD dwBlock, unsigned char *ucBuf)
+int CacheInsertReadBlock(DISK *pDisk, DWORD dwBlock, unsigned char *ucBuf,
+	int iReadAhead)
 {
-	DWORD dwOldestBlock, dwOldestAge;
-	int i;
+	DWORD dwSlot;
 
 	// check if block is already in cache
-	for(i=0; i<CACHE_SIZE; i++)
+	dwSlot = CacheLookup(pDisk, dwBlock);
+	if(CACHE_NONE!=dwSlot)
 	{
-		if(dwBlock==pDisk->dwCacheTable[i])
+		// overwrite block if not marked as dirty
+		if(0==(pDisk->ucCacheFlags[dwSlot]&CACHE_FLAG_DIRTY))
 		{
-			// overwrite block if not marked as dirty
-			if(0==(pDisk->ucCacheFlags[i]&CACHE_FLAG_DIRTY))
-			{
-				memcpy(pDisk->ucCache + i*512, ucBuf, 512);
-			}
+			memcpy(pDisk->ucCache + dwSlot*512, ucBuf, 512);
+		}
 
-			// mark block as new
-			pDisk->dwCacheAge[i] = pDisk->dwReadCounter;
-			return ERR_OK;
+		// mark block as new (reading a block ahead again is no reference
+		// for the scan resistant policy)
+		if((!iReadAhead)||(CACHE_POLICY_LRU==pDisk->iCachePolicy))
+		{
+			CacheTouch(pDisk, dwSlot);
 		}
+		return ERR_OK;
 	}
 	
 	// if we come to here, block is not in cache and has to be inserted
 
-	// find the oldest non-dirty block to overwrite it
-	dwOldestBlock = 0; dwOldestAge = pDisk->dwReadCounter+1;
-	for(i=0; i<CACHE_SIZE; i++)
-	{
-		if(pDisk->dwCacheAge[i]<dwOldestAge)
-		{
-			dwOldestAge = pDisk->dwCacheAge[i];
-			dwOldestBlock = i;
-		}
-	}
+	// take the oldest non-dirty block to overwrite it
+	dwSlot = CacheEvict(pDisk, dwBlock);
+	if(CACHE_NONE==dwSlot) return ERR_OK;
 
 	// copy new block over oldest block		
-	pDisk->dwCacheTable[dwOldestBlock] = dwBlock;
-	pDisk->dwCacheAge[dwOldestBlock] = pDisk->dwReadCounter;
-	memcpy(pDisk->ucCache + dwOldestBlock*512, ucBuf, 512);
+	memcpy(pDisk->ucCache + dwSlot*512, ucBuf, 512);
+	pDisk->ucCacheFlags[dwSlot] = CACHE_FLAG_REFERENCED;
+	if(iReadAhead)
+	{
+		pDisk->ucCacheFlags[dwSlot] = CACHE_FLAG_READAHEAD;
+		pDisk->dwReadAheadBlocks++;
+	}
+	else if(CacheIsMetadata(pDisk, dwBlock))
+	{
+		CacheMetaPin(pDisk, dwSlot);
+	}
 
 	return ERR_OK;
 }
@@ -130,8 +960,8 @@ int CacheInsertReadBlock(DISK *pDisk, DWORD dwBlock, unsigned char *ucBuf)
 // 
 // Writes a block to the write cache. The new block gets a "dirty" tag and
 // should be written with a CacheFlush() afterwards, otherwise it will be
-// lost. If 3/4 of the cache blocks (CACHE_SIZE*3/4) are marked "dirty", a
-// CacheFlush() is automatically issued.
+// lost. If 3/4 of the cache blocks are marked "dirty" and the cache can't
+// grow, a CacheFlush() is automatically issued.
 //
 // -> pDisk = pointer to valid disk structure
 //    dwBlock = block to write
@@ -144,214 +974,369 @@ int CacheInsertReadBlock(DISK *pDisk, DWORD dwBlock, unsigned char *ucBuf)
 //----------------------------------------------------------------------------
 int CacheWriteBlock(DISK *pDisk, DWORD dwBlock, unsigned char *ucBuf)
 {
-	DWORD dwOldestBlock, dwOldestAge;
-	int i, iDirtyBlocks = 0, iResult;
+	DWORD dwSlot;
+	int iResult;
 	
-	// count dirty blocks
-	for(i=0; i<CACHE_SIZE; i++)
-	{
-		if(pDisk->ucCacheFlags[i]&CACHE_FLAG_DIRTY) iDirtyBlocks++;
-	}
+	pDisk->dwCacheLastUse = GetTickCount();
 	
 	// flush cache, if necessary
-	if(iDirtyBlocks>=(CACHE_SIZE*3/4))
+	if((pDisk->dwCacheDirtyCount>=(pDisk->dwCacheSlots*3/4))&&
+	   (ERR_OK!=CacheGrow(pDisk)))
 	{
 		iResult = CacheFlush(pDisk);
 		if(ERR_OK!=iResult) return iResult;
 	}
 	
-	// search for block in cache; if found, overwrite it and mark it dirty
-	for(i=0; i<CACHE_SIZE; i++)
+	// search for block in cache; if not found, overwrite the oldest
+	// non-dirty block
+	dwSlot = CacheLookup(pDisk, dwBlock);
+	if(CACHE_NONE==dwSlot)
+	{
+		dwSlot = CacheEvict(pDisk, dwBlock);
+		if(CACHE_NONE==dwSlot) return ERR_MEM;
+	}
+	
+	// copy block to cache, refresh cache entry
+	memcpy(pDisk->ucCache + dwSlot*512, ucBuf, 512);
+	pDisk->dwCacheAge[dwSlot] = pDisk->dwReadCounter;
+
+	// tag this block as dirty, dirty blocks can't be evicted
+	if(0==(pDisk->ucCacheFlags[dwSlot]&CACHE_FLAG_DIRTY))
 	{
-		// current block already in cache?
-		if(pDisk->dwCacheTable[i]==dwBlock)
+		CacheLRUUnlink(pDisk, dwSlot);
+		pDisk->ucCacheFlags[dwSlot] = CACHE_FLAG_DIRTY;
+		if(CacheIsMetadata(pDisk, dwBlock))
+		{
+			pDisk->ucCacheFlags[dwSlot] |= CACHE_FLAG_METADATA;
+		}
+
+		// add block to the dirty set, remember if the set is still sorted
+		// (which is the normal case for sequential writes)
+		if((pDisk->dwCacheDirtyCount>0)&&
+		   (pDisk->dwCacheDirty[pDisk->dwCacheDirtyCount-1]>dwBlock))
 		{
-			// refresh cache entry
-			pDisk->dwCacheAge[i] = pDisk->dwReadCounter;
-			memcpy(pDisk->ucCache + i*512, ucBuf, 512);
-			pDisk->ucCacheFlags[i] |= CACHE_FLAG_DIRTY;
-			return ERR_OK;
+			pDisk->iCacheDirtySorted = 0;
+		}
+		pDisk->dwCacheDirty[pDisk->dwCacheDirtyCount++] = dwBlock;
+		if(pDisk->dwCacheDirtyCount>pDisk->dwCacheDirtyMax)
+		{
+			pDisk->dwCacheDirtyMax = pDisk->dwCacheDirtyCount;
 		}
 	}
 
-	// find the oldest block to overwrite it
-	dwOldestBlock = 0; dwOldestAge = pDisk->dwReadCounter+1;
-	for(i=0; i<CACHE_SIZE; i++)
-	{
-		// skip dirty cache blocks
-		if(pDisk->ucCacheFlags[i]&CACHE_FLAG_DIRTY) continue;
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// CacheCompareBlocks
+// 
+// qsort() callback to sort the dirty set by block number
+//----------------------------------------------------------------------------
+static int CacheCompareBlocks(const void *p1, const void *p2)
+{
+	DWORD dwBlock1 = *(const DWORD*)p1;
+	DWORD dwBlock2 = *(const DWORD*)p2;
+	
+	if(dwBlock1<dwBlock2) return -1;
+	if(dwBlock1>dwBlock2) return 1;
+	return 0;
+}
 
-		if(pDisk->dwCacheAge[i]<dwOldestAge)
+//----------------------------------------------------------------------------
+// CacheCollectTrack
+// 
+// Collect the whole track of a dirty block in the run buffer. Blocks which
+// are not in cache are taken from the track as it is on the disk (read
+// back once), so the track can be written in one piece. If the track can
+// not be read, only the contiguous dirty blocks are collected.
+//
+// -> pDisk = pointer to valid disk structure
+//    dwIndex = index of the first dirty block of this track in dwCacheDirty
+//    dwTrackBlocks = blocks per track
+//    pdwFirst = receives the first block to write
+//    pdwCount = receives the number of blocks to write
+// <- number of dirty blocks collected
+//----------------------------------------------------------------------------
+static DWORD CacheCollectTrack(DISK *pDisk, DWORD dwIndex, 
+	DWORD dwTrackBlocks, DWORD *pdwFirst, DWORD *pdwCount)
+{
+	DWORD *dwDirty = pDisk->dwCacheDirty, dwFirst, dwCount, dwSlot, j, k;
+	unsigned char *ucTrack;
+	int iMissing = 0;
+	
+	dwFirst = dwDirty[dwIndex] - (dwDirty[dwIndex] % dwTrackBlocks);
+	dwCount = dwTrackBlocks;
+	if(((dwFirst+dwCount)>pDisk->dwPhysicalBlocks)&&
+	   (pDisk->dwPhysicalBlocks>dwDirty[dwIndex]))
+	{
+		dwCount = pDisk->dwPhysicalBlocks - dwFirst;
+	}
+	
+	// dirty blocks belonging to this track
+	j = 0;
+	while(((dwIndex+j)<pDisk->dwCacheDirtyCount)&&
+		  (dwDirty[dwIndex+j]<(dwFirst+dwCount))) j++;
+	
+	// take all cached blocks of the track
+	for(k=0; k<dwCount; k++)
+	{
+		dwSlot = CacheLookup(pDisk, dwFirst+k);
+		if(CACHE_NONE==dwSlot)
 		{
-			dwOldestAge = pDisk->dwCacheAge[i];
-			dwOldestBlock = i;
+			iMissing = 1;
+			continue;
 		}
+		memcpy(pDisk->ucCacheFlushBuf+k*512, pDisk->ucCache+dwSlot*512, 512);
 	}
 	
-	// copy block to cache
-	pDisk->dwCacheTable[dwOldestBlock] = dwBlock;
-	pDisk->dwCacheAge[dwOldestBlock] = pDisk->dwReadCounter;
-	memcpy(pDisk->ucCache + dwOldestBlock*512, ucBuf, 512);
+	// read the rest from disk (behind the track in the run buffer)
+	if(iMissing)
+	{
+		ucTrack = pDisk->ucCacheFlushBuf + dwTrackBlocks*512;
+		if(ERR_OK!=BackendRead(pDisk, dwFirst, dwCount, ucTrack))
+		{
+			LOG("CacheCollectTrack(): track at block %d could not be read, "
+				"writing dirty blocks only.\n", dwFirst);
+			
+			j = 1;
+			while(((dwIndex+j)<pDisk->dwCacheDirtyCount)&&
+				  ((dwDirty[dwIndex+j-1]+1)==dwDirty[dwIndex+j])&&
+				  (dwDirty[dwIndex+j]<(dwFirst+dwCount))) j++;
+			memmove(pDisk->ucCacheFlushBuf, pDisk->ucCacheFlushBuf + 
+				(dwDirty[dwIndex]-dwFirst)*512, j*512);
+			*pdwFirst = dwDirty[dwIndex];
+			*pdwCount = j;
+			return j;
+		}
+		pDisk->dwTrackReads++;
+		
+		for(k=0; k<dwCount; k++)
+		{
+			if(CACHE_NONE!=CacheLookup(pDisk, dwFirst+k)) continue;
+			memcpy(pDisk->ucCacheFlushBuf+k*512, ucTrack+k*512, 512);
+		}
+	}
+	
+	*pdwFirst = dwFirst;
+	*pdwCount = dwCount;
+	return j;
+}
 
-	// tag this block as dirty
-	pDisk->ucCacheFlags[dwOldestBlock] |= CACHE_FLAG_DIRTY;
+//----------------------------------------------------------------------------
+// CacheOrderMetadataLast
+// 
+// Move the metadata blocks of the sorted dirty set behind the file data
+// blocks (both parts stay in ascending order), so metadata is written as
+// one ordered batch after the data it points to.
+//
+// -> pDisk = pointer to valid disk structure
+// <- --
+//----------------------------------------------------------------------------
+static void CacheOrderMetadataLast(DISK *pDisk)
+{
+	DWORD *dwDirty = pDisk->dwCacheDirty, *dwMeta;
+	DWORD i, dwData = 0, dwMetaCount = 0;
+	
+	// the run buffer is not in use yet (it holds CACHE_MAX_SLOTS block
+	// numbers)
+	dwMeta = (DWORD*)pDisk->ucCacheFlushBuf;
+	
+	for(i=0; i<pDisk->dwCacheDirtyCount; i++)
+	{
+		if(pDisk->ucCacheFlags[CacheLookup(pDisk, dwDirty[i])]&
+		   CACHE_FLAG_METADATA)
+		{
+			dwMeta[dwMetaCount++] = dwDirty[i];
+		}
+		else dwDirty[dwData++] = dwDirty[i];
+	}
+	if((0==dwMetaCount)||(0==dwData)) return;
+	
+	memcpy(dwDirty+dwData, dwMeta, dwMetaCount*sizeof(DWORD));
+	pDisk->iCacheDirtySorted = 0;
+}
 
-	return ERR_OK;
+//----------------------------------------------------------------------------
+// CacheFlushBackend
+// 
+// Let the backend write back its own buffers (e.g. modified pages of mapped
+// image files)
+// 
+// -> pDisk = pointer to valid disk structure
+// <- ERR_OK
+//    errors from the backend
+//----------------------------------------------------------------------------
+static int CacheFlushBackend(DISK *pDisk)
+{
+	if((NULL==pDisk->pBackend)||(NULL==pDisk->pBackend->Flush)) return ERR_OK;
+	return pDisk->pBackend->Flush(pDisk);
 }
 
 //----------------------------------------------------------------------------
-// CacheFlush
+// CacheFlushLocked
 // 
-// Flush the write cache to disk. Find all dirty cache entries and write them
-// back to disk. Try to find contiguous blocks to be written in one write
+// Flush the write cache to disk. All dirty blocks are taken from the dirty
+// set in ascending order and contiguous blocks are written in one write
 // call.
 //
+// Floppies are written in whole tracks: each track with dirty blocks is
+// completed from the cache (or read back from the disk) and written in one
+// call. Ascending block order is ascending cylinder and head order, so the
+// drive only seeks forward. The time for each track is logged.
+//
 // The read cache is not affected (cached sectors stay cached)
 //
 // -> pDisk = pointer to valid disk structure
 // <- ERR_OK
-//    ERR_SEEK
 //    ERR_WRITE
 //    ERR_NOT_OPEN
 //    ERR_MEM
 //----------------------------------------------------------------------------
-DLLEXPORT int __stdcall CacheFlush(DISK *pDisk)
+static int CacheFlushLocked(DISK *pDisk)
 {
-	DWORD dwBytesWritten, dwTemp, dwCacheTable[CACHE_SIZE], 
-		dwCacheAge[CACHE_SIZE], dwLow, dwHigh, dwError;
-	unsigned char *ucCache, ucCacheFlags[CACHE_SIZE];
-	__int64 iiFilepointer;
-	int i, j, k;
+	DWORD dwSlot, *dwDirty, i, j, k, dwFirst, dwCount, dwTrackBlocks = 0;
+	DWORD dwTrack, dwHeads, dwTime;
+	int iResult = ERR_OK;
 	
 	if(NULL==pDisk) return ERR_NOT_OPEN;
 	
+	// suspended disks have been written back completely
+	if(pDisk->iSuspended) return ERR_OK;
+	
 	// check if there is something to write
-	for(i=0; i<CACHE_SIZE; i++)
+	if(0==pDisk->dwCacheDirtyCount) return CacheFlushBackend(pDisk);
+	
+	// sort dirty set in ascending order (block number), the cache memory
+	// itself is not touched
+	dwDirty = pDisk->dwCacheDirty;
+	if(!pDisk->iCacheDirtySorted)
 	{
-		if(0!=(pDisk->ucCacheFlags[i]&CACHE_FLAG_DIRTY)) break;
+		qsort(dwDirty, pDisk->dwCacheDirtyCount, sizeof(DWORD), 
+			CacheCompareBlocks);
+		pDisk->iCacheDirtySorted = 1;
 	}
-	if(CACHE_SIZE==i) return ERR_OK;
 	
-	LOG("CacheFlush(): Sorting cache ");
-
-	// TODO: sorting is slow!
-	memcpy(dwCacheTable, pDisk->dwCacheTable, CACHE_SIZE*sizeof(DWORD));
-	ucCache = malloc(CACHE_SIZE*512);
-	if(NULL==ucCache)
+	// floppies are written track by track (the run buffer has to hold the
+	// track and the track read back from disk)
+	if(TYPE_FLOPPY==pDisk->iType)
 	{
-		LOG("failed, ERR_MEM.\n");
-		return ERR_MEM;
+		dwTrackBlocks = pDisk->DiskGeometry.Geometry.SectorsPerTrack;
+		if((dwTrackBlocks*2)>CACHE_FLUSH_RUN) dwTrackBlocks = 0;
 	}
-
-	// sort cache in ascending order (block number)
-	for(i=0; i<CACHE_SIZE; i++)
+	
+	// other devices write file data first, then metadata
+	if(0==dwTrackBlocks) CacheOrderMetadataLast(pDisk);
+	
+	// loop through all dirty blocks
+	for(i=0; i<pDisk->dwCacheDirtyCount; i+=j)
 	{
-		for(j=i+1; j<CACHE_SIZE; j++)
+		if(dwTrackBlocks)
 		{
-			if(dwCacheTable[i]>dwCacheTable[j])
-			{
-				// swap two cache entries
-				dwTemp = dwCacheTable[i];
-				dwCacheTable[i] = dwCacheTable[j];
-				dwCacheTable[j] = dwTemp;
-			}
+			// collect the whole track of the next dirty block
+			j = CacheCollectTrack(pDisk, i, dwTrackBlocks, &dwFirst, 
+				&dwCount);
 		}
-	}
-	
-	// copy the cache blocks to temp locations (this didn't happen in the
-	// above sorting function because bubblesort is too slow for that)
-	for(i=0; i<CACHE_SIZE; i++)
-	{
-		for(j=0; j<CACHE_SIZE; j++)
+		else
 		{
-			if(dwCacheTable[i]==pDisk->dwCacheTable[j])
+			// find contiguous blocks, collect them in the run buffer
+			j = 0;
+			while(((i+j)<pDisk->dwCacheDirtyCount)&&(j<CACHE_FLUSH_RUN))
 			{
-				memcpy(ucCache+i*512, pDisk->ucCache+j*512, 512);
-				dwCacheAge[i] = pDisk->dwCacheAge[j];
-				ucCacheFlags[i] = pDisk->ucCacheFlags[j];
+				// allow only blocks where the successor points to next block
+				if((j>0)&&((dwDirty[i+j-1]+1)!=dwDirty[i+j])) break;
 				
-				break;
+				dwSlot = CacheLookup(pDisk, dwDirty[i+j]);
+				memcpy(pDisk->ucCacheFlushBuf+j*512, 
+					pDisk->ucCache+dwSlot*512, 512);
+				j++;
 			}
+			dwFirst = dwDirty[i];
+			dwCount = j;
 		}
-	}
-
-	// copy temp cache structure to cache
-	free(pDisk->ucCache); pDisk->ucCache = ucCache;
-	memcpy(pDisk->dwCacheAge, dwCacheAge, CACHE_SIZE*sizeof(DWORD));
-	memcpy(pDisk->dwCacheTable, dwCacheTable, CACHE_SIZE*sizeof(DWORD));
-	memcpy(pDisk->ucCacheFlags, ucCacheFlags, CACHE_SIZE);
 
-	LOG("OK.\n");
-	
-	// loop through all cache entries
-	for(i=0; i<CACHE_SIZE; i++)
-	{
-		// skip non-dirty blocks
-		if(0==(pDisk->ucCacheFlags[i]&CACHE_FLAG_DIRTY)) continue;
-
-		// set file pointer
-		iiFilepointer = pDisk->dwCacheTable[i]; iiFilepointer *= 512;
-		dwLow = iiFilepointer & 0xFFFFFFFF;
-		dwHigh = (iiFilepointer >> 32) & 0xFFFFFFFF;
-		if(0xFFFFFFFF==SetFilePointer(pDisk->hHandle, dwLow, &dwHigh, 
-			FILE_BEGIN))
+		// write to disk
+		dwTime = GetTickCount();
+		iResult = BackendWrite(pDisk, dwFirst, dwCount, 
+			pDisk->ucCacheFlushBuf);
+		dwTime = GetTickCount() - dwTime;
+		if(ERR_OK!=iResult)
 		{
-			dwError = GetLastError();
-			if(NO_ERROR != dwError)
-			{
-				LOG("CacheFlush() failed: ERR_SEEK: "); LOG_ERR(dwError);
-				return ERR_SEEK;
-			}
+			LOG("CacheFlush(): write failed.\n");
+			break;
 		}
 
-		// try to find contiguous blocks
-		j = 1;
-		while((i+j)<=CACHE_SIZE)
+		if(dwTrackBlocks)
 		{
-			// only check dirty blocks
-			if(pDisk->ucCacheFlags[i+j]&CACHE_FLAG_DIRTY)
-			{
-				// allow only blocks where the successor points to next block
-				if((pDisk->dwCacheTable[i+j-1]+1)==(pDisk->dwCacheTable[i+j]))
-				{
-					j++;
-				}
-				else
-				{
-					break;
-				}
-			}
-			else
-			{
-				break;
-			}
+			dwTrack = dwFirst / dwTrackBlocks;
+			dwHeads = pDisk->DiskGeometry.Geometry.TracksPerCylinder;
+			if(0==dwHeads) dwHeads = 1;
+			
+			pDisk->dwTrackWrites++;
+			pDisk->dwTrackWriteTime += dwTime;
+			if(dwTime>pDisk->dwTrackWriteMax) pDisk->dwTrackWriteMax = dwTime;
+			
+			LOG("  -> track %d (cylinder %d, head %d): %d blocks (%d dirty) "
+				"written in %d ms.\n", dwTrack, dwTrack/dwHeads, 
+				dwTrack%dwHeads, dwCount, j, dwTime);
 		}
-
-		// write to disk
-		if(0==WriteFile(pDisk->hHandle, pDisk->ucCache+i*512, 512*j, 
-			&dwBytesWritten, NULL))
+		else
 		{
-			LOG("CacheFlush(): WriteFile() failed.\n");
-			return ERR_WRITE;
+			LOG("  -> %d contiguous blocks written at block %d.\n", j, 
+				dwFirst);
 		}
-		if((DWORD)(512*j)!=dwBytesWritten)
+		
+		// mark cache blocks as non-dirty, they can be evicted again
+		for(k=0; k<j; k++)
 		{
-			LOG("CacheFlush(): WriteFile() failed.\n");
-			return ERR_WRITE;
+			dwSlot = CacheLookup(pDisk, dwDirty[i+k]);
+			pDisk->ucCacheFlags[dwSlot] = CACHE_FLAG_REFERENCED |
+				(pDisk->ucCacheFlags[dwSlot] & CACHE_FLAG_METADATA);
+			CacheLRUPushFront(pDisk, dwSlot);
 		}
+	}
 
-		LOG("  -> %d contiguous blocks written at block %d.\n", j, 
-			pDisk->dwCacheTable[i]);
-		
-		// mark cache blocks as non-dirty
-		for(k=0; k<j; k++) pDisk->ucCacheFlags[i+k] = CACHE_FLAG_NONE;
-		
-		i += j - 1;
+	pDisk->dwFlushes++;
+	pDisk->dwFlushBlocks += i;
+	
+	// keep the blocks which could not be written in the dirty set
+	pDisk->dwCacheDirtyCount -= i;
+	if(pDisk->dwCacheDirtyCount>0)
+	{
+		memmove(dwDirty, dwDirty+i, pDisk->dwCacheDirtyCount*sizeof(DWORD));
 	}
+	if(ERR_OK!=iResult) return iResult;
 
-	LOG("OK, cache hits=%d, cache misses=%d, FAT hits=%d, FAT misses=%d\n", 
-		pDisk->dwCacheHits, pDisk->dwCacheMisses, pDisk->dwFATHit,
-		pDisk->dwFATMiss);
+	LOG("OK, cache hits=%d, cache misses=%d, FAT hits=%d, FAT misses=%d, "
+		"read ahead=%d blocks (%d used)\n", pDisk->dwCacheHits, 
+		pDisk->dwCacheMisses, pDisk->dwFATHit, pDisk->dwFATMiss,
+		pDisk->dwReadAheadBlocks, pDisk->dwReadAheadHits);
+	if(pDisk->dwTrackWrites)
+	{
+		LOG("   tracks written=%d (%d read back), %d ms total, "
+			"slowest %d ms\n", pDisk->dwTrackWrites, pDisk->dwTrackReads,
+			pDisk->dwTrackWriteTime, pDisk->dwTrackWriteMax);
+	}
+	LOG("   cache %d KB (peak %d KB), all disks %d KB of %d KB\n", 
+		pDisk->dwCacheSlots/2, pDisk->dwCacheSlotsPeak/2, 
+		g_dwCacheSlotsUsed/2, g_iOptionCacheBudget*1024);
 	
-	return ERR_OK;
+	return CacheFlushBackend(pDisk);
+}
+
+//----------------------------------------------------------------------------
+// CacheFlush
+//
+// Call CacheFlushLocked() with the lock of the disk held
+//
+// -> and <- see CacheFlushLocked()
+//----------------------------------------------------------------------------
+DLLEXPORT int __stdcall CacheFlush(DISK *pDisk)
+{
+	int iResult;
+	
+	if(NULL==pDisk) return ERR_NOT_OPEN;
+	EnterCriticalSection(&pDisk->csLock);
+	iResult = CacheFlushLocked(pDisk);
+	LeaveCriticalSection(&pDisk->csLock);
+	return iResult;
 }
@@ -42,22 +42,62 @@
 //----------------------------------------------------------------------------
 // #defines
 //----------------------------------------------------------------------------
-// cache size (in blocks)
-#define CACHE_SIZE	8192
+// cache size of a disk (in blocks): every disk gets CACHE_MIN_SLOTS when it
+// is mounted and grows in steps of CACHE_GROW_SLOTS up to CACHE_MAX_SLOTS
+// while the CacheBudget option (in MB, shared by all disks) allows it
+#define CACHE_MIN_SLOTS		512
+#define CACHE_GROW_SLOTS	1024
+#define CACHE_MAX_SLOTS		32768
+
+// a disk not used for this time (ms) gives its cache back to other disks
+#define CACHE_IDLE_TIME		10000
+
+// number of hash buckets for the block index (power of 2, one per slot of
+// the largest cache, so a lookup compares about one slot at any cache size)
+#define CACHE_HASH_SIZE	CACHE_MAX_SLOTS
+
+// maximum number of blocks written by CacheFlush() in one write call
+#define CACHE_FLUSH_RUN	256
+
+// marks an unused hash bucket or the end of a cache slot list
+#define CACHE_NONE	0xFFFFFFFF
 
 #define CACHE_FLAG_NONE		0
 #define CACHE_FLAG_DIRTY	1
+#define CACHE_FLAG_READAHEAD	2	// read ahead, not yet requested
+#define CACHE_FLAG_REFERENCED	4	// used since it came into the cache
+#define CACHE_FLAG_PROTECTED	8	// in the protected list (2Q)
+#define CACHE_FLAG_METADATA	16	// FAT, OS block or directory (metadata list)
+
+// replacement policies
+#define CACHE_POLICY_LRU	0	// least recently used
+#define CACHE_POLICY_2Q		1	// scan resistant (probation/protected lists)
+
+// maximum number of slots in the protected list (the probation list has
+// to hold at least one read ahead, which is half the cache at most)
+#define CACHE_PROTECTED_MAX(pDisk)	((pDisk)->dwCacheSlots/2)
+
+// maximum number of clean slots in the metadata tier
+#define CACHE_METADATA_MAX(pDisk)	((pDisk)->dwCacheSlots/4)
 
 //----------------------------------------------------------------------------
 // Prototypes
 //----------------------------------------------------------------------------
+void CacheStartup(void);
+void CacheShutdown(void);
+int CacheInit(DISK *pDisk);
+void CacheFree(DISK *pDisk);
 int CacheWriteBlock(DISK *pDisk, DWORD dwBlock, unsigned char *ucBuf);
-int CacheInsertReadBlock(DISK *pDisk, DWORD dwBlock, unsigned char *ucBuf);
+int CacheInsertReadBlock(DISK *pDisk, DWORD dwBlock, unsigned char *ucBuf,
+	int iReadAhead);
+int CacheContainsBlock(DISK *pDisk, DWORD dwBlock);
 int CacheReadBlock(DISK *pDisk, DWORD dwBlock, unsigned char *ucBuf);
+int CacheSetMetadata(DISK *pDisk, DWORD dwBlock, DWORD dwNumBlocks);
 
 //----------------------------------------------------------------------------
 // DLL exports
 //----------------------------------------------------------------------------
 DLLEXPORT int __stdcall CacheFlush(DISK *pDisk);
+DLLEXPORT int __stdcall CacheSetPolicy(DISK *pDisk, int iPolicy);
 
 #endif
@@ -0,0 +1,863 @@
+//----------------------------------------------------------------------------
+// EnsoniqFS plugin for TotalCommander
+//
+// CHUNK-COMPRESSED IMAGE FILES
+//----------------------------------------------------------------------------
+//
+// (c) 2006 Thoralt Franz
+//
+// This source code was written using Dev-Cpp 4.9.9.2
+// If you want to compile it, get Dev-Cpp. Normally the code should compile
+// with other IDEs/compilers too (with small modifications), but I did not
+// test it.
+//
+//----------------------------------------------------------------------------
+// License
+//----------------------------------------------------------------------------
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, 
+// MA  02110-1301, USA.
+// 
+// Alternatively, download a copy of the license here:
+// http://www.gnu.org/licenses/gpl.txt
+//----------------------------------------------------------------------------
+#include "chunkimg.h"
+#include "backend.h"
+
+//----------------------------------------------------------------------------
+// GetDWORD
+//
+// Read a little endian DWORD from a buffer
+//
+// -> ucBuf = pointer to 4 bytes
+// <- value
+//----------------------------------------------------------------------------
+static DWORD GetDWORD(unsigned char *ucBuf)
+{
+	return ucBuf[0] | (ucBuf[1]<<8) | (ucBuf[2]<<16) | ((DWORD)ucBuf[3]<<24);
+}
+
+//----------------------------------------------------------------------------
+// PutDWORD
+//
+// Write a little endian DWORD to a buffer
+//
+// -> ucBuf = pointer to 4 bytes
+//    dwValue = value to write
+// <- --
+//----------------------------------------------------------------------------
+static void PutDWORD(unsigned char *ucBuf, DWORD dwValue)
+{
+	ucBuf[0] = dwValue & 0xFF;
+	ucBuf[1] = (dwValue>>8) & 0xFF;
+	ucBuf[2] = (dwValue>>16) & 0xFF;
+	ucBuf[3] = (dwValue>>24) & 0xFF;
+}
+
+//----------------------------------------------------------------------------
+// PackChunk
+//
+// Compress a chunk with PackBits: a control byte n<128 is followed by n+1
+// literal bytes, a control byte n>128 is followed by one byte which is
+// repeated 257-n times.
+//
+// -> ucSrc = pointer to uncompressed data
+//    dwLength = length of uncompressed data
+//    ucDest = pointer to destination buffer (dwLength+dwLength/128+1 bytes)
+// <- length of compressed data
+//----------------------------------------------------------------------------
+static DWORD PackChunk(unsigned char *ucSrc, DWORD dwLength,
+	unsigned char *ucDest)
+{
+	DWORD i = 0, o = 0, dwRun, dwStart;
+
+	while(i<dwLength)
+	{
+		// run of at least three equal bytes?
+		for(dwRun=1; (i+dwRun<dwLength)&&(dwRun<128)&&
+			(ucSrc[i+dwRun]==ucSrc[i]); dwRun++);
+		if(dwRun>=3)
+		{
+			ucDest[o++] = (unsigned char)(257-dwRun);
+			ucDest[o++] = ucSrc[i];
+			i += dwRun;
+			continue;
+		}
+
+		// literal bytes up to the next run
+		dwStart = i;
+		while((i<dwLength)&&(i-dwStart<128))
+		{
+			if((i+2<dwLength)&&(ucSrc[i]==ucSrc[i+1])&&
+			   (ucSrc[i]==ucSrc[i+2]))
+			{
+				break;
+			}
+			i++;
+		}
+		ucDest[o++] = (unsigned char)(i-dwStart-1);
+		memcpy(ucDest+o, ucSrc+dwStart, i-dwStart);
+		o += i-dwStart;
+	}
+
+	return o;
+}
+
+//----------------------------------------------------------------------------
+// UnpackChunk
+//
+// Decompress a PackBits compressed chunk
+//
+// -> ucSrc = pointer to compressed data
+//    dwLength = length of compressed data
+//    ucDest = pointer to destination buffer
+//    dwDestLength = length of uncompressed data
+// <- ERR_OK
+//    ERR_READ (corrupt data)
+//----------------------------------------------------------------------------
+static int UnpackChunk(unsigned char *ucSrc, DWORD dwLength,
+	unsigned char *ucDest, DWORD dwDestLength)
+{
+	DWORD i = 0, o = 0, n;
+
+	while(i<dwLength)
+	{
+		n = ucSrc[i++];
+		if(n<128)
+		{
+			n++;
+			if((i+n>dwLength)||(o+n>dwDestLength)) return ERR_READ;
+			memcpy(ucDest+o, ucSrc+i, n);
+			i += n;
+			o += n;
+		}
+		else if(n>128)
+		{
+			n = 257-n;
+			if((i>=dwLength)||(o+n>dwDestLength)) return ERR_READ;
+			memset(ucDest+o, ucSrc[i++], n);
+			o += n;
+		}
+	}
+
+	return (o==dwDestLength)?ERR_OK:ERR_READ;
+}
+
+//----------------------------------------------------------------------------
+// LoadChunk
+//
+// Read and decompress one chunk
+//
+// -> hHandle = handle of the image file
+//    iiOffset = file offset of the chunk data
+//    dwLength = stored length of the chunk data
+//    dwChunkBytes = bytes per chunk
+//    ucPackBuf = buffer for compressed data (dwChunkBytes+dwChunkBytes/128+1)
+//    ucDest = pointer to destination buffer (dwChunkBytes)
+// <- ERR_OK
+//    ERR_READ
+//----------------------------------------------------------------------------
+static int LoadChunk(HANDLE hHandle, __int64 iiOffset, DWORD dwLength,
+	DWORD dwChunkBytes, unsigned char *ucPackBuf, unsigned char *ucDest)
+{
+	// chunk not stored?
+	if(0==dwLength)
+	{
+		memset(ucDest, 0, dwChunkBytes);
+		return ERR_OK;
+	}
+
+	// stored uncompressed?
+	if(dwLength==dwChunkBytes)
+	{
+		return ReadAt(hHandle, iiOffset, ucDest, dwChunkBytes);
+	}
+
+	if(dwLength>dwChunkBytes+dwChunkBytes/128+1) return ERR_READ;
+	if(ERR_OK!=ReadAt(hHandle, iiOffset, ucPackBuf, dwLength)) return ERR_READ;
+	return UnpackChunk(ucPackBuf, dwLength, ucDest, dwChunkBytes);
+}
+
+//----------------------------------------------------------------------------
+// IsChunkImage
+//
+// Check the header of a chunk-compressed image file
+//
+// -> ucHeader = pointer to the first 512 bytes of the file
+// <- 1 = chunk-compressed image, 0 = other file
+//----------------------------------------------------------------------------
+int IsChunkImage(unsigned char *ucHeader)
+{
+	DWORD dwChunkBlocks, dwBlocks;
+
+	if(0!=memcmp(ucHeader, CHUNK_IMAGE_MAGIC, 8)) return 0;
+	if(CHUNK_IMAGE_VERSION!=GetDWORD(ucHeader+0x08)) return 0;
+
+	dwChunkBlocks = GetDWORD(ucHeader+0x0C);
+	dwBlocks = GetDWORD(ucHeader+0x10);
+	if((0==dwChunkBlocks)||(dwChunkBlocks>CHUNK_IMAGE_BLOCKS*16)) return 0;
+	if(0==dwBlocks) return 0;
+	if(GetDWORD(ucHeader+0x14)!=(dwBlocks+dwChunkBlocks-1)/dwChunkBlocks)
+	{
+		return 0;
+	}
+
+	return 1;
+}
+
+//----------------------------------------------------------------------------
+// ReadChunkImageStart
+//
+// Read the first bytes of the disk stored in a chunk-compressed image file
+// (for image type detection). Only the index entries of the needed chunks
+// are read.
+//
+// -> h = handle of the image file
+//    ucBuf = pointer to destination buffer
+//    dwBytes = number of bytes to read (multiple of 512)
+// <- ERR_OK
+//    ERR_READ
+//    ERR_MEM
+//----------------------------------------------------------------------------
+int ReadChunkImageStart(HANDLE h, unsigned char *ucBuf, DWORD dwBytes)
+{
+	unsigned char ucHeader[512], ucEntry[CHUNK_INDEX_ENTRY], *ucChunk;
+	DWORD dwChunkBytes, dwChunks, dwChunk, dwCount;
+	__int64 iiOffset;
+
+	if(ERR_OK!=ReadAt(h, 0, ucHeader, 512)) return ERR_READ;
+	if(!IsChunkImage(ucHeader)) return ERR_READ;
+	dwChunkBytes = GetDWORD(ucHeader+0x0C)*512;
+	dwChunks = GetDWORD(ucHeader+0x14);
+
+	// one buffer for compressed and decompressed data
+	ucChunk = malloc(2*dwChunkBytes+dwChunkBytes/128+1);
+	if(NULL==ucChunk) return ERR_MEM;
+
+	memset(ucBuf, 0, dwBytes);
+	for(dwChunk=0; (dwChunk<dwChunks)&&(dwChunk*dwChunkBytes<dwBytes);
+		dwChunk++)
+	{
+		if(ERR_OK!=ReadAt(h, 512+dwChunk*CHUNK_INDEX_ENTRY, ucEntry,
+						  CHUNK_INDEX_ENTRY))
+		{
+			free(ucChunk);
+			return ERR_READ;
+		}
+		iiOffset = GetDWORD(ucEntry) | ((__int64)GetDWORD(ucEntry+4)<<32);
+		if(ERR_OK!=LoadChunk(h, iiOffset, GetDWORD(ucEntry+8), dwChunkBytes,
+							 ucChunk+dwChunkBytes, ucChunk))
+		{
+			free(ucChunk);
+			return ERR_READ;
+		}
+
+		dwCount = dwBytes - dwChunk*dwChunkBytes;
+		if(dwCount>dwChunkBytes) dwCount = dwChunkBytes;
+		memcpy(ucBuf+dwChunk*dwChunkBytes, ucChunk, dwCount);
+	}
+
+	free(ucChunk);
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// FreeChunkImage
+//
+// Free the index and chunk cache of a chunk-compressed image
+//
+// -> pChunk = pointer to chunk image structure (can be NULL)
+// <- --
+//----------------------------------------------------------------------------
+static void FreeChunkImage(CHUNKIMAGE *pChunk)
+{
+	if(NULL==pChunk) return;
+
+	if(pChunk->iiChunkOffset) free(pChunk->iiChunkOffset);
+	if(pChunk->dwChunkLength) free(pChunk->dwChunkLength);
+	if(pChunk->ucPackBuf) free(pChunk->ucPackBuf);
+	if(pChunk->ucCache) free(pChunk->ucCache);
+	free(pChunk);
+}
+
+//----------------------------------------------------------------------------
+// AllocChunkImage
+//
+// Allocate the index and chunk cache of a chunk-compressed image, the index
+// is initialized to all chunks not stored
+//
+// -> dwBlocks = number of blocks of the disk
+//    dwChunkBlocks = blocks per chunk
+// <- pointer to new chunk image structure, NULL if out of memory
+//----------------------------------------------------------------------------
+static CHUNKIMAGE *AllocChunkImage(DWORD dwBlocks, DWORD dwChunkBlocks)
+{
+	CHUNKIMAGE *pChunk;
+	int i;
+
+	pChunk = malloc(sizeof(CHUNKIMAGE));
+	if(NULL==pChunk) return NULL;
+	memset(pChunk, 0, sizeof(CHUNKIMAGE));
+
+	pChunk->dwChunkBlocks = dwChunkBlocks;
+	pChunk->dwChunkBytes = dwChunkBlocks*512;
+	pChunk->dwBlocks = dwBlocks;
+	pChunk->dwChunks = (dwBlocks+dwChunkBlocks-1)/dwChunkBlocks;
+
+	pChunk->iiChunkOffset = malloc(pChunk->dwChunks*sizeof(__int64));
+	pChunk->dwChunkLength = malloc(pChunk->dwChunks*sizeof(DWORD));
+	pChunk->ucPackBuf = malloc(pChunk->dwChunkBytes+pChunk->dwChunkBytes/128
+							   +1);
+	pChunk->ucCache = malloc(CHUNK_CACHE_SLOTS*pChunk->dwChunkBytes);
+	if((NULL==pChunk->iiChunkOffset)||(NULL==pChunk->dwChunkLength)||
+	   (NULL==pChunk->ucPackBuf)||(NULL==pChunk->ucCache))
+	{
+		FreeChunkImage(pChunk);
+		return NULL;
+	}
+	memset(pChunk->iiChunkOffset, 0, pChunk->dwChunks*sizeof(__int64));
+	memset(pChunk->dwChunkLength, 0, pChunk->dwChunks*sizeof(DWORD));
+
+	for(i=0; i<CHUNK_CACHE_SLOTS; i++)
+	{
+		pChunk->dwCacheChunk[i] = 0xFFFFFFFF;
+	}
+
+	// chunk data is appended behind the index
+	pChunk->iiFileEnd = (512+pChunk->dwChunks*CHUNK_INDEX_ENTRY+511)&~511;
+
+	return pChunk;
+}
+
+//----------------------------------------------------------------------------
+// WriteChunkIndex
+//
+// Write a range of index entries to the image file. The pack buffer is
+// used as scratch memory, so no chunk may be waiting in there.
+//
+// -> pChunk = pointer to chunk image structure
+//    hHandle = handle of the image file
+//    dwFirst = first index entry to write
+//    dwCount = number of index entries to write
+// <- ERR_OK
+//    ERR_WRITE
+//----------------------------------------------------------------------------
+static int WriteChunkIndex(CHUNKIMAGE *pChunk, HANDLE hHandle, DWORD dwFirst,
+	DWORD dwCount)
+{
+	DWORD i, dwBatch;
+
+	while(dwCount>0)
+	{
+		dwBatch = pChunk->dwChunkBytes/CHUNK_INDEX_ENTRY;
+		if(dwBatch>dwCount) dwBatch = dwCount;
+
+		for(i=0; i<dwBatch; i++)
+		{
+			PutDWORD(pChunk->ucPackBuf+i*CHUNK_INDEX_ENTRY,
+				(DWORD)pChunk->iiChunkOffset[dwFirst+i]);
+			PutDWORD(pChunk->ucPackBuf+i*CHUNK_INDEX_ENTRY+4,
+				(DWORD)(pChunk->iiChunkOffset[dwFirst+i]>>32));
+			PutDWORD(pChunk->ucPackBuf+i*CHUNK_INDEX_ENTRY+8,
+				pChunk->dwChunkLength[dwFirst+i]);
+		}
+		if(ERR_OK!=WriteAt(hHandle, 512+(__int64)dwFirst*CHUNK_INDEX_ENTRY,
+						   pChunk->ucPackBuf, dwBatch*CHUNK_INDEX_ENTRY))
+		{
+			LOG("WriteChunkIndex(): ERR_WRITE\n");
+			return ERR_WRITE;
+		}
+
+		dwFirst += dwBatch;
+		dwCount -= dwBatch;
+	}
+
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// AppendChunk
+//
+// Compress one chunk and append it to the rewrite log at the end of the
+// image file. All zero chunks are not stored at all, chunks which do not
+// get smaller are stored uncompressed. Only the index in memory is updated.
+//
+// -> pChunk = pointer to chunk image structure
+//    hHandle = handle of the image file
+//    dwChunk = chunk number
+//    ucData = pointer to uncompressed chunk data
+// <- ERR_OK
+//    ERR_WRITE
+//----------------------------------------------------------------------------
+static int AppendChunk(CHUNKIMAGE *pChunk, HANDLE hHandle, DWORD dwChunk,
+	unsigned char *ucData)
+{
+	DWORD i, dwLength;
+	unsigned char *ucStore;
+
+	// all zero?
+	for(i=0; (i<pChunk->dwChunkBytes)&&(0==ucData[i]); i++);
+	if(i==pChunk->dwChunkBytes)
+	{
+		pChunk->iiChunkOffset[dwChunk] = 0;
+		pChunk->dwChunkLength[dwChunk] = 0;
+		return ERR_OK;
+	}
+
+	dwLength = PackChunk(ucData, pChunk->dwChunkBytes, pChunk->ucPackBuf);
+	ucStore = pChunk->ucPackBuf;
+	if(dwLength>=pChunk->dwChunkBytes)
+	{
+		dwLength = pChunk->dwChunkBytes;
+		ucStore = ucData;
+	}
+
+	if(ERR_OK!=WriteAt(hHandle, pChunk->iiFileEnd, ucStore, dwLength))
+	{
+		LOG("AppendChunk(): ERR_WRITE\n");
+		return ERR_WRITE;
+	}
+	pChunk->iiChunkOffset[dwChunk] = pChunk->iiFileEnd;
+	pChunk->dwChunkLength[dwChunk] = dwLength;
+	pChunk->iiFileEnd += dwLength;
+
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// StoreChunkSlot
+//
+// Write a modified chunk from the chunk cache to the rewrite log and update
+// its index entry in the image file
+//
+// -> pDisk = pointer to initialized disk structure
+//    iSlot = chunk cache slot
+// <- ERR_OK
+//    ERR_WRITE
+//----------------------------------------------------------------------------
+static int StoreChunkSlot(DISK *pDisk, int iSlot)
+{
+	CHUNKIMAGE *pChunk = pDisk->pChunkImage;
+	DWORD dwChunk = pChunk->dwCacheChunk[iSlot];
+
+	if(ERR_OK!=AppendChunk(pChunk, pDisk->hHandle, dwChunk,
+						   pChunk->ucCache+iSlot*pChunk->dwChunkBytes))
+	{
+		return ERR_WRITE;
+	}
+	if(ERR_OK!=WriteChunkIndex(pChunk, pDisk->hHandle, dwChunk, 1))
+	{
+		return ERR_WRITE;
+	}
+
+	pChunk->iCacheDirty[iSlot] = 0;
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// GetChunkSlot
+//
+// Find a chunk in the chunk cache, load it into the least recently used
+// slot if it is not there (a modified chunk in this slot is stored first)
+//
+// -> pDisk = pointer to initialized disk structure
+//    dwChunk = chunk number
+//    piSlot = pointer to variable to receive the slot number
+// <- ERR_OK
+//    ERR_READ
+//    ERR_WRITE
+//----------------------------------------------------------------------------
+static int GetChunkSlot(DISK *pDisk, DWORD dwChunk, int *piSlot)
+{
+	CHUNKIMAGE *pChunk = pDisk->pChunkImage;
+	int i, iSlot = 0;
+
+	pChunk->dwAge++;
+	for(i=0; i<CHUNK_CACHE_SLOTS; i++)
+	{
+		if(pChunk->dwCacheChunk[i]==dwChunk)
+		{
+			pChunk->dwCacheAge[i] = pChunk->dwAge;
+			*piSlot = i;
+			return ERR_OK;
+		}
+		if(pChunk->dwCacheAge[i]<pChunk->dwCacheAge[iSlot]) iSlot = i;
+	}
+
+	if(pChunk->iCacheDirty[iSlot])
+	{
+		if(ERR_OK!=StoreChunkSlot(pDisk, iSlot)) return ERR_WRITE;
+	}
+
+	pChunk->dwCacheChunk[iSlot] = 0xFFFFFFFF;
+	if(ERR_OK!=LoadChunk(pDisk->hHandle, pChunk->iiChunkOffset[dwChunk],
+						 pChunk->dwChunkLength[dwChunk], pChunk->dwChunkBytes,
+						 pChunk->ucPackBuf,
+						 pChunk->ucCache+iSlot*pChunk->dwChunkBytes))
+	{
+		LOG("GetChunkSlot(): ERR_READ\n");
+		return ERR_READ;
+	}
+	pChunk->dwCacheChunk[iSlot] = dwChunk;
+	pChunk->dwCacheAge[iSlot] = pChunk->dwAge;
+
+	*piSlot = iSlot;
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// ChunkReadBlocks
+//
+// Read from chunk-compressed images. Only the chunks containing the
+// requested blocks are decompressed.
+//
+// -> pDisk = pointer to initialized disk structure
+//    dwBlock = first block to read
+//    dwNumBlocks = number of blocks to read
+//    ucBuf = pointer to destination buffer (dwNumBlocks*512 bytes)
+// <- ERR_OK
+//    ERR_READ
+//    ERR_WRITE
+//    ERR_NOT_OPEN
+//----------------------------------------------------------------------------
+int ChunkReadBlocks(DISK *pDisk, DWORD dwBlock, DWORD dwNumBlocks,
+	unsigned char *ucBuf)
+{
+	CHUNKIMAGE *pChunk = pDisk->pChunkImage;
+	DWORD dwFirst, dwCount;
+	int iSlot;
+
+	if(NULL==pChunk) return ERR_NOT_OPEN;
+	if(dwBlock+dwNumBlocks>pChunk->dwChunks*pChunk->dwChunkBlocks)
+	{
+		return ERR_READ;
+	}
+
+	while(dwNumBlocks>0)
+	{
+		if(ERR_OK!=GetChunkSlot(pDisk, dwBlock/pChunk->dwChunkBlocks,
+								&iSlot))
+		{
+			return ERR_READ;
+		}
+
+		dwFirst = dwBlock%pChunk->dwChunkBlocks;
+		dwCount = pChunk->dwChunkBlocks - dwFirst;
+		if(dwCount>dwNumBlocks) dwCount = dwNumBlocks;
+		memcpy(ucBuf, pChunk->ucCache+iSlot*pChunk->dwChunkBytes+dwFirst*512,
+			dwCount*512);
+
+		ucBuf += dwCount*512;
+		dwBlock += dwCount;
+		dwNumBlocks -= dwCount;
+	}
+
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// ChunkWriteBlocks
+//
+// Write to chunk-compressed images. The blocks are written into the chunk
+// cache, modified chunks go to the rewrite log when they are evicted or
+// when ChunkFlush() is called.
+//
+// -> pDisk = pointer to initialized disk structure
+//    dwBlock = first block to write
+//    dwNumBlocks = number of blocks to write
+//    ucBuf = pointer to source buffer (dwNumBlocks*512 bytes)
+// <- ERR_OK
+//    ERR_READ
+//    ERR_WRITE
+//    ERR_NOT_OPEN
+//----------------------------------------------------------------------------
+int ChunkWriteBlocks(DISK *pDisk, DWORD dwBlock, DWORD dwNumBlocks,
+	unsigned char *ucBuf)
+{
+	CHUNKIMAGE *pChunk = pDisk->pChunkImage;
+	DWORD dwFirst, dwCount;
+	int iSlot;
+
+	if(NULL==pChunk) return ERR_NOT_OPEN;
+	if(dwBlock+dwNumBlocks>pChunk->dwChunks*pChunk->dwChunkBlocks)
+	{
+		return ERR_WRITE;
+	}
+
+	while(dwNumBlocks>0)
+	{
+		// the whole chunk is loaded even if it is overwritten completely,
+		// this keeps the slot handling simple
+		if(ERR_OK!=GetChunkSlot(pDisk, dwBlock/pChunk->dwChunkBlocks,
+								&iSlot))
+		{
+			return ERR_WRITE;
+		}
+
+		dwFirst = dwBlock%pChunk->dwChunkBlocks;
+		dwCount = pChunk->dwChunkBlocks - dwFirst;
+		if(dwCount>dwNumBlocks) dwCount = dwNumBlocks;
+		memcpy(pChunk->ucCache+iSlot*pChunk->dwChunkBytes+dwFirst*512, ucBuf,
+			dwCount*512);
+		pChunk->iCacheDirty[iSlot] = 1;
+
+		ucBuf += dwCount*512;
+		dwBlock += dwCount;
+		dwNumBlocks -= dwCount;
+	}
+
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// ChunkFlush
+//
+// Write all modified chunks of the chunk cache to the rewrite log
+//
+// -> pDisk = pointer to initialized disk structure
+// <- ERR_OK
+//    ERR_WRITE
+//----------------------------------------------------------------------------
+int ChunkFlush(DISK *pDisk)
+{
+	int i;
+
+	if(NULL==pDisk->pChunkImage) return ERR_OK;
+
+	for(i=0; i<CHUNK_CACHE_SLOTS; i++)
+	{
+		if(!pDisk->pChunkImage->iCacheDirty[i]) continue;
+		if(ERR_OK!=StoreChunkSlot(pDisk, i)) return ERR_WRITE;
+	}
+
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// ChunkGetGeometry
+//
+// Read header and chunk index of a chunk-compressed image, the disk is as
+// large as the header says
+//
+// -> pDisk = pointer to initialized disk structure
+// <- ERR_OK
+//    ERR_READ
+//    ERR_MEM
+//----------------------------------------------------------------------------
+int ChunkGetGeometry(DISK *pDisk)
+{
+	CHUNKIMAGE *pChunk;
+	unsigned char ucHeader[512], *ucEntry;
+	DWORD i, dwBatch, dwFirst, fsl, fsh;
+	__int64 iiFileSize;
+
+	if(NULL==pDisk->pChunkImage)
+	{
+		if(ERR_OK!=ReadAt(pDisk->hHandle, 0, ucHeader, 512)) return ERR_READ;
+		if(!IsChunkImage(ucHeader)) return ERR_READ;
+
+		pChunk = AllocChunkImage(GetDWORD(ucHeader+0x10),
+								 GetDWORD(ucHeader+0x0C));
+		if(NULL==pChunk)
+		{
+			LOG("Error allocating chunk index.\n");
+			return ERR_MEM;
+		}
+
+		// read the index in pieces, the pack buffer is not in use yet
+		ucEntry = pChunk->ucPackBuf;
+		for(dwFirst=0; dwFirst<pChunk->dwChunks; dwFirst+=dwBatch)
+		{
+			dwBatch = pChunk->dwChunkBytes/CHUNK_INDEX_ENTRY;
+			if(dwBatch>pChunk->dwChunks-dwFirst)
+			{
+				dwBatch = pChunk->dwChunks-dwFirst;
+			}
+			if(ERR_OK!=ReadAt(pDisk->hHandle,
+							  512+(__int64)dwFirst*CHUNK_INDEX_ENTRY, ucEntry,
+							  dwBatch*CHUNK_INDEX_ENTRY))
+			{
+				LOG("Error reading chunk index.\n");
+				FreeChunkImage(pChunk);
+				return ERR_READ;
+			}
+			for(i=0; i<dwBatch; i++)
+			{
+				pChunk->iiChunkOffset[dwFirst+i] =
+					GetDWORD(ucEntry+i*CHUNK_INDEX_ENTRY) |
+					((__int64)GetDWORD(ucEntry+i*CHUNK_INDEX_ENTRY+4)<<32);
+				pChunk->dwChunkLength[dwFirst+i] =
+					GetDWORD(ucEntry+i*CHUNK_INDEX_ENTRY+8);
+			}
+		}
+
+		// modified chunks are appended to the end of the file
+		fsl = GetFileSize(pDisk->hHandle, &fsh);
+		iiFileSize = fsl | ((__int64)fsh<<32);
+		if(iiFileSize>pChunk->iiFileEnd) pChunk->iiFileEnd = iiFileSize;
+
+		pDisk->pChunkImage = pChunk;
+	}
+
+	pDisk->DiskGeometry.DiskSize.QuadPart =
+		(__int64)pDisk->pChunkImage->dwBlocks*512;
+
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// ChunkClose
+//
+// Free index and chunk cache, close the image file
+//
+// -> pDisk = pointer to initialized disk structure
+// <- --
+//----------------------------------------------------------------------------
+void ChunkClose(DISK *pDisk)
+{
+	FreeChunkImage(pDisk->pChunkImage);
+	pDisk->pChunkImage = NULL;
+
+	if(INVALID_HANDLE_VALUE!=pDisk->hHandle) CloseHandle(pDisk->hHandle);
+	pDisk->hHandle = INVALID_HANDLE_VALUE;
+}
+
+//----------------------------------------------------------------------------
+// ConvertImageFile
+//
+// Convert an ISO, GKH, BIN, Giebler or chunk-compressed image file into a
+// new chunk-compressed image file. The source is read chunk by chunk
+// through its backend, only one chunk is held in memory. Converting a
+// chunk-compressed image drops the unused data of its rewrite log.
+//
+// -> cSourceName = file name of source image
+//    cDestName = file name of destination image (overwritten)
+// <- ERR_OK
+//    ERR_NOT_OPEN
+//    ERR_NOT_SUPPORTED
+//    ERR_READ
+//    ERR_WRITE
+//    ERR_MEM
+//----------------------------------------------------------------------------
+DLLEXPORT int __stdcall ConvertImageFile(char *cSourceName, char *cDestName)
+{
+	DISK Source;
+	CHUNKIMAGE *pDest = NULL;
+	HANDLE hDest = INVALID_HANDLE_VALUE;
+	unsigned char ucBuf[8*512], ucHeader[512];
+	DWORD dwChunk, dwCount, dwMapLength;
+	int iResult = ERR_OK;
+
+	LOG("ConvertImageFile(\"%s\", \"%s\")\n", cSourceName, cDestName);
+
+	// open and identify the source image
+	memset(&Source, 0, sizeof(DISK));
+	Source.hHandle = CreateFile(cSourceName, GENERIC_READ,
+		FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+	if(INVALID_HANDLE_VALUE==Source.hHandle)
+	{
+		LOG("Could not open source image.\n");
+		return ERR_NOT_OPEN;
+	}
+	Source.iType = TYPE_FILE;
+	Source.iImageType = DetectImageFileType(Source.hHandle, ucBuf,
+		&Source.dwDataOffset, &Source.dwGieblerMapOffset);
+	if((IMAGE_FILE_UNKNOWN==Source.iImageType)||
+	   (ERR_OK!=SelectBackend(&Source)))
+	{
+		CloseHandle(Source.hHandle);
+		return ERR_NOT_SUPPORTED;
+	}
+
+	// disk size from the DeviceID block
+	Source.dwBlocks = ucBuf[17+512] + (ucBuf[16+512]<<8) +
+					  (ucBuf[15+512]<<16) + (ucBuf[14+512]<<24);
+	if(0==Source.dwBlocks) iResult = ERR_NOT_SUPPORTED;
+	if(ERR_OK==iResult) iResult = Source.pBackend->GetGeometry(&Source);
+
+	// Giebler images need their allocation bitmap
+	if((ERR_OK==iResult)&&(IMAGE_FILE_GIEBLER==Source.iImageType))
+	{
+		dwMapLength = (0x60==Source.dwGieblerMapOffset)?400:200;
+		Source.ucGieblerMap = malloc(dwMapLength);
+		if(NULL==Source.ucGieblerMap) iResult = ERR_MEM;
+		else if(ERR_OK!=ReadAt(Source.hHandle, Source.dwGieblerMapOffset,
+							   Source.ucGieblerMap, dwMapLength))
+		{
+			iResult = ERR_READ;
+		}
+		else iResult = DecodeGieblerMap(&Source);
+	}
+
+	// create the destination image
+	if(ERR_OK==iResult)
+	{
+		pDest = AllocChunkImage(Source.dwBlocks, CHUNK_IMAGE_BLOCKS);
+		if(NULL==pDest) iResult = ERR_MEM;
+	}
+	if(ERR_OK==iResult)
+	{
+		hDest = CreateFile(cDestName, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+			CREATE_ALWAYS, 0, NULL);
+		if(INVALID_HANDLE_VALUE==hDest)
+		{
+			LOG("Could not create destination image.\n");
+			iResult = ERR_NOT_OPEN;
+		}
+	}
+
+	// convert chunk by chunk, the first cache slot is the chunk buffer
+	for(dwChunk=0; (ERR_OK==iResult)&&(dwChunk<pDest->dwChunks); dwChunk++)
+	{
+		dwCount = Source.dwBlocks - dwChunk*pDest->dwChunkBlocks;
+		if(dwCount>pDest->dwChunkBlocks) dwCount = pDest->dwChunkBlocks;
+
+		memset(pDest->ucCache, 0, pDest->dwChunkBytes);
+		if(ERR_OK!=Source.pBackend->ReadBlocks(&Source,
+			dwChunk*pDest->dwChunkBlocks, dwCount, pDest->ucCache))
+		{
+			LOG("Error reading source image at block %d.\n",
+				dwChunk*pDest->dwChunkBlocks);
+			iResult = ERR_READ;
+			break;
+		}
+		iResult = AppendChunk(pDest, hDest, dwChunk, pDest->ucCache);
+	}
+
+	// write index and header (last, an aborted file is not recognized)
+	if(ERR_OK==iResult)
+	{
+		iResult = WriteChunkIndex(pDest, hDest, 0, pDest->dwChunks);
+	}
+	if(ERR_OK==iResult)
+	{
+		memset(ucHeader, 0, 512);
+		memcpy(ucHeader, CHUNK_IMAGE_MAGIC, 8);
+		PutDWORD(ucHeader+0x08, CHUNK_IMAGE_VERSION);
+		PutDWORD(ucHeader+0x0C, pDest->dwChunkBlocks);
+		PutDWORD(ucHeader+0x10, pDest->dwBlocks);
+		PutDWORD(ucHeader+0x14, pDest->dwChunks);
+		iResult = WriteAt(hDest, 0, ucHeader, 512);
+	}
+
+	if(INVALID_HANDLE_VALUE!=hDest) CloseHandle(hDest);
+	FreeChunkImage(pDest);
+	if(Source.ucGieblerMap) free(Source.ucGieblerMap);
+	if(Source.dwGieblerOffset) free(Source.dwGieblerOffset);
+	if(Source.ucSectorBuf) free(Source.ucSectorBuf);
+	Source.pBackend->Close(&Source);
+
+	LOG("ConvertImageFile(): %d\n", iResult);
+	return iResult;
+}
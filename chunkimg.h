@@ -0,0 +1,99 @@
+//----------------------------------------------------------------------------
+// EnsoniqFS plugin for TotalCommander
+//
+// CHUNK-COMPRESSED IMAGE FILES header file
+//----------------------------------------------------------------------------
+//
+// (c) 2006 Thoralt Franz
+//
+// This source code was written using Dev-Cpp 4.9.9.2
+// If you want to compile it, get Dev-Cpp. Normally the code should compile
+// with other IDEs/compilers too (with small modifications), but I did not
+// test it.
+//
+//----------------------------------------------------------------------------
+// License
+//----------------------------------------------------------------------------
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, 
+// MA  02110-1301, USA.
+// 
+// Alternatively, download a copy of the license here:
+// http://www.gnu.org/licenses/gpl.txt
+//----------------------------------------------------------------------------
+#ifndef _CHUNKIMG_H_
+#define _CHUNKIMG_H_
+
+#include "error.h"
+#include "log.h"
+#include "disk.h"
+
+//----------------------------------------------------------------------------
+// chunk-compressed image file format
+//
+// block 0      header (all values little endian)
+//              0x00  "EFSCHUNK"
+//              0x08  format version (CHUNK_IMAGE_VERSION)
+//              0x0C  blocks per chunk
+//              0x10  number of blocks of the disk
+//              0x14  number of chunks
+// block 1...   chunk index, CHUNK_INDEX_ENTRY bytes per chunk:
+//              0x00  file offset of the chunk data (64 bit)
+//              0x08  length of the chunk data
+// behind index chunk data
+//
+// A length of 0 means the chunk is all zero and not stored, a length of
+// one whole chunk means the chunk is stored uncompressed, everything else is
+// PackBits compressed. Modified chunks are appended to the end of the file
+// (rewrite log) and their index entry is updated, the old data stays unused
+// until the image is converted again.
+//----------------------------------------------------------------------------
+#define CHUNK_IMAGE_MAGIC	"EFSCHUNK"
+#define CHUNK_IMAGE_VERSION	1
+#define CHUNK_IMAGE_BLOCKS	128		// blocks per chunk (64 KB)
+#define CHUNK_INDEX_ENTRY	12		// bytes per chunk index entry
+#define CHUNK_CACHE_SLOTS	8		// decompressed chunks kept in memory
+
+typedef struct _CHUNKIMAGE
+{
+	DWORD dwChunkBlocks;		// blocks per chunk
+	DWORD dwChunkBytes;			// bytes per chunk
+	DWORD dwBlocks;				// number of blocks of the disk
+	DWORD dwChunks;				// number of chunks
+	__int64 *iiChunkOffset;		// file offset of each chunk
+	DWORD *dwChunkLength;		// stored length of each chunk
+	__int64 iiFileEnd;			// append position of the rewrite log
+	unsigned char *ucPackBuf;	// compressed data of one chunk
+	unsigned char *ucCache;		// decompressed chunks
+	DWORD dwCacheChunk[CHUNK_CACHE_SLOTS];	// which chunk is in each slot?
+	DWORD dwCacheAge[CHUNK_CACHE_SLOTS];	// last access of each slot
+	int iCacheDirty[CHUNK_CACHE_SLOTS];		// slot modified?
+	DWORD dwAge;				// access counter
+} CHUNKIMAGE;
+
+//----------------------------------------------------------------------------
+// Prototypes
+//----------------------------------------------------------------------------
+int IsChunkImage(unsigned char *ucHeader);
+int ReadChunkImageStart(HANDLE h, unsigned char *ucBuf, DWORD dwBytes);
+int ChunkReadBlocks(DISK *pDisk, DWORD dwBlock, DWORD dwNumBlocks,
+	unsigned char *ucBuf);
+int ChunkWriteBlocks(DISK *pDisk, DWORD dwBlock, DWORD dwNumBlocks,
+	unsigned char *ucBuf);
+int ChunkFlush(DISK *pDisk);
+int ChunkGetGeometry(DISK *pDisk);
+void ChunkClose(DISK *pDisk);
+DLLEXPORT int __stdcall ConvertImageFile(char *cSourceName, char *cDestName);
+
+#endif
@@ -37,6 +37,9 @@
 #include "error.h"
 #include "disk.h"
 #include "cache.h"
+#include "freespace.h"
+#include "backend.h"
+#include "chunkimg.h"
 #include "progressdlg.h"
 #include "fsplugin.h"
 #include "ini.h"
@@ -55,6 +58,12 @@ extern int g_iOptionEnableImages;
 extern int g_iOptionEnablePhysicalDisks;
 extern int g_iOptionAutomaticRescan;
 extern int g_iOptionEnableLogging;
+extern int g_iOptionReadAheadFloppy;
+extern int g_iOptionReadAheadCDROM;
+extern int g_iOptionReadAheadDisk;
+extern int g_iOptionReadAheadImage;
+extern int g_iOptionIdleTimeout;
+extern int g_iOptionCachePolicy;
 
 //----------------------------------------------------------------------------
 // GetShortEnsoniqFiletype
@@ -124,7 +133,7 @@ void GetShortEnsoniqFiletype(unsigned char ucType, char *cType)
 //----------------------------------------------------------------------------
 // GetNextFreeBlock
 // 
-// Find the next free block in the FAT
+// Find the next free block in the FAT (using the free space index)
 // 
 // -> pDisk = pointer to initialized disk structure
 //    iStartingBlock = first block to test if free
@@ -133,26 +142,18 @@ void GetShortEnsoniqFiletype(unsigned char ucType, char *cType)
 //----------------------------------------------------------------------------
 int GetNextFreeBlock(DISK *pDisk, int iStartingBlock)
 {
-	int iBlock;
-	DWORD i;
+	if(iStartingBlock<0) iStartingBlock = 0;
+	if(ERR_OK!=FreeSpaceBuild(pDisk)) return 0;
 
-	// loop through all FAT entries	
-	for(i=iStartingBlock; i<pDisk->dwBlocks; i++)
-	{
-		iBlock = GetFATEntry(pDisk, i);
-		if(-1==iBlock) return 0;
-		
-		// free block?
-		if(0==iBlock) return i;
-	}
-		
-	return 0;
+	return FreeSpaceFindNext(pDisk, iStartingBlock);
 }
 
 //----------------------------------------------------------------------------
 // GetContiguousBlocks
 // 
-// Try to find <dwNumBlocks> contiguous free blocks from FAT
+// Try to find <dwNumBlocks> contiguous free blocks from FAT. The smallest
+// free extent which is large enough is taken from the free space index, so
+// small holes get filled up before large extents are split.
 // 
 // -> pDisk = pointer to initialized disk structure
 //    dwNumBlocks = number of free blocks to find
@@ -161,84 +162,175 @@ int GetNextFreeBlock(DISK *pDisk, int iStartingBlock)
 //----------------------------------------------------------------------------
 int GetContiguousBlocks(DISK *pDisk, DWORD dwNumBlocks)
 {
-	static int iRecursiveCounter = 0;
-	DWORD i, dwStart = 0, dwCount = 0;
-	int iBlock;
+	DWORD dwStart;
 
-	iRecursiveCounter++;
 	LOG("GetContiguousBlocks(%d): ", dwNumBlocks);
 	
-	// loop through all FAT entries	
-	for(i=pDisk->dwLastFreeFATEntry; i<pDisk->dwBlocks; i++)
+	if(ERR_OK!=FreeSpaceBuild(pDisk))
 	{
-		iBlock = GetFATEntry(pDisk, i);
-		if(-1==iBlock)
-		{
-			LOG("failed.\n");
-			iRecursiveCounter--;
-			return 0;
-		}
-		
-		// free block?
-		if(0==iBlock)
-		{
-			// first free block?
-			if(0==dwCount) dwStart = i;
-			
-			dwCount++;
+		LOG("failed.\n");
+		return 0;
+	}
+	
+	dwStart = FreeSpaceFindContiguous(pDisk, dwNumBlocks);
+	if(0==dwStart)
+	{
+		LOG("failed.\n");
+		return 0;
+	}
+	
+	LOG("OK.\n");
+	return dwStart;
+}
 
-			// did we find enough?
-			if(dwCount>=dwNumBlocks)
-			{
-				LOG("OK.\n");
-				
-				// memorize last free FAT entry after the currently found
-				// blocks, so next time we search for a free block, we don't
-				// have to start from block #0
-				// the tradeoff: there will be holes inside the used blocks
-				// (everytime when a large file is allocated, all smaller
-				// chunks before that file will be skipped)
-				pDisk->dwLastFreeFATEntry = dwStart + dwNumBlocks;
-				iRecursiveCounter--;
-				return dwStart;
-			}
+//----------------------------------------------------------------------------
+// AdaptReadAhead
+// 
+// Adapt the read ahead size of a disk to the access pattern. A cache miss
+// right behind the previous read means sequential access and doubles the
+// read ahead, any other miss halves it. The maximum depends on the media
+// type (options ReadAheadFloppy, ReadAheadCDROM, ReadAheadDisk and
+// ReadAheadImage).
+// 
+// -> pDisk = pointer to initialized disk structure
+//    dwBlock = block which was not found in the cache
+// <- --
+//----------------------------------------------------------------------------
+static void AdaptReadAhead(DISK *pDisk, DWORD dwBlock)
+{
+	int iMax;
+	
+	switch(pDisk->iType)
+	{
+		case TYPE_FLOPPY:
+			iMax = g_iOptionReadAheadFloppy;
+			break;
+		case TYPE_CDROM:
+			iMax = g_iOptionReadAheadCDROM;
+			break;
+		case TYPE_FILE:
+			iMax = g_iOptionReadAheadImage;
+			break;
+		default:
+			iMax = g_iOptionReadAheadDisk;
+			break;
+	}
+	if(iMax>READ_AHEAD_MAX) iMax = READ_AHEAD_MAX;
+	if(iMax>(int)(pDisk->dwCacheSlots/2)) iMax = pDisk->dwCacheSlots/2;
+	if(iMax<READ_AHEAD_MIN) iMax = READ_AHEAD_MIN;
+	
+	if(dwBlock==pDisk->dwReadAheadNext) pDisk->dwReadAhead *= 2;
+	else pDisk->dwReadAhead /= 2;
+	
+	if(pDisk->dwReadAhead<READ_AHEAD_MIN) pDisk->dwReadAhead = READ_AHEAD_MIN;
+	if(pDisk->dwReadAhead>(DWORD)iMax) pDisk->dwReadAhead = iMax;
+}
+
+//----------------------------------------------------------------------------
+// DecodeGieblerMap
+// 
+// Decode the allocation bitmap of a Giebler image into a table holding the
+// file offset of every block. Blocks whose bit is set are not stored in the
+// image and read as zeroes, they get GIEBLER_ZERO_BLOCK as offset.
+// 
+// -> pDisk = pointer to disk structure with ucGieblerMap loaded
+// <- ERR_OK
+//    ERR_MEM
+//    ERR_NOT_SUPPORTED
+//----------------------------------------------------------------------------
+int DecodeGieblerMap(DISK *pDisk)
+{
+	DWORD i, dwOffset;
+	
+	if(NULL==pDisk->ucGieblerMap) return ERR_NOT_SUPPORTED;
+	
+	pDisk->dwGieblerBlocks = (0x60==pDisk->dwGieblerMapOffset)?3200:1600;
+	if(NULL==pDisk->dwGieblerOffset)
+	{
+		pDisk->dwGieblerOffset = malloc(pDisk->dwGieblerBlocks*sizeof(DWORD));
+		if(NULL==pDisk->dwGieblerOffset) return ERR_MEM;
+	}
+	
+	// the image data starts right behind the header block, blocks follow
+	// each other in the order of their cleared bits
+	dwOffset = 512;
+	for(i=0; i<pDisk->dwGieblerBlocks; i++)
+	{
+		if((pDisk->ucGieblerMap[i>>3]>>(7-(i&0x07)))&0x01)
+		{
+			pDisk->dwGieblerOffset[i] = GIEBLER_ZERO_BLOCK;
 		}
 		else
 		{
-			// reset counter because contiguous stream was interrupted
-			// by a used block
-			dwCount = 0;
+			pDisk->dwGieblerOffset[i] = dwOffset;
+			dwOffset += 512;
 		}
 	}
 	
-	// if we end up here, there's (a) no contiguous blocks of the requested
-	// size on that disk or (b) due to the use of pDisk->dwLastFreeFATEntry
-	// we skipped a few "holes" which could possibly be enough for this
-	// particular file -> so we start _one_ additional search from the
-	// beginning (recursive one level deep)
-	pDisk->dwLastFreeFATEntry = 0;
-	if(1==iRecursiveCounter)
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// IsFreeBlock
+// 
+// Check if a block is free in the FAT and can be read as zeroes. Only FAT
+// blocks which are decoded already are looked at (no I/O), blocks written
+// since the disk was mounted are never treated as free (their FAT entry may
+// be set later).
+// 
+// -> pDisk = pointer to initialized disk structure
+//    dwBlock = block to check
+// <- 1 = free block, 0 = used or unknown
+//----------------------------------------------------------------------------
+static int IsFreeBlock(DISK *pDisk, DWORD dwBlock)
+{
+	if((NULL==pDisk->ucFATLoaded)||(dwBlock>=pDisk->dwBlocks)) return 0;
+	if(!pDisk->ucFATLoaded[dwBlock/170]) return 0;
+	if(0!=pDisk->dwFAT[dwBlock]) return 0;
+	if(pDisk->ucBlockWritten&&
+	   ((pDisk->ucBlockWritten[dwBlock>>3]>>(dwBlock&0x07))&0x01))
+	{
+		return 0;
+	}
+	
+	return 1;
+}
+
+//----------------------------------------------------------------------------
+// MarkBlocksWritten
+// 
+// Remember that blocks have been written since the disk was mounted
+// 
+// -> pDisk = pointer to initialized disk structure
+//    dwBlock = first block written
+//    dwNumBlocks = number of blocks written
+// <- ERR_OK
+//    ERR_MEM
+//----------------------------------------------------------------------------
+static int MarkBlocksWritten(DISK *pDisk, DWORD dwBlock, DWORD dwNumBlocks)
+{
+	if(NULL==pDisk->ucBlockWritten)
+	{
+		pDisk->ucBlockWritten = malloc(pDisk->dwPhysicalBlocks/8 + 1);
+		if(NULL==pDisk->ucBlockWritten) return ERR_MEM;
+		memset(pDisk->ucBlockWritten, 0, pDisk->dwPhysicalBlocks/8 + 1);
+	}
+	
+	for(; dwNumBlocks>0; dwNumBlocks--, dwBlock++)
 	{
-		dwStart = GetContiguousBlocks(pDisk, dwNumBlocks);
-		if(0!=dwStart)
-		{
-			pDisk->dwLastFreeFATEntry = dwStart + dwNumBlocks;
-			iRecursiveCounter--;
-			return dwStart;
-		}
+		pDisk->ucBlockWritten[dwBlock>>3] |= 1<<(dwBlock&0x07);
 	}
 	
-	LOG("failed.\n");
-	iRecursiveCounter--;
-	return 0;
+	return ERR_OK;
 }
 
 //----------------------------------------------------------------------------
-// ReadBlock
+// ReadBlockLocked
 // 
 // Reads one block from CDROM, harddisk or image file
 // Get this block out of the cache, if possible
-// If not, read a minimum of READ_AHEAD blocks into cache
+// Free blocks (according to the FAT) are returned as zeroes without I/O
+// If not, read the block and the adaptive read ahead behind it into cache
 // 
 // -> pDisk = pointer to initialized disk structure
 //    dwBlock = block to read
@@ -249,256 +341,116 @@ int GetContiguousBlocks(DISK *pDisk, DWORD dwNumBlocks)
 //    ERR_READ
 //    ERR_MEM
 //    ERR_NOT_SUPPORTED
-//	  ERR_SEEK
 //----------------------------------------------------------------------------
-int ReadBlock(DISK *pDisk, DWORD dwBlock, unsigned char *ucBuf)
+static int ReadBlockLocked(DISK *pDisk, DWORD dwBlock, unsigned char *ucBuf)
 {
-	DWORD dwBytesRead = 0, dwFirstBlock, dwBlocksToRead, dwLow, dwHigh,
-		dwError, dwCurrentBlock, dwBlocks;
-	unsigned char *ucTemp, *ucTempUnaligned;
-	__int64 iiFilepointer;
-	int i, iResult, iCount, iLen, j, iOffset;
+	DWORD dwFirstBlock, dwBlocksToRead, dwBlocks;
+	unsigned char *ucTemp;
+	int i, iResult;
 
 	// check pointer
 	if(NULL==pDisk) return ERR_NOT_OPEN;
 
 	// check device status
-	if(INVALID_HANDLE_VALUE==pDisk->hHandle) return ERR_NOT_OPEN;
+	if(NULL==pDisk->pBackend) return ERR_NOT_OPEN;
 
 	// check boundaries
 	if(dwBlock>=pDisk->dwPhysicalBlocks) return ERR_OUT_OF_BOUNDS;
 
+	// open the device on first access
+	iResult = ActivateDisk(pDisk);
+	if(ERR_OK!=iResult) return iResult;
+	pDisk->iiBytesRead += 512;
+
+	// mapped image files and images in memory do not use the cache
+	if(pDisk->ucMapView||pDisk->ucRamImage) 
+		return pDisk->pBackend->ReadBlocks(pDisk, dwBlock, 1, ucBuf);
+
 	// try to read this block from cache
 	if(ERR_OK==CacheReadBlock(pDisk, dwBlock, ucBuf)) return ERR_OK;
 
-	// -> block not in cache, so read number of READ_AHEAD blocks into cache
-
-	// buffer has to be aligned at a 2048 byte boundary minimum
-	// this is necessary for successfully reading from CDROM devices
-	ucTempUnaligned = malloc(READ_AHEAD*512+2048);
-	if(NULL==ucTempUnaligned)
+	// free blocks are not read and not cached
+	if(IsFreeBlock(pDisk, dwBlock))
 	{
-		LOG("ReadFile(): ERR_MEM "
-			"(error allocating read ahead sector buffer.\n");
-		return ERR_MEM;
+		memset(ucBuf, 0, 512);
+		pDisk->dwFreeBlockReads++;
+		return ERR_OK;
 	}
-	ucTemp = ucTempUnaligned;
-	while(0!=((DWORD)ucTemp & (DWORD)2047)) ucTemp++;
 
-	dwBlocksToRead = READ_AHEAD;
+	// -> block not in cache, so read a number of blocks ahead into cache
+	AdaptReadAhead(pDisk, dwBlock);
+	dwBlocksToRead = pDisk->dwReadAhead;
 	dwFirstBlock = dwBlock;
 
-	// handle CDROM, Floppy and other disks with the same functions
-	if((TYPE_CDROM==pDisk->iType)
-	   ||(TYPE_DISK==pDisk->iType)
-	   ||(TYPE_FLOPPY==pDisk->iType))
+	// treat floppy differently (read complete tracks)
+	if(TYPE_FLOPPY==pDisk->iType)
 	{
-		// fall back to a 2048 byte boundary for CDROM access to work
-		if(TYPE_CDROM==pDisk->iType) dwFirstBlock = (dwBlock&0xFFFFFFFC);
-
-		// treat floppy differently (read complete track)
-		if(TYPE_FLOPPY==pDisk->iType)
-		{
-			dwBlocksToRead = pDisk->DiskGeometry.Geometry.SectorsPerTrack;
-			dwFirstBlock -= dwFirstBlock % dwBlocksToRead;
-		}
-		
-		// check physical limits
-		if((dwFirstBlock+dwBlocksToRead)>=pDisk->dwPhysicalBlocks)
-		{
-			dwBlocksToRead = pDisk->dwPhysicalBlocks - dwFirstBlock;
-		}
-		
-		// set file pointer
-		iiFilepointer = dwFirstBlock; iiFilepointer *= 512;
-		dwLow = iiFilepointer & 0xFFFFFFFF;
-		dwHigh = (iiFilepointer >> 32) & 0xFFFFFFFF;
-		if(0xFFFFFFFF==SetFilePointer(pDisk->hHandle, dwLow, &dwHigh, 
-			FILE_BEGIN))
-		{
-			dwError = GetLastError();
-			if(NO_ERROR != dwError)
-			{
-				LOG("ReadBlock(): ERR_SEEK\n"); LOG_ERR(dwError);
-				free(ucTempUnaligned);
-				return ERR_SEEK;
-			}
-		}		
-		
-		// read from device
-		iResult=ReadFile(pDisk->hHandle, ucTemp, dwBlocksToRead*512,
-						 &dwBytesRead, 0);
-		if((iResult==0)||((dwBlocksToRead*512)!=dwBytesRead))
-		{
-			LOG("ReadBlock(): ERR_READ\n");
-			free(ucTempUnaligned);
-			return ERR_READ;
-		}
+		dwBlocks = pDisk->DiskGeometry.Geometry.SectorsPerTrack;
+		if(dwBlocksToRead<dwBlocks) dwBlocksToRead = dwBlocks;
+		dwBlocksToRead -= dwBlocksToRead % dwBlocks;
+		dwFirstBlock -= dwFirstBlock % dwBlocks;
 	}
-	else if(TYPE_FILE==pDisk->iType)
+
+	// make sure the read ahead buffer is large enough
+	if(dwBlocksToRead>pDisk->dwReadAheadBufSize)
 	{
-		// check physical limits
-		if((dwFirstBlock+dwBlocksToRead)>=pDisk->dwPhysicalBlocks)
+		if(pDisk->ucReadAheadBuf) free(pDisk->ucReadAheadBuf);
+		pDisk->dwReadAheadBufSize = 0;
+		pDisk->ucReadAheadBuf = malloc(dwBlocksToRead*512+2048);
+		if(NULL==pDisk->ucReadAheadBuf)
 		{
-			dwBlocksToRead = pDisk->dwPhysicalBlocks - dwFirstBlock;
+			LOG("ReadBlock(): ERR_MEM "
+				"(error allocating read ahead sector buffer.\n");
+			return ERR_MEM;
 		}
+		pDisk->dwReadAheadBufSize = dwBlocksToRead;
+	}
 
-		// read from ISO or GKH image
-		if((IMAGE_FILE_ISO==pDisk->iImageType)||
-		   (IMAGE_FILE_GKH==pDisk->iImageType))
-		{
-			// set file pointer
-			iiFilepointer = dwFirstBlock; iiFilepointer *= 512;
-			iiFilepointer += pDisk->dwDataOffset;
-			
-			dwLow = iiFilepointer & 0xFFFFFFFF;
-			dwHigh = (iiFilepointer >> 32) & 0xFFFFFFFF;
-			if(0xFFFFFFFF==SetFilePointer(pDisk->hHandle, dwLow, &dwHigh, 
-				FILE_BEGIN))
-			{
-				dwError = GetLastError();
-				if(NO_ERROR != dwError)
-				{
-					LOG("ReadBlock(): ERR_SEEK\n"); LOG_ERR(dwError);
-					free(ucTempUnaligned);
-					return ERR_SEEK;
-				}
-			}		
-			
-			// read from device
-			iResult=ReadFile(pDisk->hHandle, ucTemp, dwBlocksToRead*512,
-							 &dwBytesRead, 0);
-			if((iResult==0)||((dwBlocksToRead*512)!=dwBytesRead))
-			{
-				LOG("ReadBlock(): ERR_READ\n");
-				free(ucTempUnaligned);
-				return ERR_READ;
-			}
-		}
+	// buffer has to be aligned at a 2048 byte boundary minimum
+	// this is necessary for successfully reading from CDROM devices
+	ucTemp = pDisk->ucReadAheadBuf;
+	while(0!=((DWORD)ucTemp & (DWORD)2047)) ucTemp++;
 
-		// read from MODE1 CD image
-		else if(IMAGE_FILE_MODE1==pDisk->iImageType)
-		{
-			// fall back to a 2048 byte boundary for to match the first
-			// 2352 byte sector
-			dwFirstBlock = (dwFirstBlock&0xFFFFFFFC);
-			dwCurrentBlock = dwFirstBlock;
-			i = 0;
-			
-			// read 4 blocks at a time (= one sector)
-			while(dwCurrentBlock<(dwFirstBlock + dwBlocksToRead))
-			{
-				// set file pointer
-				iiFilepointer = dwCurrentBlock;
-				
-				// iiFilepointer is guaranteed to be at a 4 block boundary,
-				// so there's no need to add the remainder from the >>2
-				// operation to the pointer
-				iiFilepointer = (iiFilepointer>>2)*2352 + 16;
-				dwLow = iiFilepointer & 0xFFFFFFFF;
-				dwHigh = (iiFilepointer >> 32) & 0xFFFFFFFF;
-				if(0xFFFFFFFF==SetFilePointer(pDisk->hHandle, dwLow, &dwHigh, 
-					FILE_BEGIN))
-				{
-					dwError = GetLastError();
-					if(NO_ERROR != dwError)
-					{
-						LOG("ReadBlock(): ERR_SEEK\n"); LOG_ERR(dwError);
-						free(ucTempUnaligned);
-						return ERR_SEEK;
-					}
-				}		
+	// CDROM devices and Mode1 images are read in whole 2048 byte sectors
+	if((TYPE_CDROM==pDisk->iType)||
+	   ((TYPE_FILE==pDisk->iType)&&(IMAGE_FILE_MODE1==pDisk->iImageType)))
+	{
+		dwFirstBlock = (dwFirstBlock&0xFFFFFFFC);
+	}
 
-				// read 4 blocks if possible
-				dwBlocks = 4; 
-				while((dwCurrentBlock+dwBlocks)>(dwFirstBlock+dwBlocksToRead))
-					dwBlocks--;
-					
-				// read from device
-				iResult=ReadFile(pDisk->hHandle, ucTemp + i*512, dwBlocks*512,
-								 &dwBytesRead, 0);
-				if((iResult==0)||((dwBlocks*512)!=dwBytesRead))
-				{
-					LOG("ReadBlock(): ERR_READ\n");
-					free(ucTempUnaligned);
-					return ERR_READ;
-				}
-				
-				dwCurrentBlock += dwBlocks;
-				i += dwBlocks;
-			}
-		}
-		
-		// read from Giebler image
-		else if(IMAGE_FILE_GIEBLER==pDisk->iImageType)
+	// check physical limits
+	if((dwFirstBlock+dwBlocksToRead)>=pDisk->dwPhysicalBlocks)
+	{
+		dwBlocksToRead = pDisk->dwPhysicalBlocks - dwFirstBlock;
+	}
+	
+	// stop reading ahead at the next free block (floppies and CDROMs are
+	// still read in whole tracks and sectors)
+	if((TYPE_DISK==pDisk->iType)||(TYPE_FILE==pDisk->iType))
+	{
+		for(dwBlocks=dwBlock-dwFirstBlock+1; dwBlocks<dwBlocksToRead; 
+			dwBlocks++)
 		{
-			if(NULL==pDisk->ucGieblerMap)
-			{
-				free(ucTempUnaligned);
-				return ERR_NOT_SUPPORTED;
-			}
-			
-			iLen = (0x60==pDisk->dwGieblerMapOffset)?3200:1600;
-
-			// find the block in the allocation bitmap
-			for(j=0; j<(int)dwBlocksToRead; j++)
+			if(IsFreeBlock(pDisk, dwFirstBlock+dwBlocks))
 			{
-				iOffset = -1; iCount = 0; 
-				for(i=0; i<iLen; i++)
-				{
-					// get the corresponding bit from the Giebler bitmap table
-					// if the bit == 0, then this block is included in the file
-				    if(!((pDisk->ucGieblerMap[i>>3]>>(7-(i&0x07)))&0x01))
-					{
-					    // block found?
-					    if(i==((int)dwFirstBlock+j))
-					    {
-							iOffset = iCount*512 + 512;
-							break;
-						}
-						iCount++;
-					}
-				}
-				
-				// block not found?
-				if(iOffset==-1)
-				{
-					memset(ucTemp+j*512, 0, 512);
-				}
-				else
-				{
-					// seek to offset (no 64 bit pointer required since
-					// Giebler files won't be bigger than an HD floppy)
-					SetFilePointer(pDisk->hHandle, iOffset, 0, FILE_BEGIN);
-
-					// read one block
-					iResult=ReadFile(pDisk->hHandle, ucTemp+j*512, 512,
-									 &dwBytesRead, 0);
-					if((iResult==0)||(512!=dwBytesRead))
-					{
-						LOG("ReadBlock(): ERR_READ\n");
-						free(ucTempUnaligned);
-						return ERR_READ;
-					}
-				}
+				dwBlocksToRead = dwBlocks;
+				break;
 			}
 		}
-		else
-		{
-			free(ucTempUnaligned);
-			return ERR_NOT_SUPPORTED;
-		}
-	}
-	else
-	{
-		free(ucTempUnaligned);
-		return ERR_NOT_SUPPORTED;
 	}
+	
+	// read from device or image file
+	iResult = BackendRead(pDisk, dwFirstBlock, dwBlocksToRead, ucTemp);
+	if(ERR_OK!=iResult) return iResult;
+
+	// remember where this read ended to detect sequential access
+	pDisk->dwReadAheadNext = dwFirstBlock + dwBlocksToRead;
 
 	// add freshly read blocks to the cache
 	for(i=0; i<(int)dwBlocksToRead; i++)
 	{
-		CacheInsertReadBlock(pDisk, dwFirstBlock+i, ucTemp + i*512);
+		CacheInsertReadBlock(pDisk, dwFirstBlock+i, ucTemp + i*512,
+			(dwFirstBlock+i)!=dwBlock);
 
 		// is this the block we originally wanted to have?
 		if((dwFirstBlock+i)==dwBlock)
@@ -508,16 +460,37 @@ int ReadBlock(DISK *pDisk, DWORD dwBlock, unsigned char *ucBuf)
 		}
 	}
 
-	free(ucTempUnaligned);
 	pDisk->dwReadCounter++;
 	
 	return ERR_OK;
 }
 
 //----------------------------------------------------------------------------
-// ReadBlocks
+// ReadBlock
+//
+// Call ReadBlockLocked() with the lock of the disk held
+//
+// -> and <- see ReadBlockLocked()
+//----------------------------------------------------------------------------
+int ReadBlock(DISK *pDisk, DWORD dwBlock, unsigned char *ucBuf)
+{
+	int iResult;
+	
+	if(NULL==pDisk) return ERR_NOT_OPEN;
+	EnterCriticalSection(&pDisk->csLock);
+	iResult = ReadBlockLocked(pDisk, dwBlock, ucBuf);
+	LeaveCriticalSection(&pDisk->csLock);
+	return iResult;
+}
+
+//----------------------------------------------------------------------------
+// ReadBlocksLocked
 // 
-// Read multiple blocks from CDROM, harddisk or image file
+// Read multiple blocks from CDROM, harddisk or image file. On ISO, GKH and
+// Mode1 image files, ranges of at least DIRECT_READ_MIN blocks which are not
+// in the cache are read straight into the destination buffer without
+// filling the cache (free blocks in these ranges are not read, they are
+// returned as zeroes). All other blocks are read through the cache.
 // 
 // -> pDisk = pointer to initialized disk structure
 //    dwBlock = first block to read
@@ -529,24 +502,107 @@ int ReadBlock(DISK *pDisk, DWORD dwBlock, unsigned char *ucBuf)
 //    ERR_READ
 //    ERR_MEM
 //    ERR_NOT_SUPPORTED
-//    ERR_SEEK
 //----------------------------------------------------------------------------
-DLLEXPORT int __stdcall ReadBlocks(DISK *pDisk, DWORD dwBlock, DWORD dwNumBlocks,
-			   unsigned char *ucBuf)
+static int ReadBlocksLocked(DISK *pDisk, DWORD dwBlock, DWORD dwNumBlocks,
+	unsigned char *ucBuf)
 {
-	int i, iResult;
+	DWORD i, j, dwRun, dwUsed;
+	int iResult, iDirect;
 	
-	for(i=0; i<(int)dwNumBlocks; i++)
+	// check pointer and device status
+	if(NULL==pDisk) return ERR_NOT_OPEN;
+	if(NULL==pDisk->pBackend) return ERR_NOT_OPEN;
+
+	// open the device on first access
+	iResult = ActivateDisk(pDisk);
+	if(ERR_OK!=iResult) return iResult;
+
+	// mapped image files and images in memory are read in one go
+	if(pDisk->ucMapView||pDisk->ucRamImage)
+	{
+		if(dwBlock+dwNumBlocks>pDisk->dwPhysicalBlocks) 
+			return ERR_OUT_OF_BOUNDS;
+		iResult = pDisk->pBackend->ReadBlocks(pDisk, dwBlock, dwNumBlocks, 
+			ucBuf);
+		if(ERR_OK!=iResult) return iResult;
+		pDisk->dwReadCounter++;
+		pDisk->iiBytesRead += (__int64)dwNumBlocks*512;
+		return ERR_OK;
+	}
+
+	// direct reads are possible from plain image files only
+	iDirect = (dwNumBlocks>=DIRECT_READ_MIN)&&(TYPE_FILE==pDisk->iType)&&
+		((IMAGE_FILE_ISO==pDisk->iImageType)||
+		 (IMAGE_FILE_GKH==pDisk->iImageType)||
+		 (IMAGE_FILE_MODE1==pDisk->iImageType));
+	
+	i = 0;
+	while(i<dwNumBlocks)
 	{
+		if(iDirect)
+		{
+			// count uncached blocks starting here
+			for(dwRun=0; (i+dwRun<dwNumBlocks)&&
+				(!CacheContainsBlock(pDisk, dwBlock+i+dwRun)); dwRun++);
+			
+			// long uncached range -> read it directly
+			if(dwRun>=DIRECT_READ_MIN)
+			{
+				if(dwBlock+i+dwRun>pDisk->dwPhysicalBlocks) 
+					return ERR_OUT_OF_BOUNDS;
+				
+				// skip free blocks, read the used ones in between
+				for(j=i; j<i+dwRun; j+=dwUsed)
+				{
+					if(IsFreeBlock(pDisk, dwBlock+j))
+					{
+						memset(ucBuf+j*512, 0, 512);
+						pDisk->dwFreeBlockReads++;
+						dwUsed = 1;
+						continue;
+					}
+					for(dwUsed=1; (j+dwUsed<i+dwRun)&&
+						(!IsFreeBlock(pDisk, dwBlock+j+dwUsed)); dwUsed++);
+					iResult = BackendRead(pDisk, dwBlock+j, dwUsed, 
+						ucBuf+j*512);
+					if(ERR_OK!=iResult) return iResult;
+				}
+				pDisk->dwReadCounter++;
+				pDisk->iiBytesRead += (__int64)dwRun*512;
+				i += dwRun;
+				continue;
+			}
+		}
+		
 		iResult = ReadBlock(pDisk, dwBlock + i, ucBuf + i*512);
 		if(ERR_OK!=iResult) return iResult;
+		i++;
 	}
 	
 	return ERR_OK;
 }
 
 //----------------------------------------------------------------------------
-// WriteBlocksUncached
+// ReadBlocks
+//
+// Call ReadBlocksLocked() with the lock of the disk held
+//
+// -> and <- see ReadBlocksLocked()
+//----------------------------------------------------------------------------
+DLLEXPORT int __stdcall ReadBlocks(DISK *pDisk, DWORD dwBlock, DWORD dwNumBlocks,
+			   unsigned char *ucBuf)
+{
+	int iResult;
+	
+	if(NULL==pDisk) return ERR_NOT_OPEN;
+	EnterCriticalSection(&pDisk->csLock);
+	iResult = ReadBlocksLocked(pDisk, dwBlock, dwNumBlocks, ucBuf);
+	LeaveCriticalSection(&pDisk->csLock);
+	return iResult;
+}
+
+//----------------------------------------------------------------------------
+// WriteBlocksUncachedLocked
 // 
 // Write multiple blocks to harddisk or image file (uncached).
 // 
@@ -559,79 +615,81 @@ DLLEXPORT int __stdcall ReadBlocks(DISK *pDisk, DWORD dwBlock, DWORD dwNumBlocks
 //    ERR_OUT_OF_BOUNDS
 //    ERR_WRITE
 //    ERR_NOT_SUPPORTED
-//    ERR_SEEK
+//    ERR_MEM
 //----------------------------------------------------------------------------
-DLLEXPORT int __stdcall WriteBlocksUncached(DISK *pDisk, DWORD dwBlock, 
-											DWORD dwNumBlocks,
-			   								unsigned char *ucBuf)
+static int WriteBlocksUncachedLocked(DISK *pDisk, DWORD dwBlock, 
+	DWORD dwNumBlocks, unsigned char *ucBuf)
 {
-	DWORD dwBytesWritten, dwLow, dwHigh, dwError;
-	__int64 iiFilepointer;
-	int i;
+	int i, iResult;
 
-	// check pointer
+	// check pointer and device status
 	if(NULL==pDisk) return ERR_NOT_OPEN;
+	if(NULL==pDisk->pBackend) return ERR_NOT_OPEN;
 
 	// check boundaries
 	if(dwBlock+dwNumBlocks>pDisk->dwPhysicalBlocks) return ERR_OUT_OF_BOUNDS;
 
-	// check media type
-	if((TYPE_DISK==pDisk->iType)||(TYPE_FLOPPY==pDisk->iType)||
-		((TYPE_FILE==pDisk->iType)&&(IMAGE_FILE_ISO==pDisk->iImageType)))
+	// check if the device or image type can be written to
+	if(NULL==pDisk->pBackend->WriteBlocks) return ERR_NOT_SUPPORTED;
+	
+	// open the device on first access
+	iResult = ActivateDisk(pDisk);
+	if(ERR_OK!=iResult) return iResult;
+	
+	// these blocks must not be read as free blocks any more
+	if(ERR_OK!=MarkBlocksWritten(pDisk, dwBlock, dwNumBlocks)) return ERR_MEM;
+	
+	// write to disk
+	iResult = BackendWrite(pDisk, dwBlock, dwNumBlocks, ucBuf);
+	if(ERR_OK!=iResult)
 	{
-		// set file pointer
-		iiFilepointer = dwBlock; iiFilepointer *= 512;
-		dwLow = iiFilepointer & 0xFFFFFFFF;
-		dwHigh = (iiFilepointer >> 32) & 0xFFFFFFFF;
-		if(0xFFFFFFFF==SetFilePointer(pDisk->hHandle, dwLow, &dwHigh, 
-			FILE_BEGIN))
-		{
-			dwError = GetLastError();
-			if(NO_ERROR != dwError)
-			{
-				LOG("WriteBlocksUncached(): ERR_SEEK\n"); LOG_ERR(dwError);
-				return ERR_SEEK;
-			}
-		}
-		
-		// write to disk
-		if(0==WriteFile(pDisk->hHandle, ucBuf, dwNumBlocks*512, 
-			&dwBytesWritten, NULL))
-		{
-			LOG("WriteBlocksUncached(): WriteFile() failed.\n");
-			return ERR_WRITE;
-		}
-		if(dwNumBlocks*512!=dwBytesWritten)
-		{
-			LOG("WriteBlocksUncached(): WriteFile() failed.\n");
-			return ERR_WRITE;
-		}
+		LOG("WriteBlocksUncached(): write failed.\n");
+		return iResult;
 	}
-	else if(TYPE_FILE==pDisk->iType)
+	
+	// let the backend write back its own buffers (mapped image files)
+	if(pDisk->pBackend->Flush)
 	{
-		return ERR_NOT_SUPPORTED;
+		iResult = pDisk->pBackend->Flush(pDisk);
+		if(ERR_OK!=iResult) return iResult;
 	}
-	else if(TYPE_CDROM==pDisk->iType)
+	
+	// update cache (not used for mapped image files and images in memory)
+	if((NULL==pDisk->ucMapView)&&(NULL==pDisk->ucRamImage))
 	{
-		return ERR_NOT_SUPPORTED;
-	}
-	else
-	{
-		return ERR_NOT_SUPPORTED;
-	}
-	
-	// update cache
-	for(i=0; i<(int)dwNumBlocks; i++)
-	{
-		CacheInsertReadBlock(pDisk, i+dwBlock, ucBuf + i*512);
+		for(i=0; i<(int)dwNumBlocks; i++)
+		{
+			CacheInsertReadBlock(pDisk, i+dwBlock, ucBuf + i*512, 0);
+		}
 	}
 	
 	pDisk->dwReadCounter++;
+	pDisk->iiBytesWritten += (__int64)dwNumBlocks*512;
 	return ERR_OK;
 }
 
 //----------------------------------------------------------------------------
-// WriteBlocks
+// WriteBlocksUncached
+//
+// Call WriteBlocksUncachedLocked() with the lock of the disk held
+//
+// -> and <- see WriteBlocksUncachedLocked()
+//----------------------------------------------------------------------------
+DLLEXPORT int __stdcall WriteBlocksUncached(DISK *pDisk, DWORD dwBlock, 
+											DWORD dwNumBlocks,
+			   								unsigned char *ucBuf)
+{
+	int iResult;
+	
+	if(NULL==pDisk) return ERR_NOT_OPEN;
+	EnterCriticalSection(&pDisk->csLock);
+	iResult = WriteBlocksUncachedLocked(pDisk, dwBlock, dwNumBlocks, ucBuf);
+	LeaveCriticalSection(&pDisk->csLock);
+	return iResult;
+}
+
+//----------------------------------------------------------------------------
+// WriteBlocksLocked
 // 
 // Write multiple blocks to harddisk or image file (cached).
 // 
@@ -645,23 +703,39 @@ DLLEXPORT int __stdcall WriteBlocksUncached(DISK *pDisk, DWORD dwBlock,
 //    ERR_WRITE
 //    ERR_NOT_SUPPORTED
 //    ERR_SEEK
+//    ERR_MEM
 //----------------------------------------------------------------------------
-DLLEXPORT int __stdcall WriteBlocks(DISK *pDisk, DWORD dwBlock, 
-									DWORD dwNumBlocks,
-			   						unsigned char *ucBuf)
+static int WriteBlocksLocked(DISK *pDisk, DWORD dwBlock, DWORD dwNumBlocks,
+	unsigned char *ucBuf)
 {
 	int iResult;
 	DWORD i;
 
-	// check pointer
+	// check pointer and device status
 	if(NULL==pDisk) return ERR_NOT_OPEN;
+	if(NULL==pDisk->pBackend) return ERR_NOT_OPEN;
 
 	// check boundaries
 	if(dwBlock+dwNumBlocks>pDisk->dwPhysicalBlocks) return ERR_OUT_OF_BOUNDS;
 
-	// check media type
-	if((TYPE_DISK==pDisk->iType)||(TYPE_FLOPPY==pDisk->iType)||
-		((TYPE_FILE==pDisk->iType)&&(IMAGE_FILE_ISO==pDisk->iImageType)))
+	// check if the device or image type can be written to
+	if(NULL==pDisk->pBackend->WriteBlocks) return ERR_NOT_SUPPORTED;
+	
+	// open the device on first access
+	iResult = ActivateDisk(pDisk);
+	if(ERR_OK!=iResult) return iResult;
+	
+	// these blocks must not be read as free blocks any more
+	if(ERR_OK!=MarkBlocksWritten(pDisk, dwBlock, dwNumBlocks)) return ERR_MEM;
+	
+	// mapped image files and images in memory are written directly
+	if(pDisk->ucMapView||pDisk->ucRamImage)
+	{
+		iResult = pDisk->pBackend->WriteBlocks(pDisk, dwBlock, dwNumBlocks, 
+			ucBuf);
+		if(ERR_OK!=iResult) return iResult;
+	}
+	else
 	{
 		// write all blocks to cache
 		for(i=0; i<dwNumBlocks; i++)
@@ -670,20 +744,132 @@ DLLEXPORT int __stdcall WriteBlocks(DISK *pDisk, DWORD dwBlock,
 			if(ERR_OK!=iResult) return iResult;
 		}
 	}
-	else if(TYPE_FILE==pDisk->iType)
-	{
-		return ERR_NOT_SUPPORTED;
-	}
-	else if(TYPE_CDROM==pDisk->iType)
-	{
-		return ERR_NOT_SUPPORTED;
-	}
-	else
+	
+	pDisk->dwReadCounter++;
+	pDisk->iiBytesWritten += (__int64)dwNumBlocks*512;
+	
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// WriteBlocks
+//
+// Call WriteBlocksLocked() with the lock of the disk held
+//
+// -> and <- see WriteBlocksLocked()
+//----------------------------------------------------------------------------
+DLLEXPORT int __stdcall WriteBlocks(DISK *pDisk, DWORD dwBlock, 
+									DWORD dwNumBlocks,
+			   						unsigned char *ucBuf)
+{
+	int iResult;
+	
+	if(NULL==pDisk) return ERR_NOT_OPEN;
+	EnterCriticalSection(&pDisk->csLock);
+	iResult = WriteBlocksLocked(pDisk, dwBlock, dwNumBlocks, ucBuf);
+	LeaveCriticalSection(&pDisk->csLock);
+	return iResult;
+}
+
+//----------------------------------------------------------------------------
+// GetDiskStatistics
+// 
+// Get the I/O and cache counters of a disk. The caller sets dwSize of the
+// structure, callers built with an older (shorter) DISK_STATISTICS get the
+// members they know.
+// 
+// -> pDisk = pointer to initialized disk structure
+//    pStats = pointer to structure to receive the counters
+// <- ERR_OK
+//    ERR_NOT_OPEN
+//    ERR_NOT_SUPPORTED (pStats or dwSize invalid)
+//----------------------------------------------------------------------------
+DLLEXPORT int __stdcall GetDiskStatistics(DISK *pDisk, 
+										  DISK_STATISTICS *pStats)
+{
+	DISK_STATISTICS Stats;
+	DWORD dwSize;
+	
+	if(NULL==pDisk) return ERR_NOT_OPEN;
+	if((NULL==pStats)||(pStats->dwSize<sizeof(DWORD))) 
 	{
 		return ERR_NOT_SUPPORTED;
 	}
 	
-	pDisk->dwReadCounter++;
+	memset(&Stats, 0, sizeof(DISK_STATISTICS));
+	Stats.dwSize = sizeof(DISK_STATISTICS);
+	Stats.iiBytesRead = pDisk->iiBytesRead;
+	Stats.iiBytesWritten = pDisk->iiBytesWritten;
+	Stats.iiDeviceBytesRead = pDisk->iiDeviceBytesRead;
+	Stats.iiDeviceBytesWritten = pDisk->iiDeviceBytesWritten;
+	Stats.dwDeviceReads = pDisk->dwDeviceReads;
+	Stats.dwDeviceWrites = pDisk->dwDeviceWrites;
+	Stats.dwCacheHits = pDisk->dwCacheHits;
+	Stats.dwCacheMisses = pDisk->dwCacheMisses;
+	Stats.dwCacheEvictions = pDisk->dwCacheEvictions;
+	Stats.dwReadAheadBlocks = pDisk->dwReadAheadBlocks;
+	Stats.dwReadAheadHits = pDisk->dwReadAheadHits;
+	Stats.dwFATHits = pDisk->dwFATHit;
+	Stats.dwFATMisses = pDisk->dwFATMiss;
+	Stats.dwFreeBlockReads = pDisk->dwFreeBlockReads;
+	Stats.dwFlushes = pDisk->dwFlushes;
+	Stats.dwFlushBlocks = pDisk->dwFlushBlocks;
+	Stats.dwDirtyMax = pDisk->dwCacheDirtyMax;
+	Stats.dwTrackWrites = pDisk->dwTrackWrites;
+	Stats.dwTrackReads = pDisk->dwTrackReads;
+	Stats.dwTrackWriteTime = pDisk->dwTrackWriteTime;
+	Stats.dwTrackWriteMax = pDisk->dwTrackWriteMax;
+	Stats.dwCacheSlots = pDisk->dwCacheSlots;
+	Stats.dwCacheSlotsPeak = pDisk->dwCacheSlotsPeak;
+	Stats.dwCacheProtected = pDisk->dwCacheProtCount;
+	Stats.dwCacheMetadata = pDisk->dwCacheMetaCount;
+	Stats.dwCacheDirty = pDisk->dwCacheDirtyCount;
+	Stats.iSuspended = pDisk->iSuspended;
+	
+	dwSize = pStats->dwSize;
+	if(dwSize>sizeof(DISK_STATISTICS)) dwSize = sizeof(DISK_STATISTICS);
+	memcpy(pStats, &Stats, dwSize);
+	pStats->dwSize = dwSize;
+	
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// ResetDiskStatistics
+// 
+// Set all counters of a disk to zero (the cache size peak to the current
+// cache size)
+// 
+// -> pDisk = pointer to initialized disk structure
+// <- ERR_OK
+//    ERR_NOT_OPEN
+//----------------------------------------------------------------------------
+DLLEXPORT int __stdcall ResetDiskStatistics(DISK *pDisk)
+{
+	if(NULL==pDisk) return ERR_NOT_OPEN;
+	
+	pDisk->iiBytesRead = 0;
+	pDisk->iiBytesWritten = 0;
+	pDisk->iiDeviceBytesRead = 0;
+	pDisk->iiDeviceBytesWritten = 0;
+	pDisk->dwDeviceReads = 0;
+	pDisk->dwDeviceWrites = 0;
+	pDisk->dwCacheHits = 0;
+	pDisk->dwCacheMisses = 0;
+	pDisk->dwCacheEvictions = 0;
+	pDisk->dwReadAheadBlocks = 0;
+	pDisk->dwReadAheadHits = 0;
+	pDisk->dwFATHit = 0;
+	pDisk->dwFATMiss = 0;
+	pDisk->dwFreeBlockReads = 0;
+	pDisk->dwFlushes = 0;
+	pDisk->dwFlushBlocks = 0;
+	pDisk->dwCacheDirtyMax = pDisk->dwCacheDirtyCount;
+	pDisk->dwTrackWrites = 0;
+	pDisk->dwTrackReads = 0;
+	pDisk->dwTrackWriteTime = 0;
+	pDisk->dwTrackWriteMax = 0;
+	pDisk->dwCacheSlotsPeak = pDisk->dwCacheSlots;
 	
 	return ERR_OK;
 }
@@ -747,9 +933,90 @@ void MakeLegalName(char *cName)
 }
 
 //---------------------------------------------------------------------------
-// GetFATEntry
+// LoadFATBlock
 //
-// Read the FAT entry corresponding to a given block
+// Decode one FAT block into the in-memory FAT of a disk. The memory for the
+// decoded FAT is allocated on first use.
+//
+// -> pDisk = pointer to valid disk structure
+//    dwFATBlock = index of the FAT block (0 = first FAT block = block 5)
+// <- ERR_OK
+//    ERR_MEM
+//    ERR_NOT_OPEN
+//    ERR_OUT_OF_BOUNDS
+//    ERR_READ
+//    ERR_NOT_SUPPORTED
+//    ERR_SEEK
+//---------------------------------------------------------------------------
+static int LoadFATBlock(DISK *pDisk, DWORD dwFATBlock)
+{
+	unsigned char ucBuf[512];
+	DWORD i, dwFirst, dwLast;
+	int iResult;
+	
+	// allocate decoded FAT
+	if(NULL==pDisk->dwFAT)
+	{
+		pDisk->dwFAT = malloc(pDisk->dwBlocks*sizeof(DWORD));
+		pDisk->ucFATLoaded = malloc(pDisk->dwBlocks/170 + 1);
+		if((NULL==pDisk->dwFAT)||(NULL==pDisk->ucFATLoaded))
+		{
+			LOG("LoadFATBlock(): ERR_MEM.\n");
+			if(pDisk->dwFAT) free(pDisk->dwFAT);
+			if(pDisk->ucFATLoaded) free(pDisk->ucFATLoaded);
+			pDisk->dwFAT = NULL; pDisk->ucFATLoaded = NULL;
+			return ERR_MEM;
+		}
+		memset(pDisk->ucFATLoaded, 0, pDisk->dwBlocks/170 + 1);
+	}
+	
+	// read FAT block
+	iResult = ReadBlock(pDisk, dwFATBlock + 5, ucBuf);
+	if(ERR_OK!=iResult) return iResult;
+	pDisk->dwFATMiss++;
+	
+	if((ucBuf[510]!='F')||(ucBuf[511]!='B'))
+	{
+		LOG("Warning: Missing FAT block signature in block %d.\n",
+			dwFATBlock + 5);
+	}
+	
+	// decode all entries of this FAT block
+	dwFirst = dwFATBlock*170;
+	dwLast = dwFirst + 170;
+	if(dwLast>pDisk->dwBlocks) dwLast = pDisk->dwBlocks;
+	for(i=dwFirst; i<dwLast; i++)
+	{
+		pDisk->dwFAT[i] = (ucBuf[(i-dwFirst)*3+0]<<16) +
+						  (ucBuf[(i-dwFirst)*3+1]<<8)  +
+						  (ucBuf[(i-dwFirst)*3+2]);
+	}
+	pDisk->ucFATLoaded[dwFATBlock] = 1;
+	
+	return ERR_OK;
+}
+
+//---------------------------------------------------------------------------
+// FreeFAT
+//
+// Release the decoded FAT of a disk
+//
+// -> pDisk = pointer to valid disk structure
+// <- --
+//---------------------------------------------------------------------------
+void FreeFAT(DISK *pDisk)
+{
+	if(pDisk->dwFAT) free(pDisk->dwFAT);
+	if(pDisk->ucFATLoaded) free(pDisk->ucFATLoaded);
+	pDisk->dwFAT = NULL;
+	pDisk->ucFATLoaded = NULL;
+}
+
+//---------------------------------------------------------------------------
+// GetFATEntryLocked
+//
+// Read the FAT entry corresponding to a given block. The entry is taken from
+// the decoded FAT, the containing FAT block is read only on first access.
 //
 // -> pDisk = pointer to valid disk structure
 //    dwBlock = block to lookup in the FAT
@@ -758,7 +1025,7 @@ void MakeLegalName(char *cName)
 //    1 = EOF
 //    2 = bad block
 //---------------------------------------------------------------------------
-DLLEXPORT int __stdcall GetFATEntry(DISK *pDisk, DWORD dwBlock)
+static int GetFATEntryLocked(DISK *pDisk, DWORD dwBlock)
 {
 	// check pointers
 	if(NULL==pDisk) return -1;
@@ -766,33 +1033,39 @@ DLLEXPORT int __stdcall GetFATEntry(DISK *pDisk, DWORD dwBlock)
 	// error checking
 	if(((int)dwBlock<0)||(dwBlock>=pDisk->dwBlocks)) return -1;
 	
-	// read FAT block if necessary
-	if((dwBlock/170+5)!=pDisk->dwFATCacheBlock)
+	// decode FAT block if necessary
+	if((NULL==pDisk->ucFATLoaded)||(!pDisk->ucFATLoaded[dwBlock/170]))
 	{
-		// read FAT block containing the requested FAT entry
-		if(ERR_OK!=ReadBlock(pDisk, dwBlock/170 + 5, pDisk->ucFATCache))
+		if(ERR_OK!=LoadFATBlock(pDisk, dwBlock/170))
 		{
-			LOG("GetFATEntry(): ReadBlock failed.\n");
+			LOG("GetFATEntry(): LoadFATBlock failed.\n");
 			return -1;
 		}
-		pDisk->dwFATMiss++;
-		pDisk->dwFATCacheBlock = dwBlock/170+5;
-		
-		if((pDisk->ucFATCache[510]!='F')||(pDisk->ucFATCache[511]!='B'))
-		{
-			LOG("Warning: Missing FAT block signature in block %d.\n",
-				dwBlock/170 + 5);
-		}
 	}
 	else
 	{
 		pDisk->dwFATHit++;
 	}
 	
-	// get entry from FAT block
-	return (pDisk->ucFATCache[(dwBlock%170)*3+0]<<16) +
-	  	   (pDisk->ucFATCache[(dwBlock%170)*3+1]<<8)  +
-	  	   (pDisk->ucFATCache[(dwBlock%170)*3+2]);
+	return pDisk->dwFAT[dwBlock];
+}
+
+//----------------------------------------------------------------------------
+// GetFATEntry
+//
+// Call GetFATEntryLocked() with the lock of the disk held
+//
+// -> and <- see GetFATEntryLocked()
+//----------------------------------------------------------------------------
+DLLEXPORT int __stdcall GetFATEntry(DISK *pDisk, DWORD dwBlock)
+{
+	int iResult;
+	
+	if(NULL==pDisk) return -1;
+	EnterCriticalSection(&pDisk->csLock);
+	iResult = GetFATEntryLocked(pDisk, dwBlock);
+	LeaveCriticalSection(&pDisk->csLock);
+	return iResult;
 }
 
 //---------------------------------------------------------------------------
@@ -855,65 +1128,559 @@ int AdjustFreeBlocks(DISK *pDisk, int iAdjust)
 		return iResult;
 	}
 	
-	LOG(", OK.\n");
+	LOG(", OK.\n");
+	return ERR_OK;
+}
+
+//---------------------------------------------------------------------------
+// WriteFATBlock
+//
+// Encode all entries of one FAT block from the decoded FAT and write the
+// FAT block (through the cache). Only the last FAT block, which has unused
+// entries behind the end of the disk, is read first to keep them.
+//
+// -> pDisk = pointer to valid disk structure
+//    dwFATBlock = index of the FAT block (0 = first FAT block = block 5)
+// <- ERR_OK
+//    errors from ReadBlock() and WriteBlocks()
+//---------------------------------------------------------------------------
+static int WriteFATBlock(DISK *pDisk, DWORD dwFATBlock)
+{
+	unsigned char ucBuf[512];
+	DWORD i, dwFirst, dwLast;
+	int iResult;
+	
+	dwFirst = dwFATBlock*170;
+	dwLast = dwFirst + 170;
+	if(dwLast>pDisk->dwBlocks)
+	{
+		dwLast = pDisk->dwBlocks;
+		iResult = ReadBlock(pDisk, dwFATBlock + 5, ucBuf);
+		if(ERR_OK!=iResult) return iResult;
+	}
+	ucBuf[510] = 'F';
+	ucBuf[511] = 'B';
+	
+	// encode all entries of this FAT block
+	for(i=dwFirst; i<dwLast; i++)
+	{
+		ucBuf[(i-dwFirst)*3+0] = (unsigned char)((pDisk->dwFAT[i]>>16) & 0xFF);
+		ucBuf[(i-dwFirst)*3+1] = (unsigned char)((pDisk->dwFAT[i]>>8) & 0xFF);
+		ucBuf[(i-dwFirst)*3+2] = (unsigned char)(pDisk->dwFAT[i] & 0xFF);
+	}
+	
+	return WriteBlocks(pDisk, dwFATBlock + 5, 1, ucBuf);
+}
+
+//---------------------------------------------------------------------------
+// SetFATEntryLocked
+//
+// Write the FAT entry corresponding to a given block and give back its old
+// value.
+// 
+// The decoded FAT and the free space index are kept coherent, only the FAT
+// block containing dwBlock is written (through the cache) and only if the
+// entry changes.
+//
+// -> pDisk = pointer to valid disk structure
+//    dwBlock = block to lookup in the FAT
+//    dwNewValue = new value of this entry
+// <- -1:  error
+//    >-1: previous FAT entry for dwBlock
+//---------------------------------------------------------------------------
+static int SetFATEntryLocked(DISK *pDisk, DWORD dwBlock, DWORD dwNewValue)
+{
+	int iPrevious, iResult;
+	
+	// check pointers
+	if(NULL==pDisk) return -1;
+
+	// error checking
+	if(((int)dwBlock<0)||(dwBlock>=pDisk->dwBlocks))
+	{
+		LOG("SetFATEntry(): dwBlock=%d out of bounds.\n", dwBlock); 
+		return -1;
+	}
+	
+	// get old entry from FAT block
+	iPrevious = GetFATEntry(pDisk, dwBlock);
+	if(-1==iPrevious)
+	{
+		LOG("SetFATEntry(): GetFATEntry() error.\n");
+		return -1;
+	}
+	
+	if((DWORD)iPrevious==(dwNewValue & 0xFFFFFF)) return iPrevious;
+	
+	// set new value in decoded FAT, encode and write back FAT block
+	pDisk->dwFAT[dwBlock] = dwNewValue & 0xFFFFFF;
+	iResult = WriteFATBlock(pDisk, dwBlock/170);
+	if(ERR_OK!=iResult)
+	{
+		LOG("SetFATEntry(): WriteFATBlock() error, code=%d.\n", iResult); 
+		pDisk->dwFAT[dwBlock] = iPrevious;
+		return -1;
+	}
+	
+	// keep free space index coherent
+	if((0==iPrevious)&&(0!=(dwNewValue & 0xFFFFFF)))
+	{
+		FreeSpaceMarkUsed(pDisk, dwBlock, 1);
+	}
+	else if((0!=iPrevious)&&(0==(dwNewValue & 0xFFFFFF)))
+	{
+		FreeSpaceMarkFree(pDisk, dwBlock, 1);
+	}
+	
+	return iPrevious;
+}
+
+//----------------------------------------------------------------------------
+// SetFATEntry
+//
+// Call SetFATEntryLocked() with the lock of the disk held
+//
+// -> and <- see SetFATEntryLocked()
+//----------------------------------------------------------------------------
+DLLEXPORT int __stdcall SetFATEntry(DISK *pDisk, DWORD dwBlock, 
+									DWORD dwNewValue)
+{
+	int iResult;
+	
+	if(NULL==pDisk) return -1;
+	EnterCriticalSection(&pDisk->csLock);
+	iResult = SetFATEntryLocked(pDisk, dwBlock, dwNewValue);
+	LeaveCriticalSection(&pDisk->csLock);
+	return iResult;
+}
+
+//---------------------------------------------------------------------------
+// WriteTouchedFATBlocks
+//
+// Write all FAT blocks flagged in ucTouched in ascending order and free
+// the flag array
+//
+// -> pDisk = pointer to valid disk structure
+//    ucTouched = one flag per FAT block (allocated with calloc())
+// <- ERR_OK
+//    errors from WriteFATBlock()
+//---------------------------------------------------------------------------
+static int WriteTouchedFATBlocks(DISK *pDisk, unsigned char *ucTouched)
+{
+	DWORD i;
+	int iResult = ERR_OK;
+	
+	for(i=0; i<=pDisk->dwBlocks/170; i++)
+	{
+		if(0==ucTouched[i]) continue;
+		iResult = WriteFATBlock(pDisk, i);
+		if(ERR_OK!=iResult) break;
+	}
+	
+	free(ucTouched);
+	return iResult;
+}
+
+//---------------------------------------------------------------------------
+// LinkFATRange
+//
+// Link dwLen contiguous free blocks starting at dwStart to one FAT chain,
+// the last block gets the EOF mark. Every FAT block involved is modified and
+// written only once. Nothing is changed if one of the blocks is in use.
+//
+// -> pDisk = pointer to valid disk structure
+//    dwStart = first block of chain
+//    dwLen = number of blocks
+// <- ERR_OK
+//    ERR_NOT_OPEN
+//    ERR_OUT_OF_BOUNDS
+//    ERR_FAT
+//    ERR_BLOCK_IN_USE
+//    errors from WriteFATBlock()
+//---------------------------------------------------------------------------
+int LinkFATRange(DISK *pDisk, DWORD dwStart, DWORD dwLen)
+{
+	DWORD i;
+	int iResult;
+	
+	// check pointer
+	if(NULL==pDisk) return ERR_NOT_OPEN;
+	if(0==dwLen) return ERR_OK;
+	
+	// error checking
+	if((dwStart>=pDisk->dwBlocks)||(dwLen>pDisk->dwBlocks-dwStart))
+	{
+		LOG("LinkFATRange(): %d+%d out of bounds.\n", dwStart, dwLen);
+		return ERR_OUT_OF_BOUNDS;
+	}
+	
+	// make sure the FAT blocks involved are decoded
+	for(i=dwStart; i<dwStart+dwLen; i=(i/170+1)*170)
+	{
+		if(-1==GetFATEntry(pDisk, i))
+		{
+			LOG("LinkFATRange(): GetFATEntry() error.\n");
+			return ERR_FAT;
+		}
+	}
+	for(i=dwStart; i<dwStart+dwLen; i++)
+	{
+		if(0!=pDisk->dwFAT[i])
+		{
+			LOG("LinkFATRange(): block %d is not free.\n", i);
+			return ERR_BLOCK_IN_USE;
+		}
+	}
+	
+	// link blocks in decoded FAT
+	for(i=dwStart; i<dwStart+dwLen-1; i++) pDisk->dwFAT[i] = i + 1;
+	pDisk->dwFAT[dwStart+dwLen-1] = 1;
+	FreeSpaceMarkUsed(pDisk, dwStart, dwLen);
+	
+	// write FAT blocks
+	for(i=dwStart/170; i<=(dwStart+dwLen-1)/170; i++)
+	{
+		iResult = WriteFATBlock(pDisk, i);
+		if(ERR_OK!=iResult)
+		{
+			LOG("LinkFATRange(): WriteFATBlock() error, code=%d.\n", iResult);
+			return iResult;
+		}
+	}
+	
+	return ERR_OK;
+}
+
+//---------------------------------------------------------------------------
+// LinkFATChain
+//
+// Link the free blocks given in dwChain to one FAT chain in this order, the
+// last block gets the EOF mark. Every FAT block involved is modified and
+// written only once. Nothing is changed if one of the blocks is in use.
+//
+// -> pDisk = pointer to valid disk structure
+//    dwChain = array of block numbers
+//    dwCount = number of entries in dwChain
+// <- ERR_OK
+//    ERR_NOT_OPEN
+//    ERR_OUT_OF_BOUNDS
+//    ERR_MEM
+//    ERR_FAT
+//    ERR_BLOCK_IN_USE
+//    errors from WriteFATBlock()
+//---------------------------------------------------------------------------
+int LinkFATChain(DISK *pDisk, DWORD *dwChain, DWORD dwCount)
+{
+	unsigned char *ucTouched;
+	DWORD i;
+	int iResult;
+	
+	// check pointers
+	if(NULL==pDisk) return ERR_NOT_OPEN;
+	if(0==dwCount) return ERR_OK;
+	
+	// error checking, make sure the FAT blocks involved are decoded and
+	// all blocks are free
+	for(i=0; i<dwCount; i++)
+	{
+		if(dwChain[i]>=pDisk->dwBlocks)
+		{
+			LOG("LinkFATChain(): dwBlock=%d out of bounds.\n", dwChain[i]);
+			return ERR_OUT_OF_BOUNDS;
+		}
+		iResult = GetFATEntry(pDisk, dwChain[i]);
+		if(-1==iResult)
+		{
+			LOG("LinkFATChain(): GetFATEntry() error.\n");
+			return ERR_FAT;
+		}
+		if(0!=iResult)
+		{
+			LOG("LinkFATChain(): block %d is not free.\n", dwChain[i]);
+			return ERR_BLOCK_IN_USE;
+		}
+	}
+	
+	ucTouched = calloc(pDisk->dwBlocks/170 + 1, 1);
+	if(NULL==ucTouched) return ERR_MEM;
+	
+	// link blocks in decoded FAT
+	for(i=0; i<dwCount; i++)
+	{
+		FreeSpaceMarkUsed(pDisk, dwChain[i], 1);
+		pDisk->dwFAT[dwChain[i]] = (i<dwCount-1) ? dwChain[i+1] : 1;
+		ucTouched[dwChain[i]/170] = 1;
+	}
+	
+	// write FAT blocks
+	iResult = WriteTouchedFATBlocks(pDisk, ucTouched);
+	if(ERR_OK!=iResult)
+	{
+		LOG("LinkFATChain(): WriteFATBlock() error, code=%d.\n", iResult);
+	}
+	
+	return iResult;
+}
+
+//---------------------------------------------------------------------------
+// FreeFATChain
+//
+// Follow a FAT chain and mark all of its blocks free. The chain ends at the
+// EOF mark, at a free or bad block or at an invalid block number. Every FAT
+// block involved is modified and written only once.
+//
+// -> pDisk = pointer to valid disk structure
+//    dwStart = first block of chain
+//    dwFreed = pointer to a DWORD to receive the number of freed blocks
+//              (may be NULL)
+// <- ERR_OK
+//    ERR_NOT_OPEN
+//    ERR_MEM
+//    ERR_FAT
+//    errors from WriteFATBlock()
+//---------------------------------------------------------------------------
+int FreeFATChain(DISK *pDisk, DWORD dwStart, DWORD *dwFreed)
+{
+	unsigned char *ucTouched;
+	DWORD dwBlock, dwNext, dwCount = 0;
+	int iEntry, iResult = ERR_OK, iWriteResult;
+	
+	if(dwFreed) *dwFreed = 0;
+	
+	// check pointer
+	if(NULL==pDisk) return ERR_NOT_OPEN;
+	
+	ucTouched = calloc(pDisk->dwBlocks/170 + 1, 1);
+	if(NULL==ucTouched) return ERR_MEM;
+	
+	dwBlock = dwStart;
+	while((dwBlock>=3)&&(dwBlock<pDisk->dwBlocks)&&(dwCount<pDisk->dwBlocks))
+	{
+		iEntry = GetFATEntry(pDisk, dwBlock);
+		if(-1==iEntry)
+		{
+			LOG("FreeFATChain(): GetFATEntry() error.\n");
+			iResult = ERR_FAT;
+			break;
+		}
+		
+		// hit an empty block -> something is wrong here
+		if(0==iEntry) break;
+		dwNext = iEntry;
+		
+		pDisk->dwFAT[dwBlock] = 0;
+		FreeSpaceMarkFree(pDisk, dwBlock, 1);
+		ucTouched[dwBlock/170] = 1;
+		dwCount++;
+		
+		dwBlock = dwNext;
+	}
+	
+	// write FAT blocks (also after an error to keep the disk coherent with
+	// the decoded FAT)
+	iWriteResult = WriteTouchedFATBlocks(pDisk, ucTouched);
+	if(ERR_OK==iResult) iResult = iWriteResult;
+	
+	if(dwFreed) *dwFreed = dwCount;
+	return iResult;
+}
+
+//---------------------------------------------------------------------------
+// GetExtentMap
+//
+// Follow the FAT chain of a file once and describe it as a list of extents
+// (runs of contiguous blocks). The chain ends after dwLen blocks or at the
+// EOF mark, whatever comes first. The map is positioned at its first block.
+//
+// -> pDisk = pointer to valid disk structure
+//    dwStart = first block of file
+//    dwLen = maximum number of blocks to map
+//    pMap = pointer to extent map to fill (free with FreeExtentMap())
+// <- ERR_OK
+//    ERR_NOT_OPEN
+//    ERR_OUT_OF_BOUNDS
+//    ERR_MEM
+//    ERR_FAT
+//---------------------------------------------------------------------------
+int GetExtentMap(DISK *pDisk, DWORD dwStart, DWORD dwLen, EXTENT_MAP *pMap)
+{
+	FILE_EXTENT *pNew;
+	DWORD dwBlock, dwSize = 16;
+	int iEntry;
+	
+	memset(pMap, 0, sizeof(EXTENT_MAP));
+	
+	// check pointer
+	if(NULL==pDisk) return ERR_NOT_OPEN;
+	if(0==dwLen) return ERR_OK;
+	
+	pMap->pExtent = malloc(dwSize*sizeof(FILE_EXTENT));
+	if(NULL==pMap->pExtent) return ERR_MEM;
+	
+	dwBlock = dwStart;
+	while(pMap->dwBlocks<dwLen)
+	{
+		if(dwBlock>=pDisk->dwBlocks)
+		{
+			LOG("GetExtentMap(): block %d out of bounds.\n", dwBlock);
+			FreeExtentMap(pMap);
+			return ERR_OUT_OF_BOUNDS;
+		}
+		
+		// continue current extent or start a new one
+		if(pMap->dwCount&&
+		   (pMap->pExtent[pMap->dwCount-1].dwStart +
+		    pMap->pExtent[pMap->dwCount-1].dwLen==dwBlock))
+		{
+			pMap->pExtent[pMap->dwCount-1].dwLen++;
+		}
+		else
+		{
+			if(pMap->dwCount==dwSize)
+			{
+				dwSize *= 2;
+				pNew = realloc(pMap->pExtent, dwSize*sizeof(FILE_EXTENT));
+				if(NULL==pNew)
+				{
+					FreeExtentMap(pMap);
+					return ERR_MEM;
+				}
+				pMap->pExtent = pNew;
+			}
+			pMap->pExtent[pMap->dwCount].dwStart = dwBlock;
+			pMap->pExtent[pMap->dwCount].dwLen = 1;
+			pMap->dwCount++;
+		}
+		pMap->dwBlocks++;
+		
+		// get next FAT entry
+		iEntry = GetFATEntry(pDisk, dwBlock);
+		if(-1==iEntry)
+		{
+			LOG("GetExtentMap(): GetFATEntry() error.\n");
+			FreeExtentMap(pMap);
+			return ERR_FAT;
+		}
+		
+		// end of file, empty or bad block?
+		if(iEntry<3) break;
+		dwBlock = iEntry;
+	}
+	
 	return ERR_OK;
 }
 
 //---------------------------------------------------------------------------
-// SetFATEntry
+// ReadExtentMap
 //
-// Write the FAT entry corresponding to a given block and give back its old
-// value.
-// 
-// If you call this function many times, call it with dwMode=FAT_CACHED. The
-// last call must be dwMode=FAT_WRITE to flush the cache.
+// Read the next blocks of a file described by an extent map, issuing one
+// ReadBlocks() call per extent, and advance the position of the map
 //
 // -> pDisk = pointer to valid disk structure
-//    dwBlock = block to lookup in the FAT
-//    dwNewValue = new value of this entry
-// <- -1:  error
-//    >-1: previous FAT entry for dwBlock
+//    pMap = pointer to extent map
+//    dwNumBlocks = number of blocks to read
+//    ucBuf = pointer to destination buffer (dwNumBlocks*512 bytes)
+// <- ERR_OK
+//    ERR_EOF (map ends before dwNumBlocks blocks were read)
+//    errors from ReadBlocks()
 //---------------------------------------------------------------------------
-DLLEXPORT int __stdcall SetFATEntry(DISK *pDisk, DWORD dwBlock, 
-									DWORD dwNewValue)
+int ReadExtentMap(DISK *pDisk, EXTENT_MAP *pMap, DWORD dwNumBlocks,
+	unsigned char *ucBuf)
 {
-	int iPrevious, iResult;
+	FILE_EXTENT *pExtent;
+	DWORD dwBlocks;
+	int iResult;
 	
-	// check pointers
-	if(NULL==pDisk) return -1;
-
-	// error checking
-	if(((int)dwBlock<0)||(dwBlock>=pDisk->dwBlocks))
+	while(dwNumBlocks)
 	{
-		LOG("SetFATEntry(): dwBlock=%d out of bounds.\n", dwBlock); 
-		return -1;
+		if(pMap->dwPos>=pMap->dwCount) return ERR_EOF;
+		pExtent = &(pMap->pExtent[pMap->dwPos]);
+		
+		// read as much as possible from the current extent
+		dwBlocks = pExtent->dwLen - pMap->dwOffset;
+		if(dwBlocks>dwNumBlocks) dwBlocks = dwNumBlocks;
+		
+		iResult = ReadBlocks(pDisk, pExtent->dwStart + pMap->dwOffset,
+							 dwBlocks, ucBuf);
+		if(ERR_OK!=iResult) return iResult;
+		
+		ucBuf += dwBlocks*512;
+		dwNumBlocks -= dwBlocks;
+		
+		// advance position
+		pMap->dwOffset += dwBlocks;
+		if(pMap->dwOffset>=pExtent->dwLen)
+		{
+			pMap->dwPos++;
+			pMap->dwOffset = 0;
+		}
 	}
 	
-	// get old entry from FAT block
-	iPrevious = GetFATEntry(pDisk, dwBlock);
-	if(-1==iPrevious)
+	return ERR_OK;
+}
+
+//---------------------------------------------------------------------------
+// FreeExtentMap
+//
+// Release the memory of an extent map
+//
+// -> pMap = pointer to extent map
+// <- --
+//---------------------------------------------------------------------------
+void FreeExtentMap(EXTENT_MAP *pMap)
+{
+	if(pMap->pExtent) free(pMap->pExtent);
+	memset(pMap, 0, sizeof(EXTENT_MAP));
+}
+
+//----------------------------------------------------------------------------
+// OpenDevice
+// 
+// Open a device or image file for block access. Floppy drives are switched
+// to the extended formats and locked.
+// 
+// -> cMsDosName = device name ("\\.\image=" followed by the file name for
+//                 image files)
+//    iType = TYPE_DISK | TYPE_CDROM | TYPE_FILE | TYPE_FLOPPY
+// <- handle or INVALID_HANDLE_VALUE
+//----------------------------------------------------------------------------
+static HANDLE OpenDevice(char *cMsDosName, int iType)
+{
+	HANDLE h;
+	DWORD dwBytesReturned;
+	
+	// if floppy, try to enable 80/2/10x512 and 80/2/20x512 format
+	if(TYPE_FLOPPY==iType)
 	{
-		LOG("SetFATEntry(): GetFATEntry() error.\n");
-		return -1;
+		if(FALSE==EnableExtendedFormats(cMsDosName, TRUE))
+		{
+			return INVALID_HANDLE_VALUE;
+		}
+
+		// open device
+		h = CreateFile(cMsDosName, FILE_ALL_ACCESS, 0,
+			NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+			
+		// lock device
+		DeviceIoControl(h, FSCTL_LOCK_VOLUME, NULL, 0, 
+						NULL, 0, &dwBytesReturned, NULL);
 	}
-	
-	// set new value
-	pDisk->ucFATCache[(dwBlock%170)*3+0] =
-		(unsigned char)((dwNewValue>>16) & 0xFF);
-	pDisk->ucFATCache[(dwBlock%170)*3+1] =
-		(unsigned char)((dwNewValue>>8) & 0xFF);
-	pDisk->ucFATCache[(dwBlock%170)*3+2] =
-		(unsigned char)(dwNewValue & 0xFF);
-	
-	// write back FAT block
-	iResult = WriteBlocks(pDisk, dwBlock/170 + 5, 1, pDisk->ucFATCache);
-	if(ERR_OK!=iResult)
+	else if(TYPE_FILE==iType)
 	{
-		LOG("SetFATEntry(): WriteBlocks() error, code=%d.\n", iResult); 
-		return -1;
+		// open file
+		h = CreateFile(cMsDosName+10, FILE_ALL_ACCESS,
+			FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, 
+			OPEN_EXISTING, 0, NULL);
+	}
+	else
+	{
+		// open other devices
+		h = CreateFile(cMsDosName, FILE_ALL_ACCESS,
+			FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, 
+			OPEN_EXISTING, 0, NULL);
 	}
 	
-	return iPrevious;
+	return h;
 }
 
 //----------------------------------------------------------------------------
@@ -922,7 +1689,9 @@ DLLEXPORT int __stdcall SetFATEntry(DISK *pDisk, DWORD dwBlock,
 // Scans for disk devices and adds them to global list if Ensoniq signature
 // is found.
 // 
-// A new disk structure is allocated (linked list).
+// A new disk structure is allocated (linked list). The devices are only
+// probed (signature, label, size) and closed again, ActivateDisk() opens
+// them and allocates their cache on first access.
 // -> dwAllowNonEnsoniqFilesystems = 1: also take disks with no Ensoniq
 //                                      signature into list
 //                                 = 0: only allow Ensoniq formatted media
@@ -937,7 +1706,7 @@ DLLEXPORT DISK __stdcall *ScanDevices(DWORD dwAllowNonEnsoniqFilesystems)
 
 	char cBuf[BUF_SIZE], cLongName[260], cMsDosName[260], cText[1024];
 	DISK *pDisk, *pDiskRoot = NULL, *pCurrentDisk = NULL;
-	DWORD dwBytesRead, dwBytesReturned, dwError, fsl, fsh, dwDataOffset, 
+	DWORD dwBytesRead, dwBytesReturned, dwError, dwDataOffset, 
 		dwGieblerMapOffset;
 	unsigned char *ucBuf = NULL, *ucBufUnaligned = NULL;
 	int iDeviceNameIndex, iType, j, iIsEnsoniq = 0, 
@@ -1136,37 +1905,8 @@ DLLEXPORT DISK __stdcall *ScanDevices(DWORD dwAllowNonEnsoniqFilesystems)
 
 		LOG("\n%s = %s\n  Opening: ", cMsDosName, cLongName);
 
-		// if floppy, try to enable 80/2/10x512 and 80/2/20x512 format
-		if(TYPE_FLOPPY==iType)
-		{
-			if(FALSE==EnableExtendedFormats(cMsDosName, TRUE))
-			{
-				free(ucBufUnaligned);
-				continue;
-			}
-
-			// open device
-			h = CreateFile(cMsDosName, FILE_ALL_ACCESS, 0,
-				NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
-				
-			// lock device
-			DeviceIoControl(h, FSCTL_LOCK_VOLUME, NULL, 0, 
-							NULL, 0, &dwBytesReturned, NULL);
-		}
-		else if(TYPE_FILE==iType)
-		{
-			// open file
-			h = CreateFile(cMsDosName+10, FILE_ALL_ACCESS,
-				FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, 
-				OPEN_EXISTING, 0, NULL);
-		}
-		else
-		{
-			// open other devices
-			h = CreateFile(cMsDosName, FILE_ALL_ACCESS,
-				FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, 
-				OPEN_EXISTING, 0, NULL);
-		}
+		// open device or image file
+		h = OpenDevice(cMsDosName, iType);
 		
 		// check result
 		if(INVALID_HANDLE_VALUE==h)
@@ -1279,103 +2019,18 @@ DLLEXPORT DISK __stdcall *ScanDevices(DWORD dwAllowNonEnsoniqFilesystems)
 		pDisk->iImageType = iImageType;
 		pDisk->dwDataOffset = dwDataOffset;
 		pDisk->dwGieblerMapOffset = dwGieblerMapOffset;
+		pDisk->iCachePolicy = g_iOptionCachePolicy;
 
-		// read disk geometry
-		// treat floppy and image files different (see below)
-		if((TYPE_FLOPPY!=iType)&&(TYPE_FILE!=iType))
-		{
-			LOG("Reading disk geometry: ");
-			if(0==DeviceIoControl(h, IOCTL_DISK_GET_DRIVE_GEOMETRY_EX,
-								  NULL, 0, &(pDisk->DiskGeometry),
-								  sizeof(DISK_GEOMETRY_EX),
-								  &dwBytesReturned, NULL))
-			{
-				LOG("DeviceIoControl(IOCTL_DISK_GET_DRIVE_GEOMETRY_EX) "
-					"failed.\n");
-				CloseHandle(h);
-				free(ucBufUnaligned);
-				continue;
-			}
-		}
-		
-		// allocate cache
-		pDisk->ucCache = malloc(CACHE_SIZE*512);
-		if(NULL==pDisk->ucCache)
-		{
-			LOG("Unable to allocate cache memory.\n");
-			if(TYPE_FLOPPY==iType)
-			{
-				// unlock device, close it, disable extended formats
-				DeviceIoControl(h, FSCTL_UNLOCK_VOLUME, NULL, 0, NULL, 0,
-								&dwBytesReturned, NULL);
-				CloseHandle(h);
-				EnableExtendedFormats(cMsDosName, FALSE);
-			}
-			else CloseHandle(h);
-			free(ucBufUnaligned);
-			free(pDisk);
-			continue;
-		}
-		pDisk->dwCacheTable = malloc(CACHE_SIZE*sizeof(DWORD));
-		if(NULL==pDisk->dwCacheTable)
-		{
-			LOG("Unable to allocate cache table memory.\n");
-			if(TYPE_FLOPPY==iType)
-			{
-				// unlock device, close it, disable extended formats
-				DeviceIoControl(h, FSCTL_UNLOCK_VOLUME, NULL, 0, NULL, 0,
-								&dwBytesReturned, NULL);
-				CloseHandle(h);
-				EnableExtendedFormats(cMsDosName, FALSE);
-			}
-			else CloseHandle(h);
-			free(ucBufUnaligned);
-			free(pDisk->ucCache);
-			free(pDisk);
-			continue;
-		}
-		pDisk->dwCacheAge = malloc(CACHE_SIZE*sizeof(DWORD));
-		if(NULL==pDisk->dwCacheAge)
-		{
-			LOG("Unable to allocate cache age memory.\n");
-			if(TYPE_FLOPPY==iType)
-			{
-				// unlock device, close it, disable extended formats
-				DeviceIoControl(h, FSCTL_UNLOCK_VOLUME, NULL, 0, NULL, 0,
-								&dwBytesReturned, NULL);
-				CloseHandle(h);
-				EnableExtendedFormats(cMsDosName, FALSE);
-			}
-			else CloseHandle(h);
-			free(ucBufUnaligned);
-			free(pDisk->ucCache);
-			free(pDisk->dwCacheTable);
-			free(pDisk);
-			continue;
-		}
-		pDisk->ucCacheFlags = malloc(CACHE_SIZE);
-		if(NULL==pDisk->ucCacheFlags)
+		// choose the backend for this device or image type, from now on
+		// the backend closes the device
+		if(ERR_OK!=SelectBackend(pDisk))
 		{
-			LOG("Unable to allocate cache flags memory.\n");
-			if(TYPE_FLOPPY==iType)
-			{
-				// unlock device, close it, disable extended formats
-				DeviceIoControl(h, FSCTL_UNLOCK_VOLUME, NULL, 0, NULL, 0,
-								&dwBytesReturned, NULL);
-				CloseHandle(h);
-				EnableExtendedFormats(cMsDosName, FALSE);
-			}
-			else CloseHandle(h);
+			LOG("No backend for this device or image type.\n");
+			CloseHandle(h);
 			free(ucBufUnaligned);
-			free(pDisk->ucCache);
-			free(pDisk->dwCacheAge);
-			free(pDisk->dwCacheTable);
 			free(pDisk);
 			continue;
 		}
-		memset(pDisk->dwCacheTable, 0xFF, CACHE_SIZE*sizeof(DWORD));
-		memset(pDisk->dwCacheAge, 0x00, CACHE_SIZE*sizeof(DWORD));
-		memset(pDisk->ucCacheFlags, 0x00, CACHE_SIZE);
 		
 		// copy disk name
 		for(j=0; j<7; j++)
@@ -1389,36 +2044,20 @@ DLLEXPORT DISK __stdcall *ScanDevices(DWORD dwAllowNonEnsoniqFilesystems)
 		pDisk->dwBlocks = ucBuf[17+512] + (ucBuf[16+512]<<8) + 
 						  (ucBuf[15+512]<<16) + (ucBuf[14+512]<<24);
 
+		// read disk geometry (floppy disks use the number of blocks from the
+		// DeviceID block, image files use the file size)
+		if(ERR_OK!=pDisk->pBackend->GetGeometry(pDisk))
+		{
+			free(ucBufUnaligned);
+			pDisk->pBackend->Close(pDisk);
+			free(pDisk);
+			continue;
+		}
+
 		// set physical disk values to logical values from DeviceID block
-		// for floppy or use file size for image files
+		// for floppy and image files
 		if((TYPE_FLOPPY==iType)||(TYPE_FILE==iType))
 		{
-			__int64 ii = 0;
-			if(TYPE_FLOPPY==iType)
-			{
-				ii = pDisk->dwBlocks; ii *= 512;
-			}
-			else if(TYPE_FILE==iType)
-			{
-				// get image file size
-				fsl = GetFileSize(h, &fsh); dwError = GetLastError();
-				if((0xFFFFFFFF==fsl)&&(NO_ERROR!=dwError))
-				{
-					LOG("Error reading file size.\n");
-					LOG_ERR(dwError);
-					free(ucBufUnaligned);
-					free(pDisk->ucCache);
-					free(pDisk->dwCacheAge);
-					free(pDisk->dwCacheTable);
-					free(pDisk->ucCacheFlags);
-					free(pDisk);
-					continue;
-				}
-				ii = fsh; ii <<= 32; ii += (__int64)fsl;
-			}
-
-			pDisk->DiskGeometry.DiskSize.LowPart = ii & 0xFFFFFFFF;;
-			pDisk->DiskGeometry.DiskSize.HighPart = ii >> 32;
 			pDisk->DiskGeometry.Geometry.BytesPerSector = 
 				ucBuf[13+512] + (ucBuf[12+512]<<8) + 
 				(ucBuf[11+512]<<16) + (ucBuf[10+512]<<24);
@@ -1439,8 +2078,6 @@ DLLEXPORT DISK __stdcall *ScanDevices(DWORD dwAllowNonEnsoniqFilesystems)
 							+ (ucBuf[2+512*2]<<8)
 							+ (ucBuf[3+512*2]);
 
-		pDisk->dwFATCacheBlock = 0xFFFFFFFF;
-
 
 		LOG("%d blocks (logical), %d  blocks (physical),  blocks free.\n",
 			pDisk->dwBlocks, pDisk->dwPhysicalBlocks, pDisk->dwBlocksFree);
@@ -1454,10 +2091,7 @@ DLLEXPORT DISK __stdcall *ScanDevices(DWORD dwAllowNonEnsoniqFilesystems)
 			{
 				LOG("Error allocating Giebler map.\n");
 				free(ucBufUnaligned);
-				free(pDisk->ucCache);
-				free(pDisk->dwCacheAge);
-				free(pDisk->dwCacheTable);
-				free(pDisk->ucCacheFlags);
+				pDisk->pBackend->Close(pDisk);
 				free(pDisk);
 				continue;
 			}
@@ -1468,16 +2102,36 @@ DLLEXPORT DISK __stdcall *ScanDevices(DWORD dwAllowNonEnsoniqFilesystems)
 				dwError = GetLastError();
 				LOG("Error reading Giebler map: "); LOG_ERR(dwError);
 				free(ucBufUnaligned);
-				free(pDisk->ucCache);
-				free(pDisk->dwCacheAge);
-				free(pDisk->dwCacheTable);
-				free(pDisk->ucCacheFlags);
+				pDisk->pBackend->Close(pDisk);
 				free(pDisk->ucGieblerMap);
+				if(pDisk->dwGieblerOffset) free(pDisk->dwGieblerOffset);
 				free(pDisk);
 				continue;
 			}
+			
+			// decode the bitmap once, ReadBlock() only looks up offsets
+			if(ERR_OK!=DecodeGieblerMap(pDisk))
+			{
+				LOG("Error allocating Giebler offset table.\n");
+				free(ucBufUnaligned);
+				pDisk->pBackend->Close(pDisk);
+				free(pDisk->ucGieblerMap);
+				if(pDisk->dwGieblerOffset) free(pDisk->dwGieblerOffset);
+				free(pDisk);
+				continue;
+			}
+			
+			// the bitmap covers the whole disk, blocks behind the end of
+			// the image file are valid too (not stored)
+			pDisk->dwPhysicalBlocks = pDisk->dwGieblerBlocks;
 		}
 	
+		// everything needed to list the disk is known now, the device is
+		// opened again and gets its cache on first access (ActivateDisk())
+		pDisk->pBackend->Close(pDisk);
+		pDisk->iSuspended = 1;
+		InitializeCriticalSection(&pDisk->csLock);
+	
 		// append newly created disk structure to the list
 		if(0==pDiskRoot)
 		{
@@ -1490,8 +2144,6 @@ DLLEXPORT DISK __stdcall *ScanDevices(DWORD dwAllowNonEnsoniqFilesystems)
 		pCurrentDisk = pDisk;
 
 		free(ucBufUnaligned);
-
-		// do not close handle here - will be used later
 	}
 	LOG("\n");
 	
@@ -1500,6 +2152,160 @@ DLLEXPORT DISK __stdcall *ScanDevices(DWORD dwAllowNonEnsoniqFilesystems)
 	return pDiskRoot;
 }
 
+//----------------------------------------------------------------------------
+// ActivateDisk
+// 
+// Open a disk found by ScanDevices() and allocate its cache. This is done on
+// the first access, so mounting many disks and images costs neither
+// handles nor memory before they are used.
+// 
+// -> pDisk = pointer to initialized disk structure
+// <- ERR_OK
+//    ERR_NOT_OPEN
+//    ERR_READ
+//    ERR_MEM
+//----------------------------------------------------------------------------
+int ActivateDisk(DISK *pDisk)
+{
+	DWORD dwError;
+	HANDLE h;
+	
+	pDisk->dwLastAccess = GetTickCount();
+	if(!pDisk->iSuspended) return ERR_OK;
+	
+	LOG("ActivateDisk(): '%s'\n  Opening: ", pDisk->cMsDosName);
+	h = OpenDevice(pDisk->cMsDosName, pDisk->iType);
+	if(INVALID_HANDLE_VALUE==h)
+	{
+		dwError = GetLastError();
+		LOG("failed: "); LOG_ERR(dwError);
+		return ERR_NOT_OPEN;
+	}
+	LOG("OK.\n");
+	pDisk->hHandle = h;
+	
+	// let the backend read its own structures again (chunk index)
+	if(ERR_OK!=pDisk->pBackend->GetGeometry(pDisk))
+	{
+		pDisk->pBackend->Close(pDisk);
+		return ERR_READ;
+	}
+	
+	// allocate cache
+	if(ERR_OK!=CacheInit(pDisk))
+	{
+		LOG("Unable to allocate cache memory.\n");
+		pDisk->pBackend->Close(pDisk);
+		return ERR_MEM;
+	}
+	
+	// load small image files into memory completely, reopen larger
+	// ISO and GKH image files without OS file cache or map them into
+	// memory (if allowed), the file is accessed with ReadFile/WriteFile
+	// if all fail
+	if(TYPE_FILE==pDisk->iType)
+	{
+		if((ERR_OK!=LoadRamImage(pDisk))&&(ERR_OK!=OpenDirectIO(pDisk)))
+		{
+			MapImageFile(pDisk);
+		}
+	}
+	else if(TYPE_DISK==pDisk->iType)
+	{
+		OpenDirectIO(pDisk);
+	}
+	
+	// disks served from memory do not need the block cache
+	if(pDisk->ucRamImage||pDisk->ucMapView) CacheFree(pDisk);
+	LOG("Backend: %s\n", pDisk->pBackend->cName);
+	
+	pDisk->iSuspended = 0;
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// SuspendDiskLocked
+// 
+// Write back everything and release cache, decoded FAT, free space index
+// and the device or image file of a disk. The disk stays in the device list,
+// ActivateDisk() opens it again on the next access. Cache policy and the
+// map of metadata blocks are kept.
+// 
+// -> pDisk = pointer to initialized disk structure
+// <- ERR_OK
+//    errors from CacheFlush() (the disk stays open)
+//----------------------------------------------------------------------------
+static int SuspendDiskLocked(DISK *pDisk)
+{
+	int iResult;
+	
+	if(pDisk->iSuspended) return ERR_OK;
+	
+	iResult = CacheFlush(pDisk);
+	if(ERR_OK!=iResult) return iResult;
+	
+	LOG("SuspendDisk(): '%s'\n", pDisk->cMsDosName);
+	CacheFree(pDisk);
+	FreeFAT(pDisk);
+	FreeSpaceFree(pDisk);
+	
+	// close the device, back to the backend of the image format (images in
+	// memory and mapped images are written back by their backend)
+	pDisk->pBackend->Close(pDisk);
+	SelectBackend(pDisk);
+	pDisk->dwDirectIOAlign = 0;
+	
+	pDisk->iSuspended = 1;
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// SuspendDisk
+//
+// Call SuspendDiskLocked() with the lock of the disk held
+//
+// -> and <- see SuspendDiskLocked()
+//----------------------------------------------------------------------------
+int SuspendDisk(DISK *pDisk)
+{
+	int iResult;
+	
+	if(NULL==pDisk) return ERR_NOT_OPEN;
+	EnterCriticalSection(&pDisk->csLock);
+	iResult = SuspendDiskLocked(pDisk);
+	LeaveCriticalSection(&pDisk->csLock);
+	return iResult;
+}
+
+//----------------------------------------------------------------------------
+// SuspendIdleDisks
+// 
+// Suspend all disks of the device list which were not accessed for the
+// time given by the IdleTimeout option (seconds, 0 = never). Disks locked
+// by another thread are in use and stay open.
+// 
+// -> --
+// <- --
+//----------------------------------------------------------------------------
+void SuspendIdleDisks(void)
+{
+	DISK *pDisk;
+	DWORD dwNow = GetTickCount();
+	
+	if(g_iOptionIdleTimeout<=0) return;
+	
+	for(pDisk=g_pDiskListRoot; pDisk; pDisk=pDisk->pNext)
+	{
+		if(!TryEnterCriticalSection(&pDisk->csLock)) continue;
+		if((!pDisk->iSuspended)&&
+		   ((dwNow-pDisk->dwLastAccess)>=(DWORD)g_iOptionIdleTimeout*1000))
+		{
+			SuspendDiskLocked(pDisk);
+		}
+		LeaveCriticalSection(&pDisk->csLock);
+	}
+}
+
 //----------------------------------------------------------------------------
 // DetectImageFileType
 // 
@@ -1524,6 +2330,7 @@ DLLEXPORT DISK __stdcall *ScanDevices(DWORD dwAllowNonEnsoniqFilesystems)
 //    IMAGE_FILE_MODE1
 //    IMAGE_FILE_GKH
 //    IMAGE_FILE_GIEBLER
+//    IMAGE_FILE_CHUNKED
 //----------------------------------------------------------------------------
 int DetectImageFileType(HANDLE h, unsigned char *ucReturnBuf, 
 	DWORD *dwDataOffset, DWORD *dwGieblerMapOffset)
@@ -1543,6 +2350,25 @@ int DetectImageFileType(HANDLE h, unsigned char *ucReturnBuf,
 		return IMAGE_FILE_UNKNOWN;
 	}
 	
+	// chunk-compressed?
+	if(IsChunkImage(ucBuf))
+	{
+		LOG("File identified as chunk-compressed image.\n");
+		
+		// decompress first sectors to ucReturnBuf
+		if(ucReturnBuf)
+		{
+			if(ERR_OK!=ReadChunkImageStart(h, ucReturnBuf, ID_SIZE))
+			{
+				LOG("Error reading first chunk.\n");
+				return IMAGE_FILE_UNKNOWN;
+			}
+		}
+		if(dwDataOffset) *dwDataOffset = 0;
+		
+		return IMAGE_FILE_CHUNKED;
+	}
+	
 	// GKH?
 	if(0==strncmp(ucBuf, "TDDFI", 5))	// GKH
 	{
@@ -1729,7 +2555,6 @@ int DetectImageFileType(HANDLE h, unsigned char *ucReturnBuf,
 DLLEXPORT void __stdcall FreeDiskList(int iShowProgress, DISK *pRoot)
 {
 	int iMaxDevices, iDeviceCounter;
-	DWORD dwBytesReturned;
 	DISK *pTemp, *pDisk;
 	char cText[1024];
 
@@ -1764,29 +2589,23 @@ DLLEXPORT void __stdcall FreeDiskList(int iShowProgress, DISK *pRoot)
 		// flush the cache before deleting it
 		CacheFlush(pDisk);
 
-		if(pDisk->dwCacheTable) free(pDisk->dwCacheTable);
-		if(pDisk->ucCacheFlags) free(pDisk->ucCacheFlags);
-		if(pDisk->dwCacheAge) free(pDisk->dwCacheAge);
-		if(pDisk->ucCache) free(pDisk->ucCache);
+		CacheFree(pDisk);
+		FreeFAT(pDisk);
+		FreeSpaceFree(pDisk);
+		if(pDisk->ucMetadataMap) free(pDisk->ucMetadataMap);
 		if(pDisk->ucGieblerMap) free(pDisk->ucGieblerMap);
-		if(pDisk->hHandle!=INVALID_HANDLE_VALUE)
-		{
-			if(TYPE_FLOPPY==pDisk->iType)
-			{
-				DeviceIoControl(pDisk->hHandle, FSCTL_UNLOCK_VOLUME, NULL, 0,
-								NULL, 0, &dwBytesReturned, NULL);
-				CloseHandle(pDisk->hHandle);
-				EnableExtendedFormats(pDisk->cMsDosName, FALSE);
-			}
-			else CloseHandle(pDisk->hHandle);
-
-		}
+		if(pDisk->dwGieblerOffset) free(pDisk->dwGieblerOffset);
+		if(pDisk->ucGieblerPending) free(pDisk->ucGieblerPending);
+		if(pDisk->ucBlockWritten) free(pDisk->ucBlockWritten);
+		if(pDisk->pBackend) pDisk->pBackend->Close(pDisk);
+		DeleteCriticalSection(&pDisk->csLock);
 		pTemp = pDisk->pNext;
 		free(pDisk);
 		pDisk = pTemp;
 	}
 	
 	g_pDiskListRoot = 0;
+	FreeDirectIOPool();
 
 	if(iShowProgress) DestroyProgressDialog();
 }
@@ -35,19 +35,92 @@
 #ifndef _DISK_H_
 #define _DISK_H_
 
+// TryEnterCriticalSection() needs Windows NT 4.0
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0400
+#endif
 #include <windows.h>
 #include <winioctl.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include "omniflop.h"
+#include "OmniFlop.h"
 #include "diskstructure.h"
 
 #define DLLEXPORT __declspec (dllexport)
 
-#define READ_AHEAD	256
+#define READ_AHEAD_MIN	8		// read ahead for random access (blocks)
+#define READ_AHEAD_MAX	4096	// upper limit for read ahead
+#define EXTENT_READ_COUNT	1024	// blocks read at once when extracting files
+#define DIRECT_READ_MIN		64	// uncached blocks read past the cache
+#define DIRECT_READ_CHUNK	2048	// blocks per direct read call (1 MB)
+#define SPARSE_MIN_BLOCKS	128		// zero blocks written as a hole (64 KB)
+#define DIRECT_IO_BUFFER	65536	// bytes per unbuffered I/O bounce buffer
+#define DIRECT_IO_POOL		4		// bounce buffers kept for reuse
+#define DIRECT_IO_ALIGN		4096	// unbuffered image files (sectors up to 4K)
+#define MODE1_READ_SECTORS	64		// raw sectors per read from Mode1 images
+#define GIEBLER_ZERO_BLOCK	0		// Giebler block not stored in the image
+#define GIEBLER_PENDING_BLOCK	0xFFFFFFFF	// Giebler block to be inserted
+#define GIEBLER_MOVE_BLOCKS	64		// blocks per read/write when inserting
 
 #define MAX_IMAGE_FILES		16
 
+//----------------------------------------------------------------------------
+// extent map of a file (runs of contiguous blocks)
+//----------------------------------------------------------------------------
+typedef struct _FILE_EXTENT
+{
+	DWORD dwStart, dwLen;
+} FILE_EXTENT;
+
+typedef struct _EXTENT_MAP
+{
+	FILE_EXTENT *pExtent;	// array of extents
+	DWORD dwCount;			// number of extents
+	DWORD dwBlocks;			// number of blocks in all extents
+	DWORD dwPos, dwOffset;	// read position (extent index, block offset)
+} EXTENT_MAP;
+
+//----------------------------------------------------------------------------
+// I/O and cache counters of a disk (GetDiskStatistics())
+//
+// The read ahead efficiency is dwReadAheadHits/dwReadAheadBlocks, the cache
+// hit rate dwCacheHits/(dwCacheHits+dwCacheMisses). Bytes read from and
+// written to the device differ from the bytes requested by cache hits, read
+// ahead, free blocks (not read) and whole track writes. Disks held in
+// memory do no device I/O until they are written back.
+//----------------------------------------------------------------------------
+typedef struct _DISK_STATISTICS
+{
+	DWORD dwSize;				// size of this structure, set by the caller
+	__int64 iiBytesRead;		// bytes read by ReadBlock()/ReadBlocks()
+	__int64 iiBytesWritten;		// bytes written by WriteBlocks()/...Uncached()
+	__int64 iiDeviceBytesRead;	// bytes read from the device
+	__int64 iiDeviceBytesWritten;	// bytes written to the device
+	DWORD dwDeviceReads;		// read calls to the device
+	DWORD dwDeviceWrites;		// write calls to the device
+	DWORD dwCacheHits;
+	DWORD dwCacheMisses;
+	DWORD dwCacheEvictions;		// cached blocks dropped for other blocks
+	DWORD dwReadAheadBlocks;	// blocks read ahead
+	DWORD dwReadAheadHits;		// blocks read ahead and used
+	DWORD dwFATHits;
+	DWORD dwFATMisses;
+	DWORD dwFreeBlockReads;		// free blocks read as zeroes without I/O
+	DWORD dwFlushes;			// CacheFlush() calls which wrote blocks
+	DWORD dwFlushBlocks;		// dirty blocks written by CacheFlush()
+	DWORD dwDirtyMax;			// largest number of dirty blocks
+	DWORD dwTrackWrites;		// whole tracks written (floppy only)
+	DWORD dwTrackReads;			// tracks read back for partial track writes
+	DWORD dwTrackWriteTime;		// time spent writing tracks (ms)
+	DWORD dwTrackWriteMax;		// slowest track write (ms)
+	DWORD dwCacheSlots;			// current cache size (blocks)
+	DWORD dwCacheSlotsPeak;		// largest cache size (blocks)
+	DWORD dwCacheProtected;		// slots in the protected list (2Q)
+	DWORD dwCacheMetadata;		// clean slots in the metadata tier
+	DWORD dwCacheDirty;			// dirty blocks waiting for CacheFlush()
+	int iSuspended;				// disk closed until next access
+} DISK_STATISTICS;
+
 //----------------------------------------------------------------------------
 // Prototypes
 //----------------------------------------------------------------------------
@@ -57,12 +130,24 @@ BOOL LockMediaType(const char *szDrive, MEDIA_TYPE MediaType, BOOL bLog);
 BOOL EnableExtendedFormats(const char *szDrive, BOOL bEnable);
 void MakeLegalName(char *cName);
 void GetShortEnsoniqFiletype(unsigned char ucType, char *cType);
+int DecodeGieblerMap(DISK *pDisk);
 int ReadBlock(DISK *pDisk, DWORD dwBlock, unsigned char *ucBuf);
 int GetContiguousBlocks(DISK *pDisk, DWORD dwNumBlocks);
 int GetNextFreeBlock(DISK *pDisk, int iStartingBlock);
 int AdjustFreeBlocks(DISK *pDisk, int iAdjust);
+void FreeFAT(DISK *pDisk);
+int LinkFATRange(DISK *pDisk, DWORD dwStart, DWORD dwLen);
+int LinkFATChain(DISK *pDisk, DWORD *dwChain, DWORD dwCount);
+int FreeFATChain(DISK *pDisk, DWORD dwStart, DWORD *dwFreed);
+int GetExtentMap(DISK *pDisk, DWORD dwStart, DWORD dwLen, EXTENT_MAP *pMap);
+int ReadExtentMap(DISK *pDisk, EXTENT_MAP *pMap, DWORD dwNumBlocks,
+	unsigned char *ucBuf);
+void FreeExtentMap(EXTENT_MAP *pMap);
 int DetectImageFileType(HANDLE h, unsigned char *ucReturnBuf, 
 	DWORD *dwDataOffset, DWORD *dwGieblerMapOffset);
+int ActivateDisk(DISK *pDisk);
+int SuspendDisk(DISK *pDisk);
+void SuspendIdleDisks(void);
 	
 //----------------------------------------------------------------------------
 // DLL exports
@@ -79,6 +164,9 @@ DLLEXPORT int __stdcall SetFATEntry(DISK *pDisk, DWORD dwBlock,
 	DWORD dwNewValue);
 DLLEXPORT DISK __stdcall *ScanDevices(DWORD dwAllowNonEnsoniqFilesystems);
 DLLEXPORT int __stdcall GetUsageCount(void);
+DLLEXPORT int __stdcall GetDiskStatistics(DISK *pDisk, 
+	DISK_STATISTICS *pStats);
+DLLEXPORT int __stdcall ResetDiskStatistics(DISK *pDisk);
 
 #endif
 
@@ -46,6 +46,7 @@
 #define IMAGE_FILE_MODE1	2
 #define IMAGE_FILE_GKH		3
 #define IMAGE_FILE_GIEBLER	4
+#define IMAGE_FILE_CHUNKED	5
 
 //----------------------------------------------------------------------------
 // disk descriptor
@@ -71,15 +72,86 @@ typedef struct _DISK
 	unsigned char *ucCacheFlags;	// flags (dirty flag)
 	DWORD dwCacheHits;
 	DWORD dwCacheMisses;
-	DWORD dwFATCacheBlock;	// number of block in FAT cache
+	DWORD dwFATCacheBlock;	// unused (FAT is decoded into dwFAT)
 	DWORD dwFATMiss, dwFATHit;
-	DWORD dwLastFreeFATEntry;	// marks the last free FAT entry to speedup
-								// the search for the next free one
-	unsigned char ucFATCache[512];	// FAT cache (one block)
+	DWORD dwLastFreeFATEntry;	// unused (free blocks are in pFreeSpaceRoot)
+	unsigned char ucFATCache[512];	// unused (FAT is decoded into dwFAT)
 	DWORD dwReadCounter;	// counter of read accesses (for cache age)
 	DISK_GEOMETRY_EX DiskGeometry;
 	int iIsEnsoniq;			// flag for filesystem type
 	struct _DISK *pNext;	// pointer to next disk descriptor
+
+	// ETools walks the list returned by ScanDevices(), the fields above have
+	// to stay at their offsets. Everything below is used by the plugin only.
+	struct _BACKEND *pBackend;	// physical I/O for this device/image type
+	struct _CHUNKIMAGE *pChunkImage;	// index and chunk cache (chunked only)
+	DWORD *dwGieblerOffset;	// file offset of each block (Giebler only)
+	DWORD dwGieblerBlocks;	// number of blocks covered by the bitmap
+	unsigned char *ucGieblerPending;	// new blocks waiting for insertion
+	DWORD dwGieblerPending;	// number of new blocks waiting for insertion
+	DWORD dwCacheSlots;		// current cache size (blocks)
+	DWORD dwCacheSlotsPeak;	// largest cache size since mount (blocks)
+	DWORD dwCacheLastUse;	// GetTickCount() of the last cache access
+	struct _DISK *pCacheNext;	// next disk sharing the cache budget
+	DWORD *dwCacheHashHead;	// first cache slot of each hash bucket
+	DWORD *dwCacheHashNext;	// next cache slot in the same hash bucket
+	DWORD *dwCacheLRUPrev;	// LRU list of clean cache slots (towards head)
+	DWORD *dwCacheLRUNext;	// LRU list of clean cache slots (towards tail)
+	DWORD dwCacheLRUHead;	// most recently used clean cache slot
+	DWORD dwCacheLRUTail;	// least recently used clean cache slot
+	DWORD dwCacheProtHead;	// protected list (2Q): most recently used slot
+	DWORD dwCacheProtTail;	// protected list (2Q): least recently used slot
+	DWORD dwCacheProtCount;	// number of slots in the protected list
+	DWORD dwCacheMetaHead;	// metadata list: most recently used slot
+	DWORD dwCacheMetaTail;	// metadata list: least recently used slot
+	DWORD dwCacheMetaCount;	// number of clean slots in the metadata list
+	unsigned char *ucMetadataMap;	// bit per block: directory block
+	int iCachePolicy;		// CACHE_POLICY_LRU | CACHE_POLICY_2Q
+	DWORD *dwCacheDirty;	// block numbers of all dirty cache slots
+	DWORD dwCacheDirtyCount;	// number of entries in dwCacheDirty
+	int iCacheDirtySorted;	// dwCacheDirty is in ascending order
+	unsigned char *ucCacheFlushBuf;	// run buffer for CacheFlush()
+	unsigned char *ucReadAheadBuf;	// read ahead buffer of ReadBlock()
+	DWORD dwReadAheadBufSize;	// size of read ahead buffer (blocks)
+	unsigned char *ucSectorBuf;	// raw sector buffer for Mode1 images
+	HANDLE hMapping;		// file mapping of ISO and GKH images
+	unsigned char *ucMapView;	// mapped view of the whole image file
+	int iMapDirty;			// mapped view has been written to
+	unsigned char *ucRamImage;	// whole image in memory (RAM mode)
+	DWORD dwRamDirtyFirst;	// modified blocks in RAM mode (first, last+1)
+	DWORD dwRamDirtyLast;
+	struct _BACKEND *pImageBackend;	// format backend behind RAM mode
+	int iSparseFile;		// image file is sparse (1), can not be sparse (-1)
+	DWORD dwDirectIOAlign;	// unbuffered I/O alignment in bytes (0 = off)
+	int iSuspended;			// device closed, no cache (until next access)
+	DWORD dwLastAccess;		// GetTickCount() of the last block access
+	DWORD dwReadAhead;		// current read ahead (blocks)
+	DWORD dwReadAheadNext;	// first block behind the last read
+	DWORD dwReadAheadBlocks;	// number of blocks read ahead
+	DWORD dwReadAheadHits;	// number of blocks read ahead and used
+	DWORD dwCacheEvictions;	// cached blocks dropped for other blocks
+	DWORD dwCacheDirtyMax;	// largest number of dirty blocks
+	DWORD dwFlushes;		// CacheFlush() calls which wrote blocks
+	DWORD dwFlushBlocks;	// dirty blocks written by CacheFlush()
+	__int64 iiBytesRead;	// bytes read by ReadBlock()/ReadBlocks()
+	__int64 iiBytesWritten;	// bytes written by WriteBlocks()/...Uncached()
+	__int64 iiDeviceBytesRead;	// bytes read from the device
+	__int64 iiDeviceBytesWritten;	// bytes written to the device
+	DWORD dwDeviceReads;	// read calls to the device
+	DWORD dwDeviceWrites;	// write calls to the device
+	DWORD *dwFAT;			// decoded FAT (one entry per block)
+	unsigned char *ucFATLoaded;	// flag per FAT block: entries are decoded
+	unsigned char *ucBlockWritten;	// bit per block: written since mount
+	DWORD dwFreeBlockReads;	// free blocks read as zeroes without I/O
+	DWORD dwTrackWrites;	// whole tracks written (floppy only)
+	DWORD dwTrackReads;		// tracks read back for partial track writes
+	DWORD dwTrackWriteTime;	// time spent writing tracks (ms)
+	DWORD dwTrackWriteMax;	// slowest track write (ms)
+	struct _FREE_EXTENT *pFreeSpaceRoot[2];	// free extents by start and by length
+	DWORD dwFreeSpaceBlocks;	// number of blocks in the free space index
+	DWORD dwFreeSpaceSeed;	// random seed for the free space index
+	int iFreeSpaceValid;		// free space index has been built
+	CRITICAL_SECTION csLock;	// held during block I/O and cache use
 } DISK;
 
 #endif
@@ -63,5 +63,7 @@
 #define ERR_DESTROY_DLG		21	// error destroying dialog
 #define ERR_SET_INI			22	// error setting INI value
 #define ERR_GET_INI			23	// error getting INI value
+#define ERR_EOF				24	// end of file reached before all blocks were read
+#define ERR_BLOCK_IN_USE	25	// block to be allocated is not free
 
 #endif
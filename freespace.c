@@ -0,0 +1,466 @@
+//----------------------------------------------------------------------------
+// EnsoniqFS plugin for TotalCommander
+//
+// FREE SPACE INDEX
+//----------------------------------------------------------------------------
+//
+// (c) 2006 Thoralt Franz
+//
+// This source code was written using Dev-Cpp 4.9.9.2
+// If you want to compile it, get Dev-Cpp. Normally the code should compile
+// with other IDEs/compilers too (with small modifications), but I did not
+// test it.
+//
+//----------------------------------------------------------------------------
+// License
+//----------------------------------------------------------------------------
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, 
+// MA  02110-1301, USA.
+// 
+// Alternatively, download a copy of the license here:
+// http://www.gnu.org/licenses/gpl.txt
+//----------------------------------------------------------------------------
+#include "freespace.h"
+
+//----------------------------------------------------------------------------
+// The free space of a disk is kept as a set of free extents. Every extent is
+// linked into two treaps (randomized binary search trees): one ordered by
+// start block to find neighbours and the next free block, one ordered by
+// length to find the smallest extent which can hold a new file.
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+// FreeSpaceLess
+// 
+// Compare an extent to a key in the given tree
+//
+// -> iTree = FREE_TREE_START or FREE_TREE_LEN
+//    p = extent
+//    dwStart, dwLen = key
+// <- 1 if p is ordered before the key, 0 otherwise
+//----------------------------------------------------------------------------
+static int FreeSpaceLess(int iTree, FREE_EXTENT *p, DWORD dwStart, DWORD dwLen)
+{
+	if(FREE_TREE_LEN==iTree)
+	{
+		if(p->dwLen!=dwLen) return (p->dwLen<dwLen);
+	}
+	return (p->dwStart<dwStart);
+}
+
+//----------------------------------------------------------------------------
+// FreeSpaceSplit
+// 
+// Split a treap into all extents ordered before the key and the rest
+//
+// -> iTree = FREE_TREE_START or FREE_TREE_LEN
+//    p = root of treap
+//    dwStart, dwLen = key
+//    ppLeft, ppRight = pointers to receive the roots of both parts
+// <- --
+//----------------------------------------------------------------------------
+static void FreeSpaceSplit(int iTree, FREE_EXTENT *p, DWORD dwStart, 
+	DWORD dwLen, FREE_EXTENT **ppLeft, FREE_EXTENT **ppRight)
+{
+	if(NULL==p)
+	{
+		*ppLeft = *ppRight = NULL;
+	}
+	else if(FreeSpaceLess(iTree, p, dwStart, dwLen))
+	{
+		FreeSpaceSplit(iTree, p->pChild[iTree][1], dwStart, dwLen,
+			&(p->pChild[iTree][1]), ppRight);
+		*ppLeft = p;
+	}
+	else
+	{
+		FreeSpaceSplit(iTree, p->pChild[iTree][0], dwStart, dwLen,
+			ppLeft, &(p->pChild[iTree][0]));
+		*ppRight = p;
+	}
+}
+
+//----------------------------------------------------------------------------
+// FreeSpaceMerge
+// 
+// Merge two treaps, all extents of pLeft must be ordered before pRight
+//
+// -> iTree = FREE_TREE_START or FREE_TREE_LEN
+//    pLeft, pRight = roots of both treaps
+// <- root of merged treap
+//----------------------------------------------------------------------------
+static FREE_EXTENT *FreeSpaceMerge(int iTree, FREE_EXTENT *pLeft, 
+	FREE_EXTENT *pRight)
+{
+	if(NULL==pLeft) return pRight;
+	if(NULL==pRight) return pLeft;
+	
+	if(pLeft->dwPriority>pRight->dwPriority)
+	{
+		pLeft->pChild[iTree][1] = FreeSpaceMerge(iTree, 
+			pLeft->pChild[iTree][1], pRight);
+		return pLeft;
+	}
+	
+	pRight->pChild[iTree][0] = FreeSpaceMerge(iTree, pLeft, 
+		pRight->pChild[iTree][0]);
+	return pRight;
+}
+
+//----------------------------------------------------------------------------
+// FreeSpaceInsert
+// 
+// Insert a new extent into both trees of a disk
+//
+// -> pDisk = pointer to valid disk structure
+//    dwStart, dwLen = extent to insert
+// <- ERR_OK
+//    ERR_MEM
+//----------------------------------------------------------------------------
+static int FreeSpaceInsert(DISK *pDisk, DWORD dwStart, DWORD dwLen)
+{
+	FREE_EXTENT *p, *pLeft, *pRight;
+	int iTree;
+	
+	p = malloc(sizeof(FREE_EXTENT));
+	if(NULL==p) return ERR_MEM;
+	memset(p, 0, sizeof(FREE_EXTENT));
+	p->dwStart = dwStart;
+	p->dwLen = dwLen;
+	
+	// xorshift random number as treap priority
+	pDisk->dwFreeSpaceSeed ^= pDisk->dwFreeSpaceSeed << 13;
+	pDisk->dwFreeSpaceSeed ^= pDisk->dwFreeSpaceSeed >> 17;
+	pDisk->dwFreeSpaceSeed ^= pDisk->dwFreeSpaceSeed << 5;
+	p->dwPriority = pDisk->dwFreeSpaceSeed;
+	
+	for(iTree=0; iTree<2; iTree++)
+	{
+		FreeSpaceSplit(iTree, pDisk->pFreeSpaceRoot[iTree], dwStart, dwLen,
+			&pLeft, &pRight);
+		pDisk->pFreeSpaceRoot[iTree] = FreeSpaceMerge(iTree, 
+			FreeSpaceMerge(iTree, pLeft, p), pRight);
+	}
+	
+	pDisk->dwFreeSpaceBlocks += dwLen;
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// FreeSpaceRemove
+// 
+// Remove an extent from both trees of a disk and free it
+//
+// -> pDisk = pointer to valid disk structure
+//    p = extent to remove (must be linked)
+// <- --
+//----------------------------------------------------------------------------
+static void FreeSpaceRemove(DISK *pDisk, FREE_EXTENT *p)
+{
+	FREE_EXTENT **pp;
+	int iTree;
+	
+	for(iTree=0; iTree<2; iTree++)
+	{
+		// find link pointing to this extent
+		pp = &(pDisk->pFreeSpaceRoot[iTree]);
+		while(*pp!=p)
+		{
+			if(FreeSpaceLess(iTree, *pp, p->dwStart, p->dwLen))
+				pp = &((*pp)->pChild[iTree][1]);
+			else
+				pp = &((*pp)->pChild[iTree][0]);
+		}
+		
+		*pp = FreeSpaceMerge(iTree, p->pChild[iTree][0], p->pChild[iTree][1]);
+	}
+	
+	pDisk->dwFreeSpaceBlocks -= p->dwLen;
+	free(p);
+}
+
+//----------------------------------------------------------------------------
+// FreeSpaceFloor
+// 
+// Find the extent with the highest start block <= dwBlock
+//
+// -> pDisk = pointer to valid disk structure
+//    dwBlock = block number
+// <- extent or NULL if there is none
+//----------------------------------------------------------------------------
+static FREE_EXTENT *FreeSpaceFloor(DISK *pDisk, DWORD dwBlock)
+{
+	FREE_EXTENT *p = pDisk->pFreeSpaceRoot[FREE_TREE_START], *pFound = NULL;
+	
+	while(p)
+	{
+		if(p->dwStart<=dwBlock)
+		{
+			pFound = p;
+			p = p->pChild[FREE_TREE_START][1];
+		}
+		else p = p->pChild[FREE_TREE_START][0];
+	}
+	
+	return pFound;
+}
+
+//----------------------------------------------------------------------------
+// FreeSpaceCeiling
+// 
+// Find the extent with the lowest start block >= dwBlock
+//
+// -> pDisk = pointer to valid disk structure
+//    dwBlock = block number
+// <- extent or NULL if there is none
+//----------------------------------------------------------------------------
+static FREE_EXTENT *FreeSpaceCeiling(DISK *pDisk, DWORD dwBlock)
+{
+	FREE_EXTENT *p = pDisk->pFreeSpaceRoot[FREE_TREE_START], *pFound = NULL;
+	
+	while(p)
+	{
+		if(p->dwStart>=dwBlock)
+		{
+			pFound = p;
+			p = p->pChild[FREE_TREE_START][0];
+		}
+		else p = p->pChild[FREE_TREE_START][1];
+	}
+	
+	return pFound;
+}
+
+//----------------------------------------------------------------------------
+// FreeSpaceFreeTree
+// 
+// Free all extents of a tree (recursive)
+//----------------------------------------------------------------------------
+static void FreeSpaceFreeTree(FREE_EXTENT *p)
+{
+	if(NULL==p) return;
+	FreeSpaceFreeTree(p->pChild[FREE_TREE_START][0]);
+	FreeSpaceFreeTree(p->pChild[FREE_TREE_START][1]);
+	free(p);
+}
+
+//----------------------------------------------------------------------------
+// FreeSpaceFree
+// 
+// Release the free space index of a disk
+//
+// -> pDisk = pointer to valid disk structure
+// <- --
+//----------------------------------------------------------------------------
+void FreeSpaceFree(DISK *pDisk)
+{
+	FreeSpaceFreeTree(pDisk->pFreeSpaceRoot[FREE_TREE_START]);
+	pDisk->pFreeSpaceRoot[FREE_TREE_START] = NULL;
+	pDisk->pFreeSpaceRoot[FREE_TREE_LEN] = NULL;
+	pDisk->dwFreeSpaceBlocks = 0;
+	pDisk->iFreeSpaceValid = 0;
+}
+
+//----------------------------------------------------------------------------
+// FreeSpaceBuild
+// 
+// Build the free space index of a disk from its FAT. Nothing is done if the
+// index already exists.
+//
+// -> pDisk = pointer to valid disk structure
+// <- ERR_OK
+//    ERR_FAT
+//    ERR_MEM
+//----------------------------------------------------------------------------
+int FreeSpaceBuild(DISK *pDisk)
+{
+	DWORD i, dwStart = 0, dwCount = 0;
+	int iEntry;
+	
+	if(pDisk->iFreeSpaceValid) return ERR_OK;
+	
+	LOG("FreeSpaceBuild(): ");
+	FreeSpaceFree(pDisk);
+	pDisk->dwFreeSpaceSeed = 0x9E3779B9;
+	
+	// collect runs of free FAT entries
+	for(i=0; i<=pDisk->dwBlocks; i++)
+	{
+		iEntry = (i<pDisk->dwBlocks) ? GetFATEntry(pDisk, i) : 1;
+		if(-1==iEntry)
+		{
+			LOG("failed (FAT).\n");
+			FreeSpaceFree(pDisk);
+			return ERR_FAT;
+		}
+		
+		if(0==iEntry)
+		{
+			if(0==dwCount) dwStart = i;
+			dwCount++;
+		}
+		else if(dwCount)
+		{
+			if(ERR_OK!=FreeSpaceInsert(pDisk, dwStart, dwCount))
+			{
+				LOG("failed (ERR_MEM).\n");
+				FreeSpaceFree(pDisk);
+				return ERR_MEM;
+			}
+			dwCount = 0;
+		}
+	}
+	
+	pDisk->iFreeSpaceValid = 1;
+	LOG("%d free blocks.\n", pDisk->dwFreeSpaceBlocks);
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// FreeSpaceFindContiguous
+// 
+// Find the smallest free extent which can hold dwNumBlocks blocks (best fit,
+// lowest start block if there are several)
+//
+// -> pDisk = pointer to valid disk structure with valid free space index
+//    dwNumBlocks = number of contiguous blocks needed
+// <- =0: no free extent large enough
+//    >0: first block of free extent
+//----------------------------------------------------------------------------
+DWORD FreeSpaceFindContiguous(DISK *pDisk, DWORD dwNumBlocks)
+{
+	FREE_EXTENT *p = pDisk->pFreeSpaceRoot[FREE_TREE_LEN], *pFound = NULL;
+	
+	while(p)
+	{
+		if(p->dwLen>=dwNumBlocks)
+		{
+			pFound = p;
+			p = p->pChild[FREE_TREE_LEN][0];
+		}
+		else p = p->pChild[FREE_TREE_LEN][1];
+	}
+	
+	return pFound ? pFound->dwStart : 0;
+}
+
+//----------------------------------------------------------------------------
+// FreeSpaceFindNext
+// 
+// Find the first free block starting at dwStartingBlock
+//
+// -> pDisk = pointer to valid disk structure with valid free space index
+//    dwStartingBlock = first block to test if free
+// <- =0: no free block found
+//    >0: free block
+//----------------------------------------------------------------------------
+DWORD FreeSpaceFindNext(DISK *pDisk, DWORD dwStartingBlock)
+{
+	FREE_EXTENT *p;
+	
+	// free extent containing the starting block?
+	p = FreeSpaceFloor(pDisk, dwStartingBlock);
+	if(p&&(p->dwStart+p->dwLen>dwStartingBlock)) return dwStartingBlock;
+	
+	p = FreeSpaceCeiling(pDisk, dwStartingBlock);
+	return p ? p->dwStart : 0;
+}
+
+//----------------------------------------------------------------------------
+// FreeSpaceMarkUsed
+// 
+// Remove a range of blocks from the free space index
+//
+// -> pDisk = pointer to valid disk structure
+//    dwStart, dwLen = range of blocks which are no longer free
+// <- --
+//----------------------------------------------------------------------------
+void FreeSpaceMarkUsed(DISK *pDisk, DWORD dwStart, DWORD dwLen)
+{
+	DWORD dwEnd = dwStart + dwLen, dwExtStart, dwExtEnd;
+	FREE_EXTENT *p;
+	
+	if(!pDisk->iFreeSpaceValid) return;
+	
+	while(1)
+	{
+		// find an extent overlapping the range
+		p = FreeSpaceFloor(pDisk, dwStart);
+		if((NULL==p)||(p->dwStart+p->dwLen<=dwStart))
+		{
+			p = FreeSpaceCeiling(pDisk, dwStart);
+			if((NULL==p)||(p->dwStart>=dwEnd)) break;
+		}
+		
+		// cut the range out of this extent, keep the remainders
+		dwExtStart = p->dwStart;
+		dwExtEnd = p->dwStart + p->dwLen;
+		FreeSpaceRemove(pDisk, p);
+
+		if((dwExtStart<dwStart)&&
+		   (ERR_OK!=FreeSpaceInsert(pDisk, dwExtStart, dwStart-dwExtStart)))
+		{
+			FreeSpaceFree(pDisk);
+			return;
+		}
+		if((dwExtEnd>dwEnd)&&
+		   (ERR_OK!=FreeSpaceInsert(pDisk, dwEnd, dwExtEnd-dwEnd)))
+		{
+			FreeSpaceFree(pDisk);
+			return;
+		}
+	}
+}
+
+//----------------------------------------------------------------------------
+// FreeSpaceMarkFree
+// 
+// Add a range of blocks to the free space index, merge it with adjacent
+// free extents
+//
+// -> pDisk = pointer to valid disk structure
+//    dwStart, dwLen = range of blocks which became free
+// <- --
+//----------------------------------------------------------------------------
+void FreeSpaceMarkFree(DISK *pDisk, DWORD dwStart, DWORD dwLen)
+{
+	DWORD dwEnd = dwStart + dwLen;
+	FREE_EXTENT *p;
+	
+	if(!pDisk->iFreeSpaceValid) return;
+	
+	// merge with an extent overlapping or ending right at the range start
+	p = FreeSpaceFloor(pDisk, dwStart);
+	if(p&&(p->dwStart+p->dwLen>=dwStart))
+	{
+		dwStart = p->dwStart;
+		if(p->dwStart+p->dwLen>dwEnd) dwEnd = p->dwStart + p->dwLen;
+		FreeSpaceRemove(pDisk, p);
+	}
+
+	// merge with all extents starting inside or right after the range
+	while(1)
+	{
+		p = FreeSpaceCeiling(pDisk, dwStart);
+		if((NULL==p)||(p->dwStart>dwEnd)) break;
+		if(p->dwStart+p->dwLen>dwEnd) dwEnd = p->dwStart + p->dwLen;
+		FreeSpaceRemove(pDisk, p);
+	}
+	
+	if(ERR_OK!=FreeSpaceInsert(pDisk, dwStart, dwEnd-dwStart))
+	{
+		FreeSpaceFree(pDisk);
+	}
+}
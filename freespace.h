@@ -0,0 +1,65 @@
+//----------------------------------------------------------------------------
+// EnsoniqFS plugin for TotalCommander
+//
+// FREE SPACE INDEX header file
+//----------------------------------------------------------------------------
+//
+// (c) 2006 Thoralt Franz
+//
+// This source code was written using Dev-Cpp 4.9.9.2
+// If you want to compile it, get Dev-Cpp. Normally the code should compile
+// with other IDEs/compilers too (with small modifications), but I did not
+// test it.
+//
+//----------------------------------------------------------------------------
+// License
+//----------------------------------------------------------------------------
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, 
+// MA  02110-1301, USA.
+// 
+// Alternatively, download a copy of the license here:
+// http://www.gnu.org/licenses/gpl.txt
+//----------------------------------------------------------------------------
+#ifndef _FREESPACE_H_
+#define _FREESPACE_H_
+
+#include "error.h"
+#include "log.h"
+#include "disk.h"
+
+//----------------------------------------------------------------------------
+// free extent (a run of free blocks), linked into two trees
+//----------------------------------------------------------------------------
+#define FREE_TREE_START	0	// ordered by start block
+#define FREE_TREE_LEN	1	// ordered by length, then by start block
+
+typedef struct _FREE_EXTENT
+{
+	DWORD dwStart, dwLen;
+	DWORD dwPriority;					// treap priority
+	struct _FREE_EXTENT *pChild[2][2];	// [tree][left, right]
+} FREE_EXTENT;
+
+//----------------------------------------------------------------------------
+// Prototypes
+//----------------------------------------------------------------------------
+int FreeSpaceBuild(DISK *pDisk);
+void FreeSpaceFree(DISK *pDisk);
+DWORD FreeSpaceFindContiguous(DISK *pDisk, DWORD dwNumBlocks);
+DWORD FreeSpaceFindNext(DISK *pDisk, DWORD dwStartingBlock);
+void FreeSpaceMarkUsed(DISK *pDisk, DWORD dwStart, DWORD dwLen);
+void FreeSpaceMarkFree(DISK *pDisk, DWORD dwStart, DWORD dwLen);
+
+#endif
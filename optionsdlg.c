@@ -63,6 +63,8 @@ extern int g_iOptionEnableLogging;
 extern int g_iOptionBankAdaption;
 extern int g_iOptionBankSourceDevice;
 extern int g_iOptionBankTargetDevice;
+extern int g_iOptionDirectIODisk;
+extern int g_iOptionDirectIOImage;
 
 int m_iDeviceListChanged = 0;
 
@@ -93,6 +95,7 @@ void OptionsDlg_OnCancel(HWND hWnd)
 void OptionsDlg_OnOK(HWND hWnd)
 {
 	char *cName = g_DefaultParams.DefaultIniName;
+	int iDirectIODisk, iDirectIOImage;
 	
 	LOG("OptionsDlg_OnOK()\n");
 	// save checkbox status
@@ -117,6 +120,21 @@ void OptionsDlg_OnOK(HWND hWnd)
 	g_iOptionBankAdaption = 
 		(SendMessage(GetDlgItem(hWnd, IDC_CHK_BANKADAPTION),
 		(UINT)BM_GETCHECK, (WPARAM)0, (LPARAM)0)==BST_CHECKED)?1:0;
+	iDirectIODisk = 
+		(SendMessage(GetDlgItem(hWnd, IDC_CHK_DIRECTIODISK),
+		(UINT)BM_GETCHECK, (WPARAM)0, (LPARAM)0)==BST_CHECKED)?1:0;
+	iDirectIOImage = 
+		(SendMessage(GetDlgItem(hWnd, IDC_CHK_DIRECTIOIMAGE),
+		(UINT)BM_GETCHECK, (WPARAM)0, (LPARAM)0)==BST_CHECKED)?1:0;
+	
+	// devices have to be opened again to change the I/O mode
+	if((iDirectIODisk!=g_iOptionDirectIODisk)||
+	   (iDirectIOImage!=g_iOptionDirectIOImage))
+	{
+		m_iDeviceListChanged = 1;
+	}
+	g_iOptionDirectIODisk = iDirectIODisk;
+	g_iOptionDirectIOImage = iDirectIOImage;
 
 	LRESULT lResult = SendMessage(GetDlgItem(hWnd, IDC_CBO_BANKSOURCEDEVICE),
 		(UINT)CB_GETCURSEL, (WPARAM)0, (LPARAM)0);
@@ -156,6 +174,12 @@ void OptionsDlg_OnOK(HWND hWnd)
 	SetIniValueInt(cName, "[EnsoniqFS]", "BankTargetDevice", 
 		g_iOptionBankTargetDevice);
 
+	SetIniValueInt(cName, "[EnsoniqFS]", "DirectIODisk", 
+		g_iOptionDirectIODisk);
+
+	SetIniValueInt(cName, "[EnsoniqFS]", "DirectIOImage", 
+		g_iOptionDirectIOImage);
+
 	if(m_iDeviceListChanged)
 	{
 		// rescan device list	
@@ -431,6 +455,14 @@ void OptionsDlg_OnInitDialog(HWND hWnd)
 		(UINT)BM_SETCHECK, 
 		(WPARAM)(g_iOptionBankAdaption?BST_CHECKED:BST_UNCHECKED), 
 		(LPARAM)0);
+	SendMessage(GetDlgItem(hWnd, IDC_CHK_DIRECTIODISK),
+		(UINT)BM_SETCHECK, 
+		(WPARAM)(g_iOptionDirectIODisk?BST_CHECKED:BST_UNCHECKED), 
+		(LPARAM)0);
+	SendMessage(GetDlgItem(hWnd, IDC_CHK_DIRECTIOIMAGE),
+		(UINT)BM_SETCHECK, 
+		(WPARAM)(g_iOptionDirectIOImage?BST_CHECKED:BST_UNCHECKED), 
+		(LPARAM)0);
 	
 	// clear and init "BankSourceDevice" ComboBox
 	// first entry is "convert all device ids"
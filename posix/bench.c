@@ -0,0 +1,204 @@
+//----------------------------------------------------------------------------
+// EnsoniqFS plugin for TotalCommander
+//
+// POSIX PORT: benchmark helpers
+//----------------------------------------------------------------------------
+//
+// (c) 2006 Thoralt Franz
+//
+// This source code was written using Dev-Cpp 4.9.9.2
+// If you want to compile it, get Dev-Cpp. Normally the code should compile
+// with other IDEs/compilers too (with small modifications), but I did not
+// test it.
+//
+//----------------------------------------------------------------------------
+// License
+//----------------------------------------------------------------------------
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+// MA  02110-1301, USA.
+//
+// Alternatively, download a copy of the license here:
+// http://www.gnu.org/licenses/gpl.txt
+//----------------------------------------------------------------------------
+#include <time.h>
+#include "bench.h"
+#include "fsplugin.h"
+
+//----------------------------------------------------------------------------
+// externals
+//----------------------------------------------------------------------------
+extern FsDefaultParamStruct g_DefaultParams;
+extern DISK *g_pDiskListRoot;
+
+//----------------------------------------------------------------------------
+// BenchTime
+//
+// -> --
+// <- monotonic time in seconds
+//----------------------------------------------------------------------------
+double BenchTime(void)
+{
+	struct timespec Now;
+
+	clock_gettime(CLOCK_MONOTONIC, &Now);
+	return Now.tv_sec + Now.tv_nsec/1e9;
+}
+
+//----------------------------------------------------------------------------
+// SetFATEntryRaw
+//
+// Store a 24 bit FAT entry in a FAT buffer (170 entries per block)
+//----------------------------------------------------------------------------
+static void SetFATEntryRaw(unsigned char *ucFAT, DWORD dwBlock, DWORD dwValue)
+{
+	unsigned char *ucEntry = ucFAT + (dwBlock/170)*512 + (dwBlock%170)*3;
+
+	ucEntry[0] = (dwValue>>16) & 0xFF;
+	ucEntry[1] = (dwValue>>8) & 0xFF;
+	ucEntry[2] = dwValue & 0xFF;
+}
+
+//----------------------------------------------------------------------------
+// BenchMakeImage
+//
+// Create an Ensoniq ISO image: device ID block, OS block, root directory
+// and FAT. The data blocks are either free (and zero) or, with iFull, filled
+// with random bytes and linked to one chain, so reads of them are not
+// answered from the FAT without I/O. The chain is not listed in the root
+// directory.
+//
+// -> cFileName = name of the image file
+//    dwBlocks = number of blocks
+//    iFull = allocate and fill all data blocks
+// <- ERR_OK
+//    ERR_MEM
+//    ERR_WRITE
+//----------------------------------------------------------------------------
+int BenchMakeImage(const char *cFileName, DWORD dwBlocks, int iFull)
+{
+	DWORD dwFATBlocks = (dwBlocks+169)/170, dwFree, i, j;
+	unsigned char *ucHeader, ucBlock[512];
+	FILE *f;
+
+	// blocks 0-4 and the FAT
+	ucHeader = calloc(5+dwFATBlocks, 512);
+	if(NULL==ucHeader) return ERR_MEM;
+
+	// device ID block: geometry, number of blocks, signature
+	ucHeader[512+5] = 10;		// sectors per track
+	ucHeader[512+7] = 2;		// heads
+	ucHeader[512+9] = 80;		// cylinders
+	ucHeader[512+11] = 2;		// 512 bytes per sector
+	ucHeader[512+14] = (dwBlocks>>24) & 0xFF;
+	ucHeader[512+15] = (dwBlocks>>16) & 0xFF;
+	ucHeader[512+16] = (dwBlocks>>8) & 0xFF;
+	ucHeader[512+17] = dwBlocks & 0xFF;
+	memcpy(ucHeader+512+31, "BENCH  ", 7);
+	ucHeader[512+38] = 'I'; ucHeader[512+39] = 'D';
+
+	// OS block: free blocks, signature
+	dwFree = iFull ? 0 : dwBlocks - 5 - dwFATBlocks;
+	ucHeader[1024+0] = (dwFree>>24) & 0xFF;
+	ucHeader[1024+1] = (dwFree>>16) & 0xFF;
+	ucHeader[1024+2] = (dwFree>>8) & 0xFF;
+	ucHeader[1024+3] = dwFree & 0xFF;
+	ucHeader[1024+28] = 'O'; ucHeader[1024+29] = 'S';
+
+	// empty root directory
+	ucHeader[4*512+510] = 'D'; ucHeader[4*512+511] = 'R';
+
+	// FAT: blocks 0-4 and the FAT itself are used, the root directory is a
+	// chain of two blocks
+	for(i=0; i<dwFATBlocks; i++)
+	{
+		ucHeader[(5+i)*512+510] = 'F'; ucHeader[(5+i)*512+511] = 'B';
+	}
+	for(i=0; i<5+dwFATBlocks; i++) SetFATEntryRaw(ucHeader+5*512, i, 1);
+	SetFATEntryRaw(ucHeader+5*512, 3, 4);
+	if(iFull)
+	{
+		for(i=5+dwFATBlocks; i+1<dwBlocks; i++)
+		{
+			SetFATEntryRaw(ucHeader+5*512, i, i+1);
+		}
+		SetFATEntryRaw(ucHeader+5*512, dwBlocks-1, 1);
+	}
+
+	f = fopen(cFileName, "wb");
+	if(NULL==f)
+	{
+		free(ucHeader);
+		return ERR_WRITE;
+	}
+	if(5+dwFATBlocks!=fwrite(ucHeader, 512, 5+dwFATBlocks, f))
+	{
+		fclose(f);
+		free(ucHeader);
+		return ERR_WRITE;
+	}
+	free(ucHeader);
+
+	memset(ucBlock, 0, 512);
+	for(i=5+dwFATBlocks; i<dwBlocks; i++)
+	{
+		if(iFull) for(j=0; j<512; j++) ucBlock[j] = rand();
+		if(1!=fwrite(ucBlock, 512, 1, f))
+		{
+			fclose(f);
+			return ERR_WRITE;
+		}
+	}
+
+	if(0!=fclose(f)) return ERR_WRITE;
+	return ERR_OK;
+}
+
+//----------------------------------------------------------------------------
+// BenchMount
+//
+// Mount an image file the way the plugin does: an INI file lists the image,
+// ScanDevices() probes it. The disk is activated on first access.
+//
+// -> cFileName = name of the image file
+// <- pointer to the disk or NULL
+//----------------------------------------------------------------------------
+DISK *BenchMount(const char *cFileName)
+{
+	FILE *f;
+
+	BenchUnmount();
+
+	snprintf(g_DefaultParams.DefaultIniName, MAX_PATH, "%s.ini", cFileName);
+	f = fopen(g_DefaultParams.DefaultIniName, "w");
+	if(NULL==f) return NULL;
+	fprintf(f, "[EnsoniqFS]\nimage=%s\n", cFileName);
+	fclose(f);
+
+	g_pDiskListRoot = ScanDevices(0);
+	remove(g_DefaultParams.DefaultIniName);
+	return g_pDiskListRoot;
+}
+
+//----------------------------------------------------------------------------
+// BenchUnmount
+//
+// Write back and release all mounted disks
+//----------------------------------------------------------------------------
+void BenchUnmount(void)
+{
+	if(NULL==g_pDiskListRoot) return;
+	FreeDiskList(0, g_pDiskListRoot);
+	g_pDiskListRoot = NULL;
+}
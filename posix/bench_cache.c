@@ -0,0 +1,211 @@
+//----------------------------------------------------------------------------
+// EnsoniqFS plugin for TotalCommander
+//
+// POSIX PORT: cache lookup benchmark
+//----------------------------------------------------------------------------
+//
+// (c) 2006 Thoralt Franz
+//
+// This source code was written using Dev-Cpp 4.9.9.2
+// If you want to compile it, get Dev-Cpp. Normally the code should compile
+// with other IDEs/compilers too (with small modifications), but I did not
+// test it.
+//
+//----------------------------------------------------------------------------
+// License
+//----------------------------------------------------------------------------
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+// MA  02110-1301, USA.
+//
+// Alternatively, download a copy of the license here:
+// http://www.gnu.org/licenses/gpl.txt
+//----------------------------------------------------------------------------
+#include "bench.h"
+
+//----------------------------------------------------------------------------
+// Fills the block cache of a disk step by step up to CACHE_MAX_SLOTS and
+// measures the time of a cache lookup (hit and miss) at every size, and
+// the number of slots a hit compares. The same lookups by a linear search
+// of the cache table, which is how the cache looked up blocks before the
+// hash index, are timed for comparison.
+//
+// usage: bench_cache [image file]
+//----------------------------------------------------------------------------
+
+#define LOOKUPS		1000000	// timed lookups per cache size and kind
+#define SCANS		20000	// timed linear searches per cache size
+#define PROBES		1000	// hits whose hash chain position is counted
+
+//----------------------------------------------------------------------------
+// externals
+//----------------------------------------------------------------------------
+extern int g_iOptionMemoryMapLimit;
+extern int g_iOptionRamImageLimit;
+extern int g_iOptionCacheBudget;
+
+//----------------------------------------------------------------------------
+// LinearLookup
+//
+// Reference: find a block by searching the whole cache table
+//
+// -> pDisk = pointer to valid disk structure
+//    dwBlock = block to find
+// <- 1 if the block is in the cache, 0 otherwise
+//----------------------------------------------------------------------------
+static int LinearLookup(DISK *pDisk, DWORD dwBlock)
+{
+	DWORD i;
+
+	for(i=0; i<pDisk->dwCacheSlots; i++)
+	{
+		if(dwBlock==pDisk->dwCacheTable[i]) return 1;
+	}
+	return 0;
+}
+
+//----------------------------------------------------------------------------
+// number of blocks in the cache at which the lookups are timed (the disk
+// itself occupies a few slots after mounting, so the last step stays below
+// CACHE_MAX_SLOTS to avoid evictions)
+//----------------------------------------------------------------------------
+static const DWORD g_dwFillSteps[] =
+	{ 256, 512, 1024, 2048, 4096, 8192, 16384, 30000 };
+
+//----------------------------------------------------------------------------
+// ChainLength
+//
+// Count the hash chain entries compared by a lookup of a cached block
+//
+// -> pDisk = pointer to valid disk structure
+//    dwBlock = block in the cache
+// <- number of slots compared
+//----------------------------------------------------------------------------
+static DWORD ChainLength(DISK *pDisk, DWORD dwBlock)
+{
+	DWORD dwBucket, dwSlot, dwLength;
+
+	// the bucket is the one whose chain holds the block
+	for(dwBucket=0; dwBucket<CACHE_HASH_SIZE; dwBucket++)
+	{
+		dwLength = 0;
+		for(dwSlot=pDisk->dwCacheHashHead[dwBucket]; CACHE_NONE!=dwSlot;
+			dwSlot=pDisk->dwCacheHashNext[dwSlot])
+		{
+			dwLength++;
+			if(dwBlock==pDisk->dwCacheTable[dwSlot]) return dwLength;
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *cFileName = (argc>1) ? argv[1] : "bench_cache.img";
+	DWORD dwBlocks = 2*CACHE_MAX_SLOTS, dwFirst, dwFilled = 0, dwFound;
+	DWORD *dwHit, *dwMiss, i, j;
+	unsigned char ucBuf[512];
+	double dStart, dHit, dMiss, dScan, dProbes;
+	DISK *pDisk;
+
+	// keep the image out of memory so that all reads go through the cache,
+	// and let the cache grow to its maximum size
+	g_iOptionMemoryMapLimit = 0;
+	g_iOptionRamImageLimit = 0;
+	g_iOptionCacheBudget = CACHE_MAX_SLOTS/2048 + 1;
+
+	srand(1);
+	dwHit = malloc(LOOKUPS*sizeof(DWORD));
+	dwMiss = malloc(LOOKUPS*sizeof(DWORD));
+	if((NULL==dwHit)||(NULL==dwMiss)||
+	   (ERR_OK!=BenchMakeImage(cFileName, dwBlocks, 0)))
+	{
+		fprintf(stderr, "Could not create %s.\n", cFileName);
+		return 1;
+	}
+	pDisk = BenchMount(cFileName);
+	if((NULL==pDisk)||(ERR_OK!=ReadBlock(pDisk, 0, ucBuf)))
+	{
+		fprintf(stderr, "Could not mount %s.\n", cFileName);
+		return 1;
+	}
+
+	// the benchmark blocks are taken from the upper half of the disk, the
+	// ones not inserted yet are used for misses
+	dwFirst = dwBlocks/2;
+	memset(ucBuf, 0, 512);
+
+	printf("cached blocks  slots  probes   hit ns  miss ns  linear ns\n");
+	EnterCriticalSection(&pDisk->csLock);
+	for(j=0; j<sizeof(g_dwFillSteps)/sizeof(DWORD); j++)
+	{
+		while(dwFilled<g_dwFillSteps[j])
+		{
+			CacheInsertReadBlock(pDisk, dwFirst+dwFilled, ucBuf, 0);
+			dwFilled++;
+		}
+
+		for(i=0; i<LOOKUPS; i++)
+		{
+			dwHit[i] = dwFirst + rand()%dwFilled;
+			dwMiss[i] = dwFirst + dwFilled + rand()%(dwFirst-dwFilled);
+		}
+
+		dwFound = 0;
+		dStart = BenchTime();
+		for(i=0; i<LOOKUPS; i++) dwFound += CacheContainsBlock(pDisk, dwHit[i]);
+		dHit = BenchTime() - dStart;
+		if(LOOKUPS!=dwFound)
+		{
+			fprintf(stderr, "%u of %u blocks not found.\n", LOOKUPS-dwFound,
+				LOOKUPS);
+			return 1;
+		}
+
+		dwFound = 0;
+		dStart = BenchTime();
+		for(i=0; i<LOOKUPS; i++) dwFound += CacheContainsBlock(pDisk, dwMiss[i]);
+		dMiss = BenchTime() - dStart;
+		if(0!=dwFound)
+		{
+			fprintf(stderr, "%u missing blocks found.\n", dwFound);
+			return 1;
+		}
+
+		dStart = BenchTime();
+		for(i=0; i<SCANS; i++) dwFound += LinearLookup(pDisk, dwHit[i]);
+		dScan = BenchTime() - dStart;
+		if(SCANS!=dwFound)
+		{
+			fprintf(stderr, "Linear search found %u of %u blocks.\n", dwFound,
+				SCANS);
+			return 1;
+		}
+
+		// slots compared per hit: stays near 1 while the cache grows
+		dProbes = 0;
+		for(i=0; i<PROBES; i++) dProbes += ChainLength(pDisk, dwHit[i]);
+
+		printf("%13u %6u %7.2f %8.1f %8.1f %10.1f\n", dwFilled,
+			pDisk->dwCacheSlots, dProbes/PROBES, dHit*1e9/LOOKUPS,
+			dMiss*1e9/LOOKUPS, dScan*1e9/SCANS);
+	}
+	LeaveCriticalSection(&pDisk->csLock);
+
+	BenchUnmount();
+	free(dwHit);
+	free(dwMiss);
+	remove(cFileName);
+	return 0;
+}
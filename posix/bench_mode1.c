@@ -0,0 +1,236 @@
+//----------------------------------------------------------------------------
+// EnsoniqFS plugin for TotalCommander
+//
+// POSIX PORT: Mode1 image benchmark
+//----------------------------------------------------------------------------
+//
+// (c) 2006 Thoralt Franz
+//
+// This source code was written using Dev-Cpp 4.9.9.2
+// If you want to compile it, get Dev-Cpp. Normally the code should compile
+// with other IDEs/compilers too (with small modifications), but I did not
+// test it.
+//
+//----------------------------------------------------------------------------
+// License
+//----------------------------------------------------------------------------
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+// MA  02110-1301, USA.
+//
+// Alternatively, download a copy of the license here:
+// http://www.gnu.org/licenses/gpl.txt
+//----------------------------------------------------------------------------
+#include "bench.h"
+
+//----------------------------------------------------------------------------
+// Reads a synthetic Mode1 BIN image (2352 byte raw sectors, 650 MB like a
+// full CD) sequentially in 64 KB requests three ways: the way the plugin
+// read Mode1 images before (one seek and one 2048 byte read per raw
+// sector), with the Mode1 backend (MODE1_READ_SECTORS raw sectors per read)
+// and through the whole disk layer (ReadBlocks(), which fills the cache
+// too). All passes find the image in the OS file cache (it has just been
+// written), so they compare the read path and not the disk.
+//
+// usage: bench_mode1 [image file] [size in MB]
+//----------------------------------------------------------------------------
+
+#define SEQUENTIAL_REQUEST	128		// blocks per ReadBlocks() call
+
+//----------------------------------------------------------------------------
+// externals
+//----------------------------------------------------------------------------
+extern int g_iOptionMemoryMapLimit;
+extern int g_iOptionRamImageLimit;
+
+//----------------------------------------------------------------------------
+// ToBCD
+//----------------------------------------------------------------------------
+static unsigned char ToBCD(DWORD dwValue)
+{
+	return ((dwValue/10)<<4) | (dwValue%10);
+}
+
+//----------------------------------------------------------------------------
+// MakeMode1Image
+//
+// Create an ISO image with BenchMakeImage() and wrap every 2048 bytes into
+// a raw Mode1 sector: sync pattern, address and mode in the 16 byte header,
+// the 288 byte EDC/ECC tail is left empty.
+//
+// -> cFileName = name of the image file
+//    dwSectors = number of raw sectors
+// <- ERR_OK
+//    ERR_MEM
+//    ERR_READ
+//    ERR_WRITE
+//----------------------------------------------------------------------------
+static int MakeMode1Image(const char *cFileName, DWORD dwSectors)
+{
+	unsigned char ucSector[2352];
+	char cISOName[MAX_PATH];
+	DWORD dwSector, dwAddress;
+	FILE *fISO, *fBIN;
+	int iResult;
+
+	snprintf(cISOName, MAX_PATH, "%s.iso", cFileName);
+	iResult = BenchMakeImage(cISOName, dwSectors*4, 1);
+	if(ERR_OK!=iResult) return iResult;
+
+	fISO = fopen(cISOName, "rb");
+	fBIN = fopen(cFileName, "wb");
+	iResult = ((NULL==fISO)||(NULL==fBIN)) ? ERR_WRITE : ERR_OK;
+
+	memset(ucSector, 0, 2352);
+	memset(ucSector+1, 0xFF, 10);
+	ucSector[15] = 1;
+	for(dwSector=0; (ERR_OK==iResult)&&(dwSector<dwSectors); dwSector++)
+	{
+		dwAddress = dwSector + 150;
+		ucSector[12] = ToBCD(dwAddress/4500);
+		ucSector[13] = ToBCD((dwAddress/75)%60);
+		ucSector[14] = ToBCD(dwAddress%75);
+		if(1!=fread(ucSector+16, 2048, 1, fISO)) iResult = ERR_READ;
+		else if(1!=fwrite(ucSector, 2352, 1, fBIN)) iResult = ERR_WRITE;
+	}
+
+	if(fISO) fclose(fISO);
+	if(fBIN&&(0!=fclose(fBIN))) iResult = ERR_WRITE;
+	remove(cISOName);
+	return iResult;
+}
+
+//----------------------------------------------------------------------------
+// ReadPerSector
+//
+// Reference: read all data of a Mode1 image with one seek and one read per
+// raw sector
+//
+// -> cFileName = name of the image file
+//    dwSectors = number of raw sectors
+//    ucBuf = buffer for one sector (2048 bytes)
+// <- number of read calls or 0 on error
+//----------------------------------------------------------------------------
+static DWORD ReadPerSector(const char *cFileName, DWORD dwSectors,
+	unsigned char *ucBuf)
+{
+	DWORD dwSector, dwRead;
+	LONG lHigh;
+	__int64 iiOffset;
+	HANDLE h;
+
+	h = CreateFile(cFileName, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(INVALID_HANDLE_VALUE==h) return 0;
+
+	for(dwSector=0; dwSector<dwSectors; dwSector++)
+	{
+		iiOffset = (__int64)dwSector*2352 + 16;
+		lHigh = (LONG)(iiOffset>>32);
+		SetFilePointer(h, (LONG)(iiOffset&0xFFFFFFFF), &lHigh, FILE_BEGIN);
+		if((0==ReadFile(h, ucBuf, 2048, &dwRead, NULL))||(2048!=dwRead))
+		{
+			CloseHandle(h);
+			return 0;
+		}
+	}
+
+	CloseHandle(h);
+	return dwSectors;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *cFileName = (argc>1) ? argv[1] : "bench_mode1.bin";
+	DWORD dwSectors = ((argc>2) ? atoi(argv[2]) : 650) * (1024*1024/2352);
+	DWORD dwBlocks = dwSectors*4, dwCalls, i;
+	unsigned char *ucBuf;
+	double dStart, dTime;
+	DISK *pDisk;
+
+	// the disk layer reads through the cache (Mode1 images can not be
+	// mapped anyway)
+	g_iOptionMemoryMapLimit = 0;
+	g_iOptionRamImageLimit = 0;
+
+	srand(1);
+	if(ERR_OK!=MakeMode1Image(cFileName, dwSectors))
+	{
+		fprintf(stderr, "Could not create %s.\n", cFileName);
+		return 1;
+	}
+	ucBuf = malloc(SEQUENTIAL_REQUEST*512);
+	pDisk = BenchMount(cFileName);
+	if((NULL==ucBuf)||(NULL==pDisk))
+	{
+		fprintf(stderr, "Could not mount %s.\n", cFileName);
+		return 1;
+	}
+	printf("%s, %u raw sectors (%.0f MB)\n", pDisk->pBackend->cName,
+		dwSectors, dwSectors*2352.0/(1024*1024));
+
+	// per sector reference first, it also brings the file into memory
+	dStart = BenchTime();
+	dwCalls = ReadPerSector(cFileName, dwSectors, ucBuf);
+	dTime = BenchTime() - dStart;
+	if(0==dwCalls)
+	{
+		fprintf(stderr, "Per sector read failed.\n");
+		return 1;
+	}
+	printf("per sector: %8.1f MB/s  %8u read calls\n",
+		dwSectors/512.0/dTime, dwCalls);
+
+	// the backend alone (the first access opens the device)
+	if(ERR_OK!=ReadBlock(pDisk, 0, ucBuf))
+	{
+		fprintf(stderr, "ReadBlock(0) failed.\n");
+		return 1;
+	}
+	dwCalls = 0;
+	dStart = BenchTime();
+	for(i=0; i+SEQUENTIAL_REQUEST<=dwBlocks; i+=SEQUENTIAL_REQUEST)
+	{
+		if(ERR_OK!=pDisk->pBackend->ReadBlocks(pDisk, i, SEQUENTIAL_REQUEST,
+			ucBuf))
+		{
+			fprintf(stderr, "Backend read of block %u failed.\n", i);
+			return 1;
+		}
+		dwCalls += (SEQUENTIAL_REQUEST+MODE1_READ_SECTORS*4-1)/
+			(MODE1_READ_SECTORS*4);
+	}
+	dTime = BenchTime() - dStart;
+	printf("backend:    %8.1f MB/s  %8u read calls\n",
+		dwSectors/512.0/dTime, dwCalls);
+
+	dwCalls = pDisk->dwDeviceReads;
+	dStart = BenchTime();
+	for(i=0; i+SEQUENTIAL_REQUEST<=dwBlocks; i+=SEQUENTIAL_REQUEST)
+	{
+		if(ERR_OK!=ReadBlocks(pDisk, i, SEQUENTIAL_REQUEST, ucBuf))
+		{
+			fprintf(stderr, "ReadBlocks(%u) failed.\n", i);
+			return 1;
+		}
+	}
+	dTime = BenchTime() - dStart;
+	printf("disk layer: %8.1f MB/s  %8u read calls\n",
+		dwSectors/512.0/dTime, pDisk->dwDeviceReads-dwCalls);
+
+	BenchUnmount();
+	free(ucBuf);
+	remove(cFileName);
+	return 0;
+}
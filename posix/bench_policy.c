@@ -0,0 +1,216 @@
+//----------------------------------------------------------------------------
+// EnsoniqFS plugin for TotalCommander
+//
+// POSIX PORT: cache policy benchmark
+//----------------------------------------------------------------------------
+//
+// (c) 2006 Thoralt Franz
+//
+// This source code was written using Dev-Cpp 4.9.9.2
+// If you want to compile it, get Dev-Cpp. Normally the code should compile
+// with other IDEs/compilers too (with small modifications), but I did not
+// test it.
+//
+//----------------------------------------------------------------------------
+// License
+//----------------------------------------------------------------------------
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+// MA  02110-1301, USA.
+//
+// Alternatively, download a copy of the license here:
+// http://www.gnu.org/licenses/gpl.txt
+//----------------------------------------------------------------------------
+#include "bench.h"
+
+//----------------------------------------------------------------------------
+// Replays one synthetic trace with CACHE_POLICY_LRU and CACHE_POLICY_2Q:
+// phases of random reads of a hot working set (samples played again and
+// again) mixed with FAT reads, each followed by a sequential scan twice the
+// size of the cache (a long sample streamed once). The hot blocks are
+// READ_AHEAD_MIN blocks apart, so a miss does not read other hot blocks
+// ahead. Reports the hit ratio of the hot and the FAT reads and the number
+// of device reads. The hot set is run at several sizes around
+// CACHE_PROTECTED_MAX (half the cache).
+//
+// usage: bench_policy [image file]
+//----------------------------------------------------------------------------
+
+#define IMAGE_BLOCKS	65536	// 32 MB
+#define CACHE_BUDGET	2		// MB, limits the cache to 3584 slots
+#define ROUNDS			10		// hot phase + scan
+#define HOT_READS		4		// reads per hot block in a hot phase
+#define FAT_INTERVAL	8		// every 8th read of a hot phase is a FAT read
+
+//----------------------------------------------------------------------------
+// externals
+//----------------------------------------------------------------------------
+extern int g_iOptionMemoryMapLimit;
+extern int g_iOptionRamImageLimit;
+extern int g_iOptionCacheBudget;
+
+//----------------------------------------------------------------------------
+// hot set sizes in percent of the cache
+//----------------------------------------------------------------------------
+static const int g_iHotPercent[] = { 25, 45, 60 };
+
+typedef struct _TRACE_RESULT
+{
+	DWORD dwHotReads, dwHotHits;
+	DWORD dwFATReads, dwFATHits;
+	DWORD dwDeviceReads;
+} TRACE_RESULT;
+
+//----------------------------------------------------------------------------
+// TraceRead
+//
+// Read one block and tell if it was in the cache
+//
+// -> pDisk = pointer to valid disk structure
+//    dwBlock = block to read
+// <- 1 = cache hit, 0 = miss, -1 = read error
+//----------------------------------------------------------------------------
+static int TraceRead(DISK *pDisk, DWORD dwBlock)
+{
+	unsigned char ucBuf[512];
+	int iHit;
+
+	EnterCriticalSection(&pDisk->csLock);
+	iHit = CacheContainsBlock(pDisk, dwBlock);
+	if(ERR_OK!=ReadBlock(pDisk, dwBlock, ucBuf)) iHit = -1;
+	LeaveCriticalSection(&pDisk->csLock);
+	return iHit;
+}
+
+//----------------------------------------------------------------------------
+// RunTrace
+//
+// Mount the image, fill the cache to its maximum size and replay the trace
+// with a given policy
+//
+// -> cFileName = name of the image file
+//    iPolicy = CACHE_POLICY_LRU or CACHE_POLICY_2Q
+//    iHotPercent = size of the hot set in percent of the cache
+//    pResult = receives the statistics
+//    pdwSlots = receives the cache size
+// <- ERR_OK
+//    ERR_NOT_OPEN
+//    ERR_READ
+//----------------------------------------------------------------------------
+static int RunTrace(const char *cFileName, int iPolicy, int iHotPercent,
+	TRACE_RESULT *pResult, DWORD *pdwSlots)
+{
+	DWORD dwFATEnd, dwHotFirst, dwHotBlocks, dwScan, dwScanFirst, dwBlock;
+	DWORD dwRound, i;
+	unsigned char ucBuf[512];
+	DISK *pDisk;
+	int iHit;
+
+	// the cache is set up by the first access
+	memset(pResult, 0, sizeof(TRACE_RESULT));
+	pDisk = BenchMount(cFileName);
+	if((NULL==pDisk)||(ERR_OK!=ReadBlock(pDisk, 0, ucBuf))||
+	   (ERR_OK!=CacheSetPolicy(pDisk, iPolicy)))
+	{
+		return ERR_NOT_OPEN;
+	}
+
+	// the upper half of the disk is streamed, a full pass lets the cache
+	// grow to the budget
+	dwScanFirst = IMAGE_BLOCKS/2;
+	for(dwBlock=dwScanFirst; dwBlock<IMAGE_BLOCKS; dwBlock++)
+	{
+		if(TraceRead(pDisk, dwBlock)<0) return ERR_READ;
+	}
+	*pdwSlots = pDisk->dwCacheSlots;
+
+	// the hot set lies between the FAT and the streamed half
+	dwFATEnd = 5 + IMAGE_BLOCKS/170 + 1;
+	dwHotFirst = dwFATEnd + READ_AHEAD_MIN;
+	dwHotBlocks = pDisk->dwCacheSlots*iHotPercent/100;
+	dwScan = dwScanFirst;
+	pResult->dwDeviceReads = pDisk->dwDeviceReads;
+
+	srand(1);
+	for(dwRound=0; dwRound<ROUNDS; dwRound++)
+	{
+		for(i=0; i<HOT_READS*dwHotBlocks; i++)
+		{
+			if(0==(i%FAT_INTERVAL))
+			{
+				iHit = TraceRead(pDisk, 5 + rand()%(dwFATEnd-5));
+				if(iHit<0) return ERR_READ;
+				pResult->dwFATReads++;
+				pResult->dwFATHits += iHit;
+			}
+			iHit = TraceRead(pDisk,
+				dwHotFirst + (rand()%dwHotBlocks)*READ_AHEAD_MIN);
+			if(iHit<0) return ERR_READ;
+			pResult->dwHotReads++;
+			pResult->dwHotHits += iHit;
+		}
+
+		for(i=0; i<2*pDisk->dwCacheSlots; i++)
+		{
+			if(TraceRead(pDisk, dwScan)<0) return ERR_READ;
+			if(++dwScan>=IMAGE_BLOCKS) dwScan = dwScanFirst;
+		}
+	}
+
+	pResult->dwDeviceReads = pDisk->dwDeviceReads - pResult->dwDeviceReads;
+	BenchUnmount();
+	return ERR_OK;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *cFileName = (argc>1) ? argv[1] : "bench_policy.img";
+	const char *cPolicy[] = { "LRU", "2Q" };
+	TRACE_RESULT Result;
+	DWORD dwSlots;
+	int i, iPolicy;
+
+	// keep the image out of memory so that all reads go through the cache
+	g_iOptionMemoryMapLimit = 0;
+	g_iOptionRamImageLimit = 0;
+	g_iOptionCacheBudget = CACHE_BUDGET;
+
+	srand(1);
+	if(ERR_OK!=BenchMakeImage(cFileName, IMAGE_BLOCKS, 1))
+	{
+		fprintf(stderr, "Could not create %s.\n", cFileName);
+		return 1;
+	}
+
+	printf("hot set  policy  slots  hot hits  FAT hits  device reads\n");
+	for(i=0; i<sizeof(g_iHotPercent)/sizeof(int); i++)
+	{
+		for(iPolicy=CACHE_POLICY_LRU; iPolicy<=CACHE_POLICY_2Q; iPolicy++)
+		{
+			if(ERR_OK!=RunTrace(cFileName, iPolicy, g_iHotPercent[i],
+				&Result, &dwSlots))
+			{
+				fprintf(stderr, "Could not replay the trace.\n");
+				return 1;
+			}
+			printf("%6d%%  %-6s %6u %8.1f%% %8.1f%% %13u\n", g_iHotPercent[i],
+				cPolicy[iPolicy], dwSlots,
+				100.0*Result.dwHotHits/Result.dwHotReads,
+				100.0*Result.dwFATHits/Result.dwFATReads, Result.dwDeviceReads);
+		}
+	}
+
+	remove(cFileName);
+	return 0;
+}
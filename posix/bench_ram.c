@@ -0,0 +1,242 @@
+//----------------------------------------------------------------------------
+// EnsoniqFS plugin for TotalCommander
+//
+// POSIX PORT: small image benchmark
+//----------------------------------------------------------------------------
+//
+// (c) 2006 Thoralt Franz
+//
+// This source code was written using Dev-Cpp 4.9.9.2
+// If you want to compile it, get Dev-Cpp. Normally the code should compile
+// with other IDEs/compilers too (with small modifications), but I did not
+// test it.
+//
+//----------------------------------------------------------------------------
+// License
+//----------------------------------------------------------------------------
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+// MA  02110-1301, USA.
+//
+// Alternatively, download a copy of the license here:
+// http://www.gnu.org/licenses/gpl.txt
+//----------------------------------------------------------------------------
+#include "bench.h"
+
+//----------------------------------------------------------------------------
+// Compares the ways small image files are held: loaded into memory
+// (RamImageLimit), mapped (MemoryMapLimit, ISO and GKH images only) and read
+// through the block cache. For ISO images of several sizes and a Giebler HD
+// floppy image (which can not be mapped) it reports
+//  - the time of the first access (an image in memory is loaded then)
+//  - the time of a random ReadBlock()
+//  - the time of an update: one FAT block and 16 data blocks written and
+//    flushed. An image in memory writes back everything from the first to
+//    the last modified block, which is most of the image for an update of
+//    the FAT and some data.
+// The files are in the OS file cache, so write back costs copying and no
+// disk I/O.
+//
+// usage: bench_ram [image file]
+//----------------------------------------------------------------------------
+
+#define RANDOM_READS	200000
+#define UPDATES			200
+#define UPDATE_BLOCKS	16
+
+//----------------------------------------------------------------------------
+// externals
+//----------------------------------------------------------------------------
+extern int g_iOptionMemoryMapLimit;
+extern int g_iOptionRamImageLimit;
+
+//----------------------------------------------------------------------------
+// image sizes (in blocks, 0 = Giebler HD floppy image) and modes
+//----------------------------------------------------------------------------
+static const DWORD g_dwImageBlocks[] = { 0, 3200, 8192, 32768, 131072 };
+
+#define MODE_RAM	0
+#define MODE_MAP	1
+#define MODE_CACHE	2
+
+static const char *g_cModeName[] = { "memory", "mapped", "cache" };
+
+//----------------------------------------------------------------------------
+// MakeGieblerImage
+//
+// Create an ISO image with BenchMakeImage() and put a Giebler EDA header
+// (HD, all 3200 blocks stored) in front of it
+//
+// -> cFileName = name of the image file
+// <- ERR_OK
+//    ERR_MEM
+//    ERR_READ
+//    ERR_WRITE
+//----------------------------------------------------------------------------
+static int MakeGieblerImage(const char *cFileName)
+{
+	unsigned char ucBlock[512];
+	char cISOName[MAX_PATH];
+	FILE *fISO, *fImage;
+	int iResult;
+	DWORD i;
+
+	snprintf(cISOName, MAX_PATH, "%s.iso", cFileName);
+	iResult = BenchMakeImage(cISOName, 3200, 1);
+	if(ERR_OK!=iResult) return iResult;
+
+	// header block: the map at 0x60 is all zero (every block stored)
+	memset(ucBlock, 0, 512);
+	ucBlock[0x00] = 0x0D; ucBlock[0x01] = 0x0A;
+	ucBlock[0x4E] = 0x0D; ucBlock[0x4F] = 0x0A;
+	ucBlock[0x5D] = 0x0D; ucBlock[0x5E] = 0x0A; ucBlock[0x5F] = 0x1A;
+	ucBlock[0x1FF] = 0xCB;
+
+	fISO = fopen(cISOName, "rb");
+	fImage = fopen(cFileName, "wb");
+	iResult = ((NULL==fISO)||(NULL==fImage)) ? ERR_WRITE : ERR_OK;
+	if((ERR_OK==iResult)&&(1!=fwrite(ucBlock, 512, 1, fImage)))
+	{
+		iResult = ERR_WRITE;
+	}
+	for(i=0; (ERR_OK==iResult)&&(i<3200); i++)
+	{
+		if(1!=fread(ucBlock, 512, 1, fISO)) iResult = ERR_READ;
+		else if(1!=fwrite(ucBlock, 512, 1, fImage)) iResult = ERR_WRITE;
+	}
+
+	if(fISO) fclose(fISO);
+	if(fImage&&(0!=fclose(fImage))) iResult = ERR_WRITE;
+	remove(cISOName);
+	return iResult;
+}
+
+//----------------------------------------------------------------------------
+// RunImage
+//
+// Mount an image in one mode and time the first access, random reads and
+// updates
+//
+// -> cFileName = name of the image file
+//    dwBlocks = number of blocks of the image
+//    iMode = MODE_RAM, MODE_MAP or MODE_CACHE
+// <- ERR_OK
+//    ERR_NOT_SUPPORTED (the image can not be held this way)
+//    other errors from the disk layer
+//----------------------------------------------------------------------------
+static int RunImage(const char *cFileName, DWORD dwBlocks, int iMode)
+{
+	unsigned char ucFAT[512], ucData[UPDATE_BLOCKS*512];
+	double dStart, dOpen, dRead, dUpdate;
+	DWORD dwFATBlocks = (dwBlocks+169)/170, dwBlock, i;
+	int iResult;
+	DISK *pDisk;
+
+	// limits far above the image size switch a mode on
+	g_iOptionRamImageLimit = (MODE_RAM==iMode) ? 1024 : 0;
+	g_iOptionMemoryMapLimit = (MODE_MAP==iMode) ? 1024 : 0;
+
+	pDisk = BenchMount(cFileName);
+	if(NULL==pDisk) return ERR_NOT_OPEN;
+
+	dStart = BenchTime();
+	iResult = ReadBlock(pDisk, 0, ucFAT);
+	dOpen = BenchTime() - dStart;
+	if(ERR_OK!=iResult) return iResult;
+	if(((MODE_RAM==iMode)&&(NULL==pDisk->ucRamImage))||
+	   ((MODE_MAP==iMode)&&(NULL==pDisk->ucMapView)))
+	{
+		BenchUnmount();
+		return ERR_NOT_SUPPORTED;
+	}
+
+	srand(1);
+	dStart = BenchTime();
+	for(i=0; i<RANDOM_READS; i++)
+	{
+		iResult = ReadBlock(pDisk, rand()%dwBlocks, ucData);
+		if(ERR_OK!=iResult) return iResult;
+	}
+	dRead = BenchTime() - dStart;
+
+	// rewrite a FAT block with its own content and new data behind the FAT
+	for(i=0; i<UPDATE_BLOCKS*512; i++) ucData[i] = rand();
+	dStart = BenchTime();
+	for(i=0; i<UPDATES; i++)
+	{
+		dwBlock = 5 + rand()%dwFATBlocks;
+		iResult = ReadBlock(pDisk, dwBlock, ucFAT);
+		if(ERR_OK==iResult) iResult = WriteBlocks(pDisk, dwBlock, 1, ucFAT);
+		dwBlock = 5 + dwFATBlocks +
+			rand()%(dwBlocks - 5 - dwFATBlocks - UPDATE_BLOCKS);
+		if(ERR_OK==iResult)
+		{
+			iResult = WriteBlocks(pDisk, dwBlock, UPDATE_BLOCKS, ucData);
+		}
+		if(ERR_OK==iResult) iResult = CacheFlush(pDisk);
+		if(ERR_OK!=iResult) return iResult;
+	}
+	dUpdate = BenchTime() - dStart;
+
+	printf("%8.1f MB  %-7s %9.3f %9.3f %11.1f\n", dwBlocks/2048.0,
+		g_cModeName[iMode], dOpen*1e3, dRead*1e6/RANDOM_READS,
+		dUpdate*1e6/UPDATES);
+
+	BenchUnmount();
+	return ERR_OK;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *cFileName = (argc>1) ? argv[1] : "bench_ram.img";
+	DWORD dwBlocks, i;
+	int iMode, iResult;
+
+	printf("image        mode    open ms   read us   update us\n");
+	for(i=0; i<sizeof(g_dwImageBlocks)/sizeof(DWORD); i++)
+	{
+		srand(1);
+		dwBlocks = g_dwImageBlocks[i];
+		if(0==dwBlocks)
+		{
+			printf("Giebler HD floppy image:\n");
+			dwBlocks = 3200;
+			iResult = MakeGieblerImage(cFileName);
+		}
+		else
+		{
+			if(3200==dwBlocks) printf("ISO images:\n");
+			iResult = BenchMakeImage(cFileName, dwBlocks, 1);
+		}
+		if(ERR_OK!=iResult)
+		{
+			fprintf(stderr, "Could not create %s.\n", cFileName);
+			return 1;
+		}
+
+		for(iMode=MODE_RAM; iMode<=MODE_CACHE; iMode++)
+		{
+			iResult = RunImage(cFileName, dwBlocks, iMode);
+			if(ERR_NOT_SUPPORTED==iResult) continue;
+			if(ERR_OK!=iResult)
+			{
+				fprintf(stderr, "Benchmark failed (%d).\n", iResult);
+				return 1;
+			}
+		}
+	}
+
+	remove(cFileName);
+	return 0;
+}
@@ -0,0 +1,104 @@
+//----------------------------------------------------------------------------
+// EnsoniqFS plugin for TotalCommander
+//
+// POSIX PORT: block read benchmark
+//----------------------------------------------------------------------------
+//
+// (c) 2006 Thoralt Franz
+//
+// This source code was written using Dev-Cpp 4.9.9.2
+// If you want to compile it, get Dev-Cpp. Normally the code should compile
+// with other IDEs/compilers too (with small modifications), but I did not
+// test it.
+//
+//----------------------------------------------------------------------------
+// License
+//----------------------------------------------------------------------------
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+// MA  02110-1301, USA.
+//
+// Alternatively, download a copy of the license here:
+// http://www.gnu.org/licenses/gpl.txt
+//----------------------------------------------------------------------------
+#include "bench.h"
+
+//----------------------------------------------------------------------------
+// Reads a synthetic ISO image through the disk layer: sequential ReadBlocks()
+// in 64 KB requests and random ReadBlock() calls. Reports throughput and the
+// number of reads that reached the image file.
+//
+// usage: bench_read [image file] [size in MB]
+//----------------------------------------------------------------------------
+
+#define SEQUENTIAL_REQUEST	128		// blocks per ReadBlocks() call
+#define RANDOM_READS		200000
+
+int main(int argc, char *argv[])
+{
+	const char *cFileName = (argc>1) ? argv[1] : "bench_read.img";
+	DWORD dwBlocks = ((argc>2) ? atoi(argv[2]) : 64) * 2048, i, dwReads;
+	unsigned char *ucBuf;
+	double dStart, dTime;
+	DISK *pDisk;
+
+	srand(1);
+	if(ERR_OK!=BenchMakeImage(cFileName, dwBlocks, 1))
+	{
+		fprintf(stderr, "Could not create %s.\n", cFileName);
+		return 1;
+	}
+	ucBuf = malloc(SEQUENTIAL_REQUEST*512);
+	pDisk = BenchMount(cFileName);
+	if((NULL==ucBuf)||(NULL==pDisk))
+	{
+		fprintf(stderr, "Could not mount %s.\n", cFileName);
+		return 1;
+	}
+
+	// sequential
+	dStart = BenchTime();
+	for(i=0; i+SEQUENTIAL_REQUEST<=dwBlocks; i+=SEQUENTIAL_REQUEST)
+	{
+		if(ERR_OK!=ReadBlocks(pDisk, i, SEQUENTIAL_REQUEST, ucBuf))
+		{
+			fprintf(stderr, "ReadBlocks(%u) failed.\n", i);
+			return 1;
+		}
+	}
+	dTime = BenchTime() - dStart;
+	printf("backend: %s, %u blocks\n", pDisk->pBackend->cName, dwBlocks);
+	printf("sequential: %8.1f MB/s  %8u device reads\n",
+		dwBlocks/2048.0/dTime, pDisk->dwDeviceReads);
+
+	// random (the cache holds only a part of the image)
+	dwReads = pDisk->dwDeviceReads;
+	dStart = BenchTime();
+	for(i=0; i<RANDOM_READS; i++)
+	{
+		if(ERR_OK!=ReadBlock(pDisk, rand()%dwBlocks, ucBuf))
+		{
+			fprintf(stderr, "ReadBlock() failed.\n");
+			return 1;
+		}
+	}
+	dTime = BenchTime() - dStart;
+	printf("random:     %8.3f us/read %8u device reads\n",
+		dTime*1e6/RANDOM_READS, pDisk->dwDeviceReads-dwReads);
+
+	BenchUnmount();
+	free(ucBuf);
+	remove(cFileName);
+	return 0;
+}
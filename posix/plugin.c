@@ -0,0 +1,114 @@
+//----------------------------------------------------------------------------
+// EnsoniqFS plugin for TotalCommander
+//
+// POSIX PORT: plugin globals and progress dialog
+//----------------------------------------------------------------------------
+//
+// (c) 2006 Thoralt Franz
+//
+// This source code was written using Dev-Cpp 4.9.9.2
+// If you want to compile it, get Dev-Cpp. Normally the code should compile
+// with other IDEs/compilers too (with small modifications), but I did not
+// test it.
+//
+//----------------------------------------------------------------------------
+// License
+//----------------------------------------------------------------------------
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+// MA  02110-1301, USA.
+//
+// Alternatively, download a copy of the license here:
+// http://www.gnu.org/licenses/gpl.txt
+//----------------------------------------------------------------------------
+#include <windows.h>
+#include "fsplugin.h"
+#include "disk.h"
+#include "cache.h"
+#include "backend.h"
+#include "progressdlg.h"
+
+//----------------------------------------------------------------------------
+// The disk layer uses the device list, the INI file name and the options of
+// EnsoniqFS.c and the progress dialog of progressdlg.c. Both are part of the
+// Total Commander plugin and are replaced here. The option defaults are the
+// same as in EnsoniqFS.c, except that logging is off.
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+// globals
+//----------------------------------------------------------------------------
+
+// global root of device list
+DISK *g_pDiskListRoot = NULL;
+
+// INI file name (set by the program before calling ScanDevices())
+FsDefaultParamStruct g_DefaultParams;
+
+// global options
+int g_iOptionEnableFloppy = 1;
+int g_iOptionEnableCDROM = 1;
+int g_iOptionEnableImages = 1;
+int g_iOptionEnablePhysicalDisks = 1;
+int g_iOptionEnableLogging = 0;
+int g_iOptionReadAheadFloppy = 160;
+int g_iOptionReadAheadCDROM = 1024;
+int g_iOptionReadAheadDisk = 2048;
+int g_iOptionReadAheadImage = 4096;
+int g_iOptionMemoryMapLimit = 512;
+int g_iOptionRamImageLimit = 0;
+int g_iOptionDirectIODisk = 0;
+int g_iOptionDirectIOImage = 0;
+int g_iOptionDirectIOMinSize = 512;
+int g_iOptionCachePolicy = 1;
+int g_iOptionCacheBudget = 32;
+int g_iOptionIdleTimeout = 60;
+
+//----------------------------------------------------------------------------
+// library constructor and destructor, they do what DllMain() does for the
+// disk layer
+//----------------------------------------------------------------------------
+static void __attribute__((constructor)) LibraryAttach(void)
+{
+	CacheStartup();
+	BackendStartup();
+}
+
+static void __attribute__((destructor)) LibraryDetach(void)
+{
+	BackendShutdown();
+	CacheShutdown();
+}
+
+//----------------------------------------------------------------------------
+// progress dialog (not shown)
+//----------------------------------------------------------------------------
+int CreateProgressDialog()
+{
+	return 0;
+}
+
+int DestroyProgressDialog()
+{
+	return 0;
+}
+
+void UpdateProgressDialog(char *cText, int iProgress)
+{
+}
+
+HWND GetProgressDialogHwnd(void)
+{
+	return NULL;
+}
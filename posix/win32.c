@@ -0,0 +1,699 @@
+//----------------------------------------------------------------------------
+// EnsoniqFS plugin for TotalCommander
+//
+// POSIX PORT: Win32 subset on POSIX
+//----------------------------------------------------------------------------
+//
+// (c) 2006 Thoralt Franz
+//
+// This source code was written using Dev-Cpp 4.9.9.2
+// If you want to compile it, get Dev-Cpp. Normally the code should compile
+// with other IDEs/compilers too (with small modifications), but I did not
+// test it.
+//
+//----------------------------------------------------------------------------
+// License
+//----------------------------------------------------------------------------
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+// MA  02110-1301, USA.
+//
+// Alternatively, download a copy of the license here:
+// http://www.gnu.org/licenses/gpl.txt
+//----------------------------------------------------------------------------
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/statvfs.h>
+#include "windows.h"
+#include "winioctl.h"
+
+//----------------------------------------------------------------------------
+// handles
+//
+// A HANDLE points to a POSIX_HANDLE. Files keep their descriptor, file
+// mappings keep the descriptor of the mapped file and the mapping size.
+//----------------------------------------------------------------------------
+#define HANDLE_FILE		1
+#define HANDLE_MAPPING	2
+
+typedef struct _POSIX_HANDLE
+{
+	int iKind;			// HANDLE_FILE | HANDLE_MAPPING
+	int iFileDescriptor;
+	size_t nMapSize;	// size of the mapping (HANDLE_MAPPING only)
+} POSIX_HANDLE;
+
+typedef struct _POSIX_VIEW
+{
+	struct _POSIX_VIEW *pNext;
+	void *pBase;
+	size_t nSize;
+} POSIX_VIEW;
+
+static __thread DWORD g_dwLastError = NO_ERROR;	// per thread like on Win32
+static POSIX_VIEW *g_pViews = NULL;
+static pthread_mutex_t g_ViewLock = PTHREAD_MUTEX_INITIALIZER;	// g_pViews
+
+//----------------------------------------------------------------------------
+// TranslateErrno
+//
+// Set the last error from errno
+//
+// -> iErrno = POSIX error code
+// <- --
+//----------------------------------------------------------------------------
+static void TranslateErrno(int iErrno)
+{
+	switch(iErrno)
+	{
+		case ENOENT:	g_dwLastError = ERROR_FILE_NOT_FOUND; break;
+		case EACCES:
+		case EPERM:
+		case EROFS:		g_dwLastError = ERROR_ACCESS_DENIED; break;
+		case EBADF:		g_dwLastError = ERROR_INVALID_HANDLE; break;
+		case ENOMEM:	g_dwLastError = ERROR_NOT_ENOUGH_MEMORY; break;
+		case ENOSPC:	g_dwLastError = ERROR_DISK_FULL; break;
+		case EINVAL:	g_dwLastError = ERROR_INVALID_PARAMETER; break;
+		case EOPNOTSUPP:
+		case ENOTTY:	g_dwLastError = ERROR_INVALID_FUNCTION; break;
+		default:		g_dwLastError = ERROR_READ_FAULT; break;
+	}
+}
+
+//----------------------------------------------------------------------------
+// FileDescriptor
+//
+// -> hHandle = handle returned by CreateFile()
+// <- file descriptor or -1
+//----------------------------------------------------------------------------
+static int FileDescriptor(HANDLE hHandle)
+{
+	POSIX_HANDLE *pHandle = hHandle;
+
+	if((NULL==pHandle)||(INVALID_HANDLE_VALUE==hHandle)||
+	   (HANDLE_FILE!=pHandle->iKind))
+	{
+		g_dwLastError = ERROR_INVALID_HANDLE;
+		return -1;
+	}
+	return pHandle->iFileDescriptor;
+}
+
+//----------------------------------------------------------------------------
+// CreateFile
+//
+// Open or create a file. Only files can be opened, device names ("\\.\")
+// fail with ERROR_FILE_NOT_FOUND. FILE_FLAG_NO_BUFFERING opens the file
+// with O_DIRECT. Share modes and security attributes are ignored.
+//----------------------------------------------------------------------------
+HANDLE CreateFile(const char *cFileName, DWORD dwAccess, DWORD dwShareMode,
+	void *pSecurity, DWORD dwCreation, DWORD dwFlags, HANDLE hTemplate)
+{
+	POSIX_HANDLE *pHandle;
+	int iFlags, iFileDescriptor;
+
+	if(0==strncmp(cFileName, "\\\\.\\", 4))
+	{
+		g_dwLastError = ERROR_FILE_NOT_FOUND;
+		return INVALID_HANDLE_VALUE;
+	}
+
+	if((dwAccess&GENERIC_WRITE)||(FILE_ALL_ACCESS==dwAccess)) iFlags = O_RDWR;
+	else iFlags = O_RDONLY;
+	if(CREATE_ALWAYS==dwCreation) iFlags |= O_CREAT | O_TRUNC;
+#ifdef O_DIRECT
+	if(dwFlags&FILE_FLAG_NO_BUFFERING) iFlags |= O_DIRECT;
+#else
+	if(dwFlags&FILE_FLAG_NO_BUFFERING)
+	{
+		g_dwLastError = ERROR_INVALID_PARAMETER;
+		return INVALID_HANDLE_VALUE;
+	}
+#endif
+
+	iFileDescriptor = open(cFileName, iFlags, 0644);
+	if(iFileDescriptor<0)
+	{
+		TranslateErrno(errno);
+		return INVALID_HANDLE_VALUE;
+	}
+
+	pHandle = malloc(sizeof(POSIX_HANDLE));
+	if(NULL==pHandle)
+	{
+		close(iFileDescriptor);
+		g_dwLastError = ERROR_NOT_ENOUGH_MEMORY;
+		return INVALID_HANDLE_VALUE;
+	}
+	pHandle->iKind = HANDLE_FILE;
+	pHandle->iFileDescriptor = iFileDescriptor;
+	pHandle->nMapSize = 0;
+
+	g_dwLastError = NO_ERROR;
+	return pHandle;
+}
+
+//----------------------------------------------------------------------------
+// ReadFile, WriteFile
+//
+// With an OVERLAPPED structure the transfer is positional (pread/pwrite) and
+// the file position is not changed, like synchronous overlapped I/O.
+//----------------------------------------------------------------------------
+BOOL ReadFile(HANDLE hFile, void *pBuf, DWORD dwBytes, DWORD *pdwRead,
+	OVERLAPPED *pOverlapped)
+{
+	int iFileDescriptor = FileDescriptor(hFile);
+	ssize_t nResult;
+	off_t iOffset;
+
+	if(pdwRead) *pdwRead = 0;
+	if(iFileDescriptor<0) return FALSE;
+
+	if(pOverlapped)
+	{
+		iOffset = ((off_t)pOverlapped->OffsetHigh<<32)|pOverlapped->Offset;
+		nResult = pread(iFileDescriptor, pBuf, dwBytes, iOffset);
+	}
+	else nResult = read(iFileDescriptor, pBuf, dwBytes);
+
+	if(nResult<0)
+	{
+		TranslateErrno(errno);
+		return FALSE;
+	}
+	if(pdwRead) *pdwRead = (DWORD)nResult;
+
+	// like Win32, reading at the end of a file with an offset is an error
+	if(pOverlapped&&(0==nResult)&&(dwBytes>0))
+	{
+		g_dwLastError = ERROR_HANDLE_EOF;
+		return FALSE;
+	}
+
+	g_dwLastError = NO_ERROR;
+	return TRUE;
+}
+
+BOOL WriteFile(HANDLE hFile, const void *pBuf, DWORD dwBytes,
+	DWORD *pdwWritten, OVERLAPPED *pOverlapped)
+{
+	int iFileDescriptor = FileDescriptor(hFile);
+	ssize_t nResult;
+	off_t iOffset;
+
+	if(pdwWritten) *pdwWritten = 0;
+	if(iFileDescriptor<0) return FALSE;
+
+	if(pOverlapped)
+	{
+		iOffset = ((off_t)pOverlapped->OffsetHigh<<32)|pOverlapped->Offset;
+		nResult = pwrite(iFileDescriptor, pBuf, dwBytes, iOffset);
+	}
+	else nResult = write(iFileDescriptor, pBuf, dwBytes);
+
+	if(nResult<0)
+	{
+		TranslateErrno(errno);
+		return FALSE;
+	}
+	if(pdwWritten) *pdwWritten = (DWORD)nResult;
+
+	g_dwLastError = NO_ERROR;
+	return TRUE;
+}
+
+//----------------------------------------------------------------------------
+// SetFilePointer
+//----------------------------------------------------------------------------
+DWORD SetFilePointer(HANDLE hFile, LONG lDistance, LONG *plDistanceHigh,
+	DWORD dwMethod)
+{
+	int iFileDescriptor = FileDescriptor(hFile), iWhence;
+	off_t iOffset;
+
+	if(iFileDescriptor<0) return 0xFFFFFFFF;
+
+	if(plDistanceHigh)
+	{
+		iOffset = ((off_t)*plDistanceHigh<<32)|(DWORD)lDistance;
+	}
+	else iOffset = lDistance;
+
+	if(FILE_BEGIN==dwMethod) iWhence = SEEK_SET;
+	else if(FILE_CURRENT==dwMethod) iWhence = SEEK_CUR;
+	else iWhence = SEEK_END;
+
+	iOffset = lseek(iFileDescriptor, iOffset, iWhence);
+	if(iOffset<0)
+	{
+		TranslateErrno(errno);
+		return 0xFFFFFFFF;
+	}
+
+	g_dwLastError = NO_ERROR;
+	if(plDistanceHigh) *plDistanceHigh = (LONG)(iOffset>>32);
+	return (DWORD)iOffset;
+}
+
+//----------------------------------------------------------------------------
+// GetFileSize
+//----------------------------------------------------------------------------
+DWORD GetFileSize(HANDLE hFile, DWORD *pdwSizeHigh)
+{
+	int iFileDescriptor = FileDescriptor(hFile);
+	struct stat Stat;
+
+	if(iFileDescriptor<0) return 0xFFFFFFFF;
+	if(0!=fstat(iFileDescriptor, &Stat))
+	{
+		TranslateErrno(errno);
+		return 0xFFFFFFFF;
+	}
+
+	g_dwLastError = NO_ERROR;
+	if(pdwSizeHigh) *pdwSizeHigh = (DWORD)((__int64)Stat.st_size>>32);
+	return (DWORD)Stat.st_size;
+}
+
+//----------------------------------------------------------------------------
+// FlushFileBuffers
+//----------------------------------------------------------------------------
+BOOL FlushFileBuffers(HANDLE hFile)
+{
+	int iFileDescriptor = FileDescriptor(hFile);
+
+	if(iFileDescriptor<0) return FALSE;
+	if(0!=fsync(iFileDescriptor))
+	{
+		TranslateErrno(errno);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+//----------------------------------------------------------------------------
+// CloseHandle
+//----------------------------------------------------------------------------
+BOOL CloseHandle(HANDLE hObject)
+{
+	POSIX_HANDLE *pHandle = hObject;
+
+	if((NULL==pHandle)||(INVALID_HANDLE_VALUE==hObject))
+	{
+		g_dwLastError = ERROR_INVALID_HANDLE;
+		return FALSE;
+	}
+
+	// a mapping shares the descriptor of its file
+	if(HANDLE_FILE==pHandle->iKind) close(pHandle->iFileDescriptor);
+	free(pHandle);
+	return TRUE;
+}
+
+//----------------------------------------------------------------------------
+// GetDiskFreeSpace
+//
+// Only the sector size is used by the disk layer (alignment of unbuffered
+// I/O). The file system block size is reported, it is a multiple of the
+// logical sector size and always valid for O_DIRECT.
+//----------------------------------------------------------------------------
+BOOL GetDiskFreeSpace(const char *cRoot, DWORD *pdwSectorsPerCluster,
+	DWORD *pdwBytesPerSector, DWORD *pdwFreeClusters,
+	DWORD *pdwTotalClusters)
+{
+	struct statvfs Stat;
+
+	if(0!=statvfs(cRoot, &Stat))
+	{
+		TranslateErrno(errno);
+		return FALSE;
+	}
+	if(pdwSectorsPerCluster) *pdwSectorsPerCluster = 1;
+	if(pdwBytesPerSector) *pdwBytesPerSector = (DWORD)Stat.f_bsize;
+	if(pdwFreeClusters) *pdwFreeClusters = (DWORD)Stat.f_bavail;
+	if(pdwTotalClusters) *pdwTotalClusters = (DWORD)Stat.f_blocks;
+	return TRUE;
+}
+
+//----------------------------------------------------------------------------
+// DeviceIoControl
+//
+// Volume locks succeed (there are no devices), FSCTL_SET_SPARSE succeeds
+// (POSIX files can always have holes) and FSCTL_SET_ZERO_DATA punches a hole
+// with fallocate() where available. Everything else fails.
+//----------------------------------------------------------------------------
+BOOL DeviceIoControl(HANDLE hDevice, DWORD dwCode, void *pIn, DWORD dwIn,
+	void *pOut, DWORD dwOut, DWORD *pdwReturned, OVERLAPPED *pOverlapped)
+{
+	int iFileDescriptor;
+
+	if(pdwReturned) *pdwReturned = 0;
+
+	switch(dwCode)
+	{
+		case FSCTL_LOCK_VOLUME:
+		case FSCTL_UNLOCK_VOLUME:
+			return TRUE;
+
+		case FSCTL_SET_SPARSE:
+			return (FileDescriptor(hDevice)>=0);
+
+		case FSCTL_SET_ZERO_DATA:
+			iFileDescriptor = FileDescriptor(hDevice);
+			if((iFileDescriptor<0)||(dwIn<2*sizeof(LARGE_INTEGER)))
+			{
+				return FALSE;
+			}
+#ifdef FALLOC_FL_PUNCH_HOLE
+			{
+				LARGE_INTEGER *pRange = pIn;
+
+				if(0==fallocate(iFileDescriptor,
+								FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+								pRange[0].QuadPart,
+								pRange[1].QuadPart-pRange[0].QuadPart))
+				{
+					return TRUE;
+				}
+				TranslateErrno(errno);
+				return FALSE;
+			}
+#else
+			g_dwLastError = ERROR_INVALID_FUNCTION;
+			return FALSE;
+#endif
+	}
+
+	g_dwLastError = ERROR_INVALID_FUNCTION;
+	return FALSE;
+}
+
+//----------------------------------------------------------------------------
+// QueryDosDevice
+//
+// There are no DOS devices. The list holds the NUL device only (which
+// ScanDevices() skips), the image files from the INI file are appended to
+// it. Names of single devices are not resolved.
+//----------------------------------------------------------------------------
+DWORD QueryDosDevice(const char *cDevice, char *cTarget, DWORD dwMax)
+{
+	if(NULL!=cDevice)
+	{
+		g_dwLastError = ERROR_FILE_NOT_FOUND;
+		return 0;
+	}
+	if(dwMax<5)
+	{
+		g_dwLastError = ERROR_INVALID_PARAMETER;
+		return 0;
+	}
+	memcpy(cTarget, "NUL\0", 5);
+	return 5;
+}
+
+//----------------------------------------------------------------------------
+// CreateFileMapping, MapViewOfFile, FlushViewOfFile, UnmapViewOfFile
+//
+// Only mappings of whole files are supported (which is all the disk layer
+// uses), a view is an mmap() of the complete mapping.
+//----------------------------------------------------------------------------
+HANDLE CreateFileMapping(HANDLE hFile, void *pSecurity, DWORD dwProtect,
+	DWORD dwSizeHigh, DWORD dwSizeLow, const char *cName)
+{
+	int iFileDescriptor = FileDescriptor(hFile);
+	POSIX_HANDLE *pHandle;
+	struct stat Stat;
+
+	if(iFileDescriptor<0) return NULL;
+	if(0!=fstat(iFileDescriptor, &Stat))
+	{
+		TranslateErrno(errno);
+		return NULL;
+	}
+
+	pHandle = malloc(sizeof(POSIX_HANDLE));
+	if(NULL==pHandle)
+	{
+		g_dwLastError = ERROR_NOT_ENOUGH_MEMORY;
+		return NULL;
+	}
+	pHandle->iKind = HANDLE_MAPPING;
+	pHandle->iFileDescriptor = iFileDescriptor;
+	pHandle->nMapSize = ((size_t)dwSizeHigh<<32)|dwSizeLow;
+	if(0==pHandle->nMapSize) pHandle->nMapSize = (size_t)Stat.st_size;
+	return pHandle;
+}
+
+void *MapViewOfFile(HANDLE hMapping, DWORD dwAccess, DWORD dwOffsetHigh,
+	DWORD dwOffsetLow, size_t nBytes)
+{
+	POSIX_HANDLE *pHandle = hMapping;
+	POSIX_VIEW *pView;
+	void *pBase;
+	int iProtect;
+
+	if((NULL==pHandle)||(HANDLE_MAPPING!=pHandle->iKind)||
+	   (0!=dwOffsetHigh)||(0!=dwOffsetLow))
+	{
+		g_dwLastError = ERROR_INVALID_PARAMETER;
+		return NULL;
+	}
+	if(0==nBytes) nBytes = pHandle->nMapSize;
+
+	pView = malloc(sizeof(POSIX_VIEW));
+	if(NULL==pView)
+	{
+		g_dwLastError = ERROR_NOT_ENOUGH_MEMORY;
+		return NULL;
+	}
+
+	iProtect = PROT_READ;
+	if(dwAccess&FILE_MAP_WRITE) iProtect |= PROT_WRITE;
+	pBase = mmap(NULL, nBytes, iProtect, MAP_SHARED, pHandle->iFileDescriptor,
+		0);
+	if(MAP_FAILED==pBase)
+	{
+		TranslateErrno(errno);
+		free(pView);
+		return NULL;
+	}
+
+	pView->pBase = pBase;
+	pView->nSize = nBytes;
+	pthread_mutex_lock(&g_ViewLock);
+	pView->pNext = g_pViews;
+	g_pViews = pView;
+	pthread_mutex_unlock(&g_ViewLock);
+	return pBase;
+}
+
+BOOL FlushViewOfFile(const void *pBase, size_t nBytes)
+{
+	POSIX_VIEW *pView;
+
+	pthread_mutex_lock(&g_ViewLock);
+	for(pView=g_pViews; pView; pView=pView->pNext)
+	{
+		if(pView->pBase==pBase) break;
+	}
+	if((NULL!=pView)&&(0==nBytes)) nBytes = pView->nSize;
+	pthread_mutex_unlock(&g_ViewLock);
+
+	if(NULL==pView)
+	{
+		g_dwLastError = ERROR_INVALID_PARAMETER;
+		return FALSE;
+	}
+	if(0!=msync((void *)pBase, nBytes, MS_SYNC))
+	{
+		TranslateErrno(errno);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+BOOL UnmapViewOfFile(const void *pBase)
+{
+	POSIX_VIEW **ppView, *pView = NULL;
+
+	pthread_mutex_lock(&g_ViewLock);
+	for(ppView=&g_pViews; *ppView; ppView=&(*ppView)->pNext)
+	{
+		if((*ppView)->pBase!=pBase) continue;
+		pView = *ppView;
+		*ppView = pView->pNext;
+		break;
+	}
+	pthread_mutex_unlock(&g_ViewLock);
+
+	if(NULL==pView)
+	{
+		g_dwLastError = ERROR_INVALID_PARAMETER;
+		return FALSE;
+	}
+	munmap(pView->pBase, pView->nSize);
+	free(pView);
+	return TRUE;
+}
+
+//----------------------------------------------------------------------------
+// VirtualAlloc, VirtualFree, LocalFree
+//
+// VirtualAlloc() memory is page aligned and zeroed like on Win32.
+//----------------------------------------------------------------------------
+void *VirtualAlloc(void *pAddress, size_t nBytes, DWORD dwType,
+	DWORD dwProtect)
+{
+	void *pMem = NULL;
+
+	if(0!=posix_memalign(&pMem, (size_t)sysconf(_SC_PAGESIZE), nBytes))
+	{
+		g_dwLastError = ERROR_NOT_ENOUGH_MEMORY;
+		return NULL;
+	}
+	memset(pMem, 0, nBytes);
+	return pMem;
+}
+
+BOOL VirtualFree(void *pAddress, size_t nBytes, DWORD dwType)
+{
+	free(pAddress);
+	return TRUE;
+}
+
+void *LocalFree(void *pMem)
+{
+	free(pMem);
+	return NULL;
+}
+
+//----------------------------------------------------------------------------
+// InitializeCriticalSection, DeleteCriticalSection, EnterCriticalSection,
+// TryEnterCriticalSection, LeaveCriticalSection
+//
+// A critical section is a recursive mutex, the owning thread may enter it
+// again.
+//----------------------------------------------------------------------------
+void InitializeCriticalSection(CRITICAL_SECTION *pSection)
+{
+	pthread_mutexattr_t Attributes;
+
+	pthread_mutexattr_init(&Attributes);
+	pthread_mutexattr_settype(&Attributes, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&pSection->Mutex, &Attributes);
+	pthread_mutexattr_destroy(&Attributes);
+}
+
+void DeleteCriticalSection(CRITICAL_SECTION *pSection)
+{
+	pthread_mutex_destroy(&pSection->Mutex);
+}
+
+void EnterCriticalSection(CRITICAL_SECTION *pSection)
+{
+	pthread_mutex_lock(&pSection->Mutex);
+}
+
+BOOL TryEnterCriticalSection(CRITICAL_SECTION *pSection)
+{
+	return (0==pthread_mutex_trylock(&pSection->Mutex)) ? TRUE : FALSE;
+}
+
+void LeaveCriticalSection(CRITICAL_SECTION *pSection)
+{
+	pthread_mutex_unlock(&pSection->Mutex);
+}
+
+//----------------------------------------------------------------------------
+// GetLastError, SetLastError, FormatMessage
+//----------------------------------------------------------------------------
+DWORD GetLastError(void)
+{
+	return g_dwLastError;
+}
+
+void SetLastError(DWORD dwError)
+{
+	g_dwLastError = dwError;
+}
+
+DWORD FormatMessage(DWORD dwFlags, const void *pSource, DWORD dwMessageId,
+	DWORD dwLanguageId, LPTSTR cBuffer, DWORD dwSize, va_list *pArgs)
+{
+	char *cMessage;
+
+	if(0==(dwFlags&FORMAT_MESSAGE_ALLOCATE_BUFFER)) return 0;
+	cMessage = malloc(32);
+	if(NULL==cMessage) return 0;
+	snprintf(cMessage, 32, "Win32 error %u", dwMessageId);
+	*(char **)cBuffer = cMessage;
+	return (DWORD)strlen(cMessage);
+}
+
+//----------------------------------------------------------------------------
+// GetTickCount, Sleep
+//----------------------------------------------------------------------------
+DWORD GetTickCount(void)
+{
+	struct timespec Now;
+
+	clock_gettime(CLOCK_MONOTONIC, &Now);
+	return (DWORD)(Now.tv_sec*1000 + Now.tv_nsec/1000000);
+}
+
+void Sleep(DWORD dwMilliseconds)
+{
+	usleep((useconds_t)dwMilliseconds*1000);
+}
+
+//----------------------------------------------------------------------------
+// GetWindowsDirectory
+//
+// The INI file is looked for in the current directory.
+//----------------------------------------------------------------------------
+UINT GetWindowsDirectory(char *cBuffer, UINT uSize)
+{
+	if(uSize<2) return 2;
+	strcpy(cBuffer, ".");
+	return 1;
+}
+
+//----------------------------------------------------------------------------
+// MessageBoxA, FindWindow, ShowWindow
+//
+// Messages are printed to stderr, questions are answered with the default
+// button (OK/Yes).
+//----------------------------------------------------------------------------
+int MessageBoxA(HWND hWnd, const char *cText, const char *cCaption,
+	UINT uType)
+{
+	fprintf(stderr, "%s: %s\n", cCaption, cText);
+	if(uType&MB_YESNO) return IDYES;
+	return IDOK;
+}
+
+HWND FindWindow(const char *cClassName, const char *cWindowName)
+{
+	return NULL;
+}
+
+BOOL ShowWindow(HWND hWnd, int iCmdShow)
+{
+	return FALSE;
+}
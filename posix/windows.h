@@ -0,0 +1,235 @@
+//----------------------------------------------------------------------------
+// EnsoniqFS plugin for TotalCommander
+//
+// POSIX PORT: Win32 subset header file
+//----------------------------------------------------------------------------
+//
+// (c) 2006 Thoralt Franz
+//
+// This source code was written using Dev-Cpp 4.9.9.2
+// If you want to compile it, get Dev-Cpp. Normally the code should compile
+// with other IDEs/compilers too (with small modifications), but I did not
+// test it.
+//
+//----------------------------------------------------------------------------
+// License
+//----------------------------------------------------------------------------
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+// MA  02110-1301, USA.
+//
+// Alternatively, download a copy of the license here:
+// http://www.gnu.org/licenses/gpl.txt
+//----------------------------------------------------------------------------
+#ifndef _POSIX_WINDOWS_H_
+#define _POSIX_WINDOWS_H_
+
+//----------------------------------------------------------------------------
+// Types, constants and functions of the Win32 API used by the disk layer
+// (disk.c, cache.c, backend.c, chunkimg.c, freespace.c, ini.c, log.c).
+// posix/win32.c implements the functions on top of POSIX file descriptors,
+// so these files build unchanged on Linux. Only image files are supported,
+// physical devices can not be opened.
+//----------------------------------------------------------------------------
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define __stdcall
+#define __declspec(x)
+#define WINAPI
+
+//----------------------------------------------------------------------------
+// basic types
+//----------------------------------------------------------------------------
+typedef unsigned int DWORD;
+typedef int BOOL;
+typedef int LONG;
+typedef unsigned int UINT;
+typedef unsigned char BYTE;
+typedef unsigned short WORD;
+typedef long long LONGLONG;
+typedef long long __int64;
+typedef char *LPTSTR;
+typedef void *HANDLE;
+typedef void *HWND;
+typedef void *HICON;
+typedef void *HINSTANCE;
+
+typedef union _LARGE_INTEGER
+{
+	struct
+	{
+		DWORD LowPart;
+		LONG HighPart;
+	};
+	LONGLONG QuadPart;
+} LARGE_INTEGER;
+
+typedef struct _FILETIME
+{
+	DWORD dwLowDateTime;
+	DWORD dwHighDateTime;
+} FILETIME;
+
+typedef struct _WIN32_FIND_DATA
+{
+	DWORD dwFileAttributes;
+	FILETIME ftCreationTime, ftLastAccessTime, ftLastWriteTime;
+	DWORD nFileSizeHigh, nFileSizeLow;
+	DWORD dwReserved0, dwReserved1;
+	char cFileName[260];
+	char cAlternateFileName[14];
+} WIN32_FIND_DATA;
+
+typedef struct _OVERLAPPED
+{
+	uintptr_t Internal, InternalHigh;
+	DWORD Offset, OffsetHigh;
+	HANDLE hEvent;
+} OVERLAPPED;
+
+#define TRUE	1
+#define FALSE	0
+#define MAX_PATH	260
+#define INVALID_HANDLE_VALUE	((HANDLE)(intptr_t)-1)
+
+//----------------------------------------------------------------------------
+// error codes (GetLastError())
+//----------------------------------------------------------------------------
+#define NO_ERROR				0
+#define ERROR_INVALID_FUNCTION	1
+#define ERROR_FILE_NOT_FOUND	2
+#define ERROR_ACCESS_DENIED		5
+#define ERROR_INVALID_HANDLE	6
+#define ERROR_NOT_ENOUGH_MEMORY	8
+#define ERROR_WRITE_FAULT		29
+#define ERROR_READ_FAULT		30
+#define ERROR_HANDLE_EOF		38
+#define ERROR_INVALID_PARAMETER	87
+#define ERROR_DISK_FULL			112
+
+//----------------------------------------------------------------------------
+// files
+//----------------------------------------------------------------------------
+#define GENERIC_READ		0x80000000
+#define GENERIC_WRITE		0x40000000
+#define FILE_ALL_ACCESS		0x001F01FF
+#define FILE_SHARE_READ		0x00000001
+#define FILE_SHARE_WRITE	0x00000002
+#define CREATE_ALWAYS		2
+#define OPEN_EXISTING		3
+#define FILE_ATTRIBUTE_NORMAL		0x00000080
+#define FILE_FLAG_NO_BUFFERING		0x20000000
+#define FILE_FLAG_SEQUENTIAL_SCAN	0x08000000
+#define FILE_BEGIN		0
+#define FILE_CURRENT	1
+#define FILE_END		2
+
+HANDLE CreateFile(const char *cFileName, DWORD dwAccess, DWORD dwShareMode,
+	void *pSecurity, DWORD dwCreation, DWORD dwFlags, HANDLE hTemplate);
+BOOL ReadFile(HANDLE hFile, void *pBuf, DWORD dwBytes, DWORD *pdwRead,
+	OVERLAPPED *pOverlapped);
+BOOL WriteFile(HANDLE hFile, const void *pBuf, DWORD dwBytes,
+	DWORD *pdwWritten, OVERLAPPED *pOverlapped);
+DWORD SetFilePointer(HANDLE hFile, LONG lDistance, LONG *plDistanceHigh,
+	DWORD dwMethod);
+DWORD GetFileSize(HANDLE hFile, DWORD *pdwSizeHigh);
+BOOL FlushFileBuffers(HANDLE hFile);
+BOOL CloseHandle(HANDLE hObject);
+BOOL GetDiskFreeSpace(const char *cRoot, DWORD *pdwSectorsPerCluster,
+	DWORD *pdwBytesPerSector, DWORD *pdwFreeClusters,
+	DWORD *pdwTotalClusters);
+BOOL DeviceIoControl(HANDLE hDevice, DWORD dwCode, void *pIn, DWORD dwIn,
+	void *pOut, DWORD dwOut, DWORD *pdwReturned, OVERLAPPED *pOverlapped);
+DWORD QueryDosDevice(const char *cDevice, char *cTarget, DWORD dwMax);
+
+//----------------------------------------------------------------------------
+// file mappings and memory
+//----------------------------------------------------------------------------
+#define PAGE_READONLY	0x02
+#define PAGE_READWRITE	0x04
+#define FILE_MAP_WRITE	0x02
+#define FILE_MAP_READ	0x04
+#define MEM_COMMIT		0x1000
+#define MEM_RESERVE		0x2000
+#define MEM_RELEASE		0x8000
+
+HANDLE CreateFileMapping(HANDLE hFile, void *pSecurity, DWORD dwProtect,
+	DWORD dwSizeHigh, DWORD dwSizeLow, const char *cName);
+void *MapViewOfFile(HANDLE hMapping, DWORD dwAccess, DWORD dwOffsetHigh,
+	DWORD dwOffsetLow, size_t nBytes);
+BOOL FlushViewOfFile(const void *pBase, size_t nBytes);
+BOOL UnmapViewOfFile(const void *pBase);
+void *VirtualAlloc(void *pAddress, size_t nBytes, DWORD dwType,
+	DWORD dwProtect);
+BOOL VirtualFree(void *pAddress, size_t nBytes, DWORD dwType);
+void *LocalFree(void *pMem);
+
+//----------------------------------------------------------------------------
+// critical sections (recursive like on Win32)
+//----------------------------------------------------------------------------
+typedef struct _CRITICAL_SECTION
+{
+	pthread_mutex_t Mutex;
+} CRITICAL_SECTION;
+
+void InitializeCriticalSection(CRITICAL_SECTION *pSection);
+void DeleteCriticalSection(CRITICAL_SECTION *pSection);
+void EnterCriticalSection(CRITICAL_SECTION *pSection);
+BOOL TryEnterCriticalSection(CRITICAL_SECTION *pSection);
+void LeaveCriticalSection(CRITICAL_SECTION *pSection);
+
+//----------------------------------------------------------------------------
+// system
+//----------------------------------------------------------------------------
+#define FORMAT_MESSAGE_ALLOCATE_BUFFER	0x00000100
+#define FORMAT_MESSAGE_IGNORE_INSERTS	0x00000200
+#define FORMAT_MESSAGE_FROM_SYSTEM		0x00001000
+#define LANG_NEUTRAL	0x00
+#define SUBLANG_DEFAULT	0x01
+#define MAKELANGID(p, s)	((((WORD)(s))<<10)|(WORD)(p))
+
+DWORD GetLastError(void);
+void SetLastError(DWORD dwError);
+DWORD FormatMessage(DWORD dwFlags, const void *pSource, DWORD dwMessageId,
+	DWORD dwLanguageId, LPTSTR cBuffer, DWORD dwSize, va_list *pArgs);
+DWORD GetTickCount(void);
+void Sleep(DWORD dwMilliseconds);
+UINT GetWindowsDirectory(char *cBuffer, UINT uSize);
+
+//----------------------------------------------------------------------------
+// user interface
+//----------------------------------------------------------------------------
+#define MB_OK				0x00000000
+#define MB_YESNO			0x00000004
+#define MB_ICONSTOP			0x00000010
+#define MB_ICONQUESTION		0x00000020
+#define MB_ICONEXCLAMATION	0x00000030
+#define MB_ICONWARNING		0x00000030
+#define IDOK	1
+#define IDYES	6
+#define IDNO	7
+#define SW_HIDE	0
+#define SW_SHOW	5
+
+int MessageBoxA(HWND hWnd, const char *cText, const char *cCaption,
+	UINT uType);
+HWND FindWindow(const char *cClassName, const char *cWindowName);
+BOOL ShowWindow(HWND hWnd, int iCmdShow);
+
+#endif
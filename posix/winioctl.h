@@ -0,0 +1,100 @@
+//----------------------------------------------------------------------------
+// EnsoniqFS plugin for TotalCommander
+//
+// POSIX PORT: device I/O control header file
+//----------------------------------------------------------------------------
+//
+// (c) 2006 Thoralt Franz
+//
+// This source code was written using Dev-Cpp 4.9.9.2
+// If you want to compile it, get Dev-Cpp. Normally the code should compile
+// with other IDEs/compilers too (with small modifications), but I did not
+// test it.
+//
+//----------------------------------------------------------------------------
+// License
+//----------------------------------------------------------------------------
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+// MA  02110-1301, USA.
+//
+// Alternatively, download a copy of the license here:
+// http://www.gnu.org/licenses/gpl.txt
+//----------------------------------------------------------------------------
+#ifndef _POSIX_WINIOCTL_H_
+#define _POSIX_WINIOCTL_H_
+
+#include "windows.h"
+
+#define CTL_CODE(DeviceType, Function, Method, Access) \
+	(((DeviceType)<<16)|((Access)<<14)|((Function)<<2)|(Method))
+
+#define METHOD_BUFFERED		0
+#define FILE_ANY_ACCESS		0
+#define FILE_READ_ACCESS	1
+#define FILE_WRITE_ACCESS	2
+
+#define FILE_DEVICE_DISK		0x00000007
+#define FILE_DEVICE_FILE_SYSTEM	0x00000009
+#define IOCTL_DISK_BASE			FILE_DEVICE_DISK
+
+#define IOCTL_DISK_GET_DRIVE_GEOMETRY_EX \
+	CTL_CODE(IOCTL_DISK_BASE, 0x0028, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define FSCTL_LOCK_VOLUME \
+	CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 6, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define FSCTL_UNLOCK_VOLUME \
+	CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 7, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define FSCTL_SET_SPARSE \
+	CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 49, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define FSCTL_SET_ZERO_DATA \
+	CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 50, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
+typedef enum _MEDIA_TYPE
+{
+	Unknown,
+	F5_1Pt2_512,
+	F3_1Pt44_512,
+	F3_2Pt88_512,
+	F3_20Pt8_512,
+	F3_720_512,
+	F5_360_512,
+	F5_320_512,
+	F5_320_1024,
+	F5_180_512,
+	F5_160_512,
+	RemovableMedia,
+	FixedMedia,
+	F3_120M_512,
+	F3_640_512,
+	F5_640_512,
+	F5_720_512
+} MEDIA_TYPE;
+
+typedef struct _DISK_GEOMETRY
+{
+	LARGE_INTEGER Cylinders;
+	MEDIA_TYPE MediaType;
+	DWORD TracksPerCylinder;
+	DWORD SectorsPerTrack;
+	DWORD BytesPerSector;
+} DISK_GEOMETRY;
+
+typedef struct _DISK_GEOMETRY_EX
+{
+	DISK_GEOMETRY Geometry;
+	LARGE_INTEGER DiskSize;
+	BYTE Data[1];
+} DISK_GEOMETRY_EX;
+
+#endif
@@ -53,3 +53,5 @@
 #define IDC_LBL_BANKTARGETDEVICE                1118
 #define IDC_LBL_BANKSOURCEDEVICE                1119
 #define IDC_CBO_BANKSOURCEDEVICE                1120
+#define IDC_CHK_DIRECTIODISK                    1121
+#define IDC_CHK_DIRECTIOIMAGE                   1122